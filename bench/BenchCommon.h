@@ -0,0 +1,143 @@
+#ifndef VK_ENGINE_BENCHCOMMON_H
+#define VK_ENGINE_BENCHCOMMON_H
+
+#include <Profiler.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// "--name value" and "--flag" command line arguments
+struct BenchArgs {
+    std::unordered_map<std::string, std::string> m_values;
+
+    BenchArgs(int argc, char **argv) {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.rfind("--", 0) != 0) {
+                continue;
+            }
+
+            bool has_value = i + 1 < argc && std::string(argv[i + 1]).rfind("--", 0) != 0;
+            m_values[arg.substr(2)] = has_value ? argv[++i] : "";
+        }
+    }
+
+    bool has(const char *name) const {
+        return m_values.contains(name);
+    }
+
+    uint64_t get_uint(const char *name, uint64_t default_value) const {
+        auto it = m_values.find(name);
+        return it == m_values.end() || it->second.empty() ? default_value : std::strtoull(it->second.c_str(), nullptr, 10);
+    }
+
+    double get_double(const char *name, double default_value) const {
+        auto it = m_values.find(name);
+        return it == m_values.end() || it->second.empty() ? default_value : std::strtod(it->second.c_str(), nullptr);
+    }
+
+    std::string get_string(const char *name, const std::string &default_value) const {
+        auto it = m_values.find(name);
+        return it == m_values.end() || it->second.empty() ? default_value : it->second;
+    }
+};
+
+// Tiny streaming JSON writer, keys are expected to be plain identifiers.
+class JsonWriter {
+public:
+    explicit JsonWriter(std::ostream &out) : m_out(out) {
+    }
+
+    void begin_object(const char *key = nullptr) {
+        write_key(key);
+        m_out << '{';
+        m_first.push_back(true);
+    }
+
+    void end_object() {
+        m_first.pop_back();
+        m_out << '}';
+        if (m_first.empty()) {
+            m_out << '\n';
+        }
+    }
+
+    void begin_array(const char *key = nullptr) {
+        write_key(key);
+        m_out << '[';
+        m_first.push_back(true);
+    }
+
+    void end_array() {
+        m_first.pop_back();
+        m_out << ']';
+    }
+
+    void value(const char *key, double value) {
+        write_key(key);
+        m_out << value;
+    }
+
+    void value(const char *key, uint64_t value) {
+        write_key(key);
+        m_out << value;
+    }
+
+    void value(const char *key, uint32_t value) {
+        write_key(key);
+        m_out << value;
+    }
+
+    void value(const char *key, bool value) {
+        write_key(key);
+        m_out << (value ? "true" : "false");
+    }
+
+    void value(const char *key, const std::string &value) {
+        write_key(key);
+        m_out << '"';
+        for (char c: value) {
+            if (c == '"' || c == '\\') {
+                m_out << '\\';
+            }
+            m_out << c;
+        }
+        m_out << '"';
+    }
+
+    void value(const char *key, const char *value) {
+        this->value(key, std::string(value));
+    }
+
+    // min/avg/p99/max of a set of samples, in ms
+    void stats(const char *key, const RollingStats &stats) {
+        begin_object(key);
+        value("min", stats.min());
+        value("avg", stats.avg());
+        value("p99", stats.percentile(0.99));
+        value("max", stats.max());
+        end_object();
+    }
+
+private:
+    void write_key(const char *key) {
+        if (!m_first.empty()) {
+            if (!m_first.back()) {
+                m_out << ',';
+            }
+            m_first.back() = false;
+        }
+        if (key) {
+            m_out << '"' << key << "\":";
+        }
+    }
+
+    std::ostream &m_out;
+    std::vector<bool> m_first;
+};
+
+#endif //VK_ENGINE_BENCHCOMMON_H
@@ -0,0 +1,278 @@
+#include "BenchCommon.h"
+
+#include <SceneBvh.h>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+// Usage: vk_engine_bvh_bench [--objects N,M,...] [--queries Q] [--frames F] [--moving P] [--seed S]
+//                            [--output file.json]
+// Query throughput of SceneBvh against testing every object, for each object count (default
+// 100000 and 1000000). Then moves P percent of the objects (default 10) for F frames (default
+// 300), refitting every frame and rebuilding in the background like the engine does.
+
+// Raw mt19937 output only, the std distributions differ between standard libraries
+struct BenchRandom {
+    std::mt19937 m_rng;
+
+    float next() { return (float) (m_rng() >> 8) * (1.0f / 16777216.0f); }
+    float range(float min, float max) { return min + (max - min) * next(); }
+    glm::vec3 vec3(float min, float max) {
+        float x = range(min, max);
+        float y = range(min, max);
+        float z = range(min, max);
+        return {x, y, z};
+    }
+};
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// What the BVH is compared to
+static bool frustum_overlaps(const Frustum &frustum, const Aabb &box) {
+    for (const glm::vec4 &plane: frustum.m_planes) {
+        glm::vec3 normal = glm::vec3(plane);
+        glm::vec3 positive = glm::mix(box.m_min, box.m_max, glm::greaterThan(normal, glm::vec3(0.f)));
+        if (glm::dot(normal, positive) + plane.w < 0.f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool ray_hits(const glm::vec3 &origin, const glm::vec3 &inverse_direction, float max_distance,
+                     const Aabb &box, float &distance) {
+    glm::vec3 t0 = (box.m_min - origin) * inverse_direction;
+    glm::vec3 t1 = (box.m_max - origin) * inverse_direction;
+    glm::vec3 entries = glm::min(t0, t1);
+    glm::vec3 exits = glm::max(t0, t1);
+    distance = std::max({entries.x, entries.y, entries.z, 0.f});
+    return distance <= std::min({exits.x, exits.y, exits.z, max_distance});
+}
+
+// Queries per second and average results, against the linear scan when there is one
+static void write_throughput(JsonWriter &json, const char *key, uint64_t queries, double ms, uint64_t results,
+                             double linear_ms = 0.0) {
+    json.begin_object(key);
+    json.value("queries_per_s", (double) queries / (ms / 1000.0));
+    json.value("avg_results", (double) results / (double) queries);
+    if (linear_ms > 0.0) {
+        json.value("linear_queries_per_s", (double) queries / (linear_ms / 1000.0));
+        json.value("speedup", linear_ms / ms);
+    }
+    json.end_object();
+}
+
+int main(int argc, char **argv) {
+    BenchArgs args(argc, argv);
+
+    std::vector<uint32_t> object_counts;
+    std::stringstream counts(args.get_string("objects", "100000,1000000"));
+    for (std::string count; std::getline(counts, count, ',');) {
+        object_counts.push_back((uint32_t) std::strtoul(count.c_str(), nullptr, 10));
+    }
+    uint64_t query_count = std::max<uint64_t>(args.get_uint("queries", 1000), 1);
+    uint64_t frame_count = std::max<uint64_t>(args.get_uint("frames", 300), 1);
+    float moving_fraction = (float) args.get_uint("moving", 10) / 100.f;
+    auto seed = (uint32_t) args.get_uint("seed", 1337);
+    std::string output_path = args.get_string("output", "vk_engine_bvh_bench.json");
+
+    std::ofstream out(output_path);
+    if (!out.is_open()) {
+        std::cerr << "Couldn't open " << output_path << " for writing" << std::endl;
+        return 1;
+    }
+
+    JsonWriter json(out);
+    json.begin_object();
+    json.value("seed", seed);
+    json.value("queries", query_count);
+    json.value("frames", frame_count);
+    json.value("moving_fraction", (double) moving_fraction);
+    json.begin_array("results");
+
+    for (uint32_t object_count: object_counts) {
+        if (object_count == 0) {
+            continue;
+        }
+
+        // Same density whatever the count, so the queries return about as many objects
+        BenchRandom random{std::mt19937(seed)};
+        float extent = 4.f * std::cbrt((float) object_count);
+        std::vector<Aabb> bounds(object_count);
+        for (Aabb &box: bounds) {
+            box = Aabb::from_sphere(glm::vec4(random.vec3(0.f, extent), random.range(0.25f, 1.f)));
+        }
+
+        SceneBvh bvh;
+        bvh.build(bounds);
+        BvhStats build_stats = bvh.stats();
+
+        // Cameras inside the scene looking anywhere, 100 units deep
+        std::vector<Frustum> frustums(query_count);
+        glm::mat4 projection = glm::perspective(glm::radians(70.f), 16.f / 9.f, 0.1f, 100.f);
+        for (Frustum &frustum: frustums) {
+            glm::vec3 eye = random.vec3(0.f, extent);
+            glm::vec3 target = eye + random.vec3(-1.f, 1.f);
+            frustum = Frustum::from_matrix(projection * glm::lookAt(eye, target, glm::vec3(0.f, 1.f, 0.f)));
+        }
+
+        std::vector<uint32_t> results;
+        results.reserve(object_count);
+        uint64_t frustum_results = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (const Frustum &frustum: frustums) {
+            results.clear();
+            bvh.query_frustum(frustum, results);
+            frustum_results += results.size();
+        }
+        double frustum_ms = elapsed_ms(start);
+
+        uint64_t linear_frustum_results = 0;
+        start = std::chrono::steady_clock::now();
+        for (const Frustum &frustum: frustums) {
+            for (const Aabb &box: bounds) {
+                linear_frustum_results += frustum_overlaps(frustum, box);
+            }
+        }
+        double linear_frustum_ms = elapsed_ms(start);
+
+        uint64_t sphere_results = 0;
+        start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < query_count; i++) {
+            results.clear();
+            bvh.query_sphere(random.vec3(0.f, extent), 10.f, results);
+            sphere_results += results.size();
+        }
+        double sphere_ms = elapsed_ms(start);
+
+        uint64_t aabb_results = 0;
+        start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < query_count; i++) {
+            glm::vec3 corner = random.vec3(0.f, extent);
+            results.clear();
+            bvh.query_aabb({corner, corner + glm::vec3(20.f)}, results);
+            aabb_results += results.size();
+        }
+        double aabb_ms = elapsed_ms(start);
+
+        // Picking like rays, from inside the scene
+        std::vector<glm::vec3> ray_origins(query_count);
+        std::vector<glm::vec3> ray_directions(query_count);
+        for (uint64_t i = 0; i < query_count; i++) {
+            ray_origins[i] = random.vec3(0.f, extent);
+            ray_directions[i] = glm::normalize(random.vec3(-1.f, 1.f) + glm::vec3(0.f, 0.f, 1e-3f));
+        }
+
+        uint64_t ray_hits_count = 0;
+        start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < query_count; i++) {
+            BvhRayHit hit;
+            ray_hits_count += bvh.raycast(ray_origins[i], ray_directions[i], 1000.f, hit);
+        }
+        double ray_ms = elapsed_ms(start);
+
+        uint64_t linear_ray_hits = 0;
+        start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < query_count; i++) {
+            glm::vec3 inverse_direction = 1.f / ray_directions[i];
+            float best = 1000.f;
+            bool hit = false;
+            for (const Aabb &box: bounds) {
+                float distance;
+                if (ray_hits(ray_origins[i], inverse_direction, best, box, distance)) {
+                    best = distance;
+                    hit = true;
+                }
+            }
+            linear_ray_hits += hit;
+        }
+        double linear_ray_ms = elapsed_ms(start);
+
+        // Moving objects, each with its own velocity, bouncing in the scene
+        auto moving_count = (uint32_t) ((float) object_count * moving_fraction);
+        std::vector<glm::vec3> velocities(moving_count);
+        for (glm::vec3 &velocity: velocities) {
+            velocity = random.vec3(-0.2f, 0.2f);
+        }
+
+        RollingStats refit_ms(frame_count);
+        float max_cost_ratio = 1.f;
+        for (uint64_t frame = 0; frame < frame_count; frame++) {
+            for (uint32_t i = 0; i < moving_count; i++) {
+                glm::vec3 center = (bounds[i].m_min + bounds[i].m_max) * 0.5f;
+                glm::vec3 bounce = glm::mix(glm::vec3(1.f), glm::vec3(-1.f),
+                                            glm::greaterThan(glm::abs(center + velocities[i] - extent * 0.5f),
+                                                             glm::vec3(extent * 0.5f)));
+                velocities[i] = velocities[i] * bounce;
+                bounds[i] = {bounds[i].m_min + velocities[i], bounds[i].m_max + velocities[i]};
+            }
+
+            // What Engine::update_scene_bvh does every frame
+            start = std::chrono::steady_clock::now();
+            for (uint32_t i = 0; i < moving_count; i++) {
+                bvh.update(i, bounds[i]);
+            }
+            bvh.refit();
+            bvh.poll_rebuild();
+            if (bvh.needs_rebuild()) {
+                bvh.start_rebuild();
+            }
+            refit_ms.push(elapsed_ms(start));
+            max_cost_ratio = std::max(max_cost_ratio, bvh.stats().m_cost_ratio);
+        }
+
+        // The frustums again, on the tree as the motion left it
+        uint64_t moved_frustum_results = 0;
+        start = std::chrono::steady_clock::now();
+        for (const Frustum &frustum: frustums) {
+            results.clear();
+            bvh.query_frustum(frustum, results);
+            moved_frustum_results += results.size();
+        }
+        double moved_frustum_ms = elapsed_ms(start);
+        BvhStats moved_stats = bvh.stats();
+
+        json.begin_object();
+        json.value("objects", object_count);
+        json.value("build_ms", (double) build_stats.m_last_build_ms);
+        json.value("nodes", build_stats.m_nodes);
+        json.value("depth", build_stats.m_depth);
+        write_throughput(json, "frustum", query_count, frustum_ms, frustum_results, linear_frustum_ms);
+        // Both test the same boxes, they must agree
+        json.value("frustum_matches_linear", frustum_results == linear_frustum_results);
+        write_throughput(json, "sphere", query_count, sphere_ms, sphere_results);
+        write_throughput(json, "aabb", query_count, aabb_ms, aabb_results);
+        write_throughput(json, "ray", query_count, ray_ms, ray_hits_count, linear_ray_ms);
+        json.value("ray_matches_linear", ray_hits_count == linear_ray_hits);
+
+        json.begin_object("motion");
+        json.value("moving_objects", moving_count);
+        json.stats("update_ms", refit_ms);
+        json.value("async_builds", moved_stats.m_async_builds);
+        json.value("max_cost_ratio", (double) max_cost_ratio);
+        json.value("final_cost_ratio", (double) moved_stats.m_cost_ratio);
+        json.value("last_build_ms", (double) moved_stats.m_last_build_ms);
+        write_throughput(json, "frustum_after", query_count, moved_frustum_ms, moved_frustum_results);
+        json.end_object();
+        json.end_object();
+
+        std::cout << "vk_engine_bvh_bench: " << object_count << " objects, build " << build_stats.m_last_build_ms
+                  << " ms, frustum " << linear_frustum_ms / frustum_ms << "x faster than linear, refit avg "
+                  << refit_ms.avg() << " ms" << std::endl;
+    }
+
+    json.end_array();
+    json.end_object();
+
+    std::cout << "Results written to " << output_path << std::endl;
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include "BenchCommon.h"
+
+#include <Mesh.h>
+#include <ObjParser.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+// Usage: vk_engine_obj_bench [--input file.obj] [--grid N] [--threads T] [--runs R] [--skip-tinyobj]
+//                            [--output file.json]
+// Loads the same OBJ with Mesh::load_from_obj (tinyobjloader) and Mesh::load_from_obj_parallel.
+// Without --input, an N x N grid of quads with normals and texture coordinates is generated
+// first, N = 3000 is about 1 GB.
+
+// One vertex per grid point, written with the precision of a typical exporter
+static bool write_grid(const std::string &path, uint32_t size) {
+    FILE *file = std::fopen(path.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+
+    std::fprintf(file, "# vk_engine_obj_bench grid %u\n", size);
+    for (uint32_t z = 0; z < size; z++) {
+        for (uint32_t x = 0; x < size; x++) {
+            std::fprintf(file, "v %.6f %.6f %.6f\n", (float) x * 0.01f, 0.f, (float) z * 0.01f);
+            std::fprintf(file, "vt %.6f %.6f\n", (float) x / (float) size, (float) z / (float) size);
+            std::fprintf(file, "vn %.6f %.6f %.6f\n", 0.f, 1.f, 0.f);
+        }
+    }
+    // Quads, so both loaders have to triangulate
+    for (uint32_t z = 0; z + 1 < size; z++) {
+        for (uint32_t x = 0; x + 1 < size; x++) {
+            uint32_t a = z * size + x + 1;
+            uint32_t b = a + size;
+            std::fprintf(file, "f %u/%u/%u %u/%u/%u %u/%u/%u %u/%u/%u\n", a, a, a, b, b, b, b + 1, b + 1, b + 1,
+                         a + 1, a + 1, a + 1);
+        }
+    }
+
+    return std::fclose(file) == 0;
+}
+
+// Doesn't depend on how the faces were triangulated, as long as they are planar
+static double surface_area(const std::vector<Vertex> &vertices) {
+    double area = 0.0;
+    for (size_t i = 0; i + 2 < vertices.size(); i += 3) {
+        glm::vec3 normal = glm::cross(vertices[i + 1].position - vertices[i].position,
+                                      vertices[i + 2].position - vertices[i].position);
+        area += 0.5 * (double) glm::length(normal);
+    }
+    return area;
+}
+
+int main(int argc, char **argv) {
+    BenchArgs args(argc, argv);
+
+    auto grid_size = (uint32_t) args.get_uint("grid", 1000);
+    auto thread_count = (uint32_t) args.get_uint("threads", 0);
+    uint64_t run_count = std::max<uint64_t>(args.get_uint("runs", 3), 1);
+    bool skip_tinyobj = args.has("skip-tinyobj");
+    std::string output_path = args.get_string("output", "vk_engine_obj_bench.json");
+
+    std::string input_path = args.get_string("input", "");
+    bool generated = input_path.empty();
+    if (generated) {
+        input_path = "vk_engine_obj_bench_grid.obj";
+        std::cout << "Writing a " << grid_size << "x" << grid_size << " grid to " << input_path << std::endl;
+        if (grid_size < 2 || !write_grid(input_path, grid_size)) {
+            std::cerr << "Couldn't write the grid, --grid must be at least 2" << std::endl;
+            return 1;
+        }
+    }
+
+    // Every run starts from a warm page cache, so both loaders read the file at the same speed
+    RollingStats tinyobj_ms(run_count);
+    RollingStats parallel_ms(run_count);
+    size_t tinyobj_vertices = 0;
+    double tinyobj_area = 0.0;
+    bool success = true;
+
+    if (!skip_tinyobj) {
+        for (uint64_t i = 0; i < run_count && success; i++) {
+            Mesh mesh;
+            auto start = std::chrono::steady_clock::now();
+            success = mesh.load_from_obj(input_path.c_str());
+            auto end = std::chrono::steady_clock::now();
+            tinyobj_ms.push(std::chrono::duration<double, std::milli>(end - start).count());
+            tinyobj_vertices = mesh.m_vertices.size();
+            tinyobj_area = surface_area(mesh.m_vertices);
+        }
+    }
+
+    ObjParseStats parse_stats;
+    size_t parallel_vertices = 0;
+    double parallel_area = 0.0;
+    for (uint64_t i = 0; i < run_count && success; i++) {
+        // Same as Mesh::load_from_obj_parallel, the parser keeps the stats
+        Mesh mesh;
+        ObjParser parser;
+        parser.m_thread_count = thread_count;
+        auto start = std::chrono::steady_clock::now();
+        success = parser.parse(input_path.c_str(), mesh.m_vertices);
+        auto end = std::chrono::steady_clock::now();
+        parallel_ms.push(std::chrono::duration<double, std::milli>(end - start).count());
+        parse_stats = parser.stats();
+        parallel_vertices = mesh.m_vertices.size();
+        parallel_area = surface_area(mesh.m_vertices);
+    }
+
+    if (generated) {
+        std::remove(input_path.c_str());
+    }
+
+    if (!success) {
+        std::cerr << "Failed to load " << input_path << std::endl;
+        return 1;
+    }
+
+    std::ofstream out(output_path);
+    if (!out.is_open()) {
+        std::cerr << "Couldn't open " << output_path << " for writing" << std::endl;
+        return 1;
+    }
+
+    JsonWriter json(out);
+    json.begin_object();
+    json.value("input", generated ? std::string("grid") : input_path);
+    json.value("bytes", parse_stats.m_bytes);
+    json.value("runs", run_count);
+    json.value("threads", parse_stats.m_threads);
+    json.value("chunks", parse_stats.m_chunks);
+    json.value("positions", parse_stats.m_positions);
+    json.value("normals", parse_stats.m_normals);
+    json.value("faces", parse_stats.m_faces);
+    json.value("triangles", parse_stats.m_triangles);
+    json.value("invalid_faces", parse_stats.m_invalid_faces);
+
+    json.stats("parallel_ms", parallel_ms);
+    json.value("parallel_mb_per_s", (double) parse_stats.m_bytes / (1024.0 * 1024.0) / (parallel_ms.avg() / 1000.0));
+    // Last run
+    json.begin_object("parallel_steps_ms");
+    json.value("map", parse_stats.m_map_ms);
+    json.value("count", parse_stats.m_count_ms);
+    json.value("parse", parse_stats.m_parse_ms);
+    json.value("triangulate", parse_stats.m_triangulate_ms);
+    json.end_object();
+
+    if (!skip_tinyobj) {
+        json.stats("tinyobj_ms", tinyobj_ms);
+        json.value("speedup", tinyobj_ms.avg() / parallel_ms.avg());
+        // Both triangulate differently, but the triangles cover the same surface
+        bool match = tinyobj_vertices == parallel_vertices &&
+                     std::abs(tinyobj_area - parallel_area) <= 1e-4 * std::max(tinyobj_area, 1.0);
+        json.value("outputs_match", match);
+    }
+    json.end_object();
+
+    std::cout << "vk_engine_obj_bench: " << parse_stats.m_triangles << " triangles, parallel avg " << parallel_ms.avg()
+              << " ms";
+    if (!skip_tinyobj) {
+        std::cout << ", tinyobj avg " << tinyobj_ms.avg() << " ms";
+    }
+    std::cout << ", results written to " << output_path << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,167 @@
+#include "BenchCommon.h"
+
+#include <Engine.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+// Usage: vk_engine_replay [--capture file.vkfc] [--repeat N] [--output file.json]
+// Replays a capture (F12 in the samples) headless, at the window size it was captured at, as
+// fast as the GPU goes. The capture is replayed N times in a row: the first pass also creates
+// its meshes and pipelines, and every frame reports the fastest of its replays so a regression
+// shows up on the frame that caused it.
+// Must be run from the output directory, like the samples, so the shaders are found.
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Fastest replay of one captured frame
+struct ReplayFrameTimes {
+    double m_apply_ms = 0.0;
+    double m_cpu_ms = 0.0;
+    double m_gpu_ms = 0.0;
+    double m_wall_ms = 0.0;
+};
+
+static uint32_t count_frames(const char *capture_path) {
+    FrameCaptureReader reader;
+    if (!reader.open(capture_path)) {
+        return 0;
+    }
+    uint32_t frames = 0;
+    FrameCaptureChunkType type;
+    FrameCaptureStream payload;
+    while (reader.next_chunk(&type, &payload)) {
+        frames += type == FrameCaptureChunkType::Frame ? 1 : 0;
+    }
+    return frames;
+}
+
+int main(int argc, char **argv) {
+    BenchArgs args(argc, argv);
+
+    std::string capture_path = args.get_string("capture", "vk_engine_capture.vkfc");
+    uint64_t repeat_count = args.get_uint("repeat", 3);
+    std::string output_path = args.get_string("output", "vk_engine_replay.json");
+
+    uint32_t frame_count = count_frames(capture_path.c_str());
+    if (frame_count == 0 || repeat_count == 0) {
+        std::cerr << capture_path << " has no frames to replay, or repeat is 0" << std::endl;
+        return 1;
+    }
+
+    FrameReplay replay;
+    if (!replay.open(capture_path.c_str())) {
+        return 1;
+    }
+
+    Engine engine{};
+    engine.m_headless = true;
+    engine.m_window_extent = replay.m_reader.extent();
+    engine.init();
+
+    std::vector<ReplayFrameTimes> frames(frame_count);
+    RollingStats cpu_ms(frame_count * repeat_count);
+    RollingStats gpu_ms(frame_count * repeat_count);
+    RollingStats wall_ms(frame_count * repeat_count);
+    RollingStats apply_ms(frame_count * repeat_count);
+    double first_pass_ms = 0.0;
+    double replay_ms = 0.0;
+
+    for (uint64_t pass = 0; pass < repeat_count; pass++) {
+        replay.rewind();
+        auto pass_start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < frame_count; i++) {
+            auto start = std::chrono::steady_clock::now();
+            if (!engine.replay_frame(replay)) {
+                std::cerr << "Replay stopped at frame " << i << std::endl;
+                engine.cleanup();
+                return 1;
+            }
+            double apply = elapsed_ms(start);
+            engine.draw();
+            double wall = elapsed_ms(start);
+            double cpu = engine.m_profiler.m_cpu_frame_stats.last();
+            // Resolved FRAMES_IN_FLIGHT frames late, so it's of an earlier frame
+            double gpu = engine.m_profiler.m_gpu_frame_stats.last();
+
+            apply_ms.push(apply);
+            wall_ms.push(wall);
+            cpu_ms.push(cpu);
+            gpu_ms.push(gpu);
+
+            ReplayFrameTimes &times = frames[i];
+            if (pass == 0 || wall < times.m_wall_ms) {
+                times.m_apply_ms = apply;
+                times.m_wall_ms = wall;
+            }
+            if (pass == 0 || cpu < times.m_cpu_ms) {
+                times.m_cpu_ms = cpu;
+            }
+            if (pass == 0 || gpu < times.m_gpu_ms) {
+                times.m_gpu_ms = gpu;
+            }
+        }
+        double pass_ms = elapsed_ms(pass_start);
+        if (pass == 0) {
+            first_pass_ms = pass_ms;
+        }
+        replay_ms += pass_ms;
+    }
+
+    vkDeviceWaitIdle(engine.m_device);
+
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(engine.m_physical_device, &device_properties);
+
+    std::ofstream out(output_path);
+    if (!out.is_open()) {
+        std::cerr << "Couldn't open " << output_path << " for writing" << std::endl;
+        engine.cleanup();
+        return 1;
+    }
+
+    JsonWriter json(out);
+    json.begin_object();
+    json.value("device", device_properties.deviceName);
+    json.begin_object("capture");
+    json.value("file", capture_path);
+    json.value("bytes", (uint64_t) replay.m_reader.size());
+    json.value("width", engine.m_window_extent.width);
+    json.value("height", engine.m_window_extent.height);
+    json.value("frames", frame_count);
+    json.value("meshes", (uint32_t) replay.m_meshes.size());
+    json.value("materials", (uint32_t) replay.m_materials.size());
+    json.value("objects", (uint32_t) engine.m_renderables.size());
+    json.end_object();
+
+    json.value("repeat", repeat_count);
+    json.value("first_pass_ms", first_pass_ms);
+    json.value("total_ms", replay_ms);
+    json.stats("apply_ms", apply_ms);
+    json.stats("cpu_ms", cpu_ms);
+    json.stats("gpu_ms", gpu_ms);
+    json.stats("wall_ms", wall_ms);
+
+    json.begin_array("frames");
+    for (uint32_t i = 0; i < frame_count; i++) {
+        json.begin_object();
+        json.value("frame", i);
+        json.value("apply_ms", frames[i].m_apply_ms);
+        json.value("cpu_ms", frames[i].m_cpu_ms);
+        json.value("gpu_ms", frames[i].m_gpu_ms);
+        json.value("wall_ms", frames[i].m_wall_ms);
+        json.end_object();
+    }
+    json.end_array();
+    json.end_object();
+
+    std::cout << "vk_engine_replay: " << frame_count << " frames x " << repeat_count << ", wall avg "
+              << wall_ms.avg() << " ms (p99 " << wall_ms.percentile(0.99) << "), results written to "
+              << output_path << std::endl;
+
+    engine.cleanup();
+    return 0;
+}
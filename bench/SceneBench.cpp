@@ -0,0 +1,148 @@
+#include "BenchCommon.h"
+#include "SyntheticScene.h"
+
+#include <Engine.h>
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+// Usage: vk_engine_scene_bench [--meshes N] [--instances M] [--materials K] [--seed S] [--keep-file]
+//                              [--output file.json]
+// Time to first frame of the same scene, generated and then loaded from a scene file. Each one
+// gets its own engine so the second doesn't start with the buffers the first already grew. The
+// defaults are 1M objects.
+// Must be run from the output directory, like the samples, so the shaders are found.
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void init_engine(Engine &engine) {
+    engine.m_headless = true;
+    engine.init();
+}
+
+int main(int argc, char **argv) {
+    BenchArgs args(argc, argv);
+
+    SyntheticSceneDesc desc;
+    desc.m_mesh_count = args.get_uint("meshes", desc.m_mesh_count);
+    desc.m_instances_per_mesh = args.get_uint("instances", 125000);
+    desc.m_material_count = args.get_uint("materials", desc.m_material_count);
+    desc.m_seed = args.get_uint("seed", desc.m_seed);
+    std::string output_path = args.get_string("output", "vk_engine_scene_bench.json");
+    std::string scene_path = "vk_engine_scene_bench.vksc";
+
+    if (desc.m_mesh_count == 0 || desc.m_material_count == 0) {
+        std::cerr << "meshes and materials must be at least 1" << std::endl;
+        return 1;
+    }
+
+    // Generated, the first frame builds the BVH from the meshes' bounds
+    double generate_ms, generated_first_frame_ms, save_ms;
+    uint64_t object_count;
+    {
+        Engine engine{};
+        init_engine(engine);
+
+        auto start = std::chrono::steady_clock::now();
+        SyntheticScene scene;
+        scene.build(engine, desc);
+        generate_ms = elapsed_ms(start);
+
+        start = std::chrono::steady_clock::now();
+        engine.draw();
+        generated_first_frame_ms = elapsed_ms(start);
+        object_count = engine.m_renderables.size();
+
+        start = std::chrono::steady_clock::now();
+        if (!engine.save_scene(scene_path.c_str())) {
+            engine.cleanup();
+            return 1;
+        }
+        save_ms = elapsed_ms(start);
+
+        vkDeviceWaitIdle(engine.m_device);
+        engine.cleanup();
+    }
+
+    // Loaded, only the meshes and materials are created beforehand. Same names since the
+    // description is the same.
+    double create_assets_ms, load_ms, loaded_first_frame_ms;
+    SceneLoadStats load_stats;
+    {
+        Engine engine{};
+        init_engine(engine);
+
+        auto start = std::chrono::steady_clock::now();
+        SyntheticSceneDesc assets_desc = desc;
+        assets_desc.m_instances_per_mesh = 0;
+        SyntheticScene scene;
+        scene.build(engine, assets_desc);
+        create_assets_ms = elapsed_ms(start);
+
+        start = std::chrono::steady_clock::now();
+        if (!engine.load_scene(scene_path.c_str())) {
+            engine.cleanup();
+            return 1;
+        }
+        load_ms = elapsed_ms(start);
+        load_stats = engine.m_scene_load_stats;
+
+        start = std::chrono::steady_clock::now();
+        engine.draw();
+        loaded_first_frame_ms = elapsed_ms(start);
+
+        vkDeviceWaitIdle(engine.m_device);
+        engine.cleanup();
+    }
+
+    if (!args.has("keep-file")) {
+        std::remove(scene_path.c_str());
+    }
+
+    std::ofstream out(output_path);
+    if (!out.is_open()) {
+        std::cerr << "Couldn't open " << output_path << " for writing" << std::endl;
+        return 1;
+    }
+
+    JsonWriter json(out);
+    json.begin_object();
+    json.begin_object("scene");
+    json.value("meshes", desc.m_mesh_count);
+    json.value("instances_per_mesh", desc.m_instances_per_mesh);
+    json.value("materials", desc.m_material_count);
+    json.value("objects", object_count);
+    json.value("seed", desc.m_seed);
+    json.value("file_bytes", load_stats.m_bytes);
+    json.end_object();
+
+    // Meshes and materials included, the same in both
+    json.begin_object("generated");
+    json.value("build_ms", generate_ms);
+    json.value("first_frame_ms", generated_first_frame_ms);
+    json.value("time_to_first_frame_ms", generate_ms + generated_first_frame_ms);
+    json.value("save_ms", save_ms);
+    json.end_object();
+
+    json.begin_object("loaded");
+    json.value("assets_ms", create_assets_ms);
+    json.value("load_ms", load_ms);
+    json.value("map_ms", load_stats.m_map_ms);
+    json.value("fixup_ms", load_stats.m_fixup_ms);
+    json.value("bvh_ms", load_stats.m_bvh_ms);
+    json.value("first_frame_ms", loaded_first_frame_ms);
+    json.value("time_to_first_frame_ms", create_assets_ms + load_ms + loaded_first_frame_ms);
+    json.end_object();
+    json.end_object();
+
+    std::cout << "vk_engine_scene_bench: " << object_count << " objects, time to first frame "
+              << generate_ms + generated_first_frame_ms << " ms generated, "
+              << create_assets_ms + load_ms + loaded_first_frame_ms << " ms loaded, results written to "
+              << output_path << std::endl;
+
+    return 0;
+}
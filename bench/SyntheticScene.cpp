@@ -0,0 +1,296 @@
+#include "SyntheticScene.h"
+
+#include <Initializers.h>
+#include <PipelineBuilder.h>
+
+#include <glm/gtc/constants.hpp>
+#include <glm/gtx/transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+void SyntheticScene::build(Engine &engine, const SyntheticSceneDesc &desc) {
+    m_rng.seed(desc.m_seed);
+
+    build_materials(engine, desc);
+    build_meshes(engine, desc);
+    build_renderables(engine, desc);
+    build_lights(engine, desc);
+    build_skinned(engine, desc);
+}
+
+void SyntheticScene::build_materials(Engine &engine, const SyntheticSceneDesc &desc) {
+    PipelineBuilder pipeline_builder;
+    pipeline_builder.setup_default(engine.m_window_extent);
+    pipeline_builder.m_depth_stencil_format = engine.m_depth_format;
+    pipeline_builder.m_depth_stencil = Initializers::depth_stencil_create_info(true, true,
+                                                                               VK_COMPARE_OP_LESS_OR_EQUAL);
+    pipeline_builder.set_vertex_input<Vertex>();
+    pipeline_builder.enable_dynamic_render_state();
+
+    // Same layout as the engine's pipelines for these shaders
+    bool lit = desc.m_light_count > 0 || desc.m_sun;
+    VkPipelineLayout layout = lit ? engine.m_lit_mesh_pipeline_layout : engine.m_debug_mesh_pipeline_layout;
+    pipeline_builder.m_pipeline_layout = layout;
+    std::string vertex_shader = lit ? "lit_trimesh.vert.spv" : "base_trimesh.vert.spv";
+    std::string instanced_vertex_shader = lit ? "lit_trimesh_instanced.vert.spv" : "base_trimesh_instanced.vert.spv";
+    std::string fragment_shader = lit ? "clustered_lit.frag.spv" : "base_vertex_color.frag.spv";
+
+    // States that would each need their own pipeline if they were baked
+    RenderState states[6];
+    states[1].m_cull_mode = VK_CULL_MODE_BACK_BIT;
+    states[2].m_cull_mode = VK_CULL_MODE_FRONT_BIT;
+    states[3].m_depth_compare_op = VK_COMPARE_OP_LESS;
+    states[4].m_depth_write = false;
+    states[5].m_cull_mode = VK_CULL_MODE_BACK_BIT;
+    states[5].m_front_face = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+
+    uint32_t state_variants = std::max(desc.m_state_variants, 1u);
+
+    // Otherwise same state for every material, what we measure is the cost of switching pipelines.
+    // The engine owns the pipelines.
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkPipeline instanced_pipeline = VK_NULL_HANDLE;
+    for (uint32_t i = 0; i < desc.m_material_count; i++) {
+        uint32_t variant = i % state_variants;
+        if (variant == 0) {
+            pipeline = engine.build_pipeline(pipeline_builder, {
+                    {VK_SHADER_STAGE_VERTEX_BIT, vertex_shader},
+                    {VK_SHADER_STAGE_FRAGMENT_BIT, fragment_shader}
+            });
+            instanced_pipeline = engine.build_pipeline(pipeline_builder, {
+                    {VK_SHADER_STAGE_VERTEX_BIT, instanced_vertex_shader},
+                    {VK_SHADER_STAGE_FRAGMENT_BIT, fragment_shader}
+            });
+
+            if (pipeline == VK_NULL_HANDLE || instanced_pipeline == VK_NULL_HANDLE) {
+                std::cout << "Error when building the synthetic scene pipelines" << std::endl;
+                abort();
+            }
+        }
+
+        m_materials.push_back(engine.create_material(pipeline, layout,
+                                                     "bench_material_" + std::to_string(i), instanced_pipeline,
+                                                     states[variant % 6]));
+    }
+}
+
+void SyntheticScene::build_meshes(Engine &engine, const SyntheticSceneDesc &desc) {
+    for (uint32_t i = 0; i < desc.m_mesh_count; i++) {
+        Mesh &mesh = engine.m_meshes["bench_mesh_" + std::to_string(i)];
+
+        // 8x16 up to 36x72 quads, so meshes have noticeably different costs
+        uint32_t rings = 8 + (i % 8) * 4;
+        uint32_t segments = rings * 2;
+        glm::vec3 color = random_vec3();
+
+        auto sphere_point = [&](uint32_t ring, uint32_t segment) {
+            float theta = glm::pi<float>() * (float) ring / (float) rings;
+            float phi = glm::two_pi<float>() * (float) segment / (float) segments;
+            Vertex vertex{};
+            vertex.normal = {std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi)};
+            vertex.position = vertex.normal;
+            vertex.color = color;
+            return vertex;
+        };
+
+        // Indexed, the GPU culling only handles indexed meshes
+        mesh.m_vertices.reserve((rings + 1) * (segments + 1));
+        for (uint32_t ring = 0; ring <= rings; ring++) {
+            for (uint32_t segment = 0; segment <= segments; segment++) {
+                mesh.m_vertices.push_back(sphere_point(ring, segment));
+            }
+        }
+
+        mesh.m_indices.reserve(rings * segments * 6);
+        for (uint32_t ring = 0; ring < rings; ring++) {
+            for (uint32_t segment = 0; segment < segments; segment++) {
+                uint32_t i00 = ring * (segments + 1) + segment;
+                uint32_t i01 = i00 + 1;
+                uint32_t i10 = i00 + segments + 1;
+                uint32_t i11 = i10 + 1;
+
+                mesh.m_indices.insert(mesh.m_indices.end(), {i00, i10, i11, i00, i11, i01});
+            }
+        }
+
+        m_vertex_count += mesh.m_vertices.size();
+        engine.upload_mesh(mesh);
+        m_meshes.push_back(&mesh);
+    }
+}
+
+void SyntheticScene::build_renderables(Engine &engine, const SyntheticSceneDesc &desc) {
+    uint32_t object_count = desc.m_mesh_count * desc.m_instances_per_mesh;
+
+    // Objects are spread in a cube in front of the camera
+    auto side = (uint32_t) std::ceil(std::cbrt((double) object_count));
+    float extent = 40.f;
+    float spacing = extent / (float) std::max(side, 1u);
+
+    engine.m_camera_position = {0.f, 0.f, -extent * 1.25f};
+    engine.m_renderables.reserve(engine.m_renderables.size() + object_count);
+
+    for (uint32_t i = 0; i < object_count; i++) {
+        uint32_t x = i % side;
+        uint32_t y = (i / side) % side;
+        uint32_t z = i / (side * side);
+
+        glm::vec3 position = glm::vec3(x, y, z) * spacing - glm::vec3(extent * 0.5f);
+        glm::vec3 axis = glm::normalize(random_vec3() + 0.01f);
+        float angle = random_float() * glm::two_pi<float>();
+
+        RenderObject object{};
+        object.m_mesh = m_meshes[i % desc.m_mesh_count];
+        object.m_material = m_materials[m_rng() % desc.m_material_count];
+        object.m_transform_matrix = glm::translate(position) *
+                                    glm::rotate(angle, axis) *
+                                    glm::scale(glm::vec3(spacing * 0.4f));
+        engine.m_renderables.push_back(object);
+    }
+
+    if (desc.m_sorted) {
+        std::stable_sort(engine.m_renderables.begin(), engine.m_renderables.end(),
+                         [](const RenderObject &a, const RenderObject &b) {
+                             if (a.m_material != b.m_material) {
+                                 return a.m_material < b.m_material;
+                             }
+                             return a.m_mesh < b.m_mesh;
+                         });
+    } else {
+        // Fisher-Yates with raw rng output, std::shuffle isn't reproducible across standard libraries
+        for (size_t i = engine.m_renderables.size(); i > 1; i--) {
+            std::swap(engine.m_renderables[i - 1], engine.m_renderables[m_rng() % i]);
+        }
+    }
+}
+
+void SyntheticScene::build_lights(Engine &engine, const SyntheticSceneDesc &desc) {
+    // Same cube as the objects. The radius doesn't depend on the count, so the lights per cluster
+    // grow with it.
+    float extent = 40.f;
+    engine.m_lights.reserve(engine.m_lights.size() + desc.m_light_count);
+
+    for (uint32_t i = 0; i < desc.m_light_count; i++) {
+        PointLight light{};
+        light.m_position = random_vec3() * extent - glm::vec3(extent * 0.5f);
+        light.m_radius = extent * 0.1f;
+        light.m_color = random_vec3();
+        light.m_intensity = 1.f;
+        engine.m_lights.push_back(light);
+    }
+
+    if (desc.m_sun) {
+        engine.m_sun.m_intensity = 1.f;
+    }
+}
+
+// Cylinder along y, from 0 to its height, with a joint at the start of each section
+constexpr uint32_t SKINNED_JOINTS = 4;
+constexpr float SKINNED_HEIGHT = 2.f;
+
+void SyntheticScene::build_skinned(Engine &engine, const SyntheticSceneDesc &desc) {
+    if (desc.m_skinned_instances == 0) {
+        return;
+    }
+
+    SkinnedMesh mesh;
+    mesh.m_joint_count = SKINNED_JOINTS;
+    // Bent any way, the vertices stay as far from the base as in the bind pose, which the bind
+    // pose sphere grown by the height covers
+    mesh.m_bounds_margin = SKINNED_HEIGHT;
+    uint32_t rings = 32;
+    uint32_t segments = 16;
+    float section = SKINNED_HEIGHT / (float) SKINNED_JOINTS;
+    glm::vec3 color = random_vec3();
+
+    for (uint32_t ring = 0; ring <= rings; ring++) {
+        float y = SKINNED_HEIGHT * (float) ring / (float) rings;
+        // Blended between the joint of the section and the next one over its second half
+        float t = std::min(y / section, (float) SKINNED_JOINTS - 0.001f);
+        auto joint = (uint32_t) t;
+        float blend = std::clamp((t - (float) joint - 0.5f) * 2.f, 0.f, 1.f);
+        uint32_t next_joint = std::min(joint + 1, SKINNED_JOINTS - 1);
+
+        for (uint32_t segment = 0; segment <= segments; segment++) {
+            float phi = glm::two_pi<float>() * (float) segment / (float) segments;
+            SkinnedVertex vertex{};
+            vertex.normal = {std::cos(phi), 0.f, std::sin(phi)};
+            vertex.position = vertex.normal * 0.25f + glm::vec3(0.f, y, 0.f);
+            vertex.color = color;
+            vertex.joints[0] = (uint8_t) joint;
+            vertex.joints[1] = (uint8_t) next_joint;
+            vertex.weights = {1.f - blend, blend, 0.f, 0.f};
+            mesh.m_vertices.push_back(vertex);
+        }
+    }
+    for (uint32_t ring = 0; ring < rings; ring++) {
+        for (uint32_t segment = 0; segment < segments; segment++) {
+            uint32_t i00 = ring * (segments + 1) + segment;
+            uint32_t i01 = i00 + 1;
+            uint32_t i10 = i00 + segments + 1;
+            uint32_t i11 = i10 + 1;
+            mesh.m_indices.insert(mesh.m_indices.end(), {i00, i10, i11, i00, i11, i01});
+        }
+    }
+
+    if (!engine.upload_skinned_mesh(mesh)) {
+        std::cout << "Error when uploading the synthetic skinned mesh" << std::endl;
+        abort();
+    }
+
+    // A grid through the middle of the cube of objects
+    auto side = (uint32_t) std::ceil(std::sqrt((double) desc.m_skinned_instances));
+    float extent = 40.f;
+    float spacing = extent / (float) side;
+    for (uint32_t i = 0; i < desc.m_skinned_instances; i++) {
+        uint32_t index = engine.create_skinned_instance(mesh, "bench_skinned_" + std::to_string(i));
+        if (index == UINT32_MAX) {
+            abort();
+        }
+        glm::vec3 position = glm::vec3((float) (i % side), 0.f, (float) (i / side)) * spacing -
+                             glm::vec3(extent * 0.5f, 0.f, extent * 0.5f);
+
+        RenderObject object{};
+        object.m_mesh = engine.m_skinned_instances[index].m_mesh;
+        object.m_material = m_materials[i % m_materials.size()];
+        object.m_transform_matrix = glm::translate(position) * glm::scale(glm::vec3(spacing * 0.4f));
+        // Moves every frame, the cached shadow cascades can't keep it
+        object.m_dynamic = true;
+        engine.m_renderables.push_back(object);
+
+        m_skinned.push_back(index);
+        m_skinned_phases.push_back(random_float() * glm::two_pi<float>());
+        m_skinned_vertex_count += mesh.m_vertices.size();
+    }
+}
+
+void SyntheticScene::animate(std::vector<SkinnedInstance> &instances, float time) {
+    float section = SKINNED_HEIGHT / (float) SKINNED_JOINTS;
+    for (size_t i = 0; i < m_skinned.size(); i++) {
+        // Each joint bends around its base, carried by the ones below it
+        std::vector<glm::mat4> &joints = instances[m_skinned[i]].m_joints;
+        glm::mat4 parent(1.f);
+        for (uint32_t j = 0; j < SKINNED_JOINTS; j++) {
+            glm::vec3 pivot(0.f, section * (float) j, 0.f);
+            float angle = 0.4f * std::sin(time * 2.f + m_skinned_phases[i] + (float) j * 0.5f);
+            parent = parent * glm::translate(pivot) * glm::rotate(angle, glm::vec3(0.f, 0.f, 1.f)) *
+                     glm::translate(-pivot);
+            joints[j] = parent;
+        }
+    }
+}
+
+float SyntheticScene::random_float() {
+    // 24 bits of the output, that's all a float can hold
+    return (float) (m_rng() >> 8) * (1.0f / 16777216.0f);
+}
+
+glm::vec3 SyntheticScene::random_vec3() {
+    // Separate statements, argument evaluation order is unspecified
+    float x = random_float();
+    float y = random_float();
+    float z = random_float();
+    return {x, y, z};
+}
@@ -0,0 +1,59 @@
+#ifndef VK_ENGINE_SYNTHETICSCENE_H
+#define VK_ENGINE_SYNTHETICSCENE_H
+
+#include <Engine.h>
+
+#include <cstdint>
+#include <random>
+
+struct SyntheticSceneDesc {
+    uint32_t m_mesh_count = 8;
+    uint32_t m_instances_per_mesh = 128;
+    uint32_t m_material_count = 4;
+    uint32_t m_seed = 1337;
+    // Sort renderables by material then mesh, otherwise they are left shuffled
+    bool m_sorted = false;
+    // Consecutive materials sharing a pipeline and only differing by their dynamic render state
+    // (up to 6 different states). 1 gives every material its own pipeline.
+    uint32_t m_state_variants = 1;
+    // Point lights spread through the objects, the materials are lit when there are any
+    uint32_t m_light_count = 0;
+    // Turns the sun on, the materials are lit with it too
+    bool m_sun = false;
+    // Bending cylinders skinned on the GPU, on a grid through the middle of the objects
+    uint32_t m_skinned_instances = 0;
+};
+
+// Generates the same scene for a given description on every platform: the meshes are
+// procedural spheres of increasing tessellation, and we only use raw mt19937 output
+// since the std distributions differ between standard libraries.
+class SyntheticScene {
+public:
+    void build(Engine &engine, const SyntheticSceneDesc &desc);
+    // Writes the joints of the skinned instances for the given time, in seconds. Into the
+    // engine's instances, or the simulation's ones with a render thread.
+    void animate(std::vector<SkinnedInstance> &instances, float time);
+
+    uint64_t m_vertex_count = 0;
+    // Over all the skinned instances, not in m_vertex_count
+    uint64_t m_skinned_vertex_count = 0;
+
+private:
+    void build_materials(Engine &engine, const SyntheticSceneDesc &desc);
+    void build_meshes(Engine &engine, const SyntheticSceneDesc &desc);
+    void build_renderables(Engine &engine, const SyntheticSceneDesc &desc);
+    void build_lights(Engine &engine, const SyntheticSceneDesc &desc);
+    void build_skinned(Engine &engine, const SyntheticSceneDesc &desc);
+
+    float random_float();
+    glm::vec3 random_vec3();
+
+    std::mt19937 m_rng;
+    std::vector<Mesh *> m_meshes;
+    std::vector<Material *> m_materials;
+    // Indices in Engine::m_skinned_instances, and the offset of their animation
+    std::vector<uint32_t> m_skinned;
+    std::vector<float> m_skinned_phases;
+};
+
+#endif //VK_ENGINE_SYNTHETICSCENE_H
@@ -0,0 +1,432 @@
+#include "BenchCommon.h"
+#include "SyntheticScene.h"
+
+#include <Engine.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+// A chain of passes, each reading the image the previous one wrote. The first and the last
+// images never live at the same time, a graph of its own must place them in the same memory.
+// The frame's transients mostly overlap, this checks the aliasing itself.
+static RenderGraphStats check_transient_aliasing(Engine &engine) {
+    RenderGraph graph;
+    graph.init(engine.m_device, engine.m_allocator, &engine.m_memory_budget, &engine.m_graphics_timeline,
+               &engine.m_timeline_deletion_queue, nullptr);
+    graph.begin();
+
+    RenderGraphImageDesc desc = {
+            .m_format = VK_FORMAT_R8G8B8A8_UNORM,
+            .m_extent = engine.m_window_extent,
+            .m_usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT
+    };
+    RenderGraph::Resource images[3] = {graph.create_image("chain_0", desc), graph.create_image("chain_1", desc),
+                                       graph.create_image("chain_2", desc)};
+    // Written last so nothing is culled
+    RenderGraph::Resource output = graph.import_buffer("chain_output");
+    for (uint32_t i = 0; i <= 3; i++) {
+        RenderGraph::Pass pass = graph.add_pass("chain", [](VkCommandBuffer) {});
+        if (i > 0) {
+            graph.use(pass, images[i - 1], RG_FRAGMENT_SAMPLED);
+        }
+        graph.use(pass, i < 3 ? images[i] : output, i < 3 ? RG_COLOR_ATTACHMENT : RG_COMPUTE_WRITE);
+    }
+
+    // Compiling places the images, nothing is recorded
+    graph.prepare();
+    RenderGraphStats stats = graph.stats();
+    graph.cleanup();
+    return stats;
+}
+
+// Usage: vk_engine_bench [--meshes N] [--instances M] [--materials K] [--frames F] [--warmup W]
+//                        [--seed S] [--sorted] [--instancing-threshold T] [--state-variants V] [--window]
+//                        [--depth-prepass] [--occlusion-culling] [--lights L] [--shadows C]
+//                        [--async-compute] [--command-cache] [--particles E] [--particle-capacity P]
+//                        [--dynamic-resolution] [--target-ms T] [--min-scale S] [--max-scale S]
+//                        [--skinned N] [--render-thread] [--sim-spike-ms S] [--sim-spike-every N]
+//                        [--output file.json]
+// Must be run from the output directory, like the samples, so the shaders are found.
+int main(int argc, char **argv) {
+    BenchArgs args(argc, argv);
+
+    SyntheticSceneDesc desc;
+    desc.m_mesh_count = args.get_uint("meshes", desc.m_mesh_count);
+    desc.m_instances_per_mesh = args.get_uint("instances", desc.m_instances_per_mesh);
+    desc.m_material_count = args.get_uint("materials", desc.m_material_count);
+    desc.m_seed = args.get_uint("seed", desc.m_seed);
+    desc.m_sorted = args.has("sorted");
+    desc.m_state_variants = args.get_uint("state-variants", desc.m_state_variants);
+    desc.m_light_count = args.get_uint("lights", desc.m_light_count);
+    // Cascade count, the sun and its shadows are off without it
+    uint32_t shadow_cascades = args.get_uint("shadows", 0);
+    desc.m_sun = shadow_cascades > 0;
+    desc.m_skinned_instances = args.get_uint("skinned", 0);
+
+    // Emitters, sharing the capacity so the particles stay close to it once the first ones die
+    uint32_t particle_emitters = args.get_uint("particles", 0);
+
+    // Draws on a thread of its own while the simulation steps on this one, needs a window.
+    // The frames and the warmup are then counted in simulation steps.
+    bool render_thread = args.has("render-thread");
+    // Busy waits in one simulation step out of --sim-spike-every, like slow game logic would
+    double sim_spike_ms = args.get_double("sim-spike-ms", 0.0);
+    uint64_t sim_spike_every = args.get_uint("sim-spike-every", 10);
+
+    uint64_t frame_count = args.get_uint("frames", 500);
+    uint64_t warmup_count = args.get_uint("warmup", 30);
+    std::string output_path = args.get_string("output", "vk_engine_bench.json");
+
+    if (desc.m_mesh_count == 0 || desc.m_material_count == 0 || frame_count == 0) {
+        std::cerr << "meshes, materials and frames must be at least 1" << std::endl;
+        return 1;
+    }
+
+    Engine engine{};
+    engine.m_headless = !args.has("window") && !render_thread;
+    engine.m_enable_render_thread = render_thread;
+    // 0 draws every object on its own, in the generated order
+    engine.m_instancing_threshold = args.get_uint("instancing-threshold", engine.m_instancing_threshold);
+    engine.m_enable_depth_prepass = args.has("depth-prepass");
+    engine.m_enable_occlusion_culling = args.has("occlusion-culling");
+    engine.m_enable_async_compute = args.has("async-compute");
+    engine.m_enable_command_cache = args.has("command-cache");
+    if (shadow_cascades > 0) {
+        engine.m_shadow_settings.m_enabled = true;
+        engine.m_shadow_settings.m_cascade_count = shadow_cascades;
+    }
+    engine.m_particle_capacity = args.get_uint("particle-capacity", engine.m_particle_capacity);
+    // The scale follows the GPU time of the frames, a lower target makes it drop
+    DynamicResolutionSettings &resolution = engine.m_resolution_settings;
+    resolution.m_enabled = args.has("dynamic-resolution");
+    resolution.m_target_ms = (float) args.get_double("target-ms", resolution.m_target_ms);
+    resolution.m_min_scale = (float) args.get_double("min-scale", resolution.m_min_scale);
+    resolution.m_max_scale = (float) args.get_double("max-scale", resolution.m_max_scale);
+    engine.init();
+
+    SyntheticScene scene;
+    scene.build(engine, desc);
+
+    // A grid of fountains in front of the camera
+    for (uint32_t i = 0; i < particle_emitters; i++) {
+        ParticleEmitter emitter;
+        emitter.m_position = {(float) (i % 8) * 0.5f - 1.75f, -0.5f, (float) (i / 8) * -0.5f};
+        emitter.m_velocity = {0.f, 3.f, 0.f};
+        emitter.m_velocity_spread = 1.f;
+        emitter.m_start_color = {1.f, 0.6f, 0.2f, 1.f};
+        emitter.m_end_color = {0.2f, 0.2f, 1.f, 0.f};
+        emitter.m_rate = (float) engine.m_particle_capacity / (emitter.m_lifetime * (float) particle_emitters);
+        engine.m_particle_emitters.push_back(emitter);
+    }
+
+    // Fixed steps, every run animates the same poses
+    uint64_t step = 0;
+    auto simulate = [&](std::vector<SkinnedInstance> &instances) {
+        scene.animate(instances, (float) step / 60.f);
+        if (sim_spike_ms > 0.0 && sim_spike_every > 0 && step % sim_spike_every == 0) {
+            auto spike_end = std::chrono::steady_clock::now() + std::chrono::duration<double, std::milli>(sim_spike_ms);
+            while (std::chrono::steady_clock::now() < spike_end) {}
+        }
+        step++;
+    };
+    auto run_frame = [&]() {
+        if (!engine.m_headless) {
+            glfwPollEvents();
+        }
+        simulate(engine.m_skinned_instances);
+        engine.draw();
+    };
+
+    RollingStats cpu_ms(frame_count);
+    RollingStats gpu_ms(frame_count);
+    RollingStats wall_ms(frame_count);
+    RollingStats frame_interval_ms(frame_count);
+    // Per axis, 1 without dynamic resolution
+    RollingStats render_scale(frame_count);
+    uint32_t resolution_changes = engine.m_dynamic_resolution.stats().m_changes;
+    uint32_t first_frame = engine.m_frame_count;
+
+    if (render_thread) {
+        engine.m_simulation_step = 1.f / 60.f;
+        engine.m_simulate = [&](SceneState &state, float) {
+            simulate(state.m_skinned_instances);
+            if (step == warmup_count + frame_count) {
+                glfwSetWindowShouldClose(engine.m_window, GLFW_TRUE);
+            }
+        };
+        engine.run();
+
+        // Nothing to sample from here, these are the last frames the rolling stats kept, the
+        // warmup included when the run was short
+        cpu_ms = engine.m_profiler.m_cpu_frame_stats;
+        gpu_ms = engine.m_profiler.m_gpu_frame_stats;
+        wall_ms = engine.m_frame_interval_stats;
+        frame_interval_ms = engine.m_frame_interval_stats;
+        render_scale.push((double) engine.m_render_extent.width / (double) engine.m_window_extent.width);
+    } else {
+        for (uint64_t i = 0; i < warmup_count; i++) {
+            run_frame();
+        }
+        resolution_changes = engine.m_dynamic_resolution.stats().m_changes;
+        first_frame = engine.m_frame_count;
+
+        for (uint64_t i = 0; i < frame_count; i++) {
+            auto start = std::chrono::steady_clock::now();
+            run_frame();
+            auto end = std::chrono::steady_clock::now();
+
+            wall_ms.push(std::chrono::duration<double, std::milli>(end - start).count());
+            cpu_ms.push(engine.m_profiler.m_cpu_frame_stats.last());
+            // GPU timings are resolved FRAMES_IN_FLIGHT frames late, the warmup covers the first ones
+            gpu_ms.push(engine.m_profiler.m_gpu_frame_stats.last());
+            frame_interval_ms.push(engine.m_frame_interval_stats.last());
+            render_scale.push((double) engine.m_render_extent.width / (double) engine.m_window_extent.width);
+        }
+    }
+    resolution_changes = engine.m_dynamic_resolution.stats().m_changes - resolution_changes;
+    uint32_t frames_drawn = engine.m_frame_count - first_frame;
+
+    vkDeviceWaitIdle(engine.m_device);
+
+    RenderGraphStats aliasing_stats = check_transient_aliasing(engine);
+    bool aliasing_passed = aliasing_stats.m_transient_bytes < aliasing_stats.m_transient_unaliased_bytes;
+    if (!aliasing_passed) {
+        std::cerr << "Transient images that never live at the same time don't share memory: "
+                  << aliasing_stats.m_transient_bytes << " bytes for "
+                  << aliasing_stats.m_transient_unaliased_bytes << " declared" << std::endl;
+    }
+
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(engine.m_physical_device, &device_properties);
+
+    // Make sure the heap numbers are the ones of the last frame
+    engine.m_memory_budget.update(engine.m_frame_count);
+
+    std::ofstream out(output_path);
+    if (!out.is_open()) {
+        std::cerr << "Couldn't open " << output_path << " for writing" << std::endl;
+        engine.cleanup();
+        return 1;
+    }
+
+    JsonWriter json(out);
+    json.begin_object();
+    json.value("device", device_properties.deviceName);
+    json.value("headless", engine.m_headless);
+
+    json.begin_object("scene");
+    json.value("meshes", desc.m_mesh_count);
+    json.value("instances_per_mesh", desc.m_instances_per_mesh);
+    json.value("materials", desc.m_material_count);
+    json.value("objects", (uint64_t) engine.m_renderables.size());
+    json.value("vertices", scene.m_vertex_count);
+    json.value("seed", desc.m_seed);
+    json.value("sorted", desc.m_sorted);
+    json.value("instancing_threshold", engine.m_instancing_threshold);
+    json.value("state_variants", desc.m_state_variants);
+    json.value("depth_prepass", engine.m_enable_depth_prepass);
+    json.value("occlusion_culling", engine.m_enable_occlusion_culling);
+    json.value("lights", desc.m_light_count);
+    json.value("shadow_cascades", engine.m_shadows.cascade_count());
+    json.value("async_compute_supported", engine.m_async_compute_supported);
+    json.value("async_compute", engine.m_async_compute_supported && engine.m_enable_async_compute);
+    json.value("command_cache", engine.m_enable_command_cache);
+    json.value("particle_emitters", particle_emitters);
+    json.value("particle_capacity", engine.m_particles.capacity());
+    json.value("skinned_instances", desc.m_skinned_instances);
+    json.value("skinned_vertices", scene.m_skinned_vertex_count);
+    json.value("render_thread", render_thread);
+    json.value("sim_spike_ms", sim_spike_ms);
+    json.value("sim_spike_every", sim_spike_every);
+    json.value("width", engine.m_window_extent.width);
+    json.value("height", engine.m_window_extent.height);
+    json.end_object();
+
+    json.value("frames", frame_count);
+    json.value("warmup", warmup_count);
+    // Differs from frames with the render thread, which draws as fast as the swapchain lets it
+    json.value("frames_drawn", frames_drawn);
+    json.stats("cpu_ms", cpu_ms);
+    json.stats("gpu_ms", gpu_ms);
+    json.stats("wall_ms", wall_ms);
+    // The spikes show up here when the simulation and the drawing share a thread
+    json.stats("frame_interval_ms", frame_interval_ms);
+    json.value("gpu_timing_supported", engine.m_profiler.gpu_timing_supported());
+    // Light binning alone, the rest of the light cost is in the shading
+    auto light_clusters_stats = engine.m_profiler.m_scope_stats.find("gpu:light_clusters");
+    if (light_clusters_stats != engine.m_profiler.m_scope_stats.end()) {
+        json.stats("light_clusters_gpu_ms", light_clusters_stats->second);
+    }
+    // Only the cascades rendered again in a frame, the cached ones mostly aren't
+    auto shadow_stats = engine.m_profiler.m_scope_stats.find("gpu:shadow_cascades");
+    if (shadow_stats != engine.m_profiler.m_scope_stats.end()) {
+        json.stats("shadows_gpu_ms", shadow_stats->second);
+    }
+    // Emission, simulation, compaction and sort, then the blended draw
+    auto particle_simulate_stats = engine.m_profiler.m_scope_stats.find("gpu:particles_simulate");
+    if (particle_simulate_stats != engine.m_profiler.m_scope_stats.end()) {
+        json.stats("particles_simulate_gpu_ms", particle_simulate_stats->second);
+    }
+    auto particle_draw_stats = engine.m_profiler.m_scope_stats.find("gpu:particles");
+    if (particle_draw_stats != engine.m_profiler.m_scope_stats.end()) {
+        json.stats("particles_draw_gpu_ms", particle_draw_stats->second);
+    }
+    // One dispatch per instance, throughput over the average time of the pass
+    auto skinning_stats = engine.m_profiler.m_scope_stats.find("gpu:skinning");
+    if (skinning_stats != engine.m_profiler.m_scope_stats.end()) {
+        json.stats("skinning_gpu_ms", skinning_stats->second);
+        double skinning_ms = skinning_stats->second.avg();
+        json.value("skinned_vertices_per_ms",
+                   skinning_ms > 0.0 ? (double) engine.m_render_stats.m_skinned_vertices / skinning_ms : 0.0);
+    }
+    // Render scale over the measured frames and the changes between them, the last extent drawn
+    json.begin_object("dynamic_resolution");
+    json.value("enabled", resolution.m_enabled);
+    json.value("target_ms", (double) resolution.m_target_ms);
+    json.value("min_scale", (double) resolution.m_min_scale);
+    json.value("max_scale", (double) resolution.m_max_scale);
+    json.stats("scale", render_scale);
+    json.value("changes", resolution_changes);
+    json.value("render_width", engine.m_render_extent.width);
+    json.value("render_height", engine.m_render_extent.height);
+    auto upscale_stats = engine.m_profiler.m_scope_stats.find("gpu:upscale");
+    if (upscale_stats != engine.m_profiler.m_scope_stats.end()) {
+        json.stats("upscale_gpu_ms", upscale_stats->second);
+    }
+    json.end_object();
+
+    // Time each queue was busy, and how much of it overlapped. Without async compute everything
+    // is on graphics and nothing overlaps.
+    json.begin_object("queues");
+    json.stats("graphics_busy_ms", engine.m_profiler.m_gpu_queue_busy_stats[(uint32_t) GpuQueue::Graphics]);
+    json.stats("compute_busy_ms", engine.m_profiler.m_gpu_queue_busy_stats[(uint32_t) GpuQueue::Compute]);
+    json.stats("overlap_ms", engine.m_profiler.m_gpu_overlap_stats);
+    json.end_object();
+
+    // The scene is static, so the counters of the last frame are the same for every frame
+    json.begin_object("per_frame");
+    json.value("draw_calls", engine.m_render_stats.m_draw_calls);
+    json.value("pipeline_binds", engine.m_render_stats.m_pipeline_binds);
+    json.value("vertex_buffer_binds", engine.m_render_stats.m_vertex_buffer_binds);
+    json.value("triangles", engine.m_render_stats.m_triangles);
+    json.value("instanced_draws", engine.m_render_stats.m_instanced_draws);
+    json.value("instances", engine.m_render_stats.m_instances);
+    json.value("state_calls", engine.m_render_stats.m_state_calls);
+    json.value("state_calls_skipped", engine.m_render_stats.m_state_calls_skipped);
+    // Only counted with the GPU culling, every culled object is in exactly one of them
+    json.value("visible_objects", engine.m_render_stats.m_visible_objects);
+    json.value("frustum_culled", engine.m_render_stats.m_frustum_culled);
+    json.value("occlusion_culled", engine.m_render_stats.m_occlusion_culled);
+    // Summed over the clusters, grows with the light count and radius
+    json.value("light_indices", engine.m_render_stats.m_light_indices);
+    json.value("overflowed_light_clusters", engine.m_render_stats.m_overflowed_light_clusters);
+    // Cascades rendered and caster instances drawn into them, summed over the cascades
+    json.value("shadow_cascades", engine.m_render_stats.m_shadow_cascades);
+    json.value("shadow_casters", engine.m_render_stats.m_shadow_casters);
+    json.value("cpu_culled", engine.m_render_stats.m_cpu_culled);
+    // Counted by the GPU like the culling, alive after the simulation and spawned this frame
+    json.value("particles", engine.m_render_stats.m_particles);
+    json.value("particles_emitted", engine.m_render_stats.m_particles_emitted);
+    json.value("skinned_vertices", engine.m_render_stats.m_skinned_vertices);
+    json.end_object();
+
+    // Secondary command buffers of the last frame, the draws of the replayed ones aren't in
+    // per_frame since they weren't recorded
+    const CommandCacheStats &command_stats = engine.m_command_cache.stats();
+    json.begin_object("command_buffers");
+    json.value("replayed", command_stats.m_replayed);
+    json.value("recorded", command_stats.m_recorded);
+    json.value("transient", command_stats.m_transient);
+    auto record_stats = engine.m_profiler.m_scope_stats.find("record");
+    if (record_stats != engine.m_profiler.m_scope_stats.end()) {
+        json.stats("record_ms", record_stats->second);
+    }
+    json.end_object();
+
+    // The scene is static, it is built once and never refit
+    BvhStats bvh_stats = engine.m_scene_bvh.stats();
+    json.begin_object("scene_bvh");
+    json.value("nodes", bvh_stats.m_nodes);
+    json.value("depth", bvh_stats.m_depth);
+    json.value("build_ms", (double) bvh_stats.m_last_build_ms);
+    auto bvh_scope_stats = engine.m_profiler.m_scope_stats.find("scene_bvh");
+    if (bvh_scope_stats != engine.m_profiler.m_scope_stats.end()) {
+        // Bounds update, refit and camera frustum query of every frame
+        json.stats("update_and_cull_ms", bvh_scope_stats->second);
+    }
+    json.end_object();
+
+    // Pipelines needed with the render state baked in, against the ones built with it dynamic
+    PipelineVariantStats variants = engine.get_pipeline_variant_stats();
+    json.begin_object("pipelines");
+    json.value("materials", variants.m_materials);
+    json.value("baked", variants.m_baked_pipelines);
+    json.value("dynamic", variants.m_pipelines);
+    json.end_object();
+
+    // Passes and barriers of the last frame, compiles over the whole run (1 for a static scene)
+    const RenderGraphStats &graph_stats = engine.m_render_graph.stats();
+    json.begin_object("render_graph");
+    json.value("passes", graph_stats.m_passes);
+    json.value("culled_passes", graph_stats.m_culled_passes);
+    json.value("compute_passes", graph_stats.m_compute_passes);
+    json.value("submissions", graph_stats.m_submissions);
+    json.value("queue_transfers", graph_stats.m_queue_transfers);
+    json.value("barrier_batches", graph_stats.m_barrier_batches);
+    json.value("barriers", graph_stats.m_barriers);
+    json.value("compiles", graph_stats.m_compiles);
+    json.value("transient_bytes", graph_stats.m_transient_bytes);
+    json.value("transient_unaliased_bytes", graph_stats.m_transient_unaliased_bytes);
+    json.begin_object("aliasing_check");
+    json.value("transient_bytes", aliasing_stats.m_transient_bytes);
+    json.value("transient_unaliased_bytes", aliasing_stats.m_transient_unaliased_bytes);
+    json.value("passed", aliasing_passed);
+    json.end_object();
+    json.end_object();
+
+    json.begin_object("memory");
+    json.value("budget_extension", engine.m_memory_budget.is_budget_extension_enabled());
+    json.begin_array("heaps");
+    for (const HeapBudget &heap: engine.m_memory_budget.m_heaps) {
+        json.begin_object();
+        json.value("device_local", (heap.m_flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0);
+        json.value("usage_bytes", heap.m_usage);
+        json.value("budget_bytes", heap.m_budget);
+        json.value("block_bytes", heap.m_block_bytes);
+        json.value("allocation_bytes", heap.m_allocation_bytes);
+        json.end_object();
+    }
+    json.end_array();
+    json.begin_object("categories");
+    for (uint32_t c = 0; c < (uint32_t) MemoryCategory::Count; c++) {
+        json.value(memory_category_name((MemoryCategory) c),
+                   engine.m_memory_budget.get_category_bytes((MemoryCategory) c));
+    }
+    json.end_object();
+    json.end_object();
+
+    json.begin_object("geometry");
+    json.value("vertex_capacity", engine.m_geometry.vertex_allocator().capacity());
+    json.value("vertices_used", engine.m_geometry.vertex_allocator().used());
+    json.value("index_capacity", engine.m_geometry.index_allocator().capacity());
+    json.value("indices_used", engine.m_geometry.index_allocator().used());
+    json.value("vertex_fragmentation", (double) engine.m_geometry.vertex_allocator().fragmentation());
+    json.end_object();
+
+    // Layouts asked for by the pipelines against the ones actually created
+    json.begin_object("layouts");
+    json.value("set_layouts", engine.m_layout_cache.set_layout_count());
+    json.value("set_layout_requests", engine.m_layout_cache.set_layout_requests());
+    json.value("pipeline_layouts", engine.m_layout_cache.pipeline_layout_count());
+    json.value("pipeline_layout_requests", engine.m_layout_cache.pipeline_layout_requests());
+    json.end_object();
+    json.end_object();
+
+    std::cout << "vk_engine_bench: " << engine.m_renderables.size() << " objects, cpu avg " << cpu_ms.avg()
+              << " ms, gpu avg " << gpu_ms.avg() << " ms, results written to " << output_path << std::endl;
+
+    engine.cleanup();
+
+    return aliasing_passed ? 0 : 1;
+}
@@ -0,0 +1,44 @@
+// The vendored imgui snapshot is missing imgui_tables.cpp, which imgui.cpp still calls into for
+// its garbage collection, settings and metrics window. These stand-ins build it without tables
+// and without the legacy columns: BeginTable always returns false, like a table that's clipped
+// away, so nothing past it ever runs. Replace this file with the upstream imgui_tables.cpp of the
+// same version when updating imgui.
+
+#include "imgui.h"
+#include "imgui_internal.h"
+
+bool ImGui::BeginTable(const char *, int, ImGuiTableFlags, const ImVec2 &, float) {
+    return false;
+}
+
+void ImGui::EndTable() {
+    IM_ASSERT(0 && "Tables aren't built in, BeginTable always returns false");
+}
+
+void ImGui::TableSetupColumn(const char *, ImGuiTableColumnFlags, float, ImGuiID) {}
+void ImGui::TableHeadersRow() {}
+bool ImGui::TableNextColumn() { return false; }
+void ImGui::TableSetBgColor(ImGuiTableBgTarget, ImU32, int) {}
+void ImGui::TableEndRow(ImGuiTable *) {}
+void ImGui::TablePushBackgroundChannel() {}
+void ImGui::TablePopBackgroundChannel() {}
+
+// Nothing to compact or save, no table is ever created
+void ImGui::TableGcCompactTransientBuffers(ImGuiTable *) {}
+void ImGui::TableGcCompactTransientBuffers(ImGuiTableTempData *) {}
+void ImGui::TableGcCompactSettings() {}
+void ImGui::TableSettingsAddSettingsHandler() {}
+
+#ifndef IMGUI_DISABLE_DEBUG_TOOLS
+void ImGui::DebugNodeTable(ImGuiTable *) {}
+void ImGui::DebugNodeTableSettings(ImGuiTableSettings *) {}
+#endif
+
+// Legacy columns, only reached through ImGui::Columns which isn't built in either
+void ImGui::EndColumns() {}
+void ImGui::PushColumnsBackground() {}
+void ImGui::PopColumnsBackground() {}
+
+float ImGui::GetColumnOffsetFromNorm(const ImGuiOldColumns *columns, float offset_norm) {
+    return offset_norm * (columns->OffMaxX - columns->OffMinX);
+}
@@ -0,0 +1,147 @@
+#ifndef VK_ENGINE_CASCADEDSHADOWS_H
+#define VK_ENGINE_CASCADEDSHADOWS_H
+
+#include <LayoutCache.h>
+#include <MemoryBudget.h>
+#include <VulkanHelpers.h>
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+// Must match clustered_lit.frag
+constexpr uint32_t MAX_SHADOW_CASCADES = 4;
+constexpr VkFormat SHADOW_MAP_FORMAT = VK_FORMAT_D32_SFLOAT;
+
+struct DirectionalLight {
+    // Where the light goes, normalized by the shadows
+    glm::vec3 m_direction = {0.3f, -1.f, 0.2f};
+    glm::vec3 m_color = {1.f, 1.f, 1.f};
+    // 0 turns it off
+    float m_intensity = 0.f;
+};
+
+// Read at init, except m_enabled
+struct ShadowSettings {
+    bool m_enabled = false;
+    // 2 to MAX_SHADOW_CASCADES
+    uint32_t m_cascade_count = 3;
+    // Of every cascade, they share a depth array
+    uint32_t m_resolution = 2048;
+    // Shadows stop at this view distance
+    float m_max_distance = 100.f;
+    // Mix between logarithmic (1) and uniform (0) splits
+    float m_split_lambda = 0.75f;
+    // Cascades from this one on are cached, only rendered again when the light or the static
+    // casters change, or when the camera leaves the area they cover. The last one always is.
+    uint32_t m_first_cached_cascade = 2;
+    // Cached cascades cover this much more than their split, so the camera can move in them
+    float m_cached_padding = 1.5f;
+    // Casters this far behind a cascade (towards the light) still cast into it
+    float m_caster_distance = 100.f;
+};
+
+// std140 layout, set 2 binding 0 of clustered_lit.frag
+struct ShadowData {
+    glm::mat4 m_light_view_projection[MAX_SHADOW_CASCADES];
+    // View space distance where each cascade ends
+    glm::vec4 m_split_depths;
+    // xyz towards the light, w intensity
+    glm::vec4 m_light_direction;
+    // rgb color, w unused
+    glm::vec4 m_light_color;
+    // 0 without shadows, the light still shades
+    uint32_t m_cascade_count;
+    uint32_t m_padding[3];
+};
+
+// Shadows of the directional light in a depth array, one layer per cascade. Cascades are fit to
+// a bounding sphere of their slice of the view frustum and snapped to their texels, so they
+// don't shimmer when the camera moves or turns.
+//
+// The near cascades are rendered every frame. The far ones are cached: they cover more than
+// they need to, and are only rendered again when invalidate_static() is called, the light
+// turns, or the camera leaves them. Casters marked dynamic only go in the near ones.
+//
+// Shaders read it through set 2 (see set_layout), bind it with cmd_bind.
+class CascadedShadows {
+public:
+    void init(VkDevice device, VmaAllocator allocator, MemoryBudget *memory_budget, LayoutCache *layout_cache,
+              uint32_t frame_count, const ShadowSettings &settings);
+    void cleanup();
+
+    // Fragment stage set: ShadowData uniform and the cascades as a sampler2DArrayShadow
+    VkDescriptorSetLayout set_layout() const { return m_set_layout; }
+
+    // The static casters changed, the cached cascades are rendered again
+    void invalidate_static() { m_static_dirty = true; }
+
+    // Fits the cascades and decides which ones are rendered this frame. The frame slot must be
+    // done on the GPU.
+    void update(uint32_t frame, bool enabled, const DirectionalLight &light, const glm::mat4 &view, float fov_y,
+                float aspect, float z_near);
+
+    uint32_t cascade_count() const { return m_cascade_count; }
+    bool needs_render(uint32_t cascade) const { return m_cascades[cascade].m_needs_render; }
+    // Only the static casters go in the cached ones
+    bool is_cached(uint32_t cascade) const { return cascade >= m_first_cached_cascade; }
+    const glm::mat4 &view_projection(uint32_t cascade) const { return m_cascades[cascade].m_view_projection; }
+    // World space bounding sphere, center and radius
+    bool casts_into(uint32_t cascade, const glm::vec4 &sphere) const;
+
+    // Binds the depth view of a layer, clears it and sets the viewport and scissor
+    void cmd_begin_cascade(VkCommandBuffer cmd, uint32_t cascade) const;
+    void cmd_bind(VkCommandBuffer cmd, VkPipelineLayout layout, uint32_t frame) const;
+
+    VkImage image() const { return m_image.m_image; }
+    VkImageView view() const { return m_view; }
+    // Has been in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL since the last frame, call after
+    // declaring it to the frame
+    bool layout_initialized() const { return m_layout_initialized; }
+    void set_layout_initialized() { m_layout_initialized = true; }
+
+private:
+    struct Cascade {
+        glm::mat4 m_view_projection = glm::mat4(1.f);
+        // Light space square covered, center and half size
+        glm::vec2 m_center = {0.f, 0.f};
+        float m_radius = 0.f;
+        // Light space depth range, distances along the light
+        float m_near = 0.f;
+        float m_far = 0.f;
+        bool m_valid = false;
+        bool m_needs_render = false;
+    };
+
+    void fit_cascade(Cascade &cascade, const glm::vec3 &center, float radius) const;
+
+    VkDevice m_device = VK_NULL_HANDLE;
+    VmaAllocator m_allocator = VK_NULL_HANDLE;
+    MemoryBudget *m_memory_budget = nullptr;
+
+    uint32_t m_cascade_count = 0;
+    uint32_t m_first_cached_cascade = 0;
+    ShadowSettings m_settings;
+
+    AllocatedImage m_image = {};
+    VkImageView m_view = VK_NULL_HANDLE;
+    VkImageView m_layer_views[MAX_SHADOW_CASCADES] = {};
+    VkSampler m_sampler = VK_NULL_HANDLE;
+    bool m_layout_initialized = false;
+
+    VkDescriptorSetLayout m_set_layout = VK_NULL_HANDLE;
+    VkDescriptorPool m_descriptor_pool = VK_NULL_HANDLE;
+    std::vector<AllocatedBuffer> m_data_buffers;
+    std::vector<ShadowData *> m_mapped_data;
+    std::vector<VkDescriptorSet> m_descriptors;
+
+    glm::mat4 m_light_view = glm::mat4(1.f);
+    glm::vec3 m_light_direction = {0.f, 0.f, 0.f};
+    bool m_static_dirty = true;
+    Cascade m_cascades[MAX_SHADOW_CASCADES];
+};
+
+#endif //VK_ENGINE_CASCADEDSHADOWS_H
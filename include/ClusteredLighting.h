@@ -0,0 +1,128 @@
+#ifndef VK_ENGINE_CLUSTEREDLIGHTING_H
+#define VK_ENGINE_CLUSTEREDLIGHTING_H
+
+#include <LayoutCache.h>
+#include <MemoryBudget.h>
+#include <OcclusionCuller.h>
+#include <VulkanHelpers.h>
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+// Froxel grid, screen tiles times depth slices. Must match light_cluster.comp and clustered_lit.frag.
+constexpr uint32_t CLUSTER_TILES_X = 16;
+constexpr uint32_t CLUSTER_TILES_Y = 9;
+constexpr uint32_t CLUSTER_SLICES = 24;
+constexpr uint32_t CLUSTER_COUNT = CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES;
+// Lights past this are dropped from the cluster, counted in ClusterStats
+constexpr uint32_t MAX_LIGHTS_PER_CLUSTER = 128;
+// The light buffers start with room for this many, they grow when a frame needs more
+constexpr uint32_t INITIAL_LIGHT_CAPACITY = 64;
+
+// std430 layout (see light_cluster.comp)
+struct PointLight {
+    glm::vec3 m_position;
+    // Nothing is lit past it
+    float m_radius;
+    glm::vec3 m_color;
+    float m_intensity;
+};
+static_assert(sizeof(PointLight) == 32, "PointLight must match the std430 layout of the shaders");
+
+// Uniform shared by the binning and the shading, std140 layout
+struct ClusterData {
+    glm::mat4 m_view;
+    glm::mat4 m_inverse_projection;
+    glm::vec2 m_screen_size;
+    float m_z_near;
+    float m_z_far;
+    // slice = log(view depth) * m_slice_scale + m_slice_bias
+    float m_slice_scale;
+    float m_slice_bias;
+    uint32_t m_light_count;
+    uint32_t m_padding;
+};
+
+// Written by the GPU
+struct ClusterStats {
+    // Sum of the light list lengths
+    uint32_t m_light_indices = 0;
+    // Clusters that had more than MAX_LIGHTS_PER_CLUSTER lights
+    uint32_t m_overflowed_clusters = 0;
+};
+
+// Clustered forward lighting: a compute pass bins the lights into the froxels (view space tiles
+// times logarithmic depth slices) and writes a compact light index list per cluster. Fragment
+// shaders find their cluster and only go through its lights.
+//
+// Shaders read it through set 1 (see set_layout), bind it with cmd_bind.
+class ClusteredLighting {
+public:
+    // Takes ownership of the pipeline, the layouts come from layout_cache. With more than one
+    // queue family the buffers are shared by all of them, so binning can run on async compute.
+    void init(VkDevice device, VmaAllocator allocator, MemoryBudget *memory_budget, LayoutCache *layout_cache,
+              uint32_t frame_count, const ComputeProgram &cluster, const std::vector<uint32_t> &queue_families = {});
+    void cleanup();
+
+    // Hot reload, for a pipeline made from the same shader with the same layout. The old one is
+    // the caller's to destroy once the GPU is done with it.
+    void replace_pipeline(VkPipeline old_pipeline, VkPipeline new_pipeline);
+
+    // Fragment stage set: cluster data uniform, lights, clusters (offset and count into the
+    // indices) and light indices, bindings 0 to 3
+    VkDescriptorSetLayout set_layout() const { return m_set_layout; }
+
+    // The frame slot must be done on the GPU, its light buffer grows if needed
+    void update(uint32_t frame, const std::vector<PointLight> &lights, const glm::mat4 &view,
+                const glm::mat4 &projection, VkExtent2D extent, float z_near, float z_far);
+
+    // Bins the lights, the fragment shaders need a barrier after it
+    void cmd_build_clusters(VkCommandBuffer cmd, uint32_t frame);
+    void cmd_bind(VkCommandBuffer cmd, VkPipelineLayout layout, uint32_t frame) const;
+
+    // Of the last frame submitted in this slot, only valid once the GPU is done with it
+    ClusterStats read_stats(uint32_t frame) const;
+    // Bumped when update rewrites the descriptor sets, command buffers binding them are invalid
+    uint64_t descriptor_writes() const { return m_descriptor_writes; }
+
+private:
+    struct FrameResources {
+        AllocatedBuffer m_lights;
+        PointLight *m_mapped_lights = nullptr;
+        uint32_t m_light_capacity = 0;
+        AllocatedBuffer m_cluster_data;
+        ClusterData *m_mapped_cluster_data = nullptr;
+        AllocatedBuffer m_clusters;
+        AllocatedBuffer m_light_indices;
+        // ClusterStats, the first member is also the allocation counter of the light indices
+        AllocatedBuffer m_stats;
+        ClusterStats *m_mapped_stats = nullptr;
+
+        VkDescriptorSet m_cluster_descriptor = VK_NULL_HANDLE;
+        VkDescriptorSet m_shading_descriptor = VK_NULL_HANDLE;
+    };
+
+    AllocatedBuffer create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VmaMemoryUsage memory_usage,
+                                  MemoryCategory category, void **out_mapped);
+    void destroy_buffer(const AllocatedBuffer &buffer);
+    void create_light_buffer(FrameResources &frame, uint32_t capacity);
+    void write_descriptors(FrameResources &frame);
+
+    VkDevice m_device = VK_NULL_HANDLE;
+    VmaAllocator m_allocator = VK_NULL_HANDLE;
+    MemoryBudget *m_memory_budget = nullptr;
+    std::vector<uint32_t> m_queue_families;
+
+    ComputeProgram m_cluster;
+    VkDescriptorSetLayout m_set_layout = VK_NULL_HANDLE;
+    VkDescriptorPool m_descriptor_pool = VK_NULL_HANDLE;
+
+    std::vector<FrameResources> m_frames;
+    uint64_t m_descriptor_writes = 0;
+};
+
+#endif //VK_ENGINE_CLUSTEREDLIGHTING_H
@@ -0,0 +1,77 @@
+#ifndef VK_ENGINE_COMMANDCACHE_H
+#define VK_ENGINE_COMMANDCACHE_H
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+// Attachments of the dynamic rendering a secondary command buffer is executed in
+struct SecondaryRendering {
+    // VK_FORMAT_UNDEFINED without color attachment
+    VkFormat m_color_format = VK_FORMAT_UNDEFINED;
+    VkFormat m_depth_format = VK_FORMAT_UNDEFINED;
+};
+
+// Command buffers of the last frame recorded in begin_frame's slot
+struct CommandCacheStats {
+    // Executed as they were, recorded again because their key changed, and recorded every frame
+    uint32_t m_replayed = 0;
+    uint32_t m_recorded = 0;
+    uint32_t m_transient = 0;
+};
+
+// Secondary command buffers for the draws of a rendering pass. The cached ones are recorded once
+// and replayed as long as the key they were recorded with doesn't change, the transient ones are
+// recorded again every frame for what does. The primary has to begin the rendering with
+// VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT, and the secondaries don't inherit any
+// dynamic state, they set their own viewport.
+//
+// Everything is per frame slot, so a cached command buffer is only recorded again once the GPU is
+// done with the slot's previous frame, and never needs SIMULTANEOUS_USE.
+class CommandCache {
+public:
+    void init(VkDevice device, uint32_t queue_family, uint32_t frame_count);
+    void cleanup();
+
+    // The slot's previous frame is done, its transient command buffers can be recorded again
+    void begin_frame(uint32_t frame);
+    const CommandCacheStats &stats() const { return m_stats; }
+
+    // Command buffer cached under id in this frame slot. It's recorded again with record (begun
+    // and ended here) if it never was or if it was with another key.
+    VkCommandBuffer get(uint32_t frame, uint64_t id, uint64_t key, const SecondaryRendering &rendering,
+                        const std::function<void(VkCommandBuffer cmd)> &record);
+    // Recorded with record, only valid for this frame
+    VkCommandBuffer record_transient(uint32_t frame, const SecondaryRendering &rendering,
+                                     const std::function<void(VkCommandBuffer cmd)> &record);
+
+private:
+    struct CachedCommandBuffer {
+        VkCommandBuffer m_cmd = VK_NULL_HANDLE;
+        uint64_t m_key = 0;
+        bool m_recorded = false;
+    };
+
+    struct FrameCommands {
+        // Command buffers are reset one by one
+        VkCommandPool m_cached_pool = VK_NULL_HANDLE;
+        std::unordered_map<uint64_t, CachedCommandBuffer> m_cached;
+        // Reset all at once in begin_frame
+        VkCommandPool m_transient_pool = VK_NULL_HANDLE;
+        std::vector<VkCommandBuffer> m_transient;
+        uint32_t m_transient_used = 0;
+    };
+
+    VkCommandBuffer allocate(VkCommandPool pool);
+    void record_secondary(VkCommandBuffer cmd, VkCommandBufferUsageFlags flags, const SecondaryRendering &rendering,
+                          const std::function<void(VkCommandBuffer cmd)> &record);
+
+    VkDevice m_device = VK_NULL_HANDLE;
+    std::vector<FrameCommands> m_frames;
+    CommandCacheStats m_stats;
+};
+
+#endif //VK_ENGINE_COMMANDCACHE_H
@@ -5,6 +5,7 @@
 #ifndef VK_ENGINE_DELETIONQUEUE_H
 #define VK_ENGINE_DELETIONQUEUE_H
 
+#include <cstdint>
 #include <deque>
 #include <functional>
 
@@ -16,5 +17,19 @@ struct DeletionQueue {
     void flush();
 };
 
+// Deletors that run once a GPU timeline reaches their value, instead of at a frame boundary.
+// Values must be pushed in increasing order, which GpuTimeline::next_value() guarantees.
+struct TimelineDeletionQueue {
+    std::deque<std::pair<uint64_t, std::function<void()>>> deletors;
+
+    void push_function(uint64_t value, std::function<void()>&& function);
+
+    // Runs every deletor whose value has been reached
+    void collect(uint64_t completed_value);
+
+    // Runs everything, the GPU must be idle
+    void flush();
+};
+
 
 #endif //VK_ENGINE_DELETIONQUEUE_H
@@ -0,0 +1,108 @@
+#ifndef VK_ENGINE_DYNAMICRESOLUTION_H
+#define VK_ENGINE_DYNAMICRESOLUTION_H
+
+#include <LayoutCache.h>
+#include <MemoryBudget.h>
+#include <VulkanHelpers.h>
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+
+// The scale only changes the render extent once it moved by a step, and the extent stays a
+// multiple of this
+constexpr uint32_t RENDER_EXTENT_ALIGNMENT = 8;
+
+// m_min_scale and m_max_scale are read when the targets are created (init and swapchain
+// recreation), the rest every frame
+struct DynamicResolutionSettings {
+    bool m_enabled = false;
+    // Per axis, of the window extent. Above 1 renders more pixels than the window has.
+    float m_min_scale = 0.5f;
+    float m_max_scale = 1.f;
+    // GPU frame time the controller steers towards
+    float m_target_ms = 16.f;
+    // Of the upscale, 0 is a plain bilinear blit
+    float m_sharpness = 0.5f;
+};
+
+// Last update, for the overlays and the benchmark
+struct DynamicResolutionStats {
+    float m_scale = 1.f;
+    VkExtent2D m_render_extent = {0, 0};
+    // Smoothed GPU frame time the last decision was made on
+    float m_gpu_ms = 0.f;
+    // Render extent changes since init
+    uint32_t m_changes = 0;
+};
+
+// Renders the scene in a sub-rectangle of a color target allocated at the largest scale, so
+// changing the resolution never reallocates. The scale follows the GPU frame time: it drops as
+// soon as a frame is over budget and climbs back slowly, since the cost grows with the pixel
+// count. The engine then upscales the rendered part to the swapchain with a sharpening pass.
+//
+// Shaders read the target through set 1 (see set_layout), cmd_upscale binds it.
+class DynamicResolution {
+public:
+    void init(VkDevice device, VmaAllocator allocator, MemoryBudget *memory_budget, LayoutCache *layout_cache);
+    void cleanup();
+
+    // Largest extent rendered for this window, what the color and depth targets are allocated at
+    static VkExtent2D max_extent(VkExtent2D window_extent, const DynamicResolutionSettings &settings);
+
+    // Sized after the window and recreated with it, the GPU must be done with the old one. The
+    // render extent starts at the largest scale.
+    void create_target(VkExtent2D window_extent, VkFormat format, const DynamicResolutionSettings &settings);
+    void destroy_target();
+    VkImage image() const { return m_image.m_image; }
+    VkImageView view() const { return m_view; }
+
+    // With the GPU time of the last frame resolved, 0 if there is none. Returns true when the
+    // render extent changed.
+    bool update(float gpu_ms, const DynamicResolutionSettings &settings);
+    VkExtent2D render_extent() const { return m_stats.m_render_extent; }
+    const DynamicResolutionStats &stats() const { return m_stats; }
+
+    // Fragment stage set: the target as a sampler2D, bilinear and clamped
+    VkDescriptorSetLayout set_layout() const { return m_set_layout; }
+    // Binds the target at set 1 and draws a fullscreen triangle reading the rendered part. The
+    // pipeline's fragment stage takes UpscaleConstants as push constants.
+    void cmd_upscale(VkCommandBuffer cmd, VkPipelineLayout layout, float sharpness) const;
+
+    // Push constants of upscale.frag
+    struct UpscaleConstants {
+        // Rendered part of the target, in its uv
+        glm::vec2 m_uv_scale;
+        // Of one texel of the target
+        glm::vec2 m_texel_size;
+        float m_sharpness;
+    };
+
+private:
+    void apply_scale(float scale);
+
+    VkDevice m_device = VK_NULL_HANDLE;
+    VmaAllocator m_allocator = VK_NULL_HANDLE;
+    MemoryBudget *m_memory_budget = nullptr;
+
+    AllocatedImage m_image = {};
+    VkImageView m_view = VK_NULL_HANDLE;
+    VkSampler m_sampler = VK_NULL_HANDLE;
+    VkDescriptorSetLayout m_set_layout = VK_NULL_HANDLE;
+    VkDescriptorPool m_descriptor_pool = VK_NULL_HANDLE;
+    VkDescriptorSet m_descriptor = VK_NULL_HANDLE;
+
+    VkExtent2D m_window_extent = {0, 0};
+    VkExtent2D m_target_extent = {0, 0};
+    float m_min_scale = 1.f;
+    float m_max_scale = 1.f;
+    float m_scale = 1.f;
+    float m_smoothed_ms = 0.f;
+    // Measurements taken before a change don't say anything about the new extent
+    uint32_t m_settle_frames = 0;
+    DynamicResolutionStats m_stats;
+};
+
+#endif //VK_ENGINE_DYNAMICRESOLUTION_H
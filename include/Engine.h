@@ -5,18 +5,115 @@
 #ifndef VK_ENGINE_ENGINE_H
 #define VK_ENGINE_ENGINE_H
 
+#include <CascadedShadows.h>
+#include <ClusteredLighting.h>
+#include <CommandCache.h>
 #include <DeletionQueue.h>
+#include <DynamicResolution.h>
+#include <FrameCapture.h>
+#include <GeometryBuffer.h>
+#include <GpuTimeline.h>
+#include <LayoutCache.h>
 #include <Mesh.h>
 #include <Material.h>
+#include <MemoryBudget.h>
+#include <OcclusionCuller.h>
+#include <ParticleSystem.h>
+#include <PipelineBuilder.h>
+#include <PresentLatency.h>
+#include <Profiler.h>
+#include <RenderGraph.h>
 #include <RenderObject.h>
+#include <SceneBvh.h>
+#include <SceneFile.h>
+#include <SceneSnapshot.h>
+#include <SkinningSystem.h>
+#include <ShaderReflection.h>
+#include <ShaderHotReload.h>
 #include <VulkanHelpers.h>
 
 #include <GLFW/glfw3.h>
 #include <VkBootstrap.h>
 #include <vk_mem_alloc.h>
 
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+
+// Number of frames the CPU can record ahead of the GPU.
+constexpr uint32_t FRAMES_IN_FLIGHT = 1;
+// Uploads in flight at once before submit_upload has to wait for the oldest one
+constexpr uint32_t UPLOAD_RING_SIZE = 4;
+// Instances the per-frame instance buffers start with, they grow when a frame needs more
+constexpr uint32_t INITIAL_INSTANCE_CAPACITY = 1024;
+
+// Counters reset at the start of every frame
+struct RenderStats {
+    uint32_t m_draw_calls = 0;
+    uint32_t m_pipeline_binds = 0;
+    uint32_t m_vertex_buffer_binds = 0;
+    uint64_t m_triangles = 0;
+    // Draws going through the instance buffer, and the objects they cover
+    uint32_t m_instanced_draws = 0;
+    uint32_t m_instances = 0;
+    // vkCmdSet* calls recorded, and the redundant ones skipped
+    uint32_t m_state_calls = 0;
+    uint32_t m_state_calls_skipped = 0;
+    // Objects going through the GPU culling. Counted by the GPU, so they are the ones of the last
+    // frame submitted in this frame slot.
+    uint32_t m_visible_objects = 0;
+    uint32_t m_frustum_culled = 0;
+    uint32_t m_occlusion_culled = 0;
+    // Light list entries over all clusters, and the clusters that had to drop lights. Same delay
+    // as the culling counters.
+    uint32_t m_light_indices = 0;
+    uint32_t m_overflowed_light_clusters = 0;
+    // Particles alive after the simulation and spawned by it, same delay
+    uint32_t m_particles = 0;
+    uint32_t m_particles_emitted = 0;
+    // Vertices written by the skinning this frame
+    uint32_t m_skinned_vertices = 0;
+    // Shadow cascades rendered this frame, and the casters drawn into them
+    uint32_t m_shadow_cascades = 0;
+    uint32_t m_shadow_casters = 0;
+    // Renderables outside the view frustum according to the CPU culling. The ones going through
+    // the GPU culling are tested again there.
+    uint32_t m_cpu_culled = 0;
+};
+
+// Pipelines the materials would need if their render state was baked, against the ones they use
+struct PipelineVariantStats {
+    uint32_t m_materials = 0;
+    uint32_t m_baked_pipelines = 0;
+    uint32_t m_pipelines = 0;
+};
+
+// Set 0 binding 0 of the mesh pipelines, written once per frame
+struct CameraData {
+    glm::mat4 m_view;
+    glm::mat4 m_projection;
+    glm::mat4 m_view_projection;
+};
+
+// Per frame in flight resources, only touched once the frame's timeline value was reached
+struct FrameData {
+    AllocatedBuffer m_camera_buffer;
+    CameraData *m_camera = nullptr;
+
+    // Set 0 binding 1, persistently mapped
+    AllocatedBuffer m_instance_buffer;
+    InstanceData *m_instances = nullptr;
+    uint32_t m_instance_capacity = 0;
+    // Written so far this frame, draw_objects appends after it
+    uint32_t m_instance_count = 0;
+
+    VkDescriptorSet m_global_descriptor;
+};
 
 class Engine {
 public:
@@ -26,24 +123,74 @@ public:
 
     VkExtent2D m_window_extent = { 1280, 720 };
 
+    // Set before init to render into an offscreen image without window or swapchain.
+    // run() isn't usable in this mode, frames are driven by calling draw().
+    bool m_headless = false;
+
     // Window
-    GLFWwindow* m_window;
+    GLFWwindow* m_window = nullptr;
+
+    // Falls back to FIFO, which is always supported. Can be set before init, or at runtime with
+    // set_present_mode (F4 cycles through the supported ones).
+    VkPresentModeKHR m_present_mode = VK_PRESENT_MODE_FIFO_KHR;
+    void set_present_mode(VkPresentModeKHR present_mode);
+    void cycle_present_mode();
+
+    // Set before init to draw on a thread of its own. run() then keeps the window, the input and
+    // the simulation on the calling thread: m_simulate is stepped every m_simulation_step
+    // seconds on a SceneState that starts as a copy of the scene, and every step publishes it
+    // with the one before (see SceneSnapshot). The render thread draws the latest snapshot,
+    // interpolated to the time of the frame, so a slow step doesn't hold a frame back. While
+    // run() goes the scene members below belong to the render thread, and ImGui isn't used,
+    // its GLFW backend only works on the main thread.
+    bool m_enable_render_thread = false;
+    float m_simulation_step = 1.f / 60.f;
+    std::function<void(SceneState& state, float step)> m_simulate;
 
     void init();
     void run();
     void draw();
-    void cmd_render_commands();
+    void cmd_render_commands(VkCommandBuffer cmd);
     void cleanup();
 
     bool load_shader_module(const char* file_path, VkShaderModule* out_shader_module) const;
+    // Loads the shaders and builds the pipeline, returns VK_NULL_HANDLE on failure. The engine owns the
+    // pipeline, and keeps the builder so it can rebuild it when one of the shaders is hot reloaded.
+    // The shaders are reflected: without a layout in the builder one is derived from them through
+    // m_layout_cache (written to out_layout), otherwise they are checked against it. The vertex
+    // input is trimmed to the locations the vertex shader reads.
+    VkPipeline build_pipeline(const PipelineBuilder& builder, const std::vector<ShaderFile>& shaders,
+                              VkPipelineLayout* out_layout = nullptr);
+
+    // Recompiles the GLSL sources when they change and swaps the pipelines using them at the next
+    // frame. Set before init, ignored when headless.
+    bool m_enable_shader_hot_reload = true;
+    ShaderHotReload m_shader_hot_reload;
+    // Copies the mesh into the shared geometry buffer, repacking or growing it if needed
     void upload_mesh(Mesh& mesh);
+    // Releases the mesh range once the frames in flight are done with it
+    void free_mesh(Mesh& mesh);
+    // Repacks the geometry buffer to remove the holes left by freed meshes
+    void compact_geometry();
+
+    // Records and submits commands on the next upload command buffer of the ring, without waiting.
+    // Returns the graphics timeline value reached once they completed.
+    uint64_t submit_upload(std::function<void(VkCommandBuffer cmd)>&& function);
+    // Same as submit_upload, but waits for the commands to complete.
+    void immediate_submit(std::function<void(VkCommandBuffer cmd)>&& function);
 
     // Resource management
     DeletionQueue m_main_deletion_queue;
-    DeletionQueue m_per_frame_deletion_queue;
+    // Collected every frame, push with m_graphics_timeline.next_value() for resources the
+    // GPU may still use
+    TimelineDeletionQueue m_timeline_deletion_queue;
 
     // Memory
     VmaAllocator m_allocator;
+    MemoryBudget m_memory_budget;
+
+    // Every mesh lives in there, so drawing only needs one vertex/index buffer bind
+    GeometryBuffer m_geometry;
 
     // Global Vulkan object
     VkInstance m_instance;
@@ -55,14 +202,36 @@ public:
     // We need it for swapchain creation
     vkb::Device m_vkb_device;
 
-    VkSwapchainKHR m_swapchain;
+    VkSwapchainKHR m_swapchain = VK_NULL_HANDLE;
     VkFormat m_swapchain_image_format;
-    VkSurfaceKHR m_surface;
+    VkSurfaceKHR m_surface = VK_NULL_HANDLE;
+    // Stands in for the swapchain image in headless mode
+    AllocatedImage m_offscreen_image;
     std::vector<VkImage> m_swapchain_images;
     std::vector<VkImageView> m_swapchain_images_view;
+    std::vector<VkPresentModeKHR> m_supported_present_modes;
+    // Set on resize, out of date/suboptimal presents and present mode changes. The swapchain is
+    // recreated at the start of the next frame.
+    std::atomic<bool> m_swapchain_dirty = false;
+    // Everything sized after the swapchain, flushed when it is recreated
+    DeletionQueue m_swapchain_deletion_queue;
+    PresentLatencyTracker m_present_latency;
+    // VK_KHR_present_id and VK_KHR_present_wait are both enabled
+    bool m_present_wait_supported = false;
 
     VkQueue m_graphics_queue;
     uint32_t m_graphics_queue_family;
+    // Every graphics submission signals it, replaces the render and upload fences
+    GpuTimeline m_graphics_timeline;
+    // A queue family with compute and without graphics, when the device has one. Light binning
+    // and the early culling run there next to the shadows and the prepass, F9 toggles it.
+    VkQueue m_compute_queue = VK_NULL_HANDLE;
+    uint32_t m_compute_queue_family = UINT32_MAX;
+    GpuTimeline m_compute_timeline;
+    bool m_async_compute_supported = false;
+    bool m_enable_async_compute = true;
+    // What buffers used by async compute passes are shared by, empty without it
+    std::vector<uint32_t> async_compute_queue_families() const;
 
     VkCommandPool m_main_command_pool;
     VkCommandBuffer m_main_command_buffer;
@@ -70,25 +239,171 @@ public:
     VkRenderingInfo m_render_info;
     VkSemaphore m_present_semaphore;
     VkSemaphore m_render_semaphore;
-    VkFence m_render_fence;
-
-    VkImageView m_depth_image_view;
-    AllocatedImage m_depth_image;
+    // Timeline value signaled by the last submission of each frame slot
+    uint64_t m_frame_timeline_values[FRAMES_IN_FLIGHT] = {};
+
+    struct UploadSlot {
+        VkCommandPool m_command_pool;
+        VkCommandBuffer m_command_buffer;
+        uint64_t m_timeline_value = 0;
+    };
+    UploadSlot m_upload_ring[UPLOAD_RING_SIZE];
+    uint32_t m_upload_ring_index = 0;
+
+    // The render graph's depth of this frame, set once the graph is prepared
+    VkImageView m_depth_image_view = VK_NULL_HANDLE;
     VkFormat m_depth_format;
+    // What the depth image and the scene color are allocated at, the window or larger when
+    // supersampling
+    VkExtent2D m_render_target_extent = {0, 0};
+    // Drawn this frame, the top left part of the depth (and the scene color with dynamic
+    // resolution). The window extent otherwise.
+    VkExtent2D m_render_extent = {0, 0};
+
+    // Profiling, F1 toggles the overlays, F2 exports a chrome trace and F3 dumps the VMA stats
+    Profiler m_profiler;
+    bool m_show_profiler_overlay = false;
+    // Between the starts of consecutive frames, the frame pacing as the CPU sees it
+    RollingStats m_frame_interval_stats = RollingStats(1024);
+
+    // ImGui, the vendored backend needs a render pass so it gets its own
+    VkDescriptorPool m_imgui_pool;
+    VkRenderPass m_imgui_render_pass = VK_NULL_HANDLE;
+    std::vector<VkFramebuffer> m_imgui_framebuffers;
 
     // Rendering data
     std::vector<RenderObject> m_renderables;
+    RenderStats m_render_stats;
+    // Dynamic state of the pass being recorded, reset by cmd_begin_rendering
+    RenderStateTracker m_state_tracker;
+
+    // Bounds of m_renderables, kept up to date by draw: refit when objects move, rebuilt on a
+    // worker thread once the refits made it too slow, and right away when objects are added or
+    // removed. Frustum culls the objects going through draw_objects (F8 toggles it), gathers the
+    // shadow casters and answers pick.
+    SceneBvh m_scene_bvh;
+    bool m_enable_cpu_culling = true;
+    // Renderable whose bounds are under the cursor, in window pixels. UINT32_MAX if none.
+    uint32_t pick(double cursor_x, double cursor_y) const;
+
+    // Objects sharing a mesh and material are drawn with one instanced draw once there are at
+    // least this many of them (and the material has an instanced pipeline). 0 disables instancing,
+    // objects are then drawn in the order of m_renderables.
+    uint32_t m_instancing_threshold = 8;
+
+    // When either is enabled, objects whose material has an instanced pipeline and whose mesh is
+    // indexed are frustum culled on the GPU and drawn with indirect draws, the others go through
+    // draw_objects as usual. The prepass fills the depth buffer before shading, and occlusion
+    // culling tests the objects against the depth of the previous ones (see OcclusionCuller).
+    // F5 toggles the depth prepass, F6 the occlusion culling.
+    bool m_enable_depth_prepass = false;
+    bool m_enable_occlusion_culling = false;
+    OcclusionCuller m_occlusion_culler;
+    // The culled draws only change with the scene, so they are recorded once into secondary
+    // command buffers of m_command_cache and replayed every frame, the other draws of the passes
+    // are recorded again in transient ones. Changes to m_renderables are picked up, call
+    // invalidate_command_cache after changing a material in place. F10 toggles it.
+    bool m_enable_command_cache = true;
+    CommandCache m_command_cache;
+    void invalidate_command_cache() { m_command_cache_version++; }
+    // Instanced vertex shader only, with the mesh layout
+    VkPipeline m_depth_prepass_pipeline;
+
+    // Point lights of the scene, binned into clusters every frame. Materials whose pipeline layout
+    // has ClusteredLighting::set_layout as set 1 get the cluster lists bound there.
+    std::vector<PointLight> m_lights;
+    ClusteredLighting m_lighting;
+
+    // Simulated, sorted and drawn on the GPU, the CPU only writes the emitters. The buffers hold
+    // m_particle_capacity particles, they are allocated the first frame with an emitter and again
+    // (after waiting for the GPU) when it changes.
+    std::vector<ParticleEmitter> m_particle_emitters;
+    uint32_t m_particle_capacity = 1u << 20;
+    ParticleSystem m_particles;
+    // Particles advance by this instead of the time since the last frame when above 0, set by
+    // replay_frame so replays simulate the same thing whatever their frame rate
+    float m_fixed_delta_time = 0.f;
+
+    // Animated meshes, skinned on the GPU once per frame before any pass draws them (see
+    // SkinningSystem). The application writes the joints of m_skinned_instances, the instances
+    // are drawn through regular renderables using their mesh. The culling uses the bounds of the
+    // bind pose, and the objects should be marked dynamic so the shadows don't cache them.
+    std::vector<SkinnedInstance> m_skinned_instances;
+    SkinningSystem m_skinning;
+    // Copies the bind pose to a buffer of its own, false if the mesh is invalid or MAX_SKINS is
+    // reached. The mesh can be dropped afterwards.
+    bool upload_skinned_mesh(SkinnedMesh& mesh);
+    // Creates m_meshes[mesh_name] from the bind pose and an instance skinning it, with its joints
+    // in the bind pose. Returns its index in m_skinned_instances, UINT32_MAX if the name is taken.
+    uint32_t create_skinned_instance(const SkinnedMesh& mesh, const std::string& mesh_name);
+
+    // Lights the lit materials, shadowed by cascaded shadow maps when enabled. The settings are
+    // read at init except m_enabled (F7). Call m_shadows.invalidate_static() when objects that
+    // aren't marked dynamic are added, removed or moved.
+    DirectionalLight m_sun;
+    ShadowSettings m_shadow_settings;
+    CascadedShadows m_shadows;
+
+    // The scene is drawn into an offscreen target at a scale of the window that follows the GPU
+    // frame time towards m_target_ms, then upscaled and sharpened into the swapchain (imgui stays
+    // at full resolution). The targets are allocated at the largest scale and the scene drawn to
+    // a part of them, so changing the resolution doesn't reallocate anything. The scale bounds
+    // are read at init and on swapchain recreation, F11 toggles it.
+    DynamicResolutionSettings m_resolution_settings;
+    DynamicResolution m_dynamic_resolution;
+
+    // Declared again every frame by draw, see declare_frame_graph
+    RenderGraph m_render_graph;
+
+    // Every descriptor set and pipeline layout, identical ones are shared
+    LayoutCache m_layout_cache;
+    // Layout of set 0 for the mesh pipelines: camera uniform and instance buffer. Reflected
+    // pipelines using set 0 always get this one.
+    VkDescriptorSetLayout m_global_set_layout;
+    VkDescriptorPool m_descriptor_pool;
+    FrameData m_frames[FRAMES_IN_FLIGHT];
+
+    glm::vec3 m_camera_position = {0.f, 0.f, -2.f};
+    glm::mat4 get_projection() const;
+    glm::mat4 get_view_projection() const;
 
     std::unordered_map<std::string, Material> m_materials;
     std::unordered_map<std::string, Mesh> m_meshes;
 
-    Material* create_material(VkPipeline pipeline, VkPipelineLayout layout,const std::string& name);
+    // state is used if the pipelines were built with dynamic render state
+    Material* create_material(VkPipeline pipeline, VkPipelineLayout layout,const std::string& name,
+                              VkPipeline instanced_pipeline = VK_NULL_HANDLE, const RenderState& state = {});
+    PipelineVariantStats get_pipeline_variant_stats() const;
 
     Material* get_material(const std::string& name);
 
     Mesh* get_mesh(const std::string& name);
 
+    // Binary scenes, see SceneFile. The objects are appended to m_renderables with their meshes
+    // and materials looked up by name, so those must exist already. out_parents gets the parent
+    // of every loaded object as an index into m_renderables, UINT32_MAX for the roots.
+    bool load_scene(const char* file_path, std::vector<uint32_t>* out_parents = nullptr);
+    // Writes m_renderables, parents are indices into it (empty without hierarchy). Their meshes
+    // and materials must be in m_meshes and m_materials.
+    bool save_scene(const char* file_path, const std::vector<uint32_t>& parents = {}) const;
+    SceneLoadStats m_scene_load_stats;
+
+    // Frame captures, see FrameCapture. While capturing every frame writes what draw reads (camera,
+    // toggles, lights, emitters and the renderables that changed) along with the meshes, materials
+    // and pipelines the first time they are used. F12 starts and stops a capture to
+    // vk_engine_capture.vkfc. Only pipelines built with build_pipeline can be captured.
+    bool begin_capture(const char* file_path);
+    void end_capture();
+    bool is_capturing() const { return m_capture.is_open(); }
+    // Applies the next captured frame, creating what it uses first, then draw renders it. Meshes
+    // and materials that exist under the same name are used as they are. Returns false at the end
+    // of the capture or on an invalid one.
+    bool replay_frame(FrameReplay& replay);
+
     void draw_objects(VkCommandBuffer cmd,RenderObject* first, int count);
+    // Draws a mesh uploaded with upload_mesh, the geometry buffer must be bound
+    void cmd_draw_mesh(VkCommandBuffer cmd, const Mesh& mesh, uint32_t instance_count = 1,
+                       uint32_t first_instance = 0);
 
     // Debug and tests pipeline, meshes, etc
     VkPipelineLayout m_triangle_pipeline_layout;
@@ -96,6 +411,9 @@ public:
 
     VkPipelineLayout m_debug_mesh_pipeline_layout;
     VkPipeline m_debug_mesh_pipeline;
+    VkPipeline m_debug_mesh_instanced_pipeline;
+    // Mesh pipelines shaded with m_lights, used by the "lit_mesh" material
+    VkPipelineLayout m_lit_mesh_pipeline_layout;
     Mesh m_debug_triangle_mesh;
     Mesh m_debug_monkey_mesh;
 
@@ -104,10 +422,213 @@ private:
     void init_glfw();
     void init_vulkan();
     void init_swapchain();
+    void init_surface_swapchain();
+    void recreate_swapchain();
+    void init_offscreen_target();
+    void init_render_target_extent();
     void init_commands();
+    void init_geometry();
+    void init_descriptors();
+    void create_instance_buffer(FrameData& frame, uint32_t capacity);
+    void destroy_instance_buffer(FrameData& frame);
+    void rebuild_geometry(uint32_t vertex_capacity, uint32_t index_capacity);
     void init_sync_structures();
     void init_base_pipelines();
+    void init_profiler();
+    void init_imgui();
+    void init_imgui_framebuffers();
     void init_debug_meshes();
+    void init_shader_hot_reload();
+    void init_occlusion_culling();
+    void init_depth_pyramid();
+    void init_lighting();
+    void init_shadows();
+    void init_particles();
+    void init_skinning();
+    void init_dynamic_resolution();
+    void init_scene_color();
+    void init_render_graph();
+
+    struct ReloadablePipeline {
+        PipelineBuilder m_builder;
+        std::vector<ShaderFile> m_shaders;
+        VkPipeline m_pipeline;
+    };
+    std::vector<ReloadablePipeline> m_pipelines;
+    // Every compute program, owned by the subsystem it was made for
+    struct ReloadableComputeProgram {
+        std::string m_path;
+        ComputeProgram m_program;
+    };
+    std::vector<ReloadableComputeProgram> m_compute_programs;
+    // Built with PipelineBuilder::enable_dynamic_render_state
+    std::unordered_set<VkPipeline> m_dynamic_state_pipelines;
+
+    FrameCaptureWriter m_capture;
+    // Materials skipped because a pipeline wasn't built with build_pipeline, warned about once
+    std::unordered_set<const Material*> m_uncapturable_materials;
+    void capture_frame(float delta_time);
+    // Writes the material and its pipelines if they weren't already, UINT32_MAX if they can't be
+    uint32_t capture_material(const Material* material, const std::unordered_map<const Material*, std::string>& names);
+    uint32_t capture_pipeline(VkPipeline pipeline);
+    VkPipeline replay_pipeline(FrameReplay& replay, uint32_t id, VkPipelineLayout* out_layout);
+
+    bool load_spirv(const char* file_path, std::vector<uint32_t>* out_code) const;
+    bool create_shader_module(const std::vector<uint32_t>& code, VkShaderModule* out_shader_module) const;
+    // Sets builder.m_pipeline_layout to the derived layout when it had none
+    VkPipeline create_pipeline(PipelineBuilder& builder, const std::vector<ShaderFile>& shaders);
+    // Graphics pipelines using set 0 get m_global_set_layout, compute ones their own
+    VkPipelineLayout derive_pipeline_layout(const PipelineReflection& reflection, bool global_set = true);
+    // The caller owns the pipeline. Hot reloaded through replace_compute_pipeline, so it must go
+    // to one of the subsystems that forwards to.
+    bool create_compute_program(const char* file_path, ComputeProgram* out_program);
+    bool build_compute_program(const char* file_path, ComputeProgram* out_program);
+    bool check_pipeline_layout(VkPipelineLayout layout, const PipelineReflection& reflection) const;
+    bool select_vertex_input(PipelineBuilder& builder, const PipelineReflection& reflection) const;
+    void apply_shader_reloads();
+    // Points everything that used old_pipeline (materials, debug pipelines) to new_pipeline
+    void replace_pipeline(VkPipeline old_pipeline, VkPipeline new_pipeline);
+    void replace_compute_pipeline(VkPipeline old_pipeline, VkPipeline new_pipeline);
+
+    // Dynamic rendering into the swapchain image and the depth buffer, or only the depth buffer
+    // when color_view is VK_NULL_HANDLE. Sets the viewport and scissor, unless the draws are in
+    // secondary command buffers (VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT).
+    void cmd_begin_rendering(VkCommandBuffer cmd, VkImageView color_view, VkAttachmentLoadOp color_load_op,
+                             VkAttachmentLoadOp depth_load_op, VkRenderingFlags flags = 0);
+    // Resets m_state_tracker, every command buffer drawing in a pass needs it
+    void cmd_set_viewport(VkCommandBuffer cmd);
+    void cmd_draw_debug_meshes(VkCommandBuffer cmd);
+
+    // What was last bound in a command buffer, so draws only rebind what changed
+    struct BoundPipeline {
+        VkPipeline m_pipeline = VK_NULL_HANDLE;
+        VkPipelineLayout m_layout = VK_NULL_HANDLE;
+    };
+    void cmd_bind_material(VkCommandBuffer cmd, BoundPipeline& bound, VkPipeline pipeline, const Material& material);
+    // Sorts m_draw_order so objects sharing a material and mesh are next to each other
+    void sort_draw_order(const RenderObject* first, int count);
+
+    // Consecutive culled objects sharing a material, drawn with one vkCmdDrawIndexedIndirect
+    struct CulledBatch {
+        Material* m_material;
+        uint32_t m_first;
+        uint32_t m_count;
+
+        bool operator==(const CulledBatch& other) const = default;
+    };
+    // Writes the instances and cull objects of this frame, fills m_culled_batches and m_unculled_objects
+    void prepare_culling(FrameData& frame, uint32_t frame_index);
+
+    // What the passes of a frame share
+    struct FrameGraphResources {
+        // What the scene is drawn to, the swapchain image unless dynamic resolution is enabled
+        RenderGraph::Resource m_color;
+        RenderGraph::Resource m_swapchain;
+        RenderGraph::Resource m_depth;
+        // Only declared with GPU culling
+        RenderGraph::Resource m_depth_pyramid;
+        RenderGraph::Resource m_light_clusters;
+        RenderGraph::Resource m_shadow_map;
+        // The geometry vertex buffer once skinned, when there are skinned instances
+        RenderGraph::Resource m_skinned_vertices;
+        bool m_skinned = false;
+        // A lit material is drawn, the shading passes read the light clusters and the shadows
+        bool m_lit = false;
+    };
+    // Every pass of the frame, from the light binning to imgui
+    void declare_frame_graph(uint32_t swapchain_image_index, bool gpu_culling, bool lit);
+    // Early and late phases, with the depth prepass if enabled
+    void declare_culled_passes(const FrameGraphResources &resources);
+    void use_shading_resources(RenderGraph::Pass pass, const FrameGraphResources &resources);
+    // The passes drawing meshes, they read what the skinning wrote
+    void use_skinned_vertices(RenderGraph::Pass pass, const FrameGraphResources &resources);
+    void cmd_draw_culled(VkCommandBuffer cmd, bool late, bool depth_only);
+    // The debug meshes and the objects drawn without GPU culling
+    void cmd_draw_unculled(VkCommandBuffer cmd);
+    // A depth (color_view is VK_NULL_HANDLE) or shading pass: the culled draws of the early and
+    // late phases, then the unculled ones. Through m_command_cache when it's enabled.
+    void cmd_render_culled(VkCommandBuffer cmd, VkImageView color_view, VkAttachmentLoadOp color_load_op,
+                           VkAttachmentLoadOp depth_load_op, bool early, bool late, bool unculled);
+    std::vector<CulledBatch> m_culled_batches;
+    std::vector<RenderObject> m_unculled_objects;
+    // The cached command buffers are recorded again when it changes: the culled batches, the
+    // pipelines, or the buffers and descriptors the draws use did
+    uint64_t m_command_cache_version = 0;
+    std::vector<CulledBatch> m_last_culled_batches;
+
+    // Objects sharing a mesh in a cascade, drawn with one instanced draw
+    struct ShadowBatch {
+        Mesh* m_mesh;
+        uint32_t m_first_instance;
+        uint32_t m_count;
+    };
+    struct ShadowCascadeDraws {
+        uint32_t m_cascade;
+        // Into m_shadow_casters, then m_shadow_batches once the instances are written
+        uint32_t m_first;
+        uint32_t m_count;
+    };
+    // World bounds of the renderables into m_object_spheres and m_scene_bvh
+    void update_scene_bvh();
+    // Fills m_cpu_visible
+    void cull_renderables(const glm::mat4 &view_projection);
+    // World space bounding spheres of the renderables
+    std::vector<glm::vec4> m_object_spheres;
+    std::vector<uint8_t> m_cpu_visible;
+    std::vector<RenderObject> m_visible_renderables;
+    // Scratch for the BVH queries
+    std::vector<uint32_t> m_bvh_results;
+
+    // Culls the renderables against the cascades rendered this frame, fills m_shadow_casters
+    void cull_shadow_casters();
+    // Writes the instances of the casters and batches them by mesh
+    void prepare_shadows(FrameData& frame);
+    void cmd_render_shadows(VkCommandBuffer cmd);
+    std::vector<ShadowCascadeDraws> m_shadow_cascade_draws;
+    std::vector<uint32_t> m_shadow_casters;
+    std::vector<ShadowBatch> m_shadow_batches;
+    // Depth only, light view-projection in the push constants
+    VkPipeline m_shadow_pipeline;
+    VkPipelineLayout m_shadow_pipeline_layout;
+
+    // Blended over the shaded scene, tested against its depth
+    void cmd_draw_particles(VkCommandBuffer cmd, VkImageView color_view);
+    VkPipeline m_particle_pipeline;
+    VkPipelineLayout m_particle_pipeline_layout;
+    // Start of the last draw, the particles advance by the time between frames
+    uint64_t m_last_frame_us = 0;
+
+    // Samples the scene color into the swapchain, see DynamicResolution::cmd_upscale
+    void cmd_upscale(VkCommandBuffer cmd, VkImageView swapchain_view);
+    VkPipeline m_upscale_pipeline;
+    VkPipelineLayout m_upscale_pipeline_layout;
+
+    // Scratch for draw_objects, kept to avoid reallocating every frame
+    std::vector<uint32_t> m_draw_order;
+
+    // F keys, on the render thread when there is one
+    void on_key(int key);
+    bool imgui_enabled() const { return !m_headless && !m_enable_render_thread; }
+
+    // m_enable_render_thread, run() steps the simulation and this draws
+    void run_simulation();
+    void render_thread_main();
+    // Into the scene members, swapped with m_render_state so nothing is reallocated
+    void apply_snapshot(const SceneSnapshot& snapshot, float alpha);
+    TripleBuffer<SceneSnapshot> m_snapshots;
+    SceneState m_render_state;
+    uint32_t m_applied_static_version = 0;
+    // When the input of the snapshot drawn was polled, the latency is measured from there
+    uint64_t m_snapshot_input_us = 0;
+    // Set before the thread starts and cleared once joined, so it's only read while it runs
+    bool m_render_thread_active = false;
+    std::atomic<bool> m_render_thread_quit = false;
+    std::thread m_render_thread;
+    // GLFW can only be called from the main thread, which writes the framebuffer size (width in
+    // the high bits) after every poll for recreate_swapchain, and queues the keys
+    std::atomic<uint64_t> m_framebuffer_size = 0;
+    std::mutex m_key_mutex;
+    std::vector<int> m_pending_keys;
 };
 
 
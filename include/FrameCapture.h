@@ -0,0 +1,256 @@
+#ifndef VK_ENGINE_FRAMECAPTURE_H
+#define VK_ENGINE_FRAMECAPTURE_H
+
+#include <ClusteredLighting.h>
+#include <MappedFile.h>
+#include <Material.h>
+#include <ParticleSystem.h>
+#include <PipelineBuilder.h>
+
+#include <vulkan/vulkan.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// "VKFC" read as a little endian uint32_t
+constexpr uint32_t FRAME_CAPTURE_MAGIC = 0x43464B56;
+// Files of any other version are refused
+constexpr uint32_t FRAME_CAPTURE_VERSION = 1;
+
+// FrameCaptureFrame::m_flags, the engine toggles
+constexpr uint32_t FRAME_CAPTURE_DEPTH_PREPASS = 1u << 0;
+constexpr uint32_t FRAME_CAPTURE_OCCLUSION_CULLING = 1u << 1;
+constexpr uint32_t FRAME_CAPTURE_CPU_CULLING = 1u << 2;
+constexpr uint32_t FRAME_CAPTURE_ASYNC_COMPUTE = 1u << 3;
+constexpr uint32_t FRAME_CAPTURE_COMMAND_CACHE = 1u << 4;
+constexpr uint32_t FRAME_CAPTURE_SHADOWS = 1u << 5;
+constexpr uint32_t FRAME_CAPTURE_DYNAMIC_RESOLUTION = 1u << 6;
+
+struct FrameCaptureHeader {
+    uint32_t m_magic;
+    uint32_t m_version;
+    // Of the window when the capture started, replays render at this size
+    uint32_t m_width;
+    uint32_t m_height;
+};
+
+// Followed by m_size bytes of payload
+struct FrameCaptureChunk {
+    uint32_t m_type;
+    uint32_t m_size;
+};
+
+enum class FrameCaptureChunkType : uint32_t {
+    // FrameCaptureMesh, name, vertices and indices
+    Mesh = 1,
+    // FrameCapturePipeline, then for each shader its stage and path
+    Pipeline = 2,
+    // FrameCaptureMaterial and name
+    Material = 3,
+    // FrameCaptureFrame, lights, emitters and the objects that changed
+    Frame = 4
+};
+
+// Strings are their size as a uint32_t followed by the chars. Meshes, pipelines and materials are
+// numbered in the order they are written, starting at 0 for each.
+
+struct FrameCaptureMesh {
+    uint32_t m_id;
+    uint32_t m_vertex_count;
+    uint32_t m_index_count;
+};
+
+// What a mesh material's pipeline was built with, the rest is the usual mesh pipeline setup
+// (Vertex input, depth attachment, layout derived from the shaders)
+struct FrameCapturePipeline {
+    uint32_t m_id;
+    uint32_t m_dynamic_state;
+    uint32_t m_cull_mode;
+    uint32_t m_front_face;
+    uint32_t m_topology;
+    uint32_t m_depth_test;
+    uint32_t m_depth_write;
+    uint32_t m_depth_compare_op;
+    // Alpha blending on the color attachment
+    uint32_t m_blend;
+    uint32_t m_shader_count;
+};
+
+struct FrameCaptureMaterial {
+    uint32_t m_id;
+    // Pipeline ids, UINT32_MAX without an instanced pipeline
+    uint32_t m_pipeline;
+    uint32_t m_instanced_pipeline;
+    // RenderState, only used with dynamic state pipelines
+    uint32_t m_cull_mode;
+    uint32_t m_front_face;
+    uint32_t m_topology;
+    uint32_t m_depth_test;
+    uint32_t m_depth_write;
+    uint32_t m_depth_compare_op;
+};
+
+// What draw reads from the application, as it was when the frame started
+struct FrameCaptureFrame {
+    glm::vec3 m_camera_position;
+    // Particles advance by it
+    float m_delta_time;
+    glm::vec3 m_sun_direction;
+    float m_sun_intensity;
+    glm::vec3 m_sun_color;
+    uint32_t m_flags;
+    uint32_t m_instancing_threshold;
+    uint32_t m_particle_capacity;
+    float m_resolution_target_ms;
+    float m_resolution_sharpness;
+    uint32_t m_light_count;
+    uint32_t m_emitter_count;
+    // Renderables of the frame
+    uint32_t m_object_count;
+    // FrameCaptureObject written, the others are the same as in the last frame
+    uint32_t m_changed_objects;
+};
+
+// A RenderObject at m_index in the renderables, mesh and material as ids
+struct FrameCaptureObject {
+    glm::mat4 m_transform;
+    glm::vec4 m_color;
+    uint32_t m_index;
+    uint32_t m_flags;
+    uint32_t m_mesh;
+    uint32_t m_material;
+    uint32_t m_dynamic;
+    uint32_t m_padding[3];
+};
+static_assert(sizeof(FrameCaptureHeader) == 16, "FrameCaptureHeader must match the file layout");
+static_assert(sizeof(FrameCaptureFrame) == 80, "FrameCaptureFrame must match the file layout");
+static_assert(sizeof(FrameCaptureObject) == 112, "FrameCaptureObject must match the file layout");
+static_assert(std::is_trivially_copyable_v<FrameCaptureObject>, "FrameCaptureObject is copied as is");
+
+// Appends chunks to a capture file, little endian like the scene files. Resources get a chunk
+// the first time a frame uses them, frames only carry the renderables that changed since the
+// previous one, so static scenes cost one full frame and then a few bytes per frame.
+class FrameCaptureWriter {
+public:
+    bool open(const char *filename, VkExtent2D extent);
+    void close();
+    bool is_open() const { return m_file.is_open(); }
+    uint32_t frame_count() const { return m_frame_count; }
+
+    // Ids of what was written already, UINT32_MAX for the rest
+    uint32_t mesh_id(const Mesh *mesh) const;
+    uint32_t pipeline_id(VkPipeline pipeline) const;
+    uint32_t material_id(const Material *material) const;
+
+    // The ids in the records are filled in, and returned
+    uint32_t write_mesh(const Mesh *mesh, const std::string &name);
+    uint32_t write_pipeline(VkPipeline pipeline, FrameCapturePipeline record, const std::vector<ShaderFile> &shaders);
+    uint32_t write_material(const Material *material, const std::string &name, FrameCaptureMaterial record);
+    // objects has every renderable of the frame, with m_index set. Only the ones that differ from
+    // the last frame are written.
+    void write_frame(FrameCaptureFrame record, const std::vector<PointLight> &lights,
+                     const std::vector<ParticleEmitter> &emitters, const std::vector<FrameCaptureObject> &objects);
+
+private:
+    template<typename T>
+    void put(const T &value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        m_chunk.insert(m_chunk.end(), (const char *) &value, (const char *) &value + sizeof(T));
+    }
+    void put_bytes(const void *data, size_t size);
+    void put_string(const std::string &value);
+    void flush_chunk(FrameCaptureChunkType type);
+
+    std::ofstream m_file;
+    std::string m_filename;
+    // Payload of the chunk being written
+    std::vector<char> m_chunk;
+
+    std::unordered_map<const Mesh *, uint32_t> m_mesh_ids;
+    std::unordered_map<VkPipeline, uint32_t> m_pipeline_ids;
+    std::unordered_map<const Material *, uint32_t> m_material_ids;
+    // Of the last frame, what the next one is compared to
+    std::vector<FrameCaptureObject> m_last_objects;
+    uint32_t m_frame_count = 0;
+};
+
+// Payload of one chunk, reads fail once past its end
+class FrameCaptureStream {
+public:
+    FrameCaptureStream() = default;
+    FrameCaptureStream(const char *data, size_t size) : m_data(data), m_size(size) {}
+
+    template<typename T>
+    bool read(T *out_value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        return read_bytes(out_value, sizeof(T));
+    }
+    template<typename T>
+    bool read_array(std::vector<T> *out_values, uint32_t count) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (count > (m_size - m_offset) / sizeof(T)) {
+            return false;
+        }
+        out_values->resize(count);
+        return read_bytes(out_values->data(), (size_t) count * sizeof(T));
+    }
+    bool read_bytes(void *out_data, size_t size);
+    bool read_string(std::string *out_value);
+
+private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    size_t m_offset = 0;
+};
+
+// Maps a capture file and walks its chunks
+class FrameCaptureReader {
+public:
+    bool open(const char *filename);
+    void close() { m_file.close(); m_offset = 0; }
+
+    uint64_t size() const { return m_file.size(); }
+    VkExtent2D extent() const { return m_extent; }
+
+    // Next chunk in the order they were written. False at the end of the file, or if the chunk
+    // is cut short (a capture that wasn't closed).
+    bool next_chunk(FrameCaptureChunkType *out_type, FrameCaptureStream *out_payload);
+    // Back to the first chunk
+    void rewind() { m_offset = sizeof(FrameCaptureHeader); }
+
+private:
+    MappedFile m_file;
+    VkExtent2D m_extent = {0, 0};
+    size_t m_offset = 0;
+};
+
+// Replay state, what the capture ids turned into in the replaying engine. See
+// Engine::replay_frame.
+struct FrameReplay {
+    FrameCaptureReader m_reader;
+    std::vector<Mesh *> m_meshes;
+    // Pipelines are only built for the materials the replaying engine doesn't have already,
+    // VK_NULL_HANDLE until then
+    std::vector<FrameCapturePipeline> m_pipeline_records;
+    std::vector<std::vector<ShaderFile>> m_pipeline_shaders;
+    std::vector<VkPipeline> m_pipelines;
+    std::vector<VkPipelineLayout> m_pipeline_layouts;
+    std::vector<Material *> m_materials;
+    // Frames replayed since open or the last rewind
+    uint32_t m_frame = 0;
+
+    bool open(const char *filename) { return m_reader.open(filename); }
+    // Replays from the first frame again, the ids are the same so the resources created by the
+    // first pass are reused
+    void rewind() {
+        m_reader.rewind();
+        m_frame = 0;
+    }
+};
+
+#endif //VK_ENGINE_FRAMECAPTURE_H
@@ -0,0 +1,74 @@
+#ifndef VK_ENGINE_GEOMETRYBUFFER_H
+#define VK_ENGINE_GEOMETRYBUFFER_H
+
+#include <MemoryBudget.h>
+#include <RangeAllocator.h>
+#include <VulkanHelpers.h>
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+
+#include <vector>
+
+// Where a mesh lives in the shared buffers. Indexed draws use m_first_vertex as vertexOffset.
+struct GeometryRange {
+    uint32_t m_first_vertex = 0;
+    uint32_t m_vertex_count = 0;
+    uint32_t m_first_index = 0;
+    uint32_t m_index_count = 0;
+    bool m_live = false;
+};
+
+// One device local vertex buffer and one index buffer shared by every mesh, so all the
+// geometry can be drawn after a single bind (and from a single indirect buffer later on).
+// Meshes get a handle, which stays valid when the buffers are repacked.
+class GeometryBuffer {
+public:
+    static constexpr uint32_t INVALID_HANDLE = UINT32_MAX;
+
+    AllocatedBuffer m_vertex_buffer{};
+    AllocatedBuffer m_index_buffer{};
+
+    void init(VmaAllocator allocator, MemoryBudget *memory_budget, uint32_t vertex_stride,
+              uint32_t vertex_capacity, uint32_t index_capacity);
+    void cleanup();
+
+    // Returns false when there is no contiguous room left, see cmd_rebuild.
+    bool allocate(uint32_t vertex_count, uint32_t index_count, uint32_t *out_handle);
+    // The range must not be used by the GPU anymore
+    void free(uint32_t handle);
+
+    const GeometryRange &get_range(uint32_t handle) const { return m_ranges[handle]; }
+
+    // Records copies of staged data into the range of handle. The staging buffer holds the
+    // vertices, then the indices.
+    void cmd_upload(VkCommandBuffer cmd, uint32_t handle, VkBuffer staging_buffer) const;
+
+    // Packs every live range at the start of new buffers of the given capacities, which also
+    // compacts away the holes left by freed meshes. The returned old buffers must be destroyed
+    // with destroy_buffer once cmd and the frames using them have completed.
+    std::vector<AllocatedBuffer> cmd_rebuild(VkCommandBuffer cmd, uint32_t vertex_capacity, uint32_t index_capacity);
+    void destroy_buffer(const AllocatedBuffer &buffer);
+
+    void cmd_bind(VkCommandBuffer cmd) const;
+
+    uint32_t vertex_stride() const { return m_vertex_stride; }
+    const RangeAllocator &vertex_allocator() const { return m_vertex_allocator; }
+    const RangeAllocator &index_allocator() const { return m_index_allocator; }
+
+private:
+    AllocatedBuffer create_buffer(VkDeviceSize size, VkBufferUsageFlags usage);
+    void cmd_barrier(VkCommandBuffer cmd) const;
+
+    VmaAllocator m_allocator = VK_NULL_HANDLE;
+    MemoryBudget *m_memory_budget = nullptr;
+    uint32_t m_vertex_stride = 0;
+
+    RangeAllocator m_vertex_allocator;
+    RangeAllocator m_index_allocator;
+
+    std::vector<GeometryRange> m_ranges;
+    std::vector<uint32_t> m_free_handles;
+};
+
+#endif //VK_ENGINE_GEOMETRYBUFFER_H
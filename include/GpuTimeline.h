@@ -0,0 +1,65 @@
+#ifndef VK_ENGINE_GPUTIMELINE_H
+#define VK_ENGINE_GPUTIMELINE_H
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <vector>
+
+// Queues the engine submits to. Compute is a family without graphics, only used when the
+// device has one, it runs next to the graphics queue.
+enum class GpuQueue : uint32_t {
+    Graphics,
+    Compute
+};
+constexpr uint32_t GPU_QUEUE_COUNT = 2;
+
+// Something a submission waits on. For a timeline semaphore the value is the one to reach,
+// binary semaphores (ie the swapchain acquire) ignore it.
+struct SemaphoreWait {
+    VkSemaphore m_semaphore;
+    uint64_t m_value = 0;
+    VkPipelineStageFlags m_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+};
+
+// One queue and the timeline semaphore counting its submissions. Every submit signals a new,
+// strictly increasing value, which the CPU can poll or wait on and other queues can wait on.
+// Replaces the per-submission fences.
+class GpuTimeline {
+public:
+    void init(VkDevice device, VkQueue queue, uint32_t queue_family);
+    void cleanup();
+
+    // Submits cmds once the waits are reached and returns the value signaled when they complete.
+    // A signal_value of 0 picks the next value, otherwise it must be higher than the last one.
+    // Binary semaphores in binary_signals are signaled as well, for vkQueuePresentKHR.
+    uint64_t submit(const std::vector<VkCommandBuffer> &cmds, const std::vector<SemaphoreWait> &waits,
+                    uint64_t signal_value = 0, const std::vector<VkSemaphore> &binary_signals = {});
+
+    // Value of the last submission, everything recorded so far is done once it is reached
+    uint64_t last_submitted_value() const { return m_last_submitted; }
+    // Value the next submission will signal, resources used by work not submitted yet retire at it
+    uint64_t next_value() const { return m_last_submitted + 1; }
+
+    // Polls the semaphore, doesn't block
+    uint64_t completed_value();
+    bool is_complete(uint64_t value);
+    // Blocks until value is reached, returns false on timeout
+    bool wait(uint64_t value, uint64_t timeout = UINT64_MAX);
+    void wait_idle() { wait(m_last_submitted); }
+
+    SemaphoreWait wait_info(uint64_t value, VkPipelineStageFlags stage) const { return {m_semaphore, value, stage}; }
+
+    VkQueue m_queue = VK_NULL_HANDLE;
+    uint32_t m_queue_family = 0;
+    VkSemaphore m_semaphore = VK_NULL_HANDLE;
+
+private:
+    VkDevice m_device = VK_NULL_HANDLE;
+
+    uint64_t m_last_submitted = 0;
+    // Cached so polling an already reached value doesn't go to the driver
+    uint64_t m_last_completed = 0;
+};
+
+#endif //VK_ENGINE_GPUTIMELINE_H
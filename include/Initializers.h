@@ -30,6 +30,15 @@ namespace Initializers {
 
     VkPipelineDepthStencilStateCreateInfo
     depth_stencil_create_info(bool depth_test, bool depth_write, VkCompareOp compare_op);
+
+    VkDescriptorSetLayoutBinding
+    descriptorset_layout_binding(VkDescriptorType type, VkShaderStageFlags stage_flags, uint32_t binding);
+
+    VkWriteDescriptorSet write_descriptor_buffer(VkDescriptorType type, VkDescriptorSet dst_set,
+                                                 const VkDescriptorBufferInfo *buffer_info, uint32_t binding);
+
+    VkWriteDescriptorSet write_descriptor_image(VkDescriptorType type, VkDescriptorSet dst_set,
+                                                const VkDescriptorImageInfo *image_info, uint32_t binding);
 }
 
 
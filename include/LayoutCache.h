@@ -0,0 +1,68 @@
+#ifndef VK_ENGINE_LAYOUTCACHE_H
+#define VK_ENGINE_LAYOUTCACHE_H
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Hands out one VkDescriptorSetLayout per distinct set of bindings and one VkPipelineLayout per
+// distinct list of set layouts and push constant ranges. Pipelines made with the same description
+// end up with the same handles, so they are compatible and switching between them doesn't
+// need the descriptor sets to be bound again.
+// The cache owns everything it creates, destroyed in cleanup.
+class LayoutCache {
+public:
+    struct PipelineLayoutDesc {
+        std::vector<VkDescriptorSetLayout> m_set_layouts;
+        std::vector<VkPushConstantRange> m_push_constants;
+
+        bool operator==(const PipelineLayoutDesc &other) const;
+    };
+
+    void init(VkDevice device);
+    void cleanup();
+
+    // Binding order doesn't matter, immutable samplers aren't supported
+    VkDescriptorSetLayout get_set_layout(const std::vector<VkDescriptorSetLayoutBinding> &bindings);
+    VkPipelineLayout get_pipeline_layout(const PipelineLayoutDesc &desc);
+
+    // What a layout from this cache was made from, nullptr for layouts it didn't make
+    const std::vector<VkDescriptorSetLayoutBinding> *find_set_bindings(VkDescriptorSetLayout layout) const;
+    const PipelineLayoutDesc *find_pipeline_desc(VkPipelineLayout layout) const;
+
+    // Distinct layouts created, and how many were asked for in total
+    uint32_t set_layout_count() const { return (uint32_t) m_set_layouts.size(); }
+    uint32_t pipeline_layout_count() const { return (uint32_t) m_pipeline_layouts.size(); }
+    uint32_t set_layout_requests() const { return m_set_layout_requests; }
+    uint32_t pipeline_layout_requests() const { return m_pipeline_layout_requests; }
+
+private:
+    struct SetLayoutKey {
+        std::vector<VkDescriptorSetLayoutBinding> m_bindings;
+
+        bool operator==(const SetLayoutKey &other) const;
+    };
+
+    struct SetLayoutKeyHash {
+        size_t operator()(const SetLayoutKey &key) const;
+    };
+
+    struct PipelineLayoutDescHash {
+        size_t operator()(const PipelineLayoutDesc &desc) const;
+    };
+
+    VkDevice m_device = VK_NULL_HANDLE;
+
+    std::unordered_map<SetLayoutKey, VkDescriptorSetLayout, SetLayoutKeyHash> m_set_layouts;
+    std::unordered_map<PipelineLayoutDesc, VkPipelineLayout, PipelineLayoutDescHash> m_pipeline_layouts;
+    // Reverse lookups for find_*
+    std::unordered_map<VkDescriptorSetLayout, const SetLayoutKey *> m_set_layout_keys;
+    std::unordered_map<VkPipelineLayout, const PipelineLayoutDesc *> m_pipeline_layout_descs;
+
+    uint32_t m_set_layout_requests = 0;
+    uint32_t m_pipeline_layout_requests = 0;
+};
+
+#endif //VK_ENGINE_LAYOUTCACHE_H
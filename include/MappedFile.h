@@ -0,0 +1,33 @@
+#ifndef VK_ENGINE_MAPPEDFILE_H
+#define VK_ENGINE_MAPPEDFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Read only view of a whole file. Memory mapped on Linux, so the pages are read on demand and
+// shared with the page cache, read into memory anywhere else.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const char *filename);
+    void close();
+
+    // Tells the kernel the file is read front to back, once
+    void advise_sequential() const;
+
+    const char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+    std::vector<char> m_buffer;
+};
+
+#endif //VK_ENGINE_MAPPEDFILE_H
@@ -6,12 +6,21 @@
 #define VK_ENGINE_MATERIAL_H
 
 #include <Mesh.h>
+#include <RenderState.h>
 
 #include <vulkan/vulkan.h>
 
 struct Material {
     VkPipeline m_pipeline;
     VkPipelineLayout m_pipeline_layout;
+    // Same layout, reads the per-object data from the instance buffer. Optional, materials
+    // without it are always drawn one object at a time.
+    VkPipeline m_instanced_pipeline = VK_NULL_HANDLE;
+    // Only used when the pipelines have dynamic render state, otherwise it's baked in them
+    RenderState m_state;
+    bool m_dynamic_state = false;
+    // Set 1 of the layout is ClusteredLighting::set_layout, and set 2 CascadedShadows::set_layout
+    bool m_lit = false;
 };
 
 #endif //VK_ENGINE_MATERIAL_H
@@ -0,0 +1,101 @@
+#ifndef VK_ENGINE_MEMORYBUDGET_H
+#define VK_ENGINE_MEMORYBUDGET_H
+
+#include <Profiler.h>
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+enum class MemoryCategory : uint32_t {
+    Mesh,
+    Texture,
+    RenderTarget,
+    Staging,
+    PerFrame,
+    Other,
+    Count
+};
+
+const char *memory_category_name(MemoryCategory category);
+
+struct HeapBudget {
+    VkMemoryHeapFlags m_flags = 0;
+    VkDeviceSize m_size = 0;
+    // From VK_EXT_memory_budget when available, otherwise VMA estimates them from its own allocations
+    VkDeviceSize m_usage = 0;
+    VkDeviceSize m_budget = 0;
+    // What VMA allocated from the driver, and what we actually use of it
+    VkDeviceSize m_block_bytes = 0;
+    VkDeviceSize m_allocation_bytes = 0;
+    // Tracked allocations per MemoryCategory
+    std::array<VkDeviceSize, (size_t) MemoryCategory::Count> m_category_bytes{};
+    // Usage in MB over the last frames
+    RollingStats m_usage_history;
+    // Still over the threshold after the eviction callbacks of the last update
+    bool m_over_budget = false;
+};
+
+// Called when a heap goes over budget, with how many bytes should be released. Returns how
+// many bytes were (or will be) released so the next callbacks can be skipped when it's enough.
+using EvictionCallback = std::function<VkDeviceSize(uint32_t heap_index, VkDeviceSize bytes_over_budget)>;
+
+// Records per heap usage and budget every frame, broken down by category, and lets the
+// streaming systems react before an allocation fails.
+class MemoryBudget {
+public:
+    // Eviction starts when usage goes over this fraction of the budget, so we have some room
+    // left for transient allocations.
+    float m_eviction_threshold = 0.9f;
+
+    std::vector<HeapBudget> m_heaps;
+
+    void init(VmaAllocator allocator, bool budget_extension_enabled);
+
+    // Must be called once per frame, calls the eviction callbacks if a heap is over budget
+    void update(uint32_t frame_index);
+
+    void track(VmaAllocation allocation, MemoryCategory category);
+    void untrack(VmaAllocation allocation);
+
+    uint32_t add_eviction_callback(EvictionCallback &&callback);
+    void remove_eviction_callback(uint32_t handle);
+
+    VkDeviceSize get_category_bytes(MemoryCategory category) const;
+    bool is_budget_extension_enabled() const { return m_budget_extension_enabled; }
+
+    // JSON from vmaBuildStatsString, with the full block/allocation list when detailed is true
+    std::string build_stats_json(bool detailed) const;
+    bool dump_stats_json(const char *file_path, bool detailed = true) const;
+
+    // ImGui window with the heaps usage. Needs an ImGui frame to be started.
+    void draw_overlay();
+
+private:
+    struct TrackedAllocation {
+        MemoryCategory m_category;
+        uint32_t m_heap_index;
+        VkDeviceSize m_size;
+    };
+
+    VmaAllocator m_allocator = VK_NULL_HANDLE;
+    bool m_budget_extension_enabled = false;
+    std::vector<uint32_t> m_type_to_heap;
+
+    // Guards the tracked allocations, the heaps and the eviction callbacks, update runs on the
+    // render thread
+    mutable std::mutex m_mutex;
+    std::unordered_map<VmaAllocation, TrackedAllocation> m_tracked;
+
+    uint32_t m_next_callback_handle = 0;
+    std::vector<std::pair<uint32_t, EvictionCallback>> m_eviction_callbacks;
+};
+
+#endif //VK_ENGINE_MEMORYBUDGET_H
@@ -7,35 +7,94 @@
 
 #include <vulkan/vulkan.h>
 #include <VulkanHelpers.h>
+#include <VertexLayout.h>
+#include <array>
+#include <cstdint>
 #include <vector>
 #include <glm/glm.hpp>
 
-struct VertexInputDescription {
-    std::vector<VkVertexInputBindingDescription> bindings;
-    std::vector<VkVertexInputAttributeDescription> attributes;
+struct Vertex {
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec3 color;
 
-    VkPipelineVertexInputStateCreateFlags flags = 0;
+    static constexpr auto attributes() {
+        return std::array{
+                VERTEX_ATTRIBUTE(Vertex, position, 0),
+                VERTEX_ATTRIBUTE(Vertex, normal, 1),
+                VERTEX_ATTRIBUTE(Vertex, color, 2)
+        };
+    }
 };
 
-struct Vertex {
+// Vertex plus up to 4 joints and their weights, the weights add up to 1
+struct SkinnedVertex {
     glm::vec3 position;
     glm::vec3 normal;
     glm::vec3 color;
+    uint8_t joints[4];
+    glm::vec4 weights;
 
-    static VertexInputDescription get_vertex_description();
+    static constexpr auto attributes() {
+        return std::array{
+                VERTEX_ATTRIBUTE(SkinnedVertex, position, 0),
+                VERTEX_ATTRIBUTE(SkinnedVertex, normal, 1),
+                VERTEX_ATTRIBUTE(SkinnedVertex, color, 2),
+                VERTEX_ATTRIBUTE_FORMAT(SkinnedVertex, joints, 3, VK_FORMAT_R8G8B8A8_UINT),
+                VERTEX_ATTRIBUTE(SkinnedVertex, weights, 4)
+        };
+    }
 };
 
+// 20 bytes instead of 36, the normal is 10 bit snorm and the color 8 bit unorm. The shaders read
+// them as floats like the ones of Vertex.
+struct PackedVertex {
+    glm::vec3 position;
+    uint32_t normal;
+    uint32_t color;
+
+    static constexpr auto attributes() {
+        return std::array{
+                VERTEX_ATTRIBUTE(PackedVertex, position, 0),
+                VERTEX_ATTRIBUTE_FORMAT(PackedVertex, normal, 1, VK_FORMAT_A2B10G10R10_SNORM_PACK32),
+                VERTEX_ATTRIBUTE_FORMAT(PackedVertex, color, 2, VK_FORMAT_R8G8B8A8_UNORM)
+        };
+    }
+
+    static PackedVertex pack(const Vertex &vertex);
+};
+
+// What the mesh vertex shaders (shaders/*trimesh*.vert) read, every vertex type must give it
+constexpr std::array<VertexShaderInput, 3> MESH_SHADER_INPUTS = {{
+        {0, VK_FORMAT_R32G32B32_SFLOAT},
+        {1, VK_FORMAT_R32G32B32_SFLOAT},
+        {2, VK_FORMAT_R32G32B32_SFLOAT}
+}};
+static_assert(VertexLayout<Vertex>::provides(MESH_SHADER_INPUTS));
+static_assert(VertexLayout<SkinnedVertex>::provides(MESH_SHADER_INPUTS));
+static_assert(VertexLayout<PackedVertex>::provides(MESH_SHADER_INPUTS));
+
+// Per object data of the non instanced path, view-projection comes from the frame uniform
 struct MeshPushConstants {
+    // rgb tints the vertex color
     glm::vec4 data;
-    glm::mat4 render_matrix;
+    glm::mat4 model_matrix;
 };
 
 struct Mesh {
     std::vector<Vertex> m_vertices;
+    // Optional, relative to the first vertex of the mesh. Drawn non indexed when empty.
+    std::vector<uint32_t> m_indices;
 
-    AllocatedBuffer m_vertex_buffer;
+    // Range in the engine's GeometryBuffer, set by Engine::upload_mesh
+    uint32_t m_geometry_handle = UINT32_MAX;
+    // Model space bounding sphere, center and radius, set by Engine::upload_mesh
+    glm::vec4 m_bounds = {0.f, 0.f, 0.f, 0.f};
 
     bool load_from_obj(const char* filename);
+    // Same triangles, parsed with ObjParser on thread_count threads (0 for all of them). Much
+    // faster on big files, see ObjParser.
+    bool load_from_obj_parallel(const char* filename, uint32_t thread_count = 0);
 };
 
 
@@ -0,0 +1,92 @@
+#ifndef VK_ENGINE_OBJPARSER_H
+#define VK_ENGINE_OBJPARSER_H
+
+#include <Mesh.h>
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+struct ObjParseStats {
+    uint32_t m_threads = 0;
+    uint32_t m_chunks = 0;
+    uint64_t m_bytes = 0;
+    uint64_t m_positions = 0;
+    uint64_t m_normals = 0;
+    uint64_t m_faces = 0;
+    uint64_t m_triangles = 0;
+    // Dropped, they reference a position or normal that doesn't exist
+    uint64_t m_invalid_faces = 0;
+    // Wall time of each step, in ms
+    double m_map_ms = 0.0;
+    double m_count_ms = 0.0;
+    double m_parse_ms = 0.0;
+    double m_triangulate_ms = 0.0;
+};
+
+// Loads the v, vn and f lines of an OBJ file, everything else (texture coordinates, groups,
+// materials) is skipped. Made for huge files: the file is mapped and cut into chunks at line
+// boundaries, and every step runs on all the chunks in parallel.
+//  - count: the positions, normals, face corners and triangles of each chunk. Prefix sums over
+//    the chunks give where each one writes, so the arrays are sized once and never grow.
+//  - parse: positions and normals straight into their arrays, face corners with their indices
+//    resolved (relative ones need the base of the chunk).
+//  - triangulate: faces are ear clipped, they need the positions of every chunk so it is a
+//    separate step. Writes the vertices, 3 per triangle like Mesh::load_from_obj.
+// Corners without a normal get the normal of their triangle.
+class ObjParser {
+public:
+    // 0 uses every hardware thread
+    uint32_t m_thread_count = 0;
+
+    // Replaces the content of vertices
+    bool parse(const char *filename, std::vector<Vertex> &vertices);
+
+    const ObjParseStats &stats() const { return m_stats; }
+
+private:
+    // A face corner, indices resolved and 0 based. UINT32_MAX without a normal.
+    struct Corner {
+        uint32_t m_position;
+        uint32_t m_normal;
+    };
+
+    struct Chunk {
+        const char *m_begin = nullptr;
+        const char *m_end = nullptr;
+
+        // Counted, then turned into the first index of the chunk in every array
+        uint64_t m_positions = 0;
+        uint64_t m_normals = 0;
+        uint64_t m_faces = 0;
+        uint64_t m_corners = 0;
+        uint64_t m_triangles = 0;
+
+        uint64_t m_position_base = 0;
+        uint64_t m_normal_base = 0;
+        uint64_t m_face_base = 0;
+        uint64_t m_corner_base = 0;
+        uint64_t m_triangle_base = 0;
+
+        // Triangles actually written, invalid faces leave a hole that gets compacted
+        uint64_t m_written_triangles = 0;
+        uint64_t m_invalid_faces = 0;
+    };
+
+    void count_chunk(Chunk &chunk) const;
+    void parse_chunk(Chunk &chunk);
+    void triangulate_chunk(Chunk &chunk, std::vector<Vertex> &vertices);
+
+    ObjParseStats m_stats;
+
+    std::vector<Chunk> m_chunks;
+    std::vector<glm::vec3> m_positions;
+    std::vector<glm::vec3> m_normals;
+    std::vector<Corner> m_corners;
+    // Corner count of every face, with the INVALID_FACE bit set when an index is out of range or
+    // there are fewer than 3 corners. The count is kept so the corners can be skipped.
+    std::vector<uint32_t> m_face_sizes;
+};
+
+#endif //VK_ENGINE_OBJPARSER_H
@@ -0,0 +1,161 @@
+#ifndef VK_ENGINE_OCCLUSIONCULLER_H
+#define VK_ENGINE_OCCLUSIONCULLER_H
+
+#include <MemoryBudget.h>
+#include <VulkanHelpers.h>
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+// Enough for a 65536x65536 depth buffer
+constexpr uint32_t MAX_DEPTH_PYRAMID_LEVELS = 16;
+
+// Compute pipeline with its layout, which has a single set
+struct ComputeProgram {
+    VkPipeline m_pipeline = VK_NULL_HANDLE;
+    VkPipelineLayout m_layout = VK_NULL_HANDLE;
+    VkDescriptorSetLayout m_set_layout = VK_NULL_HANDLE;
+};
+
+// One object to cull, std430 layout (see occlusion_cull.comp). Turned into a
+// VkDrawIndexedIndirectCommand drawing a single instance, or none when culled.
+struct CullObject {
+    // World space bounding sphere, center and radius
+    glm::vec4 m_sphere;
+    uint32_t m_index_count;
+    uint32_t m_first_index;
+    int32_t m_vertex_offset;
+    uint32_t m_first_instance;
+};
+static_assert(sizeof(CullObject) == 32, "CullObject must match the std430 layout of the shaders");
+
+// Uniform of occlusion_cull.comp, std140 layout
+struct CullData {
+    glm::mat4 m_view;
+    glm::mat4 m_projection;
+    // World space, pointing inside
+    glm::vec4 m_frustum[6];
+    glm::vec2 m_pyramid_size;
+    float m_pyramid_levels;
+    float m_z_near;
+    uint32_t m_object_count;
+    uint32_t m_occlusion_enabled;
+};
+
+// Written by the GPU, every object ends up in exactly one of them
+struct CullStats {
+    uint32_t m_visible = 0;
+    uint32_t m_frustum_culled = 0;
+    uint32_t m_occlusion_culled = 0;
+};
+
+// Two phase occlusion culling against a hierarchical Z pyramid:
+// - early: the objects visible last frame (and in the frustum) are drawn,
+// - the pyramid is built from the depth buffer they produced,
+// - late: everything is tested against it, the objects that became visible are drawn and the
+//   visibility is kept for the next frame.
+// Nothing visible is ever missed, an object appearing is only drawn a phase late. Without
+// occlusion only the early phase runs, and only frustum culls.
+class OcclusionCuller {
+public:
+    // Takes ownership of the pipelines, the layouts come from the engine's LayoutCache. With more
+    // than one queue family the buffers are shared by all of them, so culling can run on async
+    // compute. The pyramid stays on the queue drawing the depth.
+    void init(VkDevice device, VmaAllocator allocator, MemoryBudget *memory_budget, uint32_t frame_count,
+              const ComputeProgram &reduce, const ComputeProgram &cull,
+              const std::vector<uint32_t> &queue_families = {});
+    void cleanup();
+
+    // Hot reload, for a pipeline made from the same shader with the same layout. The old one is
+    // the caller's to destroy once the GPU is done with it.
+    void replace_pipeline(VkPipeline old_pipeline, VkPipeline new_pipeline);
+
+    // Recreates every buffer, the GPU must be done with all of them. The visibility is lost,
+    // the next frame draws everything in the late phase.
+    void reserve(uint32_t object_capacity);
+    uint32_t capacity() const { return m_capacity; }
+
+    // Sized after the depth buffer, call again when it's resized. The pyramid itself belongs to
+    // the caller: a R32_SFLOAT image of pyramid_extent and pyramid_levels levels, with storage
+    // and sampled usage, in VK_IMAGE_LAYOUT_GENERAL when built and read.
+    void resize_pyramid(VkExtent2D depth_extent);
+    VkExtent2D pyramid_extent() const { return m_pyramid_extent; }
+    uint32_t pyramid_levels() const { return m_pyramid_levels; }
+    // Points the descriptors of the frame slot at the depth (which needs
+    // VK_IMAGE_USAGE_SAMPLED_BIT) and the pyramid, a view of all its levels and one per level.
+    // Only rewritten when version changes, the frame slot must be done on the GPU. Needed
+    // before the first cmd_cull.
+    void set_images(uint32_t frame, uint64_t version, VkImageView depth_view, VkImageView pyramid_view,
+                    const VkImageView *level_views);
+
+    // Where to write this frame's objects, at most capacity(). The frame slot must be done on the GPU.
+    CullObject *map_objects(uint32_t frame, uint32_t object_count);
+    // Call after writing the objects
+    void update(uint32_t frame, const glm::mat4 &view, const glm::mat4 &projection, float z_near, bool occlusion);
+
+    // Fills the draw commands of one phase. Only the stats readback is synchronized, the draws and
+    // the late phase need a barrier after it.
+    void cmd_cull(VkCommandBuffer cmd, uint32_t frame, bool late);
+    // Between the two phases, the depth image must be readable by compute in
+    // VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL and the pyramid writable in
+    // VK_IMAGE_LAYOUT_GENERAL. The late phase needs a barrier after it. Only the top left
+    // render_extent of the depth is read, what was drawn when rendering to a part of it.
+    void cmd_build_pyramid(VkCommandBuffer cmd, uint32_t frame, VkExtent2D render_extent);
+
+    // One VkDrawIndexedIndirectCommand per object, in the order of map_objects
+    VkBuffer draw_commands(uint32_t frame, bool late) const;
+    // Of the last frame submitted in this slot, only valid once the GPU is done with it
+    CullStats read_stats(uint32_t frame) const;
+
+private:
+    struct FrameResources {
+        AllocatedBuffer m_objects;
+        CullObject *m_mapped_objects = nullptr;
+        AllocatedBuffer m_cull_data;
+        CullData *m_mapped_cull_data = nullptr;
+        AllocatedBuffer m_early_commands;
+        AllocatedBuffer m_late_commands;
+        AllocatedBuffer m_stats;
+        CullStats *m_mapped_stats = nullptr;
+
+        VkDescriptorSet m_descriptor = VK_NULL_HANDLE;
+        uint32_t m_object_count = 0;
+
+        // Each level reads the previous one, the first reads the depth
+        VkDescriptorSet m_reduce_descriptors[MAX_DEPTH_PYRAMID_LEVELS] = {};
+        // What set_images last wrote
+        uint64_t m_images_version = UINT64_MAX;
+    };
+
+    AllocatedBuffer create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VmaMemoryUsage memory_usage,
+                                  MemoryCategory category, void **out_mapped);
+    void destroy_buffer(const AllocatedBuffer &buffer);
+    void destroy_buffers();
+    void write_descriptors();
+
+    VkDevice m_device = VK_NULL_HANDLE;
+    VmaAllocator m_allocator = VK_NULL_HANDLE;
+    MemoryBudget *m_memory_budget = nullptr;
+    std::vector<uint32_t> m_queue_families;
+
+    ComputeProgram m_reduce;
+    ComputeProgram m_cull;
+    VkDescriptorPool m_descriptor_pool = VK_NULL_HANDLE;
+    VkSampler m_sampler = VK_NULL_HANDLE;
+
+    std::vector<FrameResources> m_frames;
+    // Shared by every frame, one uint per object telling if it was visible at the end of the last frame
+    AllocatedBuffer m_visibility = {};
+    bool m_visibility_cleared = false;
+    uint32_t m_capacity = 0;
+
+    VkExtent2D m_pyramid_extent = {0, 0};
+    uint32_t m_pyramid_levels = 0;
+    VkExtent2D m_depth_extent = {0, 0};
+};
+
+#endif //VK_ENGINE_OCCLUSIONCULLER_H
@@ -0,0 +1,194 @@
+#ifndef VK_ENGINE_PARTICLESYSTEM_H
+#define VK_ENGINE_PARTICLESYSTEM_H
+
+#include <LayoutCache.h>
+#include <MemoryBudget.h>
+#include <OcclusionCuller.h>
+#include <VulkanHelpers.h>
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+// Emitters past this are ignored, they all fit in a small per frame buffer
+constexpr uint32_t MAX_PARTICLE_EMITTERS = 256;
+
+// What the CPU controls, std430 layout (see particle_emit.comp). Everything but m_position and
+// m_rate is copied into the particles when they spawn, changing it only affects the new ones.
+struct ParticleEmitter {
+    glm::vec3 m_position = {0.f, 0.f, 0.f};
+    // Particles spawned per second
+    float m_rate = 1000.f;
+    glm::vec3 m_velocity = {0.f, 1.f, 0.f};
+    // Radius of the sphere the random part of the initial velocity is picked in
+    float m_velocity_spread = 0.5f;
+    glm::vec3 m_acceleration = {0.f, -9.81f, 0.f};
+    // Fraction of the velocity lost per second
+    float m_drag = 0.f;
+    // Over the lifetime of the particle, the alpha is blended
+    glm::vec4 m_start_color = {1.f, 1.f, 1.f, 1.f};
+    glm::vec4 m_end_color = {1.f, 1.f, 1.f, 0.f};
+    // In seconds
+    float m_lifetime = 2.f;
+    // Half the side of the billboard, world units
+    float m_start_size = 0.05f;
+    float m_end_size = 0.05f;
+    // Particles start anywhere in a sphere of this radius around m_position
+    float m_spawn_radius = 0.f;
+};
+static_assert(sizeof(ParticleEmitter) == 96, "ParticleEmitter must match the std430 layout of the shaders");
+
+// Written by the GPU
+struct ParticleStats {
+    // After the frame's simulation
+    uint32_t m_alive = 0;
+    // Spawned this frame, less than asked for when every particle is alive
+    uint32_t m_emitted = 0;
+};
+
+// Compute programs of the simulation, see ParticleSystem::init
+struct ParticlePrograms {
+    ComputeProgram m_args;
+    ComputeProgram m_emit;
+    ComputeProgram m_simulate;
+    ComputeProgram m_compact;
+    ComputeProgram m_sort;
+};
+
+// GPU particles, the CPU only writes the emitters. Every frame on compute:
+// - emit: the particles spawned this frame are popped from the dead list and appended to the
+//   alive list,
+// - simulate: every alive particle moves and ages,
+// - compact: the ones past their lifetime are pushed back on the dead list, the others are
+//   appended to a new list with their view depth as key (both through atomics),
+// - sort: the new list is radix sorted back to front, it's the alive list of the next frame.
+// The counts stay on the GPU, everything is dispatched and drawn indirectly. Particles are
+// drawn as camera facing quads, alpha blended in the sorted order.
+//
+// Shaders read it through set 1 (see set_layout): particles and sorted indices, bind it with
+// cmd_bind.
+class ParticleSystem {
+public:
+    // Takes ownership of the pipelines, the layouts come from layout_cache. With more than one
+    // queue family the buffers are shared by all of them, so the simulation can run on async
+    // compute.
+    void init(VkDevice device, VmaAllocator allocator, MemoryBudget *memory_budget, LayoutCache *layout_cache,
+              uint32_t frame_count, const ParticlePrograms &programs,
+              const std::vector<uint32_t> &queue_families = {});
+    void cleanup();
+
+    // Hot reload, for a pipeline made from the same shader with the same layout. The old one is
+    // the caller's to destroy once the GPU is done with it.
+    void replace_pipeline(VkPipeline old_pipeline, VkPipeline new_pipeline);
+
+    // Buffers and descriptor sets of a capacity, replaced by reserve
+    struct RetiredBuffers {
+        std::vector<AllocatedBuffer> m_buffers;
+        VkDescriptorPool m_descriptor_pool = VK_NULL_HANDLE;
+    };
+
+    // Recreates the buffers and the descriptor sets, every particle is dead again. The old ones
+    // are returned for destroy_retired, once the frames in flight are done with them.
+    RetiredBuffers reserve(uint32_t capacity);
+    void destroy_retired(const RetiredBuffers &retired);
+    uint32_t capacity() const { return m_capacity; }
+
+    // Vertex stage set: particles and their indices sorted back to front, bindings 0 and 1
+    VkDescriptorSetLayout set_layout() const { return m_set_layout; }
+
+    // The frame slot must be done on the GPU. Spawns rate * delta_time particles per emitter,
+    // the fractions carry over to the next frames. The view only orders the particles, z_far is
+    // the farthest depth they are told apart at.
+    void update(uint32_t frame, const std::vector<ParticleEmitter> &emitters, float delta_time,
+                const glm::mat4 &view, float z_far);
+
+    // Emits, simulates, compacts and sorts. The draw needs a barrier after it.
+    void cmd_simulate(VkCommandBuffer cmd, uint32_t frame);
+    void cmd_bind(VkCommandBuffer cmd, VkPipelineLayout layout) const;
+    // 6 vertices per alive particle, the vertex shader builds the quads
+    void cmd_draw(VkCommandBuffer cmd) const;
+
+    // Of the last frame submitted in this slot, only valid once the GPU is done with it
+    ParticleStats read_stats(uint32_t frame) const;
+
+private:
+    // Uniform of the compute shaders, std140 layout
+    struct FrameData {
+        glm::mat4 m_view;
+        float m_delta_time;
+        // Asked for, the emission is clamped to the dead particles
+        uint32_t m_spawn_count;
+        uint32_t m_emitter_count;
+        uint32_t m_seed;
+        float m_z_far;
+        uint32_t m_capacity;
+        uint32_t m_padding[2];
+    };
+
+    // ParticleEmitter with the range of the frame's spawns it covers
+    struct EmitterData {
+        ParticleEmitter m_emitter;
+        uint32_t m_first_spawn;
+        uint32_t m_spawn_count;
+        uint32_t m_padding[2];
+    };
+    static_assert(sizeof(EmitterData) == 112, "EmitterData must match the std430 layout of the shaders");
+
+    struct FrameResources {
+        AllocatedBuffer m_frame_data;
+        FrameData *m_mapped_frame_data = nullptr;
+        AllocatedBuffer m_emitters;
+        EmitterData *m_mapped_emitters = nullptr;
+        AllocatedBuffer m_stats;
+        ParticleStats *m_mapped_stats = nullptr;
+
+        // args, emit, simulate and compact
+        VkDescriptorSet m_descriptors[4] = {};
+    };
+
+    AllocatedBuffer create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VmaMemoryUsage memory_usage,
+                                  MemoryCategory category, void **out_mapped);
+    void destroy_buffer(const AllocatedBuffer &buffer);
+    RetiredBuffers retire_buffers();
+    void allocate_descriptors();
+    // Writes the bindings the program's set has, buffers[binding] for each
+    void write_descriptors(VkDescriptorSet set, const ComputeProgram &program, const VkBuffer *buffers,
+                           uint32_t buffer_count);
+    void cmd_dispatch_args(VkCommandBuffer cmd, VkDescriptorSet set, uint32_t stage, uint32_t group_count);
+
+    VkDevice m_device = VK_NULL_HANDLE;
+    VmaAllocator m_allocator = VK_NULL_HANDLE;
+    MemoryBudget *m_memory_budget = nullptr;
+    LayoutCache *m_layout_cache = nullptr;
+    std::vector<uint32_t> m_queue_families;
+
+    ParticlePrograms m_programs;
+    VkDescriptorSetLayout m_set_layout = VK_NULL_HANDLE;
+    // Of the current capacity, the sets are written once by reserve
+    VkDescriptorPool m_descriptor_pool = VK_NULL_HANDLE;
+
+    std::vector<FrameResources> m_frames;
+    // Shared by every frame, the particles live across them
+    AllocatedBuffer m_counters = {};
+    AllocatedBuffer m_particles = {};
+    AllocatedBuffer m_dead = {};
+    // A is the alive list, sorted. B is where the compaction appends, the sort goes back to A.
+    AllocatedBuffer m_keys[2] = {};
+    AllocatedBuffer m_values[2] = {};
+    AllocatedBuffer m_histograms = {};
+    // B to A and A to B
+    VkDescriptorSet m_sort_descriptors[2] = {};
+    VkDescriptorSet m_draw_descriptor = VK_NULL_HANDLE;
+    uint32_t m_capacity = 0;
+    // The dead list is filled by the first cmd_simulate after reserve
+    bool m_initialized = false;
+
+    // Fractional spawns carried over, per emitter
+    std::vector<float> m_spawn_remainders;
+    uint32_t m_seed = 0;
+};
+
+#endif //VK_ENGINE_PARTICLESYSTEM_H
@@ -6,17 +6,32 @@
 #define VK_ENGINE_PIPELINEBUILDER_H
 
 #include <Initializers.h>
+#include <Mesh.h>
+#include <VertexLayout.h>
 
 #include <vulkan/vulkan.h>
 
+#include <span>
+#include <string>
 #include <vector>
 
+// SPIR-V file of one pipeline stage, relative to the working directory like load_shader_module
+struct ShaderFile {
+    VkShaderStageFlagBits m_stage;
+    std::string m_path;
+};
+
 class PipelineBuilder {
 
 public:
 
     std::vector<VkPipelineShaderStageCreateInfo> m_shader_stages;
     VkPipelineVertexInputStateCreateInfo m_vertex_input_info;
+    // Static arrays of a VertexLayout, so a builder can be kept around and copied
+    std::span<const VkVertexInputBindingDescription> m_vertex_bindings;
+    std::span<const VkVertexInputAttributeDescription> m_vertex_attributes;
+    // Bit per location of the attributes to give to the pipeline, the ones the shaders read
+    uint32_t m_vertex_location_mask = UINT32_MAX;
     VkPipelineInputAssemblyStateCreateInfo m_input_assembly;
     VkViewport m_viewport;
     VkRect2D m_scissor;
@@ -26,8 +41,22 @@ public:
     VkPipelineLayout m_pipeline_layout;
     VkPipelineDepthStencilStateCreateInfo m_depth_stencil;
     VkFormat m_depth_stencil_format;
+    // Viewport and scissor by default, so pipelines survive a swapchain resize
+    std::vector<VkDynamicState> m_dynamic_states;
 
     void setup_default(VkExtent2D window_extent);
+    template<typename V>
+    void set_vertex_input() {
+        m_vertex_bindings = VertexLayout<V>::BINDINGS;
+        m_vertex_attributes = VertexLayout<V>::ATTRIBUTES;
+        m_vertex_location_mask = UINT32_MAX;
+    }
+    // Makes the RenderState fields (cull mode, front face, topology and depth test/write/compare)
+    // dynamic. The values baked in the builder are then ignored, they must be set with a
+    // RenderStateTracker before drawing. Only topologies of the class set in m_input_assembly can
+    // be used.
+    void enable_dynamic_render_state();
+    bool has_dynamic_render_state() const;
     VkPipeline build_pipeline(VkDevice device);
 };
 
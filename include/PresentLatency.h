@@ -0,0 +1,72 @@
+#ifndef VK_ENGINE_PRESENTLATENCY_H
+#define VK_ENGINE_PRESENTLATENCY_H
+
+#include <Profiler.h>
+
+#include <vulkan/vulkan.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+const char *present_mode_name(VkPresentModeKHR present_mode);
+
+// Measures how long it takes for the input sampled at the start of a frame to reach the screen.
+// The submit latency (input to vkQueuePresentKHR) is always available. The present latency
+// (input to the image actually being presented) needs VK_KHR_present_id and VK_KHR_present_wait,
+// a worker thread blocks in vkWaitForPresentKHR so the main thread never does.
+class PresentLatencyTracker {
+public:
+    void init(VkDevice device, bool present_wait_enabled);
+    void cleanup();
+
+    bool is_present_wait_enabled() const { return m_present_wait_enabled; }
+
+    // Steady clock, in microseconds
+    static uint64_t now_us();
+
+    // Call right after vkQueuePresentKHR with the id chained in VkPresentIdKHR (0 if none)
+    void on_present(VkSwapchainKHR swapchain, uint64_t present_id, uint64_t input_us);
+    // Id to chain in VkPresentIdKHR for the next present, ids must increase for a given swapchain
+    uint64_t next_present_id() { return ++m_last_present_id; }
+
+    // Must be called before destroying a swapchain, stops waiting on its presents
+    void forget_swapchain(VkSwapchainKHR swapchain);
+
+    // Thread safe copies of the stats, in ms
+    RollingStats input_to_submit_ms();
+    RollingStats input_to_present_ms();
+
+    // ImGui window, needs an ImGui frame to be started.
+    void draw_overlay(VkPresentModeKHR present_mode);
+
+private:
+    struct PendingPresent {
+        VkSwapchainKHR m_swapchain;
+        uint64_t m_present_id;
+        uint64_t m_input_us;
+    };
+
+    void worker();
+
+    VkDevice m_device = VK_NULL_HANDLE;
+    bool m_present_wait_enabled = false;
+    PFN_vkWaitForPresentKHR m_wait_for_present = nullptr;
+    uint64_t m_last_present_id = 0;
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<PendingPresent> m_pending;
+    RollingStats m_input_to_submit_ms;
+    RollingStats m_input_to_present_ms;
+
+    // Held by the worker while it waits on a swapchain, so it can't be destroyed under it
+    std::mutex m_swapchain_mutex;
+    std::atomic<bool> m_running = false;
+    std::thread m_thread;
+};
+
+#endif //VK_ENGINE_PRESENTLATENCY_H
@@ -0,0 +1,180 @@
+#ifndef VK_ENGINE_PROFILER_H
+#define VK_ENGINE_PROFILER_H
+
+#include <GpuTimeline.h>
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <deque>
+#include <vector>
+
+// Keeps the last N samples of a value (in ms) so we can show min/avg/p99 without
+// the numbers being dominated by startup frames.
+struct RollingStats {
+    std::vector<double> m_samples;
+    size_t m_head = 0;
+    size_t m_count = 0;
+
+    RollingStats();
+    explicit RollingStats(size_t capacity);
+
+    void push(double value);
+
+    double last() const;
+    double min() const;
+    double max() const;
+    double avg() const;
+    // p in [0, 1], ie 0.99 for p99
+    double percentile(double p) const;
+};
+
+struct ProfileEvent {
+    const char *name;
+    uint32_t thread_id;
+    uint32_t depth;
+    // Microseconds since the profiler was created
+    uint64_t start_us;
+    uint64_t duration_us;
+};
+
+class Profiler {
+public:
+    // GPU scopes are written as begin/end timestamp pairs, so a frame can hold
+    // MAX_GPU_SCOPES scopes per queue in a 2 * MAX_GPU_SCOPES query pool.
+    static constexpr uint32_t MAX_GPU_SCOPES = 64;
+    // Number of frames kept around for the chrome trace export.
+    static constexpr size_t TRACE_FRAME_COUNT = 120;
+    static constexpr uint32_t GPU_THREAD_ID = 0xFFFFFFFF;
+    static constexpr uint32_t GPU_COMPUTE_THREAD_ID = 0xFFFFFFFE;
+
+    bool m_enabled = true;
+
+    // Frame time stats, in ms
+    RollingStats m_cpu_frame_stats;
+    RollingStats m_gpu_frame_stats;
+    // Time each queue spent running scopes, and how much of it both queues did at once. Only the
+    // innermost scopes count, so nested ones aren't counted twice.
+    RollingStats m_gpu_queue_busy_stats[GPU_QUEUE_COUNT];
+    RollingStats m_gpu_overlap_stats;
+
+    // Per scope stats, keyed by scope name. GPU scopes are prefixed with "gpu:"
+    std::unordered_map<std::string, RollingStats> m_scope_stats;
+
+    // compute_queue_family is UINT32_MAX without an async compute queue. Both queues are assumed
+    // to share a timebase, which is the case for queues of the same device.
+    void init(VkDevice device, VkPhysicalDevice physical_device, uint32_t queue_family, uint32_t frames_in_flight,
+              uint32_t compute_queue_family = UINT32_MAX);
+    void cleanup();
+
+    // Must be called once the fence of frame_index has been waited on. Resolves the
+    // GPU queries written the last time this frame slot was used, and folds the
+    // CPU scopes of the previous frame into the stats.
+    void begin_frame(uint32_t frame_index);
+    void end_frame();
+
+    // Must be recorded before any GPU scope of that queue, outside of a render pass. The graphics
+    // one starts the frame, so it comes first.
+    void cmd_reset_queries(VkCommandBuffer cmd, GpuQueue queue = GpuQueue::Graphics);
+    // cmd must be submitted to queue
+    uint32_t cmd_begin_gpu_scope(VkCommandBuffer cmd, const char *name, GpuQueue queue = GpuQueue::Graphics);
+    void cmd_end_gpu_scope(VkCommandBuffer cmd, uint32_t scope);
+
+    // Thread safe, used by ProfileScope
+    void record_cpu_event(const ProfileEvent &event);
+    uint64_t now_us() const;
+
+    // Writes the last TRACE_FRAME_COUNT frames in the chrome://tracing / perfetto format
+    bool export_chrome_trace(const char *file_path);
+
+    bool gpu_timing_supported() const { return m_gpu_supported; }
+    bool gpu_timing_supported(GpuQueue queue) const { return m_queue_supported[(uint32_t) queue]; }
+
+    // ImGui window with frame and scope timings. Needs an ImGui frame to be started.
+    void draw_overlay();
+
+private:
+    struct GpuScope {
+        const char *name;
+        uint32_t depth;
+        GpuQueue queue;
+        // Its pair of queries in the pool of its queue
+        uint32_t query;
+    };
+
+    struct FrameSlot {
+        VkQueryPool m_query_pools[GPU_QUEUE_COUNT] = {};
+        // Scopes of both queues, in recording order
+        std::vector<GpuScope> m_scopes;
+        uint32_t m_query_counts[GPU_QUEUE_COUNT] = {};
+        bool m_reset[GPU_QUEUE_COUNT] = {};
+        uint64_t m_cpu_start_us = 0;
+        bool m_pending = false;
+    };
+
+    struct FrameTrace {
+        std::vector<ProfileEvent> m_events;
+    };
+
+    void resolve_gpu_slot(FrameSlot &slot);
+
+    VkDevice m_device = VK_NULL_HANDLE;
+    bool m_gpu_supported = false;
+    bool m_queue_supported[GPU_QUEUE_COUNT] = {};
+    // ns per timestamp tick
+    double m_timestamp_period = 1.0;
+    uint64_t m_timestamp_mask = ~0ull;
+
+    std::vector<FrameSlot> m_frame_slots;
+    uint32_t m_current_slot = 0;
+    uint32_t m_gpu_depth[GPU_QUEUE_COUNT] = {};
+
+    uint64_t m_frame_start_us = 0;
+    uint64_t m_origin_ns = 0;
+
+    std::mutex m_events_mutex;
+    std::vector<ProfileEvent> m_pending_events;
+
+    std::deque<FrameTrace> m_trace_frames;
+};
+
+// RAII CPU timer, can be nested and used from any thread.
+class ProfileScope {
+public:
+    ProfileScope(Profiler &profiler, const char *name);
+    ~ProfileScope();
+
+    ProfileScope(const ProfileScope &) = delete;
+    ProfileScope &operator=(const ProfileScope &) = delete;
+
+private:
+    Profiler &m_profiler;
+    const char *m_name;
+    uint64_t m_start_us;
+    uint32_t m_depth;
+};
+
+// RAII GPU timer, writes a timestamp pair around the commands recorded in its lifetime.
+class GpuProfileScope {
+public:
+    GpuProfileScope(Profiler &profiler, VkCommandBuffer cmd, const char *name);
+    ~GpuProfileScope();
+
+    GpuProfileScope(const GpuProfileScope &) = delete;
+    GpuProfileScope &operator=(const GpuProfileScope &) = delete;
+
+private:
+    Profiler &m_profiler;
+    VkCommandBuffer m_cmd;
+    uint32_t m_scope;
+};
+
+#define PROFILER_CONCAT_INNER(a, b) a##b
+#define PROFILER_CONCAT(a, b) PROFILER_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(profiler, name) ProfileScope PROFILER_CONCAT(profile_scope_, __LINE__)(profiler, name)
+#define PROFILE_GPU_SCOPE(profiler, cmd, name) GpuProfileScope PROFILER_CONCAT(gpu_profile_scope_, __LINE__)(profiler, cmd, name)
+
+#endif //VK_ENGINE_PROFILER_H
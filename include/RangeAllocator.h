@@ -0,0 +1,39 @@
+#ifndef VK_ENGINE_RANGEALLOCATOR_H
+#define VK_ENGINE_RANGEALLOCATOR_H
+
+#include <cstdint>
+#include <map>
+
+// Hands out [offset, offset + size) ranges of a fixed capacity, in arbitrary units
+// (vertices, indices...). Best fit over a free list, adjacent free ranges are merged back
+// on free. Doesn't touch any memory itself, so it can sub-allocate any kind of buffer.
+class RangeAllocator {
+public:
+    void init(uint32_t capacity);
+
+    // Returns false if no free range is large enough, even if the total free space is.
+    bool allocate(uint32_t size, uint32_t *out_offset);
+    void free(uint32_t offset, uint32_t size);
+
+    uint32_t capacity() const { return m_capacity; }
+    uint32_t used() const { return m_used; }
+    uint32_t largest_free_range() const;
+    uint32_t free_range_count() const { return (uint32_t) m_free_by_offset.size(); }
+
+    // 0 when all the free space is contiguous, close to 1 when it's split in tiny ranges
+    float fragmentation() const;
+
+private:
+    void insert_free(uint32_t offset, uint32_t size);
+    void erase_free(uint32_t offset, uint32_t size);
+
+    uint32_t m_capacity = 0;
+    uint32_t m_used = 0;
+
+    // offset -> size, used to find neighbours when merging
+    std::map<uint32_t, uint32_t> m_free_by_offset;
+    // size -> offset, used to find the best fit
+    std::multimap<uint32_t, uint32_t> m_free_by_size;
+};
+
+#endif //VK_ENGINE_RANGEALLOCATOR_H
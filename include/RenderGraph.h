@@ -0,0 +1,326 @@
+#ifndef VK_ENGINE_RENDERGRAPH_H
+#define VK_ENGINE_RENDERGRAPH_H
+
+#include <DeletionQueue.h>
+#include <GpuTimeline.h>
+#include <MemoryBudget.h>
+#include <Profiler.h>
+#include <VulkanHelpers.h>
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// How a pass touches a resource. The layout is ignored for buffers.
+struct RenderGraphAccess {
+    VkPipelineStageFlags2 m_stages = VK_PIPELINE_STAGE_2_NONE;
+    VkAccessFlags2 m_access = VK_ACCESS_2_NONE;
+    VkImageLayout m_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    bool operator==(const RenderGraphAccess &other) const = default;
+};
+
+// The usual ones. Attachments use the generic layout of synchronization2, like cmd_begin_rendering.
+constexpr RenderGraphAccess RG_COLOR_ATTACHMENT = {
+        VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+        VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+        VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL
+};
+constexpr RenderGraphAccess RG_DEPTH_ATTACHMENT = {
+        VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+        VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL
+};
+constexpr RenderGraphAccess RG_FRAGMENT_SAMPLED = {
+        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+        VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+};
+constexpr RenderGraphAccess RG_COMPUTE_SAMPLED = {
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+        VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+};
+constexpr RenderGraphAccess RG_COMPUTE_READ = {
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+        VK_ACCESS_2_SHADER_READ_BIT,
+        VK_IMAGE_LAYOUT_GENERAL
+};
+constexpr RenderGraphAccess RG_COMPUTE_WRITE = {
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+        VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT,
+        VK_IMAGE_LAYOUT_GENERAL
+};
+constexpr RenderGraphAccess RG_FRAGMENT_READ = {
+        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+        VK_ACCESS_2_SHADER_READ_BIT,
+        VK_IMAGE_LAYOUT_GENERAL
+};
+constexpr RenderGraphAccess RG_VERTEX_READ = {
+        VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT,
+        VK_ACCESS_2_SHADER_READ_BIT,
+        VK_IMAGE_LAYOUT_GENERAL
+};
+constexpr RenderGraphAccess RG_VERTEX_INPUT = {
+        VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT,
+        VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT,
+        VK_IMAGE_LAYOUT_UNDEFINED
+};
+constexpr RenderGraphAccess RG_INDIRECT_READ = {
+        VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT,
+        VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT,
+        VK_IMAGE_LAYOUT_UNDEFINED
+};
+
+// Image the graph creates, and places in memory shared with the transient images whose
+// lifetime doesn't overlap. Its content is undefined at its first use in the frame.
+struct RenderGraphImageDesc {
+    VkFormat m_format = VK_FORMAT_UNDEFINED;
+    VkExtent2D m_extent = {0, 0};
+    VkImageUsageFlags m_usage = 0;
+    VkImageAspectFlags m_aspect = VK_IMAGE_ASPECT_COLOR_BIT;
+    uint32_t m_layers = 1;
+    // Mip levels, each one also gets a view of its own (see level_view)
+    uint32_t m_levels = 1;
+
+    bool operator==(const RenderGraphImageDesc &other) const = default;
+};
+
+struct RenderGraphStats {
+    uint32_t m_passes = 0;
+    uint32_t m_culled_passes = 0;
+    // Passes that ran on the async compute queue, and the submissions the frame was split in
+    uint32_t m_compute_passes = 0;
+    uint32_t m_submissions = 0;
+    // vkCmdPipelineBarrier2 calls and the barriers in them
+    uint32_t m_barrier_batches = 0;
+    uint32_t m_barriers = 0;
+    // Images handed from one queue family to the other, release and acquire count as one
+    uint32_t m_queue_transfers = 0;
+    // Times the frame didn't match the last compiled one, since init
+    uint32_t m_compiles = 0;
+    // Memory of the transient images, and what it would be without aliasing
+    VkDeviceSize m_transient_bytes = 0;
+    VkDeviceSize m_transient_unaliased_bytes = 0;
+};
+
+// The frame is declared every frame: resources, then passes in execution order with the
+// resources they use. execute() culls the passes whose results nobody uses, places the
+// transient images, inserts the barriers between the passes and records them.
+//
+// Compiling only depends on the declaration, not on the imported handles, so it is cached and
+// redone only when the frame changes shape. Imported resources are the outputs of the frame,
+// passes writing them are never culled. Buffers are only used for ordering, their barriers
+// are global memory barriers.
+//
+// Passes can ask for the async compute queue. The frame is then split in submissions of
+// consecutive passes on the same queue, each waiting on the timeline of the other queue when it
+// uses something the other one touched, and images change queue family with release/acquire
+// barriers. Buffers used on both queues must be created with VK_SHARING_MODE_CONCURRENT, they
+// only get the semaphore. The last graphics submission waits on all the compute work, so the
+// value submit() returns covers the whole frame.
+class RenderGraph {
+public:
+    using Resource = uint32_t;
+    using Pass = uint32_t;
+    using RecordFunction = std::function<void(VkCommandBuffer cmd)>;
+
+    // The profiler is optional, every pass gets a GPU scope named after it. Transient images are
+    // retired through the deletion queue once the frames using them are done.
+    void init(VkDevice device, VmaAllocator allocator, MemoryBudget *memory_budget, GpuTimeline *timeline,
+              TimelineDeletionQueue *deletion_queue, Profiler *profiler);
+    // The GPU must be done with the transient images and the command buffers
+    void cleanup();
+
+    // Passes added for GpuQueue::Compute run on this timeline's queue. Without it they run on
+    // the graphics queue with the other passes.
+    void set_async_compute(GpuTimeline *compute_timeline);
+    bool async_compute_supported() const { return m_compute_timeline != nullptr; }
+
+    // Forgets the last declaration, keeps the compiled one around to compare with
+    void begin();
+
+    // initial is how the image was last used (or must be waited on, ie the swapchain acquire), an
+    // UNDEFINED layout discards its content. It is left as final, unless final has an UNDEFINED
+    // layout in which case it stays in the layout of its last use.
+    Resource import_image(const char *name, VkImage image, VkImageView view, VkImageAspectFlags aspect,
+                          const RenderGraphAccess &initial, const RenderGraphAccess &final = {});
+    // Stands for buffers owned elsewhere, the passes touching them get ordered and synchronized
+    Resource import_buffer(const char *name, const RenderGraphAccess &initial = {});
+    Resource create_image(const char *name, const RenderGraphImageDesc &desc);
+    // Internal ordering between passes, culled with them when nobody reads it
+    Resource create_buffer(const char *name);
+
+    // name must outlive the frame (a literal), it's used for the GPU scope
+    Pass add_pass(const char *name, RecordFunction &&record, GpuQueue queue = GpuQueue::Graphics);
+    // Reads and writes come from the access flags, in the layout of access
+    void use(Pass pass, Resource resource, const RenderGraphAccess &access);
+    // The submission of the first pass using resource waits on it, ie the swapchain acquire. The
+    // stage must be one of that queue, the first submission waits if no pass uses it.
+    void wait_before(Resource resource, const SemaphoreWait &wait);
+
+    // Compiles if the declaration changed, the transient images exist from then on. Only needed
+    // to point descriptors at them before recording, execute does it otherwise.
+    void prepare();
+    // Prepares if needed, then records the passes. cmd is a begun graphics command buffer and the
+    // first one of the frame, the others belong to the graph.
+    void execute(VkCommandBuffer cmd);
+    // The last graphics command buffer, where the frame ends. Can be recorded in until submit.
+    VkCommandBuffer last_command_buffer() const { return m_batch_commands[m_last_graphics_batch]; }
+    // Ends the command buffers and submits them in order, the last graphics submission signals
+    // binary_signals. Returns its value on the graphics timeline, the frame is done once reached.
+    uint64_t submit(const std::vector<VkSemaphore> &binary_signals = {});
+
+    // Valid in the record functions, and after prepare. Transient images only change when the
+    // declaration does.
+    VkImage image(Resource resource) const;
+    VkImageView view(Resource resource) const;
+    // Single level of a transient image, the whole view when it only has one
+    VkImageView level_view(Resource resource, uint32_t level) const;
+
+    const RenderGraphStats &stats() const { return m_stats; }
+
+private:
+    enum class ResourceKind : uint32_t {
+        ImportedImage,
+        ImportedBuffer,
+        TransientImage,
+        TransientBuffer
+    };
+
+    // Part of a resource that the compile depends on
+    struct ResourceDesc {
+        std::string m_name;
+        ResourceKind m_kind;
+        VkImageAspectFlags m_aspect = 0;
+        RenderGraphAccess m_initial;
+        RenderGraphAccess m_final;
+        RenderGraphImageDesc m_image;
+
+        bool operator==(const ResourceDesc &other) const = default;
+    };
+
+    struct ResourceUse {
+        Resource m_resource;
+        RenderGraphAccess m_access;
+
+        bool operator==(const ResourceUse &other) const = default;
+    };
+
+    struct PassDesc {
+        std::string m_name;
+        std::vector<ResourceUse> m_uses;
+        // Where it runs, graphics when async compute isn't there
+        GpuQueue m_queue = GpuQueue::Graphics;
+
+        bool operator==(const PassDesc &other) const = default;
+    };
+
+    struct Declaration {
+        std::vector<ResourceDesc> m_resources;
+        std::vector<PassDesc> m_passes;
+
+        bool operator==(const Declaration &other) const = default;
+    };
+
+    // Handles are filled at execute, only the resource is known when compiling
+    struct Barrier {
+        Resource m_resource;
+        VkPipelineStageFlags2 m_src_stages;
+        VkAccessFlags2 m_src_access;
+        VkPipelineStageFlags2 m_dst_stages;
+        VkAccessFlags2 m_dst_access;
+        VkImageLayout m_old_layout;
+        VkImageLayout m_new_layout;
+        // Release or acquire of a queue family ownership transfer, between these queues
+        bool m_transfer = false;
+        GpuQueue m_src_queue = GpuQueue::Graphics;
+        GpuQueue m_dst_queue = GpuQueue::Graphics;
+    };
+
+    // Consecutive passes of the frame on one queue, submitted together
+    struct Batch {
+        GpuQueue m_queue;
+        std::vector<Pass> m_passes;
+        // Batch of the other queue to wait on, NO_BATCH if none
+        uint32_t m_wait;
+        // Ownership given to the other queue, after the passes
+        std::vector<Barrier> m_releases;
+    };
+
+    // Command buffer of the graph, free again once its submission is done
+    struct CommandBuffer {
+        VkCommandBuffer m_cmd;
+        uint64_t m_retire_value;
+    };
+
+    struct TransientImage {
+        VkImage m_image = VK_NULL_HANDLE;
+        VkImageView m_view = VK_NULL_HANDLE;
+        // Only with more than one level
+        std::vector<VkImageView> m_level_views;
+        // Index into m_transient_memory
+        uint32_t m_memory = 0;
+        VkDeviceSize m_offset = 0;
+        VkDeviceSize m_size = 0;
+    };
+
+    void compile();
+    void allocate_transients(const std::vector<uint32_t> &first_use, const std::vector<uint32_t> &last_use);
+    void retire_transients();
+    void destroy_transient(const TransientImage &transient);
+    void record_barriers(VkCommandBuffer cmd, const std::vector<Barrier> &barriers);
+    GpuTimeline *timeline(GpuQueue queue) const;
+    VkCommandBuffer begin_command_buffer(GpuQueue queue, uint32_t &index);
+
+    VkDevice m_device = VK_NULL_HANDLE;
+    VmaAllocator m_allocator = VK_NULL_HANDLE;
+    MemoryBudget *m_memory_budget = nullptr;
+    GpuTimeline *m_timeline = nullptr;
+    GpuTimeline *m_compute_timeline = nullptr;
+    TimelineDeletionQueue *m_deletion_queue = nullptr;
+    Profiler *m_profiler = nullptr;
+
+    // This frame
+    Declaration m_declaration;
+    std::vector<const char *> m_pass_names;
+    std::vector<RecordFunction> m_records;
+    std::vector<VkImage> m_imported_images;
+    std::vector<VkImageView> m_imported_views;
+    std::vector<std::pair<Resource, SemaphoreWait>> m_waits;
+
+    // Last compile, m_prepared once it matches this frame's declaration
+    Declaration m_compiled;
+    bool m_has_compiled = false;
+    bool m_prepared = false;
+    std::vector<bool> m_pass_alive;
+    // Before each pass, and after the last one
+    std::vector<std::vector<Barrier>> m_pass_barriers;
+    std::vector<Barrier> m_final_barriers;
+    // Batch 0 is graphics, in the caller's command buffer. The final barriers go at the end of
+    // the last graphics one.
+    std::vector<Batch> m_batches;
+    uint32_t m_last_graphics_batch = 0;
+    // Indexed by resource, NO_BATCH for the unused ones
+    std::vector<uint32_t> m_first_batch;
+    // Indexed by resource, only set for the transient images
+    std::vector<TransientImage> m_transients;
+    std::vector<VmaAllocation> m_transient_memory;
+
+    VkCommandPool m_command_pools[GPU_QUEUE_COUNT] = {};
+    std::vector<CommandBuffer> m_command_buffers[GPU_QUEUE_COUNT];
+    // This frame, per batch. Pooled ones are indices into m_command_buffers, UINT32_MAX for cmd.
+    std::vector<VkCommandBuffer> m_batch_commands = {VK_NULL_HANDLE};
+    std::vector<uint32_t> m_batch_command_indices;
+
+    RenderGraphStats m_stats;
+    // Built at execute, kept to avoid reallocating
+    std::vector<VkImageMemoryBarrier2> m_image_barriers;
+};
+
+#endif //VK_ENGINE_RENDERGRAPH_H
@@ -16,7 +16,23 @@ struct RenderObject {
     Material *m_material;
 
     glm::mat4 m_transform_matrix;
+
+    // Multiplied with the vertex color
+    glm::vec4 m_color = {1.f, 1.f, 1.f, 1.f};
+    // Free for the shaders to use, carried to the instance data as is
+    uint32_t m_flags = 0;
+    // Moves on its own, only casts into the shadow cascades rendered every frame
+    bool m_dynamic = false;
+};
+
+// One entry of the per-frame instance buffer, std430 layout (see base_trimesh_instanced.vert)
+struct InstanceData {
+    glm::mat4 m_model_matrix;
+    glm::vec4 m_color;
+    uint32_t m_flags;
+    uint32_t m_padding[3];
 };
+static_assert(sizeof(InstanceData) == 96, "InstanceData must match the std430 layout of the shaders");
 
 
 #endif //VK_ENGINE_RENDEROBJECT_H
@@ -0,0 +1,56 @@
+#ifndef VK_ENGINE_RENDERSTATE_H
+#define VK_ENGINE_RENDERSTATE_H
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <optional>
+
+// Fixed function state set at record time on pipelines built with
+// PipelineBuilder::enable_dynamic_render_state, so materials differing only by these
+// share a pipeline. All of it is core in Vulkan 1.3 (extended dynamic state 1 and 2).
+struct RenderState {
+    VkCullModeFlags m_cull_mode = VK_CULL_MODE_NONE;
+    VkFrontFace m_front_face = VK_FRONT_FACE_CLOCKWISE;
+    VkPrimitiveTopology m_topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    bool m_depth_test = true;
+    bool m_depth_write = true;
+    VkCompareOp m_depth_compare_op = VK_COMPARE_OP_LESS_OR_EQUAL;
+
+    bool operator==(const RenderState &other) const = default;
+};
+
+// Remembers the dynamic state set in a command buffer and skips the vkCmdSet* calls that
+// wouldn't change anything.
+class RenderStateTracker {
+public:
+    // Forgets everything, call when starting a command buffer. Binding a pipeline with the same
+    // state baked in also makes it undefined, use invalidate_render_state then.
+    void reset();
+    void invalidate_render_state();
+
+    void set_viewport(VkCommandBuffer cmd, const VkViewport &viewport);
+    void set_scissor(VkCommandBuffer cmd, const VkRect2D &scissor);
+    void apply(VkCommandBuffer cmd, const RenderState &state);
+
+    // vkCmdSet* calls made and skipped since the last reset_counters
+    uint32_t m_calls = 0;
+    uint32_t m_skipped = 0;
+    void reset_counters();
+
+private:
+    // Returns true if the call is needed
+    template<typename T>
+    bool update(std::optional<T> &current, const T &value);
+
+    std::optional<VkViewport> m_viewport;
+    std::optional<VkRect2D> m_scissor;
+    std::optional<VkCullModeFlags> m_cull_mode;
+    std::optional<VkFrontFace> m_front_face;
+    std::optional<VkPrimitiveTopology> m_topology;
+    std::optional<bool> m_depth_test;
+    std::optional<bool> m_depth_write;
+    std::optional<VkCompareOp> m_depth_compare_op;
+};
+
+#endif //VK_ENGINE_RENDERSTATE_H
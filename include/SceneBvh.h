@@ -0,0 +1,149 @@
+#ifndef VK_ENGINE_SCENEBVH_H
+#define VK_ENGINE_SCENEBVH_H
+
+#include <glm/glm.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+struct Aabb {
+    glm::vec3 m_min = {0.f, 0.f, 0.f};
+    glm::vec3 m_max = {0.f, 0.f, 0.f};
+
+    static Aabb from_sphere(const glm::vec4 &sphere) {
+        glm::vec3 center = glm::vec3(sphere);
+        return {center - sphere.w, center + sphere.w};
+    }
+
+    bool operator==(const Aabb &other) const = default;
+};
+
+// Planes pointing inwards, normalized
+struct Frustum {
+    glm::vec4 m_planes[6];
+
+    // Clip volume of a Vulkan view-projection (0 <= z <= w), perspective or orthographic
+    static Frustum from_matrix(const glm::mat4 &view_projection);
+};
+
+struct BvhRayHit {
+    uint32_t m_object = UINT32_MAX;
+    // Along the ray direction, where it enters the bounds of the object
+    float m_distance = 0.f;
+};
+
+struct BvhStats {
+    uint32_t m_objects = 0;
+    uint32_t m_nodes = 0;
+    uint32_t m_depth = 0;
+    // Surface area heuristic of the tree, relative to the one it had when it was built. Refits
+    // make it grow, a rebuild brings it back to 1.
+    float m_cost_ratio = 1.f;
+    uint32_t m_builds = 0;
+    uint32_t m_async_builds = 0;
+    float m_last_build_ms = 0.f;
+};
+
+// Bounding volume hierarchy over object bounds, objects being the indices of the bounds given to
+// build. Built top down with the binned surface area heuristic.
+//
+// Moving objects refit the tree: their leaf and its parents grow or shrink in place, which is
+// cheap but makes the tree worse over time. Once it costs more than m_rebuild_threshold times
+// what it did when built, start_rebuild builds a new one on a worker thread from a copy of the
+// bounds. The current tree keeps answering queries meanwhile, and poll_rebuild swaps the new one
+// in and refits the objects that moved since the copy.
+//
+// Adding or removing objects needs a build. Queries append the objects to out, in no particular
+// order.
+class SceneBvh {
+public:
+    // Cost ratio where needs_rebuild becomes true
+    float m_rebuild_threshold = 1.3f;
+
+    ~SceneBvh();
+
+    // Synchronous, waits for a running rebuild and drops it
+    void build(const std::vector<Aabb> &bounds);
+    void clear();
+
+    uint32_t object_count() const { return (uint32_t) m_object_bounds.size(); }
+    const Aabb &object_bounds(uint32_t object) const { return m_object_bounds[object]; }
+
+    // Queued, applied by refit
+    void update(uint32_t object, const Aabb &bounds);
+    void refit();
+
+    bool needs_rebuild() const;
+    // No-op while one is running
+    void start_rebuild();
+    bool is_rebuilding() const { return m_rebuild_thread.joinable(); }
+    // Swaps in the tree built by the worker if it is done, true if it did
+    bool poll_rebuild();
+
+    // Objects inside or intersecting. Subtrees entirely inside are taken without testing them.
+    void query_frustum(const Frustum &frustum, std::vector<uint32_t> &out) const;
+    void query_sphere(const glm::vec3 &center, float radius, std::vector<uint32_t> &out) const;
+    void query_aabb(const Aabb &box, std::vector<uint32_t> &out) const;
+    // Closest object whose bounds the ray enters before max_distance. The direction doesn't have
+    // to be normalized, distances are in its units.
+    bool raycast(const glm::vec3 &origin, const glm::vec3 &direction, float max_distance, BvhRayHit &hit) const;
+
+    BvhStats stats() const;
+
+private:
+    // Children of internal nodes: the left one follows its parent, m_right is the right one.
+    // Objects of a subtree are contiguous in m_objects, so whole subtrees can be appended.
+    struct Node {
+        glm::vec3 m_min;
+        uint32_t m_first;
+        glm::vec3 m_max;
+        uint32_t m_count;
+        // 0 for leaves, the root can't be a child
+        uint32_t m_right;
+        uint32_t m_parent;
+    };
+
+    struct Tree {
+        std::vector<Node> m_nodes;
+        // Object indices, in leaf order
+        std::vector<uint32_t> m_objects;
+        // Leaf of every object
+        std::vector<uint32_t> m_object_leaves;
+        uint32_t m_depth = 0;
+        // Surface area of every node times its cost, summed. Normalized by the root area it is
+        // the SAH cost of the tree.
+        double m_area_cost = 0.0;
+        double m_built_cost = 0.0;
+    };
+
+    static void build_tree(const std::vector<Aabb> &bounds, Tree &tree);
+    static uint32_t build_node(const std::vector<Aabb> &bounds, const std::vector<glm::vec3> &centroids, Tree &tree,
+                               uint32_t first, uint32_t count, uint32_t parent, uint32_t depth);
+    static double tree_cost(const Tree &tree, double area_cost);
+
+    // Recomputes a node from its children or objects, true if its bounds changed
+    bool refit_node(uint32_t node);
+    // Every object under node, without testing them
+    void append_subtree(uint32_t node, std::vector<uint32_t> &out) const;
+
+    std::vector<Aabb> m_object_bounds;
+    Tree m_tree;
+    std::vector<uint32_t> m_dirty_leaves;
+    std::vector<uint8_t> m_leaf_dirty;
+
+    // Worker rebuild, the objects moved since it copied the bounds are refit after the swap
+    std::thread m_rebuild_thread;
+    std::atomic<bool> m_rebuild_done = false;
+    std::vector<Aabb> m_rebuild_bounds;
+    Tree m_rebuild_tree;
+    float m_rebuild_ms = 0.f;
+    std::vector<uint32_t> m_moved_while_rebuilding;
+
+    uint32_t m_builds = 0;
+    uint32_t m_async_builds = 0;
+    float m_last_build_ms = 0.f;
+};
+
+#endif //VK_ENGINE_SCENEBVH_H
@@ -0,0 +1,108 @@
+#ifndef VK_ENGINE_SCENEFILE_H
+#define VK_ENGINE_SCENEFILE_H
+
+#include <MappedFile.h>
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// "VKSC" read as a little endian uint32_t
+constexpr uint32_t SCENE_FILE_MAGIC = 0x43534B56;
+// Files of any other version are refused
+constexpr uint32_t SCENE_FILE_VERSION = 1;
+// Of every section, so the records can be read in place from the mapping
+constexpr uint64_t SCENE_FILE_ALIGNMENT = 16;
+
+// m_count records starting m_offset bytes into the file
+struct SceneFileSection {
+    uint64_t m_offset;
+    uint64_t m_count;
+};
+
+struct SceneFileHeader {
+    uint32_t m_magic;
+    uint32_t m_version;
+    // SceneFileObject
+    SceneFileSection m_objects;
+    // SceneFileString, what the objects reference by index
+    SceneFileSection m_meshes;
+    SceneFileSection m_materials;
+    // chars, the names point into it
+    SceneFileSection m_strings;
+};
+
+struct SceneFileString {
+    uint32_t m_offset;
+    uint32_t m_size;
+};
+
+// A RenderObject with its mesh and material as indices, and its bounds so the BVH is built
+// without touching the meshes
+struct SceneFileObject {
+    // World space, the hierarchy is already applied
+    glm::mat4 m_transform;
+    glm::vec4 m_color;
+    // World space bounding sphere
+    glm::vec4 m_bounds;
+    uint32_t m_flags;
+    uint32_t m_mesh;
+    uint32_t m_material;
+    // UINT32_MAX for roots, parents come before their children
+    uint32_t m_parent;
+    uint32_t m_dynamic;
+    uint32_t m_padding[3];
+};
+static_assert(sizeof(SceneFileHeader) == 72, "SceneFileHeader must match the file layout");
+static_assert(sizeof(SceneFileObject) == 128, "SceneFileObject must match the file layout");
+static_assert(std::is_trivially_copyable_v<SceneFileObject>, "SceneFileObject is read in place");
+
+// Of the last Engine::load_scene, times in ms
+struct SceneLoadStats {
+    uint32_t m_objects = 0;
+    uint64_t m_bytes = 0;
+    double m_map_ms = 0.0;
+    // Names resolved, and the objects copied with their indices turned into pointers
+    double m_fixup_ms = 0.0;
+    double m_bvh_ms = 0.0;
+};
+
+// Binary scene container, little endian whatever the platform writing it. The file is mapped and
+// the records are read where they are, loading only resolves the mesh and material names once
+// and goes through the objects once (see Engine::load_scene).
+class SceneFile {
+public:
+    // Maps the file and checks the header and the section bounds. The objects' indices are
+    // checked by whoever reads them.
+    bool open(const char *filename);
+    void close() { m_file.close(); m_header = nullptr; }
+
+    uint64_t size() const { return m_file.size(); }
+
+    uint32_t object_count() const { return (uint32_t) m_header->m_objects.m_count; }
+    const SceneFileObject *objects() const { return section<SceneFileObject>(m_header->m_objects); }
+
+    uint32_t mesh_count() const { return (uint32_t) m_header->m_meshes.m_count; }
+    std::string_view mesh_name(uint32_t mesh) const;
+    uint32_t material_count() const { return (uint32_t) m_header->m_materials.m_count; }
+    std::string_view material_name(uint32_t material) const;
+
+    static bool write(const char *filename, const std::vector<SceneFileObject> &objects,
+                      const std::vector<std::string> &meshes, const std::vector<std::string> &materials);
+
+private:
+    template<typename T>
+    const T *section(const SceneFileSection &section) const {
+        return (const T *) (m_file.data() + section.m_offset);
+    }
+    std::string_view name(const SceneFileSection &names, uint32_t index) const;
+
+    MappedFile m_file;
+    const SceneFileHeader *m_header = nullptr;
+};
+
+#endif //VK_ENGINE_SCENEFILE_H
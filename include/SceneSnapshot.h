@@ -0,0 +1,83 @@
+#ifndef VK_ENGINE_SCENESNAPSHOT_H
+#define VK_ENGINE_SCENESNAPSHOT_H
+
+#include <CascadedShadows.h>
+#include <ClusteredLighting.h>
+#include <ParticleSystem.h>
+#include <RenderObject.h>
+#include <SkinningSystem.h>
+
+#include <glm/glm.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Single producer, single consumer handoff of the latest value, without locks. The producer
+// fills back() and publishes it, which swaps it with the middle slot. The consumer's acquire
+// swaps its front slot with the middle one when something was published since. Neither side
+// ever waits, values published while the consumer was busy are skipped.
+template<typename T>
+class TripleBuffer {
+public:
+    // Producer side, holds whatever was there before, write all of it
+    T &back() { return m_slots[m_back]; }
+    void publish() {
+        // Release the writes to the slot, acquire the reads the consumer did of the one we get
+        uint32_t middle = m_middle.exchange(m_back | FRESH_BIT, std::memory_order_acq_rel);
+        m_back = middle & INDEX_MASK;
+    }
+
+    // Consumer side, true when front() changed
+    bool acquire() {
+        if ((m_middle.load(std::memory_order_relaxed) & FRESH_BIT) == 0) {
+            return false;
+        }
+        uint32_t middle = m_middle.exchange(m_front, std::memory_order_acq_rel);
+        m_front = middle & INDEX_MASK;
+        return true;
+    }
+    const T &front() const { return m_slots[m_front]; }
+
+private:
+    static constexpr uint32_t INDEX_MASK = 3;
+    // Set in m_middle when it holds a value the consumer hasn't seen
+    static constexpr uint32_t FRESH_BIT = 4;
+
+    T m_slots[3];
+    // Only touched by their side
+    uint32_t m_back = 0;
+    uint32_t m_front = 2;
+    alignas(64) std::atomic<uint32_t> m_middle = 1;
+};
+
+// What the simulation writes and draw reads, see Engine::m_simulate. Meshes and materials are
+// created before Engine::run, the renderables only point to them.
+struct SceneState {
+    glm::vec3 m_camera_position = {0.f, 0.f, -2.f};
+    std::vector<RenderObject> m_renderables;
+    std::vector<PointLight> m_lights;
+    std::vector<ParticleEmitter> m_particle_emitters;
+    // Created with Engine::create_skinned_instance, the simulation writes the joints
+    std::vector<SkinnedInstance> m_skinned_instances;
+    DirectionalLight m_sun;
+    // Bumped by the simulation when objects that aren't marked dynamic were added, removed or
+    // moved, the cached shadow cascades are rendered again
+    uint32_t m_static_version = 0;
+};
+
+// The last two simulation steps, drawn somewhere between them
+struct SceneSnapshot {
+    SceneState m_previous;
+    SceneState m_current;
+    uint64_t m_step = 0;
+    // When m_current was published, and when the input it saw was polled
+    uint64_t m_published_us = 0;
+    uint64_t m_input_us = 0;
+
+    // alpha 0 is m_previous and 1 m_current. Only the camera, the transforms and the joints move
+    // in between, and only when both steps have the same objects. The rest is m_current.
+    void interpolate(float alpha, SceneState *out_state) const;
+};
+
+#endif //VK_ENGINE_SCENESNAPSHOT_H
@@ -0,0 +1,42 @@
+#ifndef VK_ENGINE_SHADERHOTRELOAD_H
+#define VK_ENGINE_SHADERHOTRELOAD_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Watches the GLSL sources with inotify and recompiles the ones that change with glslangValidator,
+// on a background thread. The main thread picks up the freshly written .spv names with
+// poll_compiled at a frame boundary and rebuilds what uses them.
+// Only available on Linux, init returns false anywhere else.
+class ShaderHotReload {
+public:
+    // The .spv files are written to output_dir, named like the Shaders target names them
+    // (ie base_trimesh.vert.spv).
+    bool init(const std::string &source_dir, const std::string &output_dir, const std::string &compiler);
+    void cleanup();
+
+    bool is_running() const { return m_running; }
+
+    // Names of the .spv files recompiled since the last call
+    std::vector<std::string> poll_compiled();
+
+private:
+    void worker();
+    bool compile(const std::string &file_name);
+
+    std::string m_source_dir;
+    std::string m_output_dir;
+    std::string m_compiler;
+
+    int m_inotify_fd = -1;
+    std::atomic<bool> m_running = false;
+    std::thread m_thread;
+
+    std::mutex m_mutex;
+    std::vector<std::string> m_compiled;
+};
+
+#endif //VK_ENGINE_SHADERHOTRELOAD_H
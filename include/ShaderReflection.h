@@ -0,0 +1,45 @@
+#ifndef VK_ENGINE_SHADERREFLECTION_H
+#define VK_ENGINE_SHADERREFLECTION_H
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <vector>
+
+struct ReflectedBinding {
+    uint32_t m_set;
+    VkDescriptorSetLayoutBinding m_binding;
+};
+
+struct ReflectedVertexInput {
+    uint32_t m_location;
+    VkFormat m_format;
+};
+
+// What a SPIR-V module declares: descriptors, push constants and, for vertex shaders, the
+// inputs read from the vertex buffers. Only the subset of SPIR-V glslangValidator emits for
+// our shaders is understood, that's enough to avoid pulling in a reflection library.
+struct ShaderReflection {
+    VkShaderStageFlagBits m_stage;
+    std::vector<ReflectedBinding> m_bindings;
+    // Size 0 when the module has no push constant block
+    VkPushConstantRange m_push_constants = {0, 0, 0};
+    std::vector<ReflectedVertexInput> m_vertex_inputs;
+};
+
+// Returns false if the code isn't SPIR-V or uses something we can't reflect.
+bool reflect_spirv(const std::vector<uint32_t> &code, ShaderReflection *out_reflection);
+
+// Every stage of a pipeline merged together, what its layout needs to provide
+struct PipelineReflection {
+    // Indexed by set, bindings sorted. Sets the shaders skip are empty.
+    std::vector<std::vector<VkDescriptorSetLayoutBinding>> m_sets;
+    // All the stages share one range, so pushing everything at once stays valid
+    VkPushConstantRange m_push_constants = {0, 0, 0};
+    std::vector<ReflectedVertexInput> m_vertex_inputs;
+
+    // False if a binding is declared with a different type in another stage
+    bool add_stage(const ShaderReflection &stage);
+};
+
+#endif //VK_ENGINE_SHADERREFLECTION_H
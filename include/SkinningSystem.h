@@ -0,0 +1,128 @@
+#ifndef VK_ENGINE_SKINNINGSYSTEM_H
+#define VK_ENGINE_SKINNINGSYSTEM_H
+
+#include <GeometryBuffer.h>
+#include <LayoutCache.h>
+#include <MemoryBudget.h>
+#include <Mesh.h>
+#include <OcclusionCuller.h>
+#include <VulkanHelpers.h>
+
+#include <vulkan/vulkan.h>
+#include <vk_mem_alloc.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+// Skins past this can't be added, each one has a descriptor set per frame
+constexpr uint32_t MAX_SKINS = 256;
+
+// Read as 14 words by skinning.comp
+static_assert(sizeof(SkinnedVertex) == 56, "SkinnedVertex must match the layout skinning.comp reads");
+
+// Bind pose of an animated mesh, uploaded once with Engine::upload_skinned_mesh and shared by
+// every instance of it
+struct SkinnedMesh {
+    std::vector<SkinnedVertex> m_vertices;
+    // Relative to the first vertex, like Mesh
+    std::vector<uint32_t> m_indices;
+    uint32_t m_joint_count = 0;
+    // How far the animation can take a vertex out of the bounding sphere of the bind pose. The
+    // instances are culled with the bind pose bounds grown by it.
+    float m_bounds_margin = 0.f;
+    // Set by Engine::upload_skinned_mesh
+    uint32_t m_skin_handle = UINT32_MAX;
+};
+
+// One animated copy of a skinned mesh, see Engine::create_skinned_instance. m_mesh is a regular
+// mesh whose vertices are written by the skinning every frame, drawn like any other.
+struct SkinnedInstance {
+    uint32_t m_skin = UINT32_MAX;
+    Mesh *m_mesh = nullptr;
+    // Model space, joint transform times inverse bind matrix. Written by the application, read
+    // every frame. Its size is the skin's joint count.
+    std::vector<glm::mat4> m_joints;
+};
+
+// Vertex skinning on compute. Every frame the joint palettes of the instances are written to a
+// per frame storage buffer, then one dispatch per instance reads the bind pose of its skin and
+// writes the skinned positions and normals as plain Vertex into the instance's range of the
+// geometry buffer. The shadow, prepass and main passes then draw the instances with the usual
+// mesh pipelines, they never see a joint.
+class SkinningSystem {
+public:
+    // Takes ownership of the pipeline, its layout comes from layout_cache
+    void init(VkDevice device, VmaAllocator allocator, MemoryBudget *memory_budget, LayoutCache *layout_cache,
+              uint32_t frame_count, const ComputeProgram &program);
+    void cleanup();
+
+    // Hot reload, for a pipeline made from the same shader with the same layout. The old one is
+    // the caller's to destroy once the GPU is done with it.
+    void replace_pipeline(VkPipeline old_pipeline, VkPipeline new_pipeline);
+
+    // A device local buffer for the bind pose, filled by the caller before the first frame
+    // using it. Returns UINT32_MAX once MAX_SKINS is reached.
+    uint32_t add_skin(uint32_t vertex_count, uint32_t joint_count);
+    VkBuffer skin_buffer(uint32_t skin) const { return m_skins[skin].m_buffer.m_buffer; }
+    uint32_t skin_vertex_count(uint32_t skin) const { return m_skins[skin].m_vertex_count; }
+    uint32_t skin_joint_count(uint32_t skin) const { return m_skins[skin].m_joint_count; }
+
+    // The frame slot must be done on the GPU. Writes the palettes and prepares a dispatch per
+    // instance, the ranges are read from geometry so it must be after any upload or repack of
+    // the frame. Returns the vertices that will be skinned.
+    uint32_t update(uint32_t frame, const std::vector<SkinnedInstance> &instances, const GeometryBuffer &geometry);
+    bool has_work(uint32_t frame) const { return !m_frames[frame].m_dispatches.empty(); }
+    // Writes the vertex buffer of geometry, the draws need a barrier after it
+    void cmd_skin(VkCommandBuffer cmd, uint32_t frame) const;
+
+private:
+    // Matches the push constants of skinning.comp
+    struct SkinConstants {
+        uint32_t m_vertex_count;
+        // In the geometry buffer, and in the frame's palettes
+        uint32_t m_first_output_vertex;
+        uint32_t m_first_joint;
+    };
+
+    struct Dispatch {
+        uint32_t m_skin;
+        SkinConstants m_constants;
+    };
+
+    struct Skin {
+        AllocatedBuffer m_buffer;
+        uint32_t m_vertex_count;
+        uint32_t m_joint_count;
+    };
+
+    struct FrameResources {
+        AllocatedBuffer m_joints = {};
+        glm::mat4 *m_mapped_joints = nullptr;
+        uint32_t m_joint_capacity = 0;
+        // One per skin, written again when the joints or the vertex buffer they point to change
+        std::vector<VkDescriptorSet> m_descriptors;
+        VkBuffer m_written_vertex_buffer = VK_NULL_HANDLE;
+        VkBuffer m_written_joints = VK_NULL_HANDLE;
+        uint32_t m_written_skins = 0;
+        std::vector<Dispatch> m_dispatches;
+    };
+
+    AllocatedBuffer create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VmaMemoryUsage memory_usage,
+                                  MemoryCategory category, void **out_mapped);
+    void destroy_buffer(const AllocatedBuffer &buffer);
+    void reserve_joints(FrameResources &frame, uint32_t joint_count);
+    void write_descriptor(VkDescriptorSet set, const FrameResources &frame, const Skin &skin, VkBuffer vertex_buffer);
+
+    VkDevice m_device = VK_NULL_HANDLE;
+    VmaAllocator m_allocator = VK_NULL_HANDLE;
+    MemoryBudget *m_memory_budget = nullptr;
+
+    ComputeProgram m_program;
+    VkDescriptorPool m_descriptor_pool = VK_NULL_HANDLE;
+
+    std::vector<Skin> m_skins;
+    std::vector<FrameResources> m_frames;
+};
+
+#endif //VK_ENGINE_SKINNINGSYSTEM_H
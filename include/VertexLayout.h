@@ -0,0 +1,183 @@
+#ifndef VK_ENGINE_VERTEXLAYOUT_H
+#define VK_ENGINE_VERTEXLAYOUT_H
+
+#include <vulkan/vulkan.h>
+#include <glm/glm.hpp>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Guaranteed minimum of maxVertexInputAttributes, locations also fit in a 32 bit mask
+constexpr uint32_t MAX_VERTEX_ATTRIBUTES = 16;
+
+struct VertexAttribute {
+    uint32_t m_location;
+    VkFormat m_format;
+    uint32_t m_offset;
+    // Of the member, the format must fit in it
+    uint32_t m_size;
+};
+
+// Format of a member when none is given. Other types (packed, normalized) need one.
+template<typename T>
+struct VertexFormatOf;
+template<> struct VertexFormatOf<float> { static constexpr VkFormat FORMAT = VK_FORMAT_R32_SFLOAT; };
+template<> struct VertexFormatOf<glm::vec2> { static constexpr VkFormat FORMAT = VK_FORMAT_R32G32_SFLOAT; };
+template<> struct VertexFormatOf<glm::vec3> { static constexpr VkFormat FORMAT = VK_FORMAT_R32G32B32_SFLOAT; };
+template<> struct VertexFormatOf<glm::vec4> { static constexpr VkFormat FORMAT = VK_FORMAT_R32G32B32A32_SFLOAT; };
+template<> struct VertexFormatOf<uint32_t> { static constexpr VkFormat FORMAT = VK_FORMAT_R32_UINT; };
+template<> struct VertexFormatOf<glm::uvec4> { static constexpr VkFormat FORMAT = VK_FORMAT_R32G32B32A32_UINT; };
+template<> struct VertexFormatOf<glm::ivec4> { static constexpr VkFormat FORMAT = VK_FORMAT_R32G32B32A32_SINT; };
+
+// To list in a static constexpr attributes() function of the vertex struct, where offsetof works
+#define VERTEX_ATTRIBUTE(vertex, member, location) \
+    VertexAttribute{location, VertexFormatOf<decltype(vertex::member)>::FORMAT, offsetof(vertex, member), \
+                    sizeof(vertex::member)}
+#define VERTEX_ATTRIBUTE_FORMAT(vertex, member, location, format) \
+    VertexAttribute{location, format, offsetof(vertex, member), sizeof(vertex::member)}
+
+enum class VertexNumericType {
+    Unknown,
+    Float,
+    Uint,
+    Sint
+};
+
+// Only the formats vertices use, 0 for the others
+constexpr uint32_t vertex_format_size(VkFormat format) {
+    switch (format) {
+        case VK_FORMAT_R32_SFLOAT:
+        case VK_FORMAT_R32_UINT:
+        case VK_FORMAT_R32_SINT:
+        case VK_FORMAT_R8G8B8A8_UNORM:
+        case VK_FORMAT_R8G8B8A8_SNORM:
+        case VK_FORMAT_R8G8B8A8_UINT:
+        case VK_FORMAT_R16G16_SFLOAT:
+        case VK_FORMAT_R16G16_UNORM:
+        case VK_FORMAT_R16G16_SNORM:
+        case VK_FORMAT_A2B10G10R10_UNORM_PACK32:
+        case VK_FORMAT_A2B10G10R10_SNORM_PACK32:
+            return 4;
+        case VK_FORMAT_R32G32_SFLOAT:
+        case VK_FORMAT_R16G16B16A16_SFLOAT:
+        case VK_FORMAT_R16G16B16A16_UNORM:
+        case VK_FORMAT_R16G16B16A16_SNORM:
+        case VK_FORMAT_R16G16B16A16_UINT:
+            return 8;
+        case VK_FORMAT_R32G32B32_SFLOAT:
+            return 12;
+        case VK_FORMAT_R32G32B32A32_SFLOAT:
+        case VK_FORMAT_R32G32B32A32_UINT:
+        case VK_FORMAT_R32G32B32A32_SINT:
+            return 16;
+        default:
+            return 0;
+    }
+}
+
+// What the shader sees, normalized formats read as floats
+constexpr VertexNumericType vertex_format_numeric_type(VkFormat format) {
+    switch (format) {
+        case VK_FORMAT_R32_UINT:
+        case VK_FORMAT_R8G8B8A8_UINT:
+        case VK_FORMAT_R16G16B16A16_UINT:
+        case VK_FORMAT_R32G32B32A32_UINT:
+            return VertexNumericType::Uint;
+        case VK_FORMAT_R32_SINT:
+        case VK_FORMAT_R32G32B32A32_SINT:
+            return VertexNumericType::Sint;
+        default:
+            return vertex_format_size(format) == 0 ? VertexNumericType::Unknown : VertexNumericType::Float;
+    }
+}
+
+// What a vertex shader reads, with the 32 bit format of its GLSL type like ShaderReflection gives
+struct VertexShaderInput {
+    uint32_t m_location;
+    VkFormat m_format;
+};
+
+// Binding 0 for vertex type V, from V::attributes(), with everything checked at compile time. The
+// arrays have static storage, PipelineBuilder only points at them.
+template<typename V>
+struct VertexLayout {
+    static constexpr auto SOURCE = V::attributes();
+
+    static constexpr bool locations_valid() {
+        for (size_t i = 0; i < SOURCE.size(); i++) {
+            if (SOURCE[i].m_location >= 32) {
+                return false;
+            }
+            for (size_t j = i + 1; j < SOURCE.size(); j++) {
+                if (SOURCE[i].m_location == SOURCE[j].m_location) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    static constexpr bool formats_known() {
+        for (const VertexAttribute &attribute: SOURCE) {
+            if (vertex_format_size(attribute.m_format) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static constexpr bool formats_fit() {
+        for (const VertexAttribute &attribute: SOURCE) {
+            if (vertex_format_size(attribute.m_format) > attribute.m_size ||
+                attribute.m_offset + attribute.m_size > sizeof(V)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static_assert(SOURCE.size() > 0 && SOURCE.size() <= MAX_VERTEX_ATTRIBUTES, "Too many vertex attributes");
+    static_assert(locations_valid(), "Vertex attribute locations must be unique and below 32");
+    static_assert(formats_known(), "Vertex attribute format isn't in vertex_format_size");
+    static_assert(formats_fit(), "Vertex attribute format is bigger than its member");
+
+    static constexpr std::array<VkVertexInputBindingDescription, 1> BINDINGS = {{{
+            .binding = 0,
+            .stride = sizeof(V),
+            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
+    }}};
+
+    static constexpr std::array<VkVertexInputAttributeDescription, SOURCE.size()> ATTRIBUTES = []() {
+        std::array<VkVertexInputAttributeDescription, SOURCE.size()> attributes = {};
+        for (size_t i = 0; i < SOURCE.size(); i++) {
+            attributes[i] = {
+                    .location = SOURCE[i].m_location,
+                    .binding = 0,
+                    .format = SOURCE[i].m_format,
+                    .offset = SOURCE[i].m_offset
+            };
+        }
+        return attributes;
+    }();
+
+    // True if every input the shader reads is there with the same numeric type. It can read fewer
+    // components than the format has, the others are dropped.
+    template<size_t N>
+    static constexpr bool provides(const std::array<VertexShaderInput, N> &inputs) {
+        for (const VertexShaderInput &input: inputs) {
+            bool found = false;
+            for (const VertexAttribute &attribute: SOURCE) {
+                found = found || (attribute.m_location == input.m_location &&
+                                  vertex_format_numeric_type(attribute.m_format) ==
+                                  vertex_format_numeric_type(input.m_format));
+            }
+            if (!found) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif //VK_ENGINE_VERTEXLAYOUT_H
@@ -6,15 +6,22 @@ layout (location = 2) in vec3 vColor;
 
 layout (location = 0) out vec3 outColor;
 
+layout (set = 0, binding = 0) uniform CameraBuffer
+{
+    mat4 view;
+    mat4 projection;
+    mat4 view_projection;
+} camera;
+
 //push constants block
 layout( push_constant ) uniform constants
 {
     vec4 data;
-    mat4 render_matrix;
+    mat4 model_matrix;
 } PushConstants;
 
 void main()
 {
-    gl_Position = PushConstants.render_matrix * vec4(vPosition, 1.0f);
-    outColor = vColor;
+    gl_Position = camera.view_projection * PushConstants.model_matrix * vec4(vPosition, 1.0f);
+    outColor = vColor * PushConstants.data.rgb;
 }
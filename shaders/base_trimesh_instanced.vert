@@ -0,0 +1,36 @@
+#version 450
+
+layout (location = 0) in vec3 vPosition;
+layout (location = 1) in vec3 vNormal;
+layout (location = 2) in vec3 vColor;
+
+layout (location = 0) out vec3 outColor;
+
+layout (set = 0, binding = 0) uniform CameraBuffer
+{
+    mat4 view;
+    mat4 projection;
+    mat4 view_projection;
+} camera;
+
+// Matches InstanceData in RenderObject.h
+struct InstanceData
+{
+    mat4 model_matrix;
+    vec4 color;
+    uint flags;
+};
+
+layout (std430, set = 0, binding = 1) readonly buffer InstanceBuffer
+{
+    InstanceData instances[];
+} instance_buffer;
+
+void main()
+{
+    // gl_InstanceIndex already includes firstInstance, the batch offset in the buffer
+    InstanceData instance = instance_buffer.instances[gl_InstanceIndex];
+
+    gl_Position = camera.view_projection * instance.model_matrix * vec4(vPosition, 1.0f);
+    outColor = vColor * instance.color.rgb;
+}
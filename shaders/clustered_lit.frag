@@ -0,0 +1,132 @@
+#version 450
+
+// Matches ClusteredLighting.h
+#define TILES_X 16
+#define TILES_Y 9
+#define SLICES 24
+
+#define AMBIENT 0.05f
+
+// Matches CascadedShadows.h
+#define MAX_CASCADES 4
+
+layout (location = 0) in vec3 inColor;
+layout (location = 1) in vec3 inWorldPosition;
+layout (location = 2) in vec3 inNormal;
+
+layout (location = 0) out vec4 outFragColor;
+
+// Matches PointLight in ClusteredLighting.h
+struct PointLight
+{
+    vec3 position;
+    float radius;
+    vec3 color;
+    float intensity;
+};
+
+// Set 1 is ClusteredLighting::set_layout
+layout (set = 1, binding = 0) uniform ClusterData
+{
+    mat4 view;
+    mat4 inverse_projection;
+    vec2 screen_size;
+    float z_near;
+    float z_far;
+    float slice_scale;
+    float slice_bias;
+    uint light_count;
+} cluster_data;
+
+layout (std430, set = 1, binding = 1) readonly buffer Lights
+{
+    PointLight lights[];
+};
+
+layout (std430, set = 1, binding = 2) readonly buffer Clusters
+{
+    uvec2 clusters[];
+};
+
+layout (std430, set = 1, binding = 3) readonly buffer LightIndices
+{
+    uint light_indices[];
+};
+
+// Set 2 is CascadedShadows::set_layout
+layout (set = 2, binding = 0) uniform ShadowData
+{
+    mat4 light_view_projection[MAX_CASCADES];
+    vec4 split_depths;
+    // xyz towards the light, w intensity
+    vec4 light_direction;
+    vec4 light_color;
+    uint cascade_count;
+} shadow_data;
+
+layout (set = 2, binding = 1) uniform sampler2DArrayShadow shadow_map;
+
+// 1 when lit, 0 in the shadow of the directional light
+float directional_shadow(float depth, vec3 normal)
+{
+    uint cascade = 0;
+    while (cascade < shadow_data.cascade_count && depth > shadow_data.split_depths[cascade]) {
+        cascade++;
+    }
+    if (cascade >= shadow_data.cascade_count) {
+        return 1.0f;
+    }
+
+    // Pushed along the normal by about a texel. The light view is a rotation, so the first row of
+    // the matrix is 1 / half size of the cascade.
+    mat4 light_view_projection = shadow_data.light_view_projection[cascade];
+    vec2 texel_size = 1.0f / vec2(textureSize(shadow_map, 0).xy);
+    float half_size = 1.0f / length(vec3(light_view_projection[0][0], light_view_projection[1][0],
+                                         light_view_projection[2][0]));
+    vec3 offset_position = inWorldPosition + normal * (2.0f * half_size * texel_size.x * 1.5f);
+    vec4 light_position = light_view_projection * vec4(offset_position, 1.0f);
+    vec2 uv = light_position.xy * 0.5f + 0.5f;
+
+    // 3x3 PCF on top of the bilinear compare
+    float lit = 0.0f;
+    for (int y = -1; y <= 1; y++) {
+        for (int x = -1; x <= 1; x++) {
+            lit += texture(shadow_map, vec4(uv + vec2(x, y) * texel_size, float(cascade), light_position.z));
+        }
+    }
+    return lit / 9.0f;
+}
+
+void main()
+{
+    // Same froxel as light_cluster.comp, tile from the pixel and slice from the view depth
+    float depth = -(cluster_data.view * vec4(inWorldPosition, 1.0f)).z;
+    uvec2 tile = min(uvec2(gl_FragCoord.xy / cluster_data.screen_size * vec2(TILES_X, TILES_Y)),
+                     uvec2(TILES_X - 1, TILES_Y - 1));
+    uint slice = uint(clamp(log(depth) * cluster_data.slice_scale + cluster_data.slice_bias, 0.0f, float(SLICES - 1)));
+    uvec2 cluster = clusters[tile.x + tile.y * TILES_X + slice * TILES_X * TILES_Y];
+
+    vec3 normal = normalize(inNormal);
+    vec3 lighting = vec3(AMBIENT);
+    for (uint i = 0; i < cluster.y; i++) {
+        PointLight light = lights[light_indices[cluster.x + i]];
+
+        vec3 to_light = light.position - inWorldPosition;
+        float distance_squared = dot(to_light, to_light);
+        float radius_squared = light.radius * light.radius;
+        if (distance_squared < radius_squared) {
+            // Smooth falloff reaching 0 at the radius
+            float falloff = 1.0f - distance_squared / radius_squared;
+            float lambert = max(dot(normal, to_light * inversesqrt(distance_squared)), 0.0f);
+            lighting += light.color * (light.intensity * lambert * falloff * falloff);
+        }
+    }
+
+    if (shadow_data.light_direction.w > 0.0f) {
+        float lambert = max(dot(normal, shadow_data.light_direction.xyz), 0.0f);
+        float shadow = lambert > 0.0f ? directional_shadow(depth, normal) : 0.0f;
+        lighting += shadow_data.light_color.rgb * (shadow_data.light_direction.w * lambert * shadow);
+    }
+
+    outFragColor = vec4(inColor * lighting, 1.0f);
+}
@@ -0,0 +1,11 @@
+#version 450
+
+// 0 to 1 over the screen
+layout (location = 0) out vec2 outUV;
+
+// One triangle covering the screen, no vertex buffer
+void main()
+{
+    outUV = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+    gl_Position = vec4(outUV * 2.0 - 1.0, 0.0, 1.0);
+}
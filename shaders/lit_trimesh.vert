@@ -0,0 +1,33 @@
+#version 450
+
+layout (location = 0) in vec3 vPosition;
+layout (location = 1) in vec3 vNormal;
+layout (location = 2) in vec3 vColor;
+
+layout (location = 0) out vec3 outColor;
+layout (location = 1) out vec3 outWorldPosition;
+layout (location = 2) out vec3 outNormal;
+
+layout (set = 0, binding = 0) uniform CameraBuffer
+{
+    mat4 view;
+    mat4 projection;
+    mat4 view_projection;
+} camera;
+
+//push constants block
+layout( push_constant ) uniform constants
+{
+    vec4 data;
+    mat4 model_matrix;
+} PushConstants;
+
+void main()
+{
+    vec4 world_position = PushConstants.model_matrix * vec4(vPosition, 1.0f);
+    gl_Position = camera.view_projection * world_position;
+    outColor = vColor * PushConstants.data.rgb;
+    outWorldPosition = world_position.xyz;
+    // Fine as long as the scale is uniform
+    outNormal = mat3(PushConstants.model_matrix) * vNormal;
+}
@@ -0,0 +1,42 @@
+#version 450
+
+layout (location = 0) in vec3 vPosition;
+layout (location = 1) in vec3 vNormal;
+layout (location = 2) in vec3 vColor;
+
+layout (location = 0) out vec3 outColor;
+layout (location = 1) out vec3 outWorldPosition;
+layout (location = 2) out vec3 outNormal;
+
+layout (set = 0, binding = 0) uniform CameraBuffer
+{
+    mat4 view;
+    mat4 projection;
+    mat4 view_projection;
+} camera;
+
+// Matches InstanceData in RenderObject.h
+struct InstanceData
+{
+    mat4 model_matrix;
+    vec4 color;
+    uint flags;
+};
+
+layout (std430, set = 0, binding = 1) readonly buffer InstanceBuffer
+{
+    InstanceData instances[];
+} instance_buffer;
+
+void main()
+{
+    InstanceData instance = instance_buffer.instances[gl_InstanceIndex];
+
+    // Same position as base_trimesh_instanced.vert, the depth prepass relies on it
+    vec4 world_position = instance.model_matrix * vec4(vPosition, 1.0f);
+    gl_Position = camera.view_projection * world_position;
+    outColor = vColor * instance.color.rgb;
+    outWorldPosition = world_position.xyz;
+    // Fine as long as the scale is uniform
+    outNormal = mat3(instance.model_matrix) * vNormal;
+}
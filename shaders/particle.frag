@@ -0,0 +1,16 @@
+#version 450
+
+layout (location = 0) in vec4 inColor;
+layout (location = 1) in vec2 inCorner;
+
+layout (location = 0) out vec4 outFragColor;
+
+void main()
+{
+    // Round, fading out towards the edge
+    float alpha = 1.0 - smoothstep(0.5, 1.0, length(inCorner));
+    if (alpha <= 0.0) {
+        discard;
+    }
+    outFragColor = vec4(inColor.rgb, inColor.a * alpha);
+}
@@ -0,0 +1,59 @@
+#version 450
+
+layout (location = 0) out vec4 outColor;
+// -1 to 1 over the quad
+layout (location = 1) out vec2 outCorner;
+
+// Matches the one in particle_emit.comp
+struct Particle
+{
+    vec3 position;
+    float age;
+    vec3 velocity;
+    float lifetime;
+    vec3 acceleration;
+    float drag;
+    uint start_color;
+    uint end_color;
+    float start_size;
+    float end_size;
+};
+
+layout (set = 0, binding = 0) uniform CameraBuffer
+{
+    mat4 view;
+    mat4 projection;
+    mat4 view_projection;
+} camera;
+
+// Set 1 is ParticleSystem::set_layout
+layout (std430, set = 1, binding = 0) readonly buffer Particles
+{
+    Particle particles[];
+};
+
+// Back to front, one instance each
+layout (std430, set = 1, binding = 1) readonly buffer Sorted
+{
+    uint sorted[];
+};
+
+const vec2 corners[6] = vec2[](
+    vec2(-1.0, -1.0), vec2(1.0, -1.0), vec2(1.0, 1.0),
+    vec2(-1.0, -1.0), vec2(1.0, 1.0), vec2(-1.0, 1.0)
+);
+
+void main()
+{
+    Particle particle = particles[sorted[gl_InstanceIndex]];
+    float t = clamp(particle.age / particle.lifetime, 0.0, 1.0);
+    vec2 corner = corners[gl_VertexIndex];
+
+    // Facing the camera, the quad is offset in view space
+    vec4 view_position = camera.view * vec4(particle.position, 1.0);
+    view_position.xy += corner * mix(particle.start_size, particle.end_size, t);
+    gl_Position = camera.projection * view_position;
+
+    outColor = mix(unpackUnorm4x8(particle.start_color), unpackUnorm4x8(particle.end_color), t);
+    outCorner = corner;
+}
@@ -0,0 +1,28 @@
+#version 450
+
+layout (location = 0) in vec3 vPosition;
+
+// Matches InstanceData in RenderObject.h
+struct InstanceData
+{
+    mat4 model_matrix;
+    vec4 color;
+    uint flags;
+};
+
+layout (std430, set = 0, binding = 1) readonly buffer InstanceBuffer
+{
+    InstanceData instances[];
+} instance_buffer;
+
+// Light view-projection of the cascade being rendered
+layout( push_constant ) uniform constants
+{
+    mat4 view_projection;
+} PushConstants;
+
+void main()
+{
+    InstanceData instance = instance_buffer.instances[gl_InstanceIndex];
+    gl_Position = PushConstants.view_projection * instance.model_matrix * vec4(vPosition, 1.0f);
+}
@@ -0,0 +1,45 @@
+#version 450
+
+layout (location = 0) in vec2 inUV;
+
+layout (location = 0) out vec4 outFragColor;
+
+// Set 1 is DynamicResolution::set_layout, only the top left part of it was rendered
+layout (set = 1, binding = 0) uniform sampler2D sceneColor;
+
+// Matches DynamicResolution::UpscaleConstants
+layout (push_constant) uniform Constants
+{
+    vec2 uv_scale;
+    vec2 texel_size;
+    float sharpness;
+} constants;
+
+// Clamped half a texel inside the rendered part, bilinear would blend in what's past it
+vec4 fetch(vec2 uv)
+{
+    vec2 half_texel = constants.texel_size * 0.5;
+    return texture(sceneColor, clamp(uv, half_texel, constants.uv_scale - half_texel));
+}
+
+void main()
+{
+    vec2 uv = inUV * constants.uv_scale;
+    vec4 center = fetch(uv);
+    if (constants.sharpness <= 0.0) {
+        outFragColor = center;
+        return;
+    }
+
+    // Unsharp mask over the 4 neighbours of the source, clamped to their range so edges
+    // don't ring
+    vec4 left = fetch(uv - vec2(constants.texel_size.x, 0.0));
+    vec4 right = fetch(uv + vec2(constants.texel_size.x, 0.0));
+    vec4 up = fetch(uv - vec2(0.0, constants.texel_size.y));
+    vec4 down = fetch(uv + vec2(0.0, constants.texel_size.y));
+
+    vec4 low = min(center, min(min(left, right), min(up, down)));
+    vec4 high = max(center, max(max(left, right), max(up, down)));
+    vec4 blurred = (left + right + up + down) * 0.25;
+    outFragColor = clamp(center + (center - blurred) * constants.sharpness, low, high);
+}
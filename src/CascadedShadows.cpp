@@ -0,0 +1,303 @@
+#include "CascadedShadows.h"
+
+#include <Initializers.h>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+void CascadedShadows::init(VkDevice device, VmaAllocator allocator, MemoryBudget *memory_budget,
+                           LayoutCache *layout_cache, uint32_t frame_count, const ShadowSettings &settings) {
+    m_device = device;
+    m_allocator = allocator;
+    m_memory_budget = memory_budget;
+    m_settings = settings;
+    m_cascade_count = std::clamp(settings.m_cascade_count, 2u, MAX_SHADOW_CASCADES);
+    m_first_cached_cascade = std::min(settings.m_first_cached_cascade, m_cascade_count - 1);
+
+    // Same bindings as the ones reflected from the lit fragment shaders
+    m_set_layout = layout_cache->get_set_layout({
+            Initializers::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+                                                       VK_SHADER_STAGE_FRAGMENT_BIT, 0),
+            Initializers::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                                                       VK_SHADER_STAGE_FRAGMENT_BIT, 1)
+    });
+
+    VkImageCreateInfo image_info = Initializers::image_create_info(SHADOW_MAP_FORMAT,
+                                                                   VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                                                                   VK_IMAGE_USAGE_SAMPLED_BIT,
+                                                                   {settings.m_resolution, settings.m_resolution, 1});
+    image_info.arrayLayers = m_cascade_count;
+
+    VmaAllocationCreateInfo image_allocinfo = {};
+    image_allocinfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+    image_allocinfo.requiredFlags = VkMemoryPropertyFlags(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    VK_CHECK(vmaCreateImage(m_allocator, &image_info, &image_allocinfo, &m_image.m_image, &m_image.m_allocation,
+                            nullptr))
+    m_memory_budget->track(m_image.m_allocation, MemoryCategory::RenderTarget);
+
+    // Sampled as an array, rendered one layer at a time
+    VkImageViewCreateInfo view_info = Initializers::imageview_create_info(SHADOW_MAP_FORMAT, m_image.m_image,
+                                                                          VK_IMAGE_ASPECT_DEPTH_BIT);
+    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+    view_info.subresourceRange.layerCount = m_cascade_count;
+    VK_CHECK(vkCreateImageView(m_device, &view_info, nullptr, &m_view))
+
+    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    view_info.subresourceRange.layerCount = 1;
+    for (uint32_t cascade = 0; cascade < m_cascade_count; cascade++) {
+        view_info.subresourceRange.baseArrayLayer = cascade;
+        VK_CHECK(vkCreateImageView(m_device, &view_info, nullptr, &m_layer_views[cascade]))
+    }
+
+    // Hardware compare with bilinear filtering, outside the cascades nothing is shadowed
+    VkSamplerCreateInfo sampler_info = {
+            .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .magFilter = VK_FILTER_LINEAR,
+            .minFilter = VK_FILTER_LINEAR,
+            .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+            .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+            .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+            .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .compareEnable = VK_TRUE,
+            .compareOp = VK_COMPARE_OP_LESS_OR_EQUAL,
+            .minLod = 0.f,
+            .maxLod = 0.f,
+            .borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE
+    };
+    VK_CHECK(vkCreateSampler(m_device, &sampler_info, nullptr, &m_sampler))
+
+    VkDescriptorPoolSize pool_sizes[] = {
+            {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, frame_count},
+            {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, frame_count}
+    };
+    VkDescriptorPoolCreateInfo pool_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .maxSets = frame_count,
+            .poolSizeCount = 2,
+            .pPoolSizes = pool_sizes
+    };
+    VK_CHECK(vkCreateDescriptorPool(m_device, &pool_info, nullptr, &m_descriptor_pool))
+
+    m_data_buffers.resize(frame_count);
+    m_mapped_data.resize(frame_count);
+    m_descriptors.resize(frame_count);
+    for (uint32_t frame = 0; frame < frame_count; frame++) {
+        VkBufferCreateInfo buffer_info = {
+                .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                .size = sizeof(ShadowData),
+                .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT
+        };
+        VmaAllocationCreateInfo vma_alloc_info = {};
+        vma_alloc_info.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+        vma_alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+        VmaAllocationInfo allocation_info;
+        VK_CHECK(vmaCreateBuffer(m_allocator, &buffer_info, &vma_alloc_info, &m_data_buffers[frame].m_buffer,
+                                 &m_data_buffers[frame].m_allocation, &allocation_info))
+        m_memory_budget->track(m_data_buffers[frame].m_allocation, MemoryCategory::PerFrame);
+        m_mapped_data[frame] = (ShadowData *) allocation_info.pMappedData;
+        *m_mapped_data[frame] = {};
+
+        VkDescriptorSetAllocateInfo allocate_info = {
+                .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+                .pNext = nullptr,
+                .descriptorPool = m_descriptor_pool,
+                .descriptorSetCount = 1,
+                .pSetLayouts = &m_set_layout
+        };
+        VK_CHECK(vkAllocateDescriptorSets(m_device, &allocate_info, &m_descriptors[frame]))
+
+        VkDescriptorBufferInfo data_info = {m_data_buffers[frame].m_buffer, 0, sizeof(ShadowData)};
+        VkDescriptorImageInfo map_info = {
+                .sampler = m_sampler,
+                .imageView = m_view,
+                .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+        };
+        VkWriteDescriptorSet writes[] = {
+                Initializers::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, m_descriptors[frame],
+                                                      &data_info, 0),
+                Initializers::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, m_descriptors[frame],
+                                                     &map_info, 1)
+        };
+        vkUpdateDescriptorSets(m_device, 2, writes, 0, nullptr);
+    }
+}
+
+void CascadedShadows::cleanup() {
+    for (AllocatedBuffer &buffer: m_data_buffers) {
+        m_memory_budget->untrack(buffer.m_allocation);
+        vmaDestroyBuffer(m_allocator, buffer.m_buffer, buffer.m_allocation);
+    }
+    m_data_buffers.clear();
+    m_mapped_data.clear();
+    m_descriptors.clear();
+    vkDestroyDescriptorPool(m_device, m_descriptor_pool, nullptr);
+
+    vkDestroySampler(m_device, m_sampler, nullptr);
+    for (uint32_t cascade = 0; cascade < m_cascade_count; cascade++) {
+        vkDestroyImageView(m_device, m_layer_views[cascade], nullptr);
+    }
+    vkDestroyImageView(m_device, m_view, nullptr);
+    m_memory_budget->untrack(m_image.m_allocation);
+    vmaDestroyImage(m_allocator, m_image.m_image, m_image.m_allocation);
+    m_image = {};
+}
+
+void CascadedShadows::update(uint32_t frame, bool enabled, const DirectionalLight &light, const glm::mat4 &view,
+                             float fov_y, float aspect, float z_near) {
+    for (Cascade &cascade: m_cascades) {
+        cascade.m_needs_render = false;
+    }
+
+    glm::vec3 direction = glm::normalize(light.m_direction);
+    if (direction != m_light_direction) {
+        // Light space is only rotated, the cascades are snapped in it
+        glm::vec3 up = std::abs(direction.y) > 0.99f ? glm::vec3(0.f, 0.f, 1.f) : glm::vec3(0.f, 1.f, 0.f);
+        m_light_view = glm::lookAt(glm::vec3(0.f), direction, up);
+        m_light_direction = direction;
+        for (Cascade &cascade: m_cascades) {
+            cascade.m_valid = false;
+        }
+    }
+    if (m_static_dirty) {
+        for (uint32_t i = m_first_cached_cascade; i < m_cascade_count; i++) {
+            m_cascades[i].m_valid = false;
+        }
+        m_static_dirty = false;
+    }
+
+    // Between logarithmic splits, which keep the texel density even in view, and uniform ones
+    float z_far = std::max(m_settings.m_max_distance, z_near * 2.f);
+    float splits[MAX_SHADOW_CASCADES + 1] = {z_near};
+    for (uint32_t i = 1; i <= m_cascade_count; i++) {
+        float t = (float) i / (float) m_cascade_count;
+        float logarithmic = z_near * std::pow(z_far / z_near, t);
+        float uniform = z_near + (z_far - z_near) * t;
+        splits[i] = m_settings.m_split_lambda * logarithmic + (1.f - m_settings.m_split_lambda) * uniform;
+    }
+
+    glm::mat4 inverse_view = glm::inverse(view);
+    float tan_y = std::tan(fov_y * 0.5f);
+    float tan_x = tan_y * aspect;
+    float corner_scale = tan_x * tan_x + tan_y * tan_y;
+
+    if (enabled) {
+        for (uint32_t i = 0; i < m_cascade_count; i++) {
+            // Smallest sphere around the slice, centered on the view axis. It only depends on the
+            // splits and the projection, so its size doesn't change when the camera turns.
+            float near = splits[i];
+            float far = splits[i + 1];
+            float center_depth = ((far * far * (1.f + corner_scale)) - (near * near * (1.f + corner_scale))) /
+                                 (2.f * (far - near));
+            center_depth = std::clamp(center_depth, near, far);
+            float radius = std::sqrt((far - center_depth) * (far - center_depth) + far * far * corner_scale);
+            // Rounded so floating point noise doesn't change the texel size
+            radius = std::ceil(radius * 16.f) / 16.f;
+            glm::vec3 center = glm::vec3(inverse_view * glm::vec4(0.f, 0.f, -center_depth, 1.f));
+
+            Cascade &cascade = m_cascades[i];
+            if (!is_cached(i)) {
+                fit_cascade(cascade, center, radius);
+                cascade.m_needs_render = true;
+                continue;
+            }
+
+            // Kept as long as the slice is inside what was rendered
+            glm::vec3 light_center = glm::vec3(m_light_view * glm::vec4(center, 1.f));
+            float depth = -light_center.z;
+            bool inside = cascade.m_valid &&
+                          std::abs(light_center.x - cascade.m_center.x) + radius <= cascade.m_radius &&
+                          std::abs(light_center.y - cascade.m_center.y) + radius <= cascade.m_radius &&
+                          depth - radius - m_settings.m_caster_distance >= cascade.m_near &&
+                          depth + radius <= cascade.m_far;
+            if (!inside) {
+                fit_cascade(cascade, center, radius * m_settings.m_cached_padding);
+                cascade.m_valid = true;
+                cascade.m_needs_render = true;
+            }
+        }
+    }
+
+    ShadowData &data = *m_mapped_data[frame];
+    for (uint32_t i = 0; i < m_cascade_count; i++) {
+        data.m_light_view_projection[i] = m_cascades[i].m_view_projection;
+        data.m_split_depths[(int) i] = splits[i + 1];
+    }
+    data.m_light_direction = glm::vec4(-direction, light.m_intensity);
+    data.m_light_color = glm::vec4(light.m_color, 0.f);
+    data.m_cascade_count = enabled ? m_cascade_count : 0;
+    vmaFlushAllocation(m_allocator, m_data_buffers[frame].m_allocation, 0, VK_WHOLE_SIZE);
+}
+
+void CascadedShadows::fit_cascade(Cascade &cascade, const glm::vec3 &center, float radius) const {
+    glm::vec3 light_center = glm::vec3(m_light_view * glm::vec4(center, 1.f));
+
+    // Moves by whole texels only, so the rasterized edges stay put
+    float texel_size = 2.f * radius / (float) m_settings.m_resolution;
+    cascade.m_center = glm::floor(glm::vec2(light_center) / texel_size) * texel_size;
+    cascade.m_radius = radius;
+    // Casters between the light and the cascade still cast into it
+    cascade.m_near = -light_center.z - radius - m_settings.m_caster_distance;
+    cascade.m_far = -light_center.z + radius;
+
+    glm::mat4 projection = glm::orthoRH_ZO(cascade.m_center.x - radius, cascade.m_center.x + radius,
+                                           cascade.m_center.y - radius, cascade.m_center.y + radius,
+                                           cascade.m_near, cascade.m_far);
+    cascade.m_view_projection = projection * m_light_view;
+}
+
+bool CascadedShadows::casts_into(uint32_t cascade, const glm::vec4 &sphere) const {
+    const Cascade &fit = m_cascades[cascade];
+    glm::vec3 center = glm::vec3(m_light_view * glm::vec4(glm::vec3(sphere), 1.f));
+    float depth = -center.z;
+    return std::abs(center.x - fit.m_center.x) <= fit.m_radius + sphere.w &&
+           std::abs(center.y - fit.m_center.y) <= fit.m_radius + sphere.w &&
+           depth + sphere.w >= fit.m_near && depth - sphere.w <= fit.m_far;
+}
+
+void CascadedShadows::cmd_begin_cascade(VkCommandBuffer cmd, uint32_t cascade) const {
+    const VkRenderingAttachmentInfo depth_attachment_info{
+            .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR,
+            .imageView = m_layer_views[cascade],
+            .imageLayout = VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+            .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+            .clearValue = VkClearValue{
+                    .depthStencil = {1, 0}
+            },
+    };
+
+    VkExtent2D extent = {m_settings.m_resolution, m_settings.m_resolution};
+    const VkRenderingInfo render_info{
+            .sType = VK_STRUCTURE_TYPE_RENDERING_INFO_KHR,
+            .renderArea = {0, 0, extent},
+            .layerCount = 1,
+            .colorAttachmentCount = 0,
+            .pColorAttachments = nullptr,
+            .pDepthAttachment = &depth_attachment_info
+    };
+    vkCmdBeginRendering(cmd, &render_info);
+
+    VkViewport viewport = {
+            .x = 0.0f,
+            .y = 0.0f,
+            .width = (float) extent.width,
+            .height = (float) extent.height,
+            .minDepth = 0.0f,
+            .maxDepth = 1.0f
+    };
+    VkRect2D scissor = {{0, 0}, extent};
+    vkCmdSetViewport(cmd, 0, 1, &viewport);
+    vkCmdSetScissor(cmd, 0, 1, &scissor);
+}
+
+void CascadedShadows::cmd_bind(VkCommandBuffer cmd, VkPipelineLayout layout, uint32_t frame) const {
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 2, 1, &m_descriptors[frame], 0, nullptr);
+}
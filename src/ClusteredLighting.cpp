@@ -0,0 +1,252 @@
+#include "ClusteredLighting.h"
+
+#include <Initializers.h>
+
+#include <algorithm>
+#include <cmath>
+
+// Matches the local size of light_cluster.comp, one cluster per invocation
+constexpr uint32_t CLUSTER_GROUP_SIZE = 64;
+
+void ClusteredLighting::init(VkDevice device, VmaAllocator allocator, MemoryBudget *memory_budget,
+                             LayoutCache *layout_cache, uint32_t frame_count, const ComputeProgram &cluster,
+                             const std::vector<uint32_t> &queue_families) {
+    m_device = device;
+    m_allocator = allocator;
+    m_memory_budget = memory_budget;
+    m_queue_families = queue_families;
+    m_cluster = cluster;
+    m_frames.resize(frame_count);
+
+    // Same bindings as the ones reflected from the lit fragment shaders, so the cache hands out
+    // the layout their pipelines were derived with
+    m_set_layout = layout_cache->get_set_layout({
+            Initializers::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+                                                       VK_SHADER_STAGE_FRAGMENT_BIT, 0),
+            Initializers::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                                       VK_SHADER_STAGE_FRAGMENT_BIT, 1),
+            Initializers::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                                       VK_SHADER_STAGE_FRAGMENT_BIT, 2),
+            Initializers::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                                       VK_SHADER_STAGE_FRAGMENT_BIT, 3)
+    });
+
+    // Binning and shading sets of every frame
+    std::vector<VkDescriptorPoolSize> pool_sizes = {
+            {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2 * frame_count},
+            {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 7 * frame_count}
+    };
+    VkDescriptorPoolCreateInfo pool_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .maxSets = 2 * frame_count,
+            .poolSizeCount = (uint32_t) pool_sizes.size(),
+            .pPoolSizes = pool_sizes.data()
+    };
+    VK_CHECK(vkCreateDescriptorPool(m_device, &pool_info, nullptr, &m_descriptor_pool))
+
+    for (FrameResources &frame: m_frames) {
+        VkDescriptorSetLayout layouts[] = {m_cluster.m_set_layout, m_set_layout};
+        VkDescriptorSet sets[2];
+        VkDescriptorSetAllocateInfo allocate_info = {
+                .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+                .pNext = nullptr,
+                .descriptorPool = m_descriptor_pool,
+                .descriptorSetCount = 2,
+                .pSetLayouts = layouts
+        };
+        VK_CHECK(vkAllocateDescriptorSets(m_device, &allocate_info, sets))
+        frame.m_cluster_descriptor = sets[0];
+        frame.m_shading_descriptor = sets[1];
+
+        frame.m_cluster_data = create_buffer(sizeof(ClusterData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                                             VMA_MEMORY_USAGE_CPU_TO_GPU, MemoryCategory::PerFrame,
+                                             (void **) &frame.m_mapped_cluster_data);
+        *frame.m_mapped_cluster_data = {};
+        frame.m_clusters = create_buffer((VkDeviceSize) CLUSTER_COUNT * sizeof(glm::uvec2),
+                                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY,
+                                         MemoryCategory::PerFrame, nullptr);
+        // Worst case, every cluster full
+        frame.m_light_indices = create_buffer((VkDeviceSize) CLUSTER_COUNT * MAX_LIGHTS_PER_CLUSTER * sizeof(uint32_t),
+                                              VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY,
+                                              MemoryCategory::PerFrame, nullptr);
+        // Cleared before binning and read back once the frame is done
+        frame.m_stats = create_buffer(sizeof(ClusterStats), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                                            VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                      VMA_MEMORY_USAGE_GPU_TO_CPU, MemoryCategory::PerFrame,
+                                      (void **) &frame.m_mapped_stats);
+        *frame.m_mapped_stats = {};
+
+        // Also writes the descriptors
+        create_light_buffer(frame, INITIAL_LIGHT_CAPACITY);
+    }
+}
+
+void ClusteredLighting::cleanup() {
+    for (FrameResources &frame: m_frames) {
+        destroy_buffer(frame.m_lights);
+        destroy_buffer(frame.m_cluster_data);
+        destroy_buffer(frame.m_clusters);
+        destroy_buffer(frame.m_light_indices);
+        destroy_buffer(frame.m_stats);
+    }
+    m_frames.clear();
+
+    vkDestroyDescriptorPool(m_device, m_descriptor_pool, nullptr);
+    vkDestroyPipeline(m_device, m_cluster.m_pipeline, nullptr);
+}
+
+void ClusteredLighting::replace_pipeline(VkPipeline old_pipeline, VkPipeline new_pipeline) {
+    if (m_cluster.m_pipeline == old_pipeline) {
+        m_cluster.m_pipeline = new_pipeline;
+    }
+}
+
+AllocatedBuffer ClusteredLighting::create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                                                 VmaMemoryUsage memory_usage, MemoryCategory category,
+                                                 void **out_mapped) {
+    VkBufferCreateInfo buffer_info = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .size = size,
+            .usage = usage
+    };
+    if (m_queue_families.size() > 1) {
+        buffer_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        buffer_info.queueFamilyIndexCount = (uint32_t) m_queue_families.size();
+        buffer_info.pQueueFamilyIndices = m_queue_families.data();
+    }
+
+    VmaAllocationCreateInfo vma_alloc_info = {};
+    vma_alloc_info.usage = memory_usage;
+    if (out_mapped) {
+        vma_alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+    }
+
+    AllocatedBuffer buffer;
+    VmaAllocationInfo allocation_info;
+    VK_CHECK(vmaCreateBuffer(m_allocator, &buffer_info, &vma_alloc_info, &buffer.m_buffer, &buffer.m_allocation,
+                             &allocation_info))
+    m_memory_budget->track(buffer.m_allocation, category);
+
+    if (out_mapped) {
+        *out_mapped = allocation_info.pMappedData;
+    }
+    return buffer;
+}
+
+void ClusteredLighting::destroy_buffer(const AllocatedBuffer &buffer) {
+    m_memory_budget->untrack(buffer.m_allocation);
+    vmaDestroyBuffer(m_allocator, buffer.m_buffer, buffer.m_allocation);
+}
+
+void ClusteredLighting::create_light_buffer(FrameResources &frame, uint32_t capacity) {
+    if (frame.m_light_capacity > 0) {
+        destroy_buffer(frame.m_lights);
+    }
+
+    frame.m_lights = create_buffer((VkDeviceSize) capacity * sizeof(PointLight), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                   VMA_MEMORY_USAGE_CPU_TO_GPU, MemoryCategory::PerFrame,
+                                   (void **) &frame.m_mapped_lights);
+    frame.m_light_capacity = capacity;
+    write_descriptors(frame);
+}
+
+void ClusteredLighting::write_descriptors(FrameResources &frame) {
+    VkDescriptorBufferInfo cluster_data_info = {frame.m_cluster_data.m_buffer, 0, sizeof(ClusterData)};
+    VkDescriptorBufferInfo lights_info = {frame.m_lights.m_buffer, 0, VK_WHOLE_SIZE};
+    VkDescriptorBufferInfo clusters_info = {frame.m_clusters.m_buffer, 0, VK_WHOLE_SIZE};
+    VkDescriptorBufferInfo indices_info = {frame.m_light_indices.m_buffer, 0, VK_WHOLE_SIZE};
+    VkDescriptorBufferInfo stats_info = {frame.m_stats.m_buffer, 0, sizeof(ClusterStats)};
+
+    // Same bindings in both, binning has the stats on top
+    VkWriteDescriptorSet writes[9];
+    uint32_t write_count = 0;
+    for (VkDescriptorSet set: {frame.m_cluster_descriptor, frame.m_shading_descriptor}) {
+        writes[write_count++] = Initializers::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, set,
+                                                                      &cluster_data_info, 0);
+        writes[write_count++] = Initializers::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, set,
+                                                                      &lights_info, 1);
+        writes[write_count++] = Initializers::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, set,
+                                                                      &clusters_info, 2);
+        writes[write_count++] = Initializers::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, set,
+                                                                      &indices_info, 3);
+    }
+    writes[write_count++] = Initializers::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                                                  frame.m_cluster_descriptor, &stats_info, 4);
+    vkUpdateDescriptorSets(m_device, write_count, writes, 0, nullptr);
+    m_descriptor_writes++;
+}
+
+void ClusteredLighting::update(uint32_t frame, const std::vector<PointLight> &lights, const glm::mat4 &view,
+                               const glm::mat4 &projection, VkExtent2D extent, float z_near, float z_far) {
+    FrameResources &resources = m_frames[frame];
+
+    auto light_count = (uint32_t) lights.size();
+    if (light_count > resources.m_light_capacity) {
+        create_light_buffer(resources, std::max(light_count, resources.m_light_capacity * 2));
+    }
+    if (light_count > 0) {
+        std::copy(lights.begin(), lights.end(), resources.m_mapped_lights);
+        vmaFlushAllocation(m_allocator, resources.m_lights.m_allocation, 0,
+                           (VkDeviceSize) light_count * sizeof(PointLight));
+    }
+
+    // Slices split the depth range logarithmically, so they keep roughly cubic froxels
+    float log_range = std::log(z_far / z_near);
+
+    ClusterData &data = *resources.m_mapped_cluster_data;
+    data.m_view = view;
+    data.m_inverse_projection = glm::inverse(projection);
+    data.m_screen_size = {(float) extent.width, (float) extent.height};
+    data.m_z_near = z_near;
+    data.m_z_far = z_far;
+    data.m_slice_scale = (float) CLUSTER_SLICES / log_range;
+    data.m_slice_bias = -(float) CLUSTER_SLICES * std::log(z_near) / log_range;
+    data.m_light_count = light_count;
+    vmaFlushAllocation(m_allocator, resources.m_cluster_data.m_allocation, 0, VK_WHOLE_SIZE);
+}
+
+void ClusteredLighting::cmd_build_clusters(VkCommandBuffer cmd, uint32_t frame) {
+    FrameResources &resources = m_frames[frame];
+
+    vkCmdFillBuffer(cmd, resources.m_stats.m_buffer, 0, sizeof(ClusterStats), 0);
+    VkMemoryBarrier fill_barrier = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .pNext = nullptr,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                         &fill_barrier, 0, nullptr, 0, nullptr);
+
+    // Runs even without lights, every cluster still needs an empty list
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_cluster.m_pipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_cluster.m_layout, 0, 1,
+                            &resources.m_cluster_descriptor, 0, nullptr);
+    vkCmdDispatch(cmd, (CLUSTER_COUNT + CLUSTER_GROUP_SIZE - 1) / CLUSTER_GROUP_SIZE, 1, 1);
+
+    // Stats for the readback, the shading passes are synchronized by the render graph
+    VkMemoryBarrier cluster_barrier = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .pNext = nullptr,
+            .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_HOST_READ_BIT
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1,
+                         &cluster_barrier, 0, nullptr, 0, nullptr);
+}
+
+void ClusteredLighting::cmd_bind(VkCommandBuffer cmd, VkPipelineLayout layout, uint32_t frame) const {
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 1, 1,
+                            &m_frames[frame].m_shading_descriptor, 0, nullptr);
+}
+
+ClusterStats ClusteredLighting::read_stats(uint32_t frame) const {
+    const FrameResources &resources = m_frames[frame];
+    if (!resources.m_mapped_stats) {
+        return {};
+    }
+    vmaInvalidateAllocation(m_allocator, resources.m_stats.m_allocation, 0, VK_WHOLE_SIZE);
+    return *resources.m_mapped_stats;
+}
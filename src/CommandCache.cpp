@@ -0,0 +1,119 @@
+#include "CommandCache.h"
+
+#include <VulkanHelpers.h>
+
+void CommandCache::init(VkDevice device, uint32_t queue_family, uint32_t frame_count) {
+    m_device = device;
+    m_frames.resize(frame_count);
+
+    for (FrameCommands &frame: m_frames) {
+        VkCommandPoolCreateInfo pool_info = {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                .pNext = nullptr,
+                .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+                .queueFamilyIndex = queue_family
+        };
+        VK_CHECK(vkCreateCommandPool(m_device, &pool_info, nullptr, &frame.m_cached_pool))
+
+        pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        VK_CHECK(vkCreateCommandPool(m_device, &pool_info, nullptr, &frame.m_transient_pool))
+    }
+}
+
+void CommandCache::cleanup() {
+    // Frees the command buffers with them
+    for (FrameCommands &frame: m_frames) {
+        vkDestroyCommandPool(m_device, frame.m_cached_pool, nullptr);
+        vkDestroyCommandPool(m_device, frame.m_transient_pool, nullptr);
+    }
+    m_frames.clear();
+}
+
+void CommandCache::begin_frame(uint32_t frame) {
+    FrameCommands &commands = m_frames[frame];
+    VK_CHECK(vkResetCommandPool(m_device, commands.m_transient_pool, 0))
+    commands.m_transient_used = 0;
+    m_stats = {};
+}
+
+VkCommandBuffer CommandCache::get(uint32_t frame, uint64_t id, uint64_t key, const SecondaryRendering &rendering,
+                                  const std::function<void(VkCommandBuffer cmd)> &record) {
+    CachedCommandBuffer &cached = m_frames[frame].m_cached[id];
+    if (cached.m_recorded && cached.m_key == key) {
+        m_stats.m_replayed++;
+        return cached.m_cmd;
+    }
+
+    if (cached.m_cmd == VK_NULL_HANDLE) {
+        cached.m_cmd = allocate(m_frames[frame].m_cached_pool);
+    }
+    // Beginning it again resets it, the pool allows it
+    record_secondary(cached.m_cmd, 0, rendering, record);
+    cached.m_key = key;
+    cached.m_recorded = true;
+    m_stats.m_recorded++;
+    return cached.m_cmd;
+}
+
+VkCommandBuffer CommandCache::record_transient(uint32_t frame, const SecondaryRendering &rendering,
+                                               const std::function<void(VkCommandBuffer cmd)> &record) {
+    FrameCommands &commands = m_frames[frame];
+    if (commands.m_transient_used == commands.m_transient.size()) {
+        commands.m_transient.push_back(allocate(commands.m_transient_pool));
+    }
+    VkCommandBuffer cmd = commands.m_transient[commands.m_transient_used++];
+
+    record_secondary(cmd, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, rendering, record);
+    m_stats.m_transient++;
+    return cmd;
+}
+
+VkCommandBuffer CommandCache::allocate(VkCommandPool pool) {
+    VkCommandBufferAllocateInfo allocate_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .pNext = nullptr,
+            .commandPool = pool,
+            .level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+            .commandBufferCount = 1
+    };
+    VkCommandBuffer cmd;
+    VK_CHECK(vkAllocateCommandBuffers(m_device, &allocate_info, &cmd))
+    return cmd;
+}
+
+void CommandCache::record_secondary(VkCommandBuffer cmd, VkCommandBufferUsageFlags flags,
+                                    const SecondaryRendering &rendering,
+                                    const std::function<void(VkCommandBuffer cmd)> &record) {
+    bool color = rendering.m_color_format != VK_FORMAT_UNDEFINED;
+    VkCommandBufferInheritanceRenderingInfo rendering_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .viewMask = 0,
+            .colorAttachmentCount = color ? 1u : 0u,
+            .pColorAttachmentFormats = color ? &rendering.m_color_format : nullptr,
+            .depthAttachmentFormat = rendering.m_depth_format,
+            .stencilAttachmentFormat = VK_FORMAT_UNDEFINED,
+            .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT
+    };
+    VkCommandBufferInheritanceInfo inheritance_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+            .pNext = &rendering_info,
+            .renderPass = VK_NULL_HANDLE,
+            .subpass = 0,
+            .framebuffer = VK_NULL_HANDLE,
+            .occlusionQueryEnable = VK_FALSE,
+            .queryFlags = 0,
+            .pipelineStatistics = 0
+    };
+    VkCommandBufferBeginInfo begin_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .pNext = nullptr,
+            .flags = flags | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+            .pInheritanceInfo = &inheritance_info
+    };
+
+    VK_CHECK(vkBeginCommandBuffer(cmd, &begin_info))
+    record(cmd);
+    VK_CHECK(vkEndCommandBuffer(cmd))
+}
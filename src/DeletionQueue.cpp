@@ -15,4 +15,23 @@ void DeletionQueue::flush() {
     }
 
     deletors.clear();
-}
\ No newline at end of file
+}
+
+void TimelineDeletionQueue::push_function(uint64_t value, std::function<void()> &&function) {
+    deletors.emplace_back(value, function);
+}
+
+void TimelineDeletionQueue::collect(uint64_t completed_value) {
+    while (!deletors.empty() && deletors.front().first <= completed_value) {
+        deletors.front().second();
+        deletors.pop_front();
+    }
+}
+
+void TimelineDeletionQueue::flush() {
+    for (auto &deletor: deletors) {
+        deletor.second();
+    }
+
+    deletors.clear();
+}
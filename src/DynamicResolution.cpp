@@ -0,0 +1,220 @@
+#include "DynamicResolution.h"
+
+#include <Initializers.h>
+
+#include <algorithm>
+#include <cmath>
+
+// Largest scale asked for, a 2x2 supersample is already 4 times the pixels
+constexpr float MAX_RESOLUTION_SCALE = 2.f;
+constexpr float MIN_RESOLUTION_SCALE = 0.25f;
+// Weight of the new measurement in the smoothed frame time
+constexpr float FRAME_TIME_SMOOTHING = 0.2f;
+// A frame this far over the target is acted on right away, the smoothing would take a few
+// frames to see it
+constexpr float FRAME_TIME_SPIKE = 1.2f;
+// Closer than this to the current scale isn't worth a change
+constexpr float SCALE_DEADBAND = 0.02f;
+// Fraction of an increase applied at once, decreases are applied fully
+constexpr float SCALE_INCREASE_RATE = 0.25f;
+// Frames ignored after a change, until the timestamps are of the new extent
+constexpr uint32_t SETTLE_FRAMES = 2;
+
+static void clamp_scales(const DynamicResolutionSettings &settings, float *min_scale, float *max_scale) {
+    *max_scale = std::clamp(settings.m_max_scale, MIN_RESOLUTION_SCALE, MAX_RESOLUTION_SCALE);
+    *min_scale = std::clamp(settings.m_min_scale, MIN_RESOLUTION_SCALE, *max_scale);
+}
+
+static uint32_t scale_dimension(uint32_t size, float scale) {
+    uint32_t scaled = (uint32_t) std::ceil((float) size * scale);
+    scaled = (scaled + RENDER_EXTENT_ALIGNMENT - 1) / RENDER_EXTENT_ALIGNMENT * RENDER_EXTENT_ALIGNMENT;
+    return std::max(scaled, RENDER_EXTENT_ALIGNMENT);
+}
+
+void DynamicResolution::init(VkDevice device, VmaAllocator allocator, MemoryBudget *memory_budget,
+                             LayoutCache *layout_cache) {
+    m_device = device;
+    m_allocator = allocator;
+    m_memory_budget = memory_budget;
+
+    // Same binding as the one reflected from upscale.frag
+    m_set_layout = layout_cache->get_set_layout({
+            Initializers::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                                                       VK_SHADER_STAGE_FRAGMENT_BIT, 0)
+    });
+
+    // Bilinear, the shader keeps the reads inside the rendered part
+    VkSamplerCreateInfo sampler_info = {
+            .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .magFilter = VK_FILTER_LINEAR,
+            .minFilter = VK_FILTER_LINEAR,
+            .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+            .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .minLod = 0.f,
+            .maxLod = 0.f
+    };
+    VK_CHECK(vkCreateSampler(m_device, &sampler_info, nullptr, &m_sampler))
+
+    VkDescriptorPoolSize pool_size = {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1};
+    VkDescriptorPoolCreateInfo pool_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .maxSets = 1,
+            .poolSizeCount = 1,
+            .pPoolSizes = &pool_size
+    };
+    VK_CHECK(vkCreateDescriptorPool(m_device, &pool_info, nullptr, &m_descriptor_pool))
+
+    // Rewritten with every target
+    VkDescriptorSetAllocateInfo allocate_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .pNext = nullptr,
+            .descriptorPool = m_descriptor_pool,
+            .descriptorSetCount = 1,
+            .pSetLayouts = &m_set_layout
+    };
+    VK_CHECK(vkAllocateDescriptorSets(m_device, &allocate_info, &m_descriptor))
+}
+
+void DynamicResolution::cleanup() {
+    destroy_target();
+    vkDestroyDescriptorPool(m_device, m_descriptor_pool, nullptr);
+    vkDestroySampler(m_device, m_sampler, nullptr);
+}
+
+VkExtent2D DynamicResolution::max_extent(VkExtent2D window_extent, const DynamicResolutionSettings &settings) {
+    float min_scale, max_scale;
+    clamp_scales(settings, &min_scale, &max_scale);
+    // Exactly the window at 1, so rendering at full scale doesn't resample anything
+    if (max_scale == 1.f) {
+        return window_extent;
+    }
+    return {scale_dimension(window_extent.width, max_scale), scale_dimension(window_extent.height, max_scale)};
+}
+
+void DynamicResolution::create_target(VkExtent2D window_extent, VkFormat format,
+                                      const DynamicResolutionSettings &settings) {
+    m_window_extent = window_extent;
+    m_target_extent = max_extent(window_extent, settings);
+    clamp_scales(settings, &m_min_scale, &m_max_scale);
+
+    VkImageCreateInfo image_info = Initializers::image_create_info(format,
+                                                                   VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                                                                   VK_IMAGE_USAGE_SAMPLED_BIT,
+                                                                   {m_target_extent.width, m_target_extent.height, 1});
+
+    VmaAllocationCreateInfo image_allocinfo = {};
+    image_allocinfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+    image_allocinfo.requiredFlags = VkMemoryPropertyFlags(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    VK_CHECK(vmaCreateImage(m_allocator, &image_info, &image_allocinfo, &m_image.m_image, &m_image.m_allocation,
+                            nullptr))
+    m_memory_budget->track(m_image.m_allocation, MemoryCategory::RenderTarget);
+
+    VkImageViewCreateInfo view_info = Initializers::imageview_create_info(format, m_image.m_image,
+                                                                          VK_IMAGE_ASPECT_COLOR_BIT);
+    VK_CHECK(vkCreateImageView(m_device, &view_info, nullptr, &m_view))
+
+    VkDescriptorImageInfo target_info = {
+            .sampler = m_sampler,
+            .imageView = m_view,
+            .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+    };
+    VkWriteDescriptorSet write = Initializers::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                                                                      m_descriptor, &target_info, 0);
+    vkUpdateDescriptorSets(m_device, 1, &write, 0, nullptr);
+
+    // Starts from the top, the controller lowers it within a few frames if it's too much. The
+    // old frame times were of another window.
+    m_smoothed_ms = 0.f;
+    m_settle_frames = 0;
+    m_stats.m_gpu_ms = 0.f;
+    m_scale = m_max_scale;
+    m_stats.m_scale = m_scale;
+    m_stats.m_render_extent = m_target_extent;
+}
+
+void DynamicResolution::destroy_target() {
+    if (m_image.m_image == VK_NULL_HANDLE) {
+        return;
+    }
+
+    vkDestroyImageView(m_device, m_view, nullptr);
+    m_view = VK_NULL_HANDLE;
+    m_memory_budget->untrack(m_image.m_allocation);
+    vmaDestroyImage(m_allocator, m_image.m_image, m_image.m_allocation);
+    m_image = {};
+}
+
+bool DynamicResolution::update(float gpu_ms, const DynamicResolutionSettings &settings) {
+    if (m_settle_frames > 0) {
+        m_settle_frames--;
+        return false;
+    }
+    if (gpu_ms <= 0.f || settings.m_target_ms <= 0.f) {
+        return false;
+    }
+
+    if (m_smoothed_ms == 0.f || gpu_ms > settings.m_target_ms * FRAME_TIME_SPIKE) {
+        m_smoothed_ms = gpu_ms;
+    } else {
+        m_smoothed_ms += (gpu_ms - m_smoothed_ms) * FRAME_TIME_SMOOTHING;
+    }
+    m_stats.m_gpu_ms = m_smoothed_ms;
+
+    // The frame time mostly follows the pixel count, so the square of the scale
+    float desired = m_scale * std::sqrt(settings.m_target_ms / m_smoothed_ms);
+    desired = std::clamp(desired, m_min_scale, m_max_scale);
+    if (std::abs(desired - m_scale) < SCALE_DEADBAND && desired != m_min_scale && desired != m_max_scale) {
+        return false;
+    }
+    if (desired == m_scale) {
+        return false;
+    }
+
+    // Over budget is dropped at once, going back up is slower so a short lull doesn't bring
+    // the next spike
+    if (desired > m_scale) {
+        desired = std::min(m_scale + std::max((desired - m_scale) * SCALE_INCREASE_RATE, SCALE_DEADBAND), desired);
+    }
+
+    VkExtent2D previous = m_stats.m_render_extent;
+    apply_scale(desired);
+    if (m_stats.m_render_extent.width == previous.width && m_stats.m_render_extent.height == previous.height) {
+        return false;
+    }
+
+    m_settle_frames = SETTLE_FRAMES;
+    m_stats.m_changes++;
+    return true;
+}
+
+void DynamicResolution::apply_scale(float scale) {
+    m_scale = scale;
+    m_stats.m_scale = scale;
+    if (scale >= m_max_scale) {
+        m_stats.m_render_extent = m_target_extent;
+        return;
+    }
+    m_stats.m_render_extent = {
+            std::min(scale_dimension(m_window_extent.width, scale), m_target_extent.width),
+            std::min(scale_dimension(m_window_extent.height, scale), m_target_extent.height)
+    };
+}
+
+void DynamicResolution::cmd_upscale(VkCommandBuffer cmd, VkPipelineLayout layout, float sharpness) const {
+    UpscaleConstants constants = {
+            .m_uv_scale = {(float) m_stats.m_render_extent.width / (float) m_target_extent.width,
+                           (float) m_stats.m_render_extent.height / (float) m_target_extent.height},
+            .m_texel_size = {1.f / (float) m_target_extent.width, 1.f / (float) m_target_extent.height},
+            .m_sharpness = std::max(sharpness, 0.f)
+    };
+    vkCmdPushConstants(cmd, layout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(constants), &constants);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 1, 1, &m_descriptor, 0, nullptr);
+    vkCmdDraw(cmd, 3, 1, 0, 0);
+}
@@ -4,14 +4,34 @@
 
 #include <Engine.h>
 
+#include <imgui.h>
+#include <imgui_impl_glfw.h>
+#include <imgui_impl_vulkan.h>
+
 #include <vulkan/vulkan.h>
 #include <glm/gtx/transform.hpp>
 
+#include <algorithm>
+#include <chrono>
 #include <fstream>
+#include <numeric>
+#include <optional>
 #include <string>
+#include <cstdio>
 #include <cstring>
 
+constexpr float CAMERA_Z_NEAR = 0.1f;
+constexpr float CAMERA_Z_FAR = 200.f;
+constexpr float CAMERA_FOV_Y = 70.f;
+// Simulation steps run back to back to catch up after a hitch, the time past it is dropped
+constexpr uint32_t MAX_SIMULATION_STEPS = 5;
+
 void Engine::run() {
+    if (m_enable_render_thread) {
+        run_simulation();
+        return;
+    }
+
     bool quit = false;
     while (!glfwWindowShouldClose(m_window) && !quit) {
         glfwPollEvents();
@@ -19,16 +39,229 @@ void Engine::run() {
     }
 }
 
+void Engine::run_simulation() {
+    // Starts from the scene set up before run, drawn until the first step
+    SceneState state = {
+            .m_camera_position = m_camera_position,
+            .m_renderables = m_renderables,
+            .m_lights = m_lights,
+            .m_particle_emitters = m_particle_emitters,
+            .m_skinned_instances = m_skinned_instances,
+            .m_sun = m_sun
+    };
+    SceneState previous = state;
+    uint64_t step = 0;
+
+    auto publish = [&](uint64_t input_us) {
+        SceneSnapshot &snapshot = m_snapshots.back();
+        snapshot.m_previous = previous;
+        snapshot.m_current = state;
+        snapshot.m_step = step;
+        snapshot.m_input_us = input_us;
+        snapshot.m_published_us = PresentLatencyTracker::now_us();
+        m_snapshots.publish();
+    };
+    auto publish_framebuffer_size = [&]() {
+        int width = 0;
+        int height = 0;
+        glfwGetFramebufferSize(m_window, &width, &height);
+        m_framebuffer_size = ((uint64_t) width << 32) | (uint32_t) height;
+    };
+
+    publish_framebuffer_size();
+    publish(PresentLatencyTracker::now_us());
+    m_render_thread_quit = false;
+    m_render_thread_active = true;
+    m_render_thread = std::thread(&Engine::render_thread_main, this);
+
+    auto step_us = (uint64_t) ((double) m_simulation_step * 1e6);
+    uint64_t next_step_us = PresentLatencyTracker::now_us() + step_us;
+    while (!glfwWindowShouldClose(m_window)) {
+        // Sleeps until the next step, input wakes it up earlier
+        uint64_t now_us = PresentLatencyTracker::now_us();
+        if (now_us < next_step_us) {
+            glfwWaitEventsTimeout((double) (next_step_us - now_us) * 1e-6);
+        } else {
+            glfwPollEvents();
+        }
+        publish_framebuffer_size();
+
+        uint64_t input_us = PresentLatencyTracker::now_us();
+        uint32_t steps = 0;
+        while (input_us >= next_step_us && steps < MAX_SIMULATION_STEPS) {
+            previous = state;
+            if (m_simulate) {
+                m_simulate(state, m_simulation_step);
+            }
+            next_step_us += step_us;
+            step++;
+            steps++;
+        }
+        // Too far behind after a hitch, the missed time is dropped instead of simulated
+        if (input_us >= next_step_us) {
+            next_step_us = input_us + step_us;
+        }
+        if (steps > 0) {
+            publish(input_us);
+        }
+    }
+
+    m_render_thread_quit = true;
+    m_render_thread.join();
+    m_render_thread_active = false;
+}
+
+void Engine::render_thread_main() {
+    auto step_us = (double) m_simulation_step * 1e6;
+    std::vector<int> keys;
+    while (!m_render_thread_quit) {
+        {
+            std::lock_guard<std::mutex> lock(m_key_mutex);
+            keys.swap(m_pending_keys);
+        }
+        for (int key: keys) {
+            on_key(key);
+        }
+        keys.clear();
+
+        // One step behind the simulation, moving from the previous state of the snapshot to its
+        // current one over the step that follows its publication
+        m_snapshots.acquire();
+        const SceneSnapshot &snapshot = m_snapshots.front();
+        auto since_publish_us = (double) (PresentLatencyTracker::now_us() - snapshot.m_published_us);
+        apply_snapshot(snapshot, std::clamp((float) (since_publish_us / step_us), 0.f, 1.f));
+        draw();
+    }
+}
+
+void Engine::apply_snapshot(const SceneSnapshot &snapshot, float alpha) {
+    snapshot.interpolate(alpha, &m_render_state);
+    m_camera_position = m_render_state.m_camera_position;
+    m_renderables.swap(m_render_state.m_renderables);
+    m_lights.swap(m_render_state.m_lights);
+    m_particle_emitters.swap(m_render_state.m_particle_emitters);
+    m_skinned_instances.swap(m_render_state.m_skinned_instances);
+    m_sun = m_render_state.m_sun;
+    if (m_render_state.m_static_version != m_applied_static_version) {
+        m_shadows.invalidate_static();
+        m_applied_static_version = m_render_state.m_static_version;
+    }
+    m_snapshot_input_us = snapshot.m_input_us;
+}
+
 void Engine::draw() {
-    VK_CHECK(vkWaitForFences(m_device, 1, &m_render_fence, true, 1000000000))
-    VK_CHECK(vkResetFences(m_device, 1, &m_render_fence))
-    // We need to flush after vulkan has finished working.
-    m_per_frame_deletion_queue.flush();
+    // Input is polled right before draw, everything from here on counts towards the latency. On
+    // the render thread it was polled before the simulation step drawn.
+    uint64_t frame_start_us = PresentLatencyTracker::now_us();
+    uint64_t input_us = m_render_thread_active ? m_snapshot_input_us : frame_start_us;
+
+    uint32_t frame_index = m_frame_count % FRAMES_IN_FLIGHT;
+    {
+        PROFILE_SCOPE(m_profiler, "wait_for_gpu");
+        if (!m_graphics_timeline.wait(m_frame_timeline_values[frame_index], 1000000000)) {
+            std::cout << "Timed out waiting for frame " << m_frame_count - FRAMES_IN_FLIGHT << std::endl;
+            abort();
+        }
+    }
+    // Reaching the value guarantees the queries of this frame slot are available.
+    m_profiler.begin_frame(frame_index);
+    m_command_cache.begin_frame(frame_index);
+    m_render_stats = {};
+    m_state_tracker.reset_counters();
+    CullStats cull_stats = m_occlusion_culler.read_stats(frame_index);
+    m_render_stats.m_visible_objects = cull_stats.m_visible;
+    m_render_stats.m_frustum_culled = cull_stats.m_frustum_culled;
+    m_render_stats.m_occlusion_culled = cull_stats.m_occlusion_culled;
+    ClusterStats cluster_stats = m_lighting.read_stats(frame_index);
+    m_render_stats.m_light_indices = cluster_stats.m_light_indices;
+    m_render_stats.m_overflowed_light_clusters = cluster_stats.m_overflowed_clusters;
+    ParticleStats particle_stats = m_particles.read_stats(frame_index);
+    m_render_stats.m_particles = particle_stats.m_alive;
+    m_render_stats.m_particles_emitted = particle_stats.m_emitted;
+    m_memory_budget.update(m_frame_count);
+
+    // Only what the GPU is done with, uploads submitted since the last frame may still be running
+    m_timeline_deletion_queue.collect(m_graphics_timeline.completed_value());
+
+    // Frame boundary, nothing is recorded yet so pipelines can be swapped
+    if (m_shader_hot_reload.is_running()) {
+        PROFILE_SCOPE(m_profiler, "shader_reload");
+        apply_shader_reloads();
+    }
+
+    if (!m_headless && m_swapchain_dirty) {
+        PROFILE_SCOPE(m_profiler, "recreate_swapchain");
+        recreate_swapchain();
+    }
+
+    // From the GPU time of the last frame, which begin_frame just resolved. Without timestamps
+    // the scale stays where it is.
+    VkExtent2D render_extent = m_window_extent;
+    if (m_resolution_settings.m_enabled) {
+        float gpu_ms = m_profiler.gpu_timing_supported() ? (float) m_profiler.m_gpu_frame_stats.last() : 0.f;
+        m_dynamic_resolution.update(gpu_ms, m_resolution_settings);
+        render_extent = m_dynamic_resolution.render_extent();
+    }
+    if (render_extent.width != m_render_extent.width || render_extent.height != m_render_extent.height) {
+        m_render_extent = render_extent;
+        // The cached draws set the viewport
+        invalidate_command_cache();
+    }
 
     // Will call present semaphore when done.
-    uint32_t swapchain_image_index;
-    VK_CHECK(vkAcquireNextImageKHR(m_device, m_swapchain, 1000000000, m_present_semaphore, nullptr,
-                                   &swapchain_image_index))
+    uint32_t swapchain_image_index = 0;
+    bool out_of_date = false;
+    if (!m_headless) {
+        PROFILE_SCOPE(m_profiler, "acquire");
+        VkResult acquire_result = vkAcquireNextImageKHR(m_device, m_swapchain, 1000000000, m_present_semaphore,
+                                                        nullptr, &swapchain_image_index);
+        out_of_date = acquire_result == VK_ERROR_OUT_OF_DATE_KHR;
+        // Suboptimal still acquired an image, it's recreated after presenting it
+        if (!out_of_date && acquire_result != VK_SUBOPTIMAL_KHR) {
+            VK_CHECK(acquire_result)
+        }
+    }
+    if (out_of_date) {
+        // The semaphore wasn't signaled, nothing was submitted, we can skip the frame entirely. The
+        // profiler's frame still ends, the command cache only resets the slot again next time.
+        m_swapchain_dirty = true;
+        m_profiler.end_frame();
+        return;
+    }
+
+    // Clamped, a hitch shouldn't spawn a burst of particles
+    float delta_time = 0.f;
+    if (m_last_frame_us != 0) {
+        m_frame_interval_stats.push((double) (frame_start_us - m_last_frame_us) / 1000.0);
+        delta_time = std::min((float) (frame_start_us - m_last_frame_us) * 1e-6f, 0.1f);
+    }
+    m_last_frame_us = frame_start_us;
+    if (m_fixed_delta_time > 0.f) {
+        delta_time = m_fixed_delta_time;
+    }
+
+    // The frame is certain to be drawn from here, and nothing was read from the application yet
+    if (m_capture.is_open()) {
+        PROFILE_SCOPE(m_profiler, "capture");
+        capture_frame(delta_time);
+    }
+
+    if (imgui_enabled()) {
+        PROFILE_SCOPE(m_profiler, "imgui");
+        ImGui_ImplVulkan_NewFrame();
+        ImGui_ImplGlfw_NewFrame();
+        ImGui::NewFrame();
+        if (m_show_profiler_overlay) {
+            m_profiler.draw_overlay();
+            m_memory_budget.draw_overlay();
+            m_present_latency.draw_overlay(m_present_mode);
+        }
+        ImGui::Render();
+    }
+
+    // Ends once the command buffer is closed, the rest of draw is timed separately
+    std::optional<ProfileScope> record_scope;
+    record_scope.emplace(m_profiler, "record");
 
     VK_CHECK(vkResetCommandBuffer(m_main_command_buffer, 0))
 
@@ -42,42 +275,155 @@ void Engine::draw() {
 
     VK_CHECK(vkBeginCommandBuffer(m_main_command_buffer, &command_buffer_begin_info))
 
-    VkImageMemoryBarrier image_memory_barrier{
-            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-            .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-            .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-            .newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-            .image = m_swapchain_images[swapchain_image_index],
-            .subresourceRange = {
-                    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                    .baseMipLevel = 0,
-                    .levelCount = 1,
-                    .baseArrayLayer = 0,
-                    .layerCount = 1,
-            }
-    };
+    // This slot's previous frame is done, its uniform can be overwritten
+    FrameData &frame = m_frames[frame_index];
+    frame.m_camera->m_view = glm::translate(glm::mat4(1.f), m_camera_position);
+    frame.m_camera->m_projection = get_projection();
+    frame.m_camera->m_view_projection = frame.m_camera->m_projection * frame.m_camera->m_view;
+    vmaFlushAllocation(m_allocator, frame.m_camera_buffer.m_allocation, 0, VK_WHOLE_SIZE);
+    m_lighting.update(frame_index, m_lights, frame.m_camera->m_view, frame.m_camera->m_projection,
+                      m_render_extent, CAMERA_Z_NEAR, CAMERA_Z_FAR);
+
+    if (m_particles.capacity() != m_particle_capacity &&
+        (!m_particle_emitters.empty() || m_particles.capacity() > 0)) {
+        // The particles are shared by every frame slot, the other ones may still be simulating
+        ParticleSystem::RetiredBuffers retired = m_particles.reserve(m_particle_capacity);
+        m_timeline_deletion_queue.push_function(m_graphics_timeline.next_value(), [=, this]() {
+            m_particles.destroy_retired(retired);
+        });
+    }
+    if (m_particles.capacity() > 0) {
+        m_particles.update(frame_index, m_particle_emitters, delta_time, frame.m_camera->m_view, CAMERA_Z_FAR);
+    }
+    // After the uploads of the frame, the instances are written where their meshes are now
+    m_render_stats.m_skinned_vertices = m_skinning.update(frame_index, m_skinned_instances, m_geometry);
+
+    {
+        PROFILE_SCOPE(m_profiler, "scene_bvh");
+        update_scene_bvh();
+        if (m_enable_cpu_culling) {
+            cull_renderables(frame.m_camera->m_view_projection);
+        }
+    }
+
+    // Nothing reads the clusters nor the shadows without a lit material
+    bool lit = std::any_of(m_renderables.begin(), m_renderables.end(), [](const RenderObject &object) {
+        return object.m_material->m_lit;
+    });
+    bool shadows = m_shadow_settings.m_enabled && lit;
+    m_shadows.update(frame_index, shadows, m_sun, frame.m_camera->m_view,
+                     glm::radians(CAMERA_FOV_Y), (float) m_window_extent.width / (float) m_window_extent.height,
+                     CAMERA_Z_NEAR);
+    m_shadow_cascade_draws.clear();
+    if (shadows) {
+        PROFILE_SCOPE(m_profiler, "cull_shadows");
+        cull_shadow_casters();
+    }
+
+    // Recorded draws reference the instance buffer, so it can only be replaced before recording.
+    // Sized for the whole scene and the shadow casters, draw_objects falls back to per-object
+    // draws if it still runs out.
+    frame.m_instance_count = 0;
+    uint32_t instances_needed = (uint32_t) (m_renderables.size() + m_shadow_casters.size());
+    if (instances_needed > frame.m_instance_capacity) {
+        destroy_instance_buffer(frame);
+        create_instance_buffer(frame, std::max(instances_needed, INITIAL_INSTANCE_CAPACITY * 2));
+    }
+    if (!m_shadow_cascade_draws.empty()) {
+        prepare_shadows(frame);
+    }
+
+    bool gpu_culling = m_enable_depth_prepass || m_enable_occlusion_culling;
+    if (gpu_culling) {
+        PROFILE_SCOPE(m_profiler, "prepare_culling");
+        prepare_culling(frame, frame_index);
+    }
+
+    m_profiler.cmd_reset_queries(m_main_command_buffer);
+    uint32_t gpu_frame_scope = m_profiler.cmd_begin_gpu_scope(m_main_command_buffer, "frame");
+
+    // Passes and barriers, the graph is only compiled again when the frame changes shape. It
+    // records the passes on other command buffers when the frame is split between the queues.
+    declare_frame_graph(swapchain_image_index, gpu_culling, lit);
+    m_render_graph.execute(m_main_command_buffer);
+
+    m_render_stats.m_state_calls = m_state_tracker.m_calls;
+    m_render_stats.m_state_calls_skipped = m_state_tracker.m_skipped;
 
-    vkCmdPipelineBarrier(
-            m_main_command_buffer,
-            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,  // srcStageMask
-            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, // dstStageMask
-            0,
-            0,
-            nullptr,
-            0,
-            nullptr,
-            1, // imageMemoryBarrierCount
-            &image_memory_barrier // pImageMemoryBarriers
-    );
+    m_profiler.cmd_end_gpu_scope(m_render_graph.last_command_buffer(), gpu_frame_scope);
+    record_scope.reset();
 
+    {
+        PROFILE_SCOPE(m_profiler, "submit");
+
+        // The graph waits for the present semaphore before the first pass drawing to the
+        // swapchain, and we signal render semaphore when done. Headless frames are never
+        // acquired nor presented, so there is nothing to wait on or signal.
+        std::vector<VkSemaphore> binary_signals;
+        if (!m_headless) {
+            binary_signals.push_back(m_render_semaphore);
+        }
+
+        // Covers the compute submissions of the frame too
+        m_frame_timeline_values[frame_index] = m_render_graph.submit(binary_signals);
+    }
+
+    if (!m_headless) {
+        PROFILE_SCOPE(m_profiler, "present");
+
+        // Lets the latency tracker wait for this exact present
+        uint64_t present_id = m_present_wait_supported ? m_present_latency.next_present_id() : 0;
+        VkPresentIdKHR present_id_info = {
+                .sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR,
+                .pNext = nullptr,
+                .swapchainCount = 1,
+                .pPresentIds = &present_id
+        };
+
+        // Present info, we will wait for render semaphore.
+        VkPresentInfoKHR present_info = {
+                .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+                .pNext = m_present_wait_supported ? &present_id_info : nullptr,
+                .waitSemaphoreCount = 1,
+                .pWaitSemaphores = &m_render_semaphore,
+                .swapchainCount = 1,
+                .pSwapchains = &m_swapchain,
+                .pImageIndices = &swapchain_image_index,
+        };
+
+        VkResult present_result = vkQueuePresentKHR(m_graphics_queue, &present_info);
+        if (present_result == VK_ERROR_OUT_OF_DATE_KHR || present_result == VK_SUBOPTIMAL_KHR) {
+            m_swapchain_dirty = true;
+        } else {
+            VK_CHECK(present_result)
+        }
+
+        m_present_latency.on_present(m_swapchain, present_id, input_us);
+    }
+
+    m_profiler.end_frame();
+    m_frame_count++;
+
+    // Info, updating the title every frame is surprisingly expensive on some platforms
+    if (!m_headless && !m_render_thread_active && m_frame_count % 60 == 0) {
+        char title[128];
+        snprintf(title, sizeof(title), "VulkanEngine - CPU %.2f ms (p99 %.2f) - GPU %.2f ms (p99 %.2f)",
+                 m_profiler.m_cpu_frame_stats.avg(), m_profiler.m_cpu_frame_stats.percentile(0.99),
+                 m_profiler.m_gpu_frame_stats.avg(), m_profiler.m_gpu_frame_stats.percentile(0.99));
+        glfwSetWindowTitle(m_window, title);
+    }
+}
+
+void Engine::cmd_begin_rendering(VkCommandBuffer cmd, VkImageView color_view, VkAttachmentLoadOp color_load_op,
+                                 VkAttachmentLoadOp depth_load_op, VkRenderingFlags flags) {
     // Create as many color attachment as needed.
     // You can specify the layout, the image view (if use outside of a swapchain)
     // clear value and so on.
     const VkRenderingAttachmentInfo color_attachment_info{
             .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR,
-            .imageView = m_swapchain_images_view[swapchain_image_index],
+            .imageView = color_view,
             .imageLayout = VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL_KHR,
-            .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+            .loadOp = color_load_op,
             .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
             .clearValue = VkClearValue{
                     .color = {0.f, 0.f, 0.f, 1}
@@ -88,7 +434,7 @@ void Engine::draw() {
             .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR,
             .imageView = m_depth_image_view,
             .imageLayout = VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL_KHR,
-            .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+            .loadOp = depth_load_op,
             .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
             .clearValue = VkClearValue{
                     .depthStencil = {1, 0}
@@ -100,179 +446,2019 @@ void Engine::draw() {
     // layout(location = COLOR_ATTACHMENT INDEX) vecX variable_name;
     const VkRenderingInfo render_info{
             .sType = VK_STRUCTURE_TYPE_RENDERING_INFO_KHR,
-            .renderArea = {0, 0, m_window_extent},
+            .flags = flags,
+            .renderArea = {0, 0, m_render_extent},
             .layerCount = 1,
-            .colorAttachmentCount = 1,
-            .pColorAttachments = &color_attachment_info,
+            .colorAttachmentCount = color_view != VK_NULL_HANDLE ? 1u : 0u,
+            .pColorAttachments = color_view != VK_NULL_HANDLE ? &color_attachment_info : nullptr,
             .pDepthAttachment = &depth_attachment_info
     };
 
     // We make use of dynamic_rendering. This allows us to forget about renderpasses and
     // framebuffers completely. We can specify render attachments on the struct
     // above
-    vkCmdBeginRendering(m_main_command_buffer, &render_info);
-
-    cmd_render_commands();
-
-    vkCmdEndRendering(m_main_command_buffer);
-
-    // We need to convert image from render to present format
-    image_memory_barrier = {
-            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-            .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-            .oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-            .newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-            .image = m_swapchain_images[swapchain_image_index],
-            .subresourceRange = {
-                    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                    .baseMipLevel = 0,
-                    .levelCount = 1,
-                    .baseArrayLayer = 0,
-                    .layerCount = 1,
-            }
-    };
-
-    vkCmdPipelineBarrier(
-            m_main_command_buffer,
-            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,  // srcStageMask
-            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, // dstStageMask
-            0,
-            0,
-            nullptr,
-            0,
-            nullptr,
-            1, // imageMemoryBarrierCount
-            &image_memory_barrier // pImageMemoryBarriers
-    );
-
-    VK_CHECK(vkEndCommandBuffer(m_main_command_buffer));
-
-    VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-
-    // Submit info (our draw calls). We want to wait for present semaphore, and will signal render semaphore when done.
-    VkSubmitInfo submit = {
-            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-            .pNext = nullptr,
-            .waitSemaphoreCount = 1,
-            .pWaitSemaphores = &m_present_semaphore,
-            .pWaitDstStageMask = &wait_stage,
-            .commandBufferCount = 1,
-            .pCommandBuffers = &m_main_command_buffer,
-            .signalSemaphoreCount = 1,
-            .pSignalSemaphores = &m_render_semaphore
-    };
-
+    vkCmdBeginRendering(cmd, &render_info);
 
-    // Render fence blocked
-    VK_CHECK(vkQueueSubmit(m_graphics_queue, 1, &submit, m_render_fence))
+    // Only vkCmdExecuteCommands is allowed, the secondaries don't inherit the viewport anyway
+    if (!(flags & VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT)) {
+        cmd_set_viewport(cmd);
+    }
+}
 
-    // Present info, we will wait for render semaphore.
-    VkPresentInfoKHR present_info = {
-            .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-            .pNext = nullptr,
-            .waitSemaphoreCount = 1,
-            .pWaitSemaphores = &m_render_semaphore,
-            .swapchainCount = 1,
-            .pSwapchains = &m_swapchain,
-            .pImageIndices = &swapchain_image_index,
+void Engine::cmd_set_viewport(VkCommandBuffer cmd) {
+    // Dynamic, so the pipelines don't depend on the swapchain size or the render scale
+    VkViewport viewport = {
+            .x = 0.0f,
+            .y = 0.0f,
+            .width = (float) m_render_extent.width,
+            .height = (float) m_render_extent.height,
+            .minDepth = 0.0f,
+            .maxDepth = 1.0f
     };
+    VkRect2D scissor = {{0, 0}, m_render_extent};
+    m_state_tracker.reset();
+    m_state_tracker.set_viewport(cmd, viewport);
+    m_state_tracker.set_scissor(cmd, scissor);
+}
 
-    VK_CHECK(vkQueuePresentKHR(m_graphics_queue, &present_info))
-
-    m_frame_count++;
+void Engine::cmd_render_commands(VkCommandBuffer cmd) {
+    cmd_draw_debug_meshes(cmd);
+    if (!m_enable_cpu_culling) {
+        draw_objects(cmd, m_renderables.data(), (int) m_renderables.size());
+        return;
+    }
 
-    // Info
-    // glfwSetWindowTitle(m_window, ("VulkanEngine - Frame count: " + std::to_string(m_frame_count)).c_str());
+    // In the order of m_renderables, like without culling
+    m_visible_renderables.clear();
+    for (size_t i = 0; i < m_renderables.size(); i++) {
+        if (m_cpu_visible[i]) {
+            m_visible_renderables.push_back(m_renderables[i]);
+        }
+    }
+    draw_objects(cmd, m_visible_renderables.data(), (int) m_visible_renderables.size());
 }
 
-void Engine::cmd_render_commands() {
-    vkCmdBindPipeline(m_main_command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, m_debug_mesh_pipeline);
+void Engine::cmd_draw_debug_meshes(VkCommandBuffer cmd) {
+    // The debug monkey is only loaded in debug builds
+    if (!m_debug_monkey_mesh.m_vertices.empty()) {
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_debug_mesh_pipeline);
+        m_render_stats.m_pipeline_binds++;
+        m_state_tracker.apply(cmd, RenderState{});
+
+        const FrameData &frame = m_frames[m_frame_count % FRAMES_IN_FLIGHT];
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                m_debug_mesh_pipeline_layout, 0, 1, &frame.m_global_descriptor, 0, nullptr);
 
-    // Will be moved somewhere else in the end
-    {
-        //make a model view matrix for rendering the object
-        //camera position
-        glm::vec3 cam_pos = {0.f, 0.f, -2.f};
-
-        glm::mat4 view = glm::translate(glm::mat4(1.f), cam_pos);
-        //camera projection
-        glm::mat4 projection = glm::perspective(glm::radians(70.f), 1700.f / 900.f, 0.1f, 200.0f);
-        projection[1][1] *= -1;
         //model rotation
         glm::mat4 model = glm::rotate(glm::mat4{1.0f}, glm::radians(m_frame_count * 0.4f), glm::vec3(0, 1, 0));
 
-        //calculate final mesh matrix
-        glm::mat4 mesh_matrix = projection * view * model;
-
         MeshPushConstants constants{};
-        constants.render_matrix = mesh_matrix;
+        constants.data = glm::vec4(1.f);
+        constants.model_matrix = model;
 
         //upload the matrix to the GPU via push constants
-        vkCmdPushConstants(m_main_command_buffer, m_debug_mesh_pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0,
+        vkCmdPushConstants(cmd, m_debug_mesh_pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0,
                            sizeof(MeshPushConstants), &constants);
+
+        m_geometry.cmd_bind(cmd);
+        m_render_stats.m_vertex_buffer_binds++;
+
+        cmd_draw_mesh(cmd, m_debug_monkey_mesh);
     }
+}
 
-    VkDeviceSize offset = 0;
-    vkCmdBindVertexBuffers(m_main_command_buffer, 0, 1, &m_debug_monkey_mesh.m_vertex_buffer.m_buffer, &offset);
+void Engine::cmd_draw_particles(VkCommandBuffer cmd, VkImageView color_view) {
+    const FrameData &frame = m_frames[m_frame_count % FRAMES_IN_FLIGHT];
 
-    vkCmdDraw(m_main_command_buffer, m_debug_monkey_mesh.m_vertices.size(), 1, 0, 0);
+    cmd_begin_rendering(cmd, color_view, VK_ATTACHMENT_LOAD_OP_LOAD, VK_ATTACHMENT_LOAD_OP_LOAD);
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_particle_pipeline);
+    m_render_stats.m_pipeline_binds++;
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_particle_pipeline_layout, 0, 1,
+                            &frame.m_global_descriptor, 0, nullptr);
+    m_particles.cmd_bind(cmd, m_particle_pipeline_layout);
+    // No vertex buffer, the count is the one the simulation left
+    m_particles.cmd_draw(cmd);
+    m_render_stats.m_draw_calls++;
+    vkCmdEndRendering(cmd);
 }
 
-bool Engine::load_shader_module(const char *file_path, VkShaderModule *out_shader_module) const {
-    std::ifstream file(file_path, std::ios::ate | std::ios::binary);
+void Engine::cmd_upscale(VkCommandBuffer cmd, VkImageView swapchain_view) {
+    // Every pixel is written, and at the window size instead of the render extent
+    const VkRenderingAttachmentInfo color_attachment_info{
+            .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR,
+            .imageView = swapchain_view,
+            .imageLayout = VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL_KHR,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .storeOp = VK_ATTACHMENT_STORE_OP_STORE
+    };
+    const VkRenderingInfo render_info{
+            .sType = VK_STRUCTURE_TYPE_RENDERING_INFO_KHR,
+            .renderArea = {0, 0, m_window_extent},
+            .layerCount = 1,
+            .colorAttachmentCount = 1,
+            .pColorAttachments = &color_attachment_info
+    };
+    vkCmdBeginRendering(cmd, &render_info);
 
-    if (!file.is_open()) {
-        return false;
+    VkViewport viewport = {
+            .x = 0.0f,
+            .y = 0.0f,
+            .width = (float) m_window_extent.width,
+            .height = (float) m_window_extent.height,
+            .minDepth = 0.0f,
+            .maxDepth = 1.0f
+    };
+    m_state_tracker.reset();
+    m_state_tracker.set_viewport(cmd, viewport);
+    m_state_tracker.set_scissor(cmd, {{0, 0}, m_window_extent});
+
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_upscale_pipeline);
+    m_render_stats.m_pipeline_binds++;
+    m_dynamic_resolution.cmd_upscale(cmd, m_upscale_pipeline_layout, m_resolution_settings.m_sharpness);
+    m_render_stats.m_draw_calls++;
+    vkCmdEndRendering(cmd);
+}
+
+void Engine::cmd_draw_mesh(VkCommandBuffer cmd, const Mesh &mesh, uint32_t instance_count,
+                           uint32_t first_instance) {
+    const GeometryRange &range = m_geometry.get_range(mesh.m_geometry_handle);
+
+    if (range.m_index_count > 0) {
+        vkCmdDrawIndexed(cmd, range.m_index_count, instance_count, range.m_first_index,
+                         (int32_t) range.m_first_vertex, first_instance);
+        m_render_stats.m_triangles += (uint64_t) range.m_index_count / 3 * instance_count;
+    } else {
+        vkCmdDraw(cmd, range.m_vertex_count, instance_count, range.m_first_vertex, first_instance);
+        m_render_stats.m_triangles += (uint64_t) range.m_vertex_count / 3 * instance_count;
     }
+    m_render_stats.m_draw_calls++;
+}
 
-    size_t file_size = (size_t) file.tellg();
+glm::mat4 Engine::get_projection() const {
+    glm::mat4 projection = glm::perspective(glm::radians(CAMERA_FOV_Y),
+                                            (float) m_window_extent.width / (float) m_window_extent.height,
+                                            CAMERA_Z_NEAR, CAMERA_Z_FAR);
+    projection[1][1] *= -1;
 
-    std::vector<uint32_t> buffer(file_size / sizeof(uint32_t));
+    return projection;
+}
 
-    file.seekg(0);
-    file.read((char *) buffer.data(), file_size);
+glm::mat4 Engine::get_view_projection() const {
+    glm::mat4 view = glm::translate(glm::mat4(1.f), m_camera_position);
 
-    file.close();
+    return get_projection() * view;
+}
 
-    VkShaderModuleCreateInfo create_info = {
-            .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-            .pNext = nullptr,
-            // Size in bytes
-            .codeSize = buffer.size() * sizeof(uint32_t),
-            .pCode = buffer.data(),
+void Engine::draw_objects(VkCommandBuffer cmd, RenderObject *first, int count) {
+    if (count <= 0) {
+        return;
+    }
+
+    FrameData &frame = m_frames[m_frame_count % FRAMES_IN_FLIGHT];
+
+    // Gather the objects sharing a mesh and material so they can be drawn as one batch. The order
+    // between batches doesn't matter for opaque objects.
+    m_draw_order.resize(count);
+    std::iota(m_draw_order.begin(), m_draw_order.end(), 0u);
+    if (m_instancing_threshold > 0) {
+        sort_draw_order(first, count);
+    }
+
+    // All meshes share the same buffers
+    m_geometry.cmd_bind(cmd);
+    m_render_stats.m_vertex_buffer_binds++;
+
+    // Only rebind what changed, instanced and non instanced pipelines share the layout
+    BoundPipeline bound;
+    auto bind_pipeline = [&](VkPipeline pipeline, const Material &material) {
+        cmd_bind_material(cmd, bound, pipeline, material);
     };
-    VkShaderModule shader_module;
-    if (vkCreateShaderModule(m_device, &create_info, nullptr, &shader_module) != VK_SUCCESS) {
-        return false;
+
+    uint32_t first_written_instance = frame.m_instance_count;
+    int batch_start = 0;
+    while (batch_start < count) {
+        const RenderObject &head = first[m_draw_order[batch_start]];
+
+        int batch_end = batch_start + 1;
+        while (batch_end < count && first[m_draw_order[batch_end]].m_mesh == head.m_mesh &&
+               first[m_draw_order[batch_end]].m_material == head.m_material) {
+            batch_end++;
+        }
+        auto batch_size = (uint32_t) (batch_end - batch_start);
+
+        if (m_instancing_threshold > 0 && batch_size >= m_instancing_threshold &&
+            head.m_material->m_instanced_pipeline != VK_NULL_HANDLE &&
+            frame.m_instance_count + batch_size <= frame.m_instance_capacity) {
+            bind_pipeline(head.m_material->m_instanced_pipeline, *head.m_material);
+
+            for (uint32_t i = 0; i < batch_size; i++) {
+                const RenderObject &object = first[m_draw_order[batch_start + i]];
+                InstanceData &instance = frame.m_instances[frame.m_instance_count + i];
+                instance.m_model_matrix = object.m_transform_matrix;
+                instance.m_color = object.m_color;
+                instance.m_flags = object.m_flags;
+            }
+
+            cmd_draw_mesh(cmd, *head.m_mesh, batch_size, frame.m_instance_count);
+            frame.m_instance_count += batch_size;
+            m_render_stats.m_instanced_draws++;
+            m_render_stats.m_instances += batch_size;
+        } else {
+            bind_pipeline(head.m_material->m_pipeline, *head.m_material);
+
+            for (int i = batch_start; i < batch_end; i++) {
+                const RenderObject &object = first[m_draw_order[i]];
+
+                MeshPushConstants constants{};
+                constants.data = object.m_color;
+                constants.model_matrix = object.m_transform_matrix;
+                vkCmdPushConstants(cmd, object.m_material->m_pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0,
+                                   sizeof(MeshPushConstants), &constants);
+
+                cmd_draw_mesh(cmd, *object.m_mesh);
+            }
+        }
+
+        batch_start = batch_end;
+    }
+
+    if (frame.m_instance_count > first_written_instance) {
+        vmaFlushAllocation(m_allocator, frame.m_instance_buffer.m_allocation,
+                           (VkDeviceSize) first_written_instance * sizeof(InstanceData),
+                           (VkDeviceSize) (frame.m_instance_count - first_written_instance) * sizeof(InstanceData));
     }
-    *out_shader_module = shader_module;
-    return true;
 }
 
-void Engine::upload_mesh(Mesh &mesh) {
-    VkBufferCreateInfo buffer_info = {
-            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-            .size = mesh.m_vertices.size() * sizeof(Vertex),
-            .usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT
-    };
+void Engine::sort_draw_order(const RenderObject *first, int count) {
+    std::sort(m_draw_order.begin(), m_draw_order.begin() + count, [=](uint32_t a, uint32_t b) {
+        if (first[a].m_material != first[b].m_material) {
+            return first[a].m_material < first[b].m_material;
+        }
+        if (first[a].m_mesh != first[b].m_mesh) {
+            return first[a].m_mesh < first[b].m_mesh;
+        }
+        return a < b;
+    });
+}
 
-    VmaAllocationCreateInfo vma_alloc_info = {};
-    vma_alloc_info.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+void Engine::cmd_bind_material(VkCommandBuffer cmd, BoundPipeline &bound, VkPipeline pipeline,
+                               const Material &material) {
+    if (pipeline != bound.m_pipeline) {
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        bound.m_pipeline = pipeline;
+        m_render_stats.m_pipeline_binds++;
+        // A pipeline with the state baked in overwrites whatever was set
+        if (!material.m_dynamic_state) {
+            m_state_tracker.invalidate_render_state();
+        }
+    }
+    // Materials sharing a pipeline can still differ here, the tracker skips what didn't change
+    if (material.m_dynamic_state) {
+        m_state_tracker.apply(cmd, material.m_state);
+    }
+    if (material.m_pipeline_layout != bound.m_layout) {
+        uint32_t frame_index = m_frame_count % FRAMES_IN_FLIGHT;
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, material.m_pipeline_layout, 0, 1,
+                                &m_frames[frame_index].m_global_descriptor, 0, nullptr);
+        // Lit materials read the light clusters from set 1 and the shadows from set 2
+        if (material.m_lit) {
+            m_lighting.cmd_bind(cmd, material.m_pipeline_layout, frame_index);
+            m_shadows.cmd_bind(cmd, material.m_pipeline_layout, frame_index);
+        }
+        bound.m_layout = material.m_pipeline_layout;
+    }
+}
+
+// The depth prepass shares the main pass depth test, materials testing or writing depth
+// differently would end up with a different depth buffer
+static bool in_depth_prepass(const Material &material) {
+    return material.m_state.m_depth_test && material.m_state.m_depth_write &&
+           material.m_state.m_depth_compare_op == VK_COMPARE_OP_LESS_OR_EQUAL;
+}
+
+void Engine::prepare_culling(FrameData &frame, uint32_t frame_index) {
+    m_last_culled_batches.swap(m_culled_batches);
+    m_culled_batches.clear();
+    m_unculled_objects.clear();
+
+    // Drawn indirectly, each object is one instance of the instance buffer
+    m_draw_order.clear();
+    for (uint32_t i = 0; i < (uint32_t) m_renderables.size(); i++) {
+        const RenderObject &object = m_renderables[i];
+        if (object.m_material->m_instanced_pipeline != VK_NULL_HANDLE &&
+            m_geometry.get_range(object.m_mesh->m_geometry_handle).m_index_count > 0) {
+            m_draw_order.push_back(i);
+        } else if (!m_enable_cpu_culling || m_cpu_visible[i]) {
+            m_unculled_objects.push_back(object);
+        }
+    }
+    // Indices into m_renderables here, keeps the object order (and the visibility of last frame)
+    // stable while the scene doesn't change
+    sort_draw_order(m_renderables.data(), (int) m_draw_order.size());
+
+    auto object_count = (uint32_t) m_draw_order.size();
+    if (object_count > m_occlusion_culler.capacity()) {
+        // The visibility buffer is shared by the frames in flight
+        m_graphics_timeline.wait_idle();
+        m_occlusion_culler.reserve(std::max(object_count, m_occlusion_culler.capacity() * 2));
+        // New draw command buffers
+        invalidate_command_cache();
+    }
+
+    CullObject *cull_objects = m_occlusion_culler.map_objects(frame_index, object_count);
+    uint32_t first_instance = frame.m_instance_count;
+    for (uint32_t i = 0; i < object_count; i++) {
+        const RenderObject &object = m_renderables[m_draw_order[i]];
 
-    VK_CHECK(vmaCreateBuffer(m_allocator, &buffer_info, &vma_alloc_info,
-                             &mesh.m_vertex_buffer.m_buffer,
-                             &mesh.m_vertex_buffer.m_allocation,
-                             nullptr));
+        InstanceData &instance = frame.m_instances[first_instance + i];
+        instance.m_model_matrix = object.m_transform_matrix;
+        instance.m_color = object.m_color;
+        instance.m_flags = object.m_flags;
 
-    m_main_deletion_queue.push_function([=, this]() {
-        vmaDestroyBuffer(m_allocator, mesh.m_vertex_buffer.m_buffer, mesh.m_vertex_buffer.m_allocation);
+        // The radius grows with the largest scale of the transform
+        const glm::mat4 &transform = object.m_transform_matrix;
+        float scale = std::max({glm::length(glm::vec3(transform[0])), glm::length(glm::vec3(transform[1])),
+                                glm::length(glm::vec3(transform[2]))});
+        glm::vec4 bounds = object.m_mesh->m_bounds;
+
+        const GeometryRange &range = m_geometry.get_range(object.m_mesh->m_geometry_handle);
+        cull_objects[i] = {
+                .m_sphere = glm::vec4(glm::vec3(transform * glm::vec4(glm::vec3(bounds), 1.f)), bounds.w * scale),
+                .m_index_count = range.m_index_count,
+                .m_first_index = range.m_first_index,
+                .m_vertex_offset = (int32_t) range.m_first_vertex,
+                .m_first_instance = first_instance + i
+        };
+
+        if (m_culled_batches.empty() || m_culled_batches.back().m_material != object.m_material) {
+            m_culled_batches.push_back({object.m_material, i, 0});
+        }
+        m_culled_batches.back().m_count++;
+    }
+    // The batches are all the cached draws depend on in the scene
+    if (m_culled_batches != m_last_culled_batches) {
+        invalidate_command_cache();
+    }
+
+    if (object_count > 0) {
+        frame.m_instance_count += object_count;
+        vmaFlushAllocation(m_allocator, frame.m_instance_buffer.m_allocation,
+                           (VkDeviceSize) first_instance * sizeof(InstanceData),
+                           (VkDeviceSize) object_count * sizeof(InstanceData));
+    }
+
+    m_occlusion_culler.update(frame_index, frame.m_camera->m_view, frame.m_camera->m_projection, CAMERA_Z_NEAR,
+                              m_enable_occlusion_culling);
+}
+
+void Engine::declare_frame_graph(uint32_t swapchain_image_index, bool gpu_culling, bool lit) {
+    uint32_t frame_index = m_frame_count % FRAMES_IN_FLIGHT;
+    RenderGraph &graph = m_render_graph;
+    graph.begin();
+
+    FrameGraphResources resources;
+    // The submit waits for the acquire at color output, and it's left ready to present (or to
+    // be copied from when headless)
+    RenderGraphAccess swapchain_final = m_headless ?
+            RenderGraphAccess{VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT,
+                              VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL} :
+            RenderGraphAccess{VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR};
+    resources.m_swapchain = graph.import_image("swapchain", m_swapchain_images[swapchain_image_index],
+                                               m_swapchain_images_view[swapchain_image_index],
+                                               VK_IMAGE_ASPECT_COLOR_BIT,
+                                               {VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_NONE,
+                                                VK_IMAGE_LAYOUT_UNDEFINED}, swapchain_final);
+    if (!m_headless) {
+        graph.wait_before(resources.m_swapchain,
+                          {m_present_semaphore, 0, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT});
+    }
+    // Cleared every frame like the depth, the last upscale may still be reading it
+    bool upscale = m_resolution_settings.m_enabled;
+    resources.m_color = upscale ?
+            graph.import_image("scene_color", m_dynamic_resolution.image(), m_dynamic_resolution.view(),
+                               VK_IMAGE_ASPECT_COLOR_BIT,
+                               {RG_FRAGMENT_SAMPLED.m_stages, VK_ACCESS_2_NONE, VK_IMAGE_LAYOUT_UNDEFINED}) :
+            resources.m_swapchain;
+    // Cleared by its first pass every frame, so it can share memory with the other transients
+    resources.m_depth = graph.create_image("depth", {
+            .m_format = m_depth_format,
+            .m_extent = m_render_target_extent,
+            .m_usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+            .m_aspect = VK_IMAGE_ASPECT_DEPTH_BIT
     });
 
-    // Copy the data
-    void *data;
-    vmaMapMemory(m_allocator, mesh.m_vertex_buffer.m_allocation, &data);
+    // Only read when a lit material is drawn, otherwise the binning is culled. Nothing before
+    // the shading needs it, so on async compute it runs next to the shadows and the prepass.
+    resources.m_light_clusters = graph.create_buffer("light_clusters");
+    resources.m_lit = lit;
+    GpuQueue compute_queue = m_enable_async_compute ? GpuQueue::Compute : GpuQueue::Graphics;
+
+    RenderGraph::Pass pass = graph.add_pass("light_clusters", [=, this](VkCommandBuffer cmd) {
+        m_lighting.cmd_build_clusters(cmd, frame_index);
+    }, compute_queue);
+    graph.use(pass, resources.m_light_clusters, RG_COMPUTE_WRITE);
+
+    // Only needs the particles of the last frame, on async compute with the binning. Writes the
+    // imported buffers so it's never culled, the particles keep living while nothing is drawn.
+    bool particles = m_particles.capacity() > 0;
+    RenderGraph::Resource particle_buffers = {};
+    RenderGraph::Resource particle_draws = {};
+    if (particles) {
+        particle_buffers = graph.import_buffer("particles");
+        particle_draws = graph.create_buffer("particle_draws");
+        pass = graph.add_pass("particles_simulate", [=, this](VkCommandBuffer cmd) {
+            m_particles.cmd_simulate(cmd, frame_index);
+        }, compute_queue);
+        graph.use(pass, particle_buffers, RG_COMPUTE_WRITE);
+        graph.use(pass, particle_draws, RG_COMPUTE_WRITE);
+    }
+
+    // Before anything draws the instances. The last frame drew the vertices it overwrites, and
+    // writing an imported buffer means it's never culled.
+    resources.m_skinned = m_skinning.has_work(frame_index);
+    if (resources.m_skinned) {
+        resources.m_skinned_vertices = graph.import_buffer("skinned_vertices", RG_VERTEX_INPUT);
+        pass = graph.add_pass("skinning", [=, this](VkCommandBuffer cmd) {
+            m_skinning.cmd_skin(cmd, frame_index);
+        });
+        graph.use(pass, resources.m_skinned_vertices, RG_COMPUTE_WRITE);
+    }
+
+    // Kept across frames for the cached cascades, left in the layout the shading samples it in
+    if (resources.m_lit) {
+        RenderGraphAccess shadow_initial = m_shadows.layout_initialized() ?
+                RenderGraphAccess{VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_NONE,
+                                  VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL} : RenderGraphAccess{};
+        resources.m_shadow_map = graph.import_image("shadow_cascades", m_shadows.image(), m_shadows.view(),
+                                                    VK_IMAGE_ASPECT_DEPTH_BIT, shadow_initial);
+        m_shadows.set_layout_initialized();
+
+        if (!m_shadow_cascade_draws.empty()) {
+            pass = graph.add_pass("shadow_cascades", [=, this](VkCommandBuffer cmd) {
+                cmd_render_shadows(cmd);
+            });
+            graph.use(pass, resources.m_shadow_map, RG_DEPTH_ATTACHMENT);
+            use_skinned_vertices(pass, resources);
+        }
+    }
+
+    if (gpu_culling) {
+        resources.m_depth_pyramid = graph.create_image("depth_pyramid", {
+                .m_format = VK_FORMAT_R32_SFLOAT,
+                .m_extent = m_occlusion_culler.pyramid_extent(),
+                .m_usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                .m_levels = m_occlusion_culler.pyramid_levels()
+        });
+        declare_culled_passes(resources);
+    } else {
+        VkImageView color_view = graph.view(resources.m_color);
+        pass = graph.add_pass("main_pass", [=, this](VkCommandBuffer cmd) {
+            cmd_begin_rendering(cmd, color_view, VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_LOAD_OP_CLEAR);
+            cmd_render_commands(cmd);
+            vkCmdEndRendering(cmd);
+        });
+        use_shading_resources(pass, resources);
+    }
+
+    // Blended last, over everything opaque
+    if (particles) {
+        VkImageView color_view = graph.view(resources.m_color);
+        pass = graph.add_pass("particles", [=, this](VkCommandBuffer cmd) {
+            cmd_draw_particles(cmd, color_view);
+        });
+        graph.use(pass, resources.m_color, RG_COLOR_ATTACHMENT);
+        graph.use(pass, resources.m_depth, RG_DEPTH_ATTACHMENT);
+        graph.use(pass, particle_buffers, RG_VERTEX_READ);
+        graph.use(pass, particle_draws, RG_INDIRECT_READ);
+    }
+
+    // Everything before drew at the render extent, the UI goes on top at full resolution
+    if (upscale) {
+        VkImageView swapchain_view = graph.view(resources.m_swapchain);
+        pass = graph.add_pass("upscale", [=, this](VkCommandBuffer cmd) {
+            cmd_upscale(cmd, swapchain_view);
+        });
+        graph.use(pass, resources.m_color, RG_FRAGMENT_SAMPLED);
+        graph.use(pass, resources.m_swapchain, RG_COLOR_ATTACHMENT);
+    }
+
+    ImDrawData *imgui_draw_data = imgui_enabled() ? ImGui::GetDrawData() : nullptr;
+    if (imgui_draw_data && imgui_draw_data->CmdListsCount > 0) {
+        pass = graph.add_pass("imgui", [=, this](VkCommandBuffer cmd) {
+            VkRenderPassBeginInfo imgui_pass_info = {
+                    .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+                    .pNext = nullptr,
+                    .renderPass = m_imgui_render_pass,
+                    .framebuffer = m_imgui_framebuffers[swapchain_image_index],
+                    .renderArea = {0, 0, m_window_extent},
+                    .clearValueCount = 0,
+                    .pClearValues = nullptr
+            };
+            vkCmdBeginRenderPass(cmd, &imgui_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+            ImGui_ImplVulkan_RenderDrawData(imgui_draw_data, cmd);
+            vkCmdEndRenderPass(cmd);
+        });
+        graph.use(pass, resources.m_swapchain, RG_COLOR_ATTACHMENT);
+    }
+
+    // The transient images only exist once compiled, and change when the frame does. The culler's
+    // descriptors of this frame slot must point at them before anything is recorded.
+    graph.prepare();
+    m_depth_image_view = graph.view(resources.m_depth);
+    if (gpu_culling) {
+        VkImageView level_views[MAX_DEPTH_PYRAMID_LEVELS];
+        for (uint32_t level = 0; level < m_occlusion_culler.pyramid_levels(); level++) {
+            level_views[level] = graph.level_view(resources.m_depth_pyramid, level);
+        }
+        m_occlusion_culler.set_images(frame_index, graph.stats().m_compiles, m_depth_image_view,
+                                      graph.view(resources.m_depth_pyramid), level_views);
+    }
+}
+
+void Engine::use_shading_resources(RenderGraph::Pass pass, const FrameGraphResources &resources) {
+    m_render_graph.use(pass, resources.m_color, RG_COLOR_ATTACHMENT);
+    m_render_graph.use(pass, resources.m_depth, RG_DEPTH_ATTACHMENT);
+    if (resources.m_lit) {
+        m_render_graph.use(pass, resources.m_light_clusters, RG_FRAGMENT_READ);
+        m_render_graph.use(pass, resources.m_shadow_map, RG_FRAGMENT_SAMPLED);
+    }
+    use_skinned_vertices(pass, resources);
+}
+
+void Engine::use_skinned_vertices(RenderGraph::Pass pass, const FrameGraphResources &resources) {
+    if (resources.m_skinned) {
+        m_render_graph.use(pass, resources.m_skinned_vertices, RG_VERTEX_INPUT);
+    }
+}
+
+void Engine::declare_culled_passes(const FrameGraphResources &resources) {
+    uint32_t frame_index = m_frame_count % FRAMES_IN_FLIGHT;
+    RenderGraph &graph = m_render_graph;
+
+    // The culler's buffers: draw commands and visibility
+    RenderGraph::Resource cull_commands = graph.create_buffer("cull_commands");
+    RenderGraph::Resource depth_pyramid = resources.m_depth_pyramid;
+    VkImageView color_view = graph.view(resources.m_color);
+
+    // Only needs last frame's visibility, overlaps the shadows on async compute. The late phase
+    // depends on this frame's depth, it stays on graphics with the pyramid.
+    GpuQueue compute_queue = m_enable_async_compute ? GpuQueue::Compute : GpuQueue::Graphics;
+    RenderGraph::Pass pass = graph.add_pass("cull_early", [=, this](VkCommandBuffer cmd) {
+        m_occlusion_culler.cmd_cull(cmd, frame_index, false);
+    }, compute_queue);
+    graph.use(pass, cull_commands, RG_COMPUTE_WRITE);
+    // Never sampled in the early phase, but bound. Without occlusion nothing else uses the
+    // pyramid, this keeps it alive.
+    if (!m_enable_occlusion_culling) {
+        graph.use(pass, depth_pyramid, RG_COMPUTE_READ);
+    }
+
+    // Early phase, what was visible last frame
+    if (m_enable_depth_prepass) {
+        pass = graph.add_pass("depth_prepass", [=, this](VkCommandBuffer cmd) {
+            cmd_render_culled(cmd, VK_NULL_HANDLE, VK_ATTACHMENT_LOAD_OP_DONT_CARE, VK_ATTACHMENT_LOAD_OP_CLEAR,
+                              true, false, false);
+        });
+        graph.use(pass, resources.m_depth, RG_DEPTH_ATTACHMENT);
+        use_skinned_vertices(pass, resources);
+    } else {
+        pass = graph.add_pass("main_pass", [=, this](VkCommandBuffer cmd) {
+            // Nothing comes after without occlusion
+            cmd_render_culled(cmd, color_view, VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_LOAD_OP_CLEAR,
+                              true, false, !m_enable_occlusion_culling);
+        });
+        use_shading_resources(pass, resources);
+    }
+    graph.use(pass, cull_commands, RG_INDIRECT_READ);
+
+    // Late phase, what the depth drawn so far doesn't hide
+    if (m_enable_occlusion_culling) {
+        pass = graph.add_pass("depth_pyramid", [=, this](VkCommandBuffer cmd) {
+            m_occlusion_culler.cmd_build_pyramid(cmd, frame_index, m_render_extent);
+        });
+        graph.use(pass, resources.m_depth, RG_COMPUTE_SAMPLED);
+        graph.use(pass, depth_pyramid, RG_COMPUTE_WRITE);
+
+        pass = graph.add_pass("cull_late", [=, this](VkCommandBuffer cmd) {
+            m_occlusion_culler.cmd_cull(cmd, frame_index, true);
+        });
+        graph.use(pass, depth_pyramid, RG_COMPUTE_READ);
+        graph.use(pass, cull_commands, RG_COMPUTE_WRITE);
+
+        if (m_enable_depth_prepass) {
+            pass = graph.add_pass("depth_prepass_late", [=, this](VkCommandBuffer cmd) {
+                cmd_render_culled(cmd, VK_NULL_HANDLE, VK_ATTACHMENT_LOAD_OP_DONT_CARE, VK_ATTACHMENT_LOAD_OP_LOAD,
+                                  false, true, false);
+            });
+            graph.use(pass, resources.m_depth, RG_DEPTH_ATTACHMENT);
+            use_skinned_vertices(pass, resources);
+        } else {
+            pass = graph.add_pass("main_pass_late", [=, this](VkCommandBuffer cmd) {
+                cmd_render_culled(cmd, color_view, VK_ATTACHMENT_LOAD_OP_LOAD, VK_ATTACHMENT_LOAD_OP_LOAD,
+                                  false, true, true);
+            });
+            use_shading_resources(pass, resources);
+        }
+        graph.use(pass, cull_commands, RG_INDIRECT_READ);
+    }
+
+    // Shading on top of the prepass depth, only the closest surface passes the depth test
+    if (m_enable_depth_prepass) {
+        pass = graph.add_pass("main_pass", [=, this](VkCommandBuffer cmd) {
+            cmd_render_culled(cmd, color_view, VK_ATTACHMENT_LOAD_OP_CLEAR, VK_ATTACHMENT_LOAD_OP_LOAD,
+                              true, m_enable_occlusion_culling, true);
+        });
+        use_shading_resources(pass, resources);
+        graph.use(pass, cull_commands, RG_INDIRECT_READ);
+    }
+}
+
+void Engine::update_scene_bvh() {
+    // The radius grows with the largest scale of the transform
+    m_object_spheres.resize(m_renderables.size());
+    for (size_t i = 0; i < m_renderables.size(); i++) {
+        const RenderObject &object = m_renderables[i];
+        const glm::mat4 &transform = object.m_transform_matrix;
+        float scale = std::max({glm::length(glm::vec3(transform[0])), glm::length(glm::vec3(transform[1])),
+                                glm::length(glm::vec3(transform[2]))});
+        glm::vec4 bounds = object.m_mesh->m_bounds;
+        m_object_spheres[i] = glm::vec4(glm::vec3(transform * glm::vec4(glm::vec3(bounds), 1.f)), bounds.w * scale);
+    }
+
+    if (m_scene_bvh.object_count() != m_renderables.size()) {
+        std::vector<Aabb> bounds(m_renderables.size());
+        for (size_t i = 0; i < m_renderables.size(); i++) {
+            bounds[i] = Aabb::from_sphere(m_object_spheres[i]);
+        }
+        m_scene_bvh.build(bounds);
+        return;
+    }
+
+    // Only the objects that moved touch the tree
+    for (uint32_t i = 0; i < (uint32_t) m_renderables.size(); i++) {
+        m_scene_bvh.update(i, Aabb::from_sphere(m_object_spheres[i]));
+    }
+    m_scene_bvh.refit();
+    m_scene_bvh.poll_rebuild();
+    if (m_scene_bvh.needs_rebuild()) {
+        m_scene_bvh.start_rebuild();
+    }
+}
+
+void Engine::cull_renderables(const glm::mat4 &view_projection) {
+    m_bvh_results.clear();
+    m_scene_bvh.query_frustum(Frustum::from_matrix(view_projection), m_bvh_results);
+
+    m_cpu_visible.assign(m_renderables.size(), 0);
+    for (uint32_t object: m_bvh_results) {
+        m_cpu_visible[object] = 1;
+    }
+    m_render_stats.m_cpu_culled = (uint32_t) (m_renderables.size() - m_bvh_results.size());
+}
+
+uint32_t Engine::pick(double cursor_x, double cursor_y) const {
+    // The projection flips y, so NDC goes down like the window does
+    glm::vec2 ndc = {(float) (cursor_x / m_window_extent.width) * 2.f - 1.f,
+                     (float) (cursor_y / m_window_extent.height) * 2.f - 1.f};
+    glm::mat4 inverse_view_projection = glm::inverse(get_view_projection());
+    glm::vec4 near_point = inverse_view_projection * glm::vec4(ndc, 0.f, 1.f);
+    glm::vec4 far_point = inverse_view_projection * glm::vec4(ndc, 1.f, 1.f);
+    glm::vec3 origin = glm::vec3(near_point) / near_point.w;
+    glm::vec3 direction = glm::vec3(far_point) / far_point.w - origin;
+
+    // The direction spans the whole depth range
+    BvhRayHit hit;
+    return m_scene_bvh.raycast(origin, direction, 1.f, hit) ? hit.m_object : UINT32_MAX;
+}
+
+void Engine::cull_shadow_casters() {
+    m_shadow_casters.clear();
+
+    for (uint32_t cascade = 0; cascade < m_shadows.cascade_count(); cascade++) {
+        if (!m_shadows.needs_render(cascade)) {
+            continue;
+        }
+
+        // The cascade's box reaches back towards the light, far enough for its casters
+        m_bvh_results.clear();
+        m_scene_bvh.query_frustum(Frustum::from_matrix(m_shadows.view_projection(cascade)), m_bvh_results);
+
+        bool cached = m_shadows.is_cached(cascade);
+        auto first = (uint32_t) m_shadow_casters.size();
+        for (uint32_t i: m_bvh_results) {
+            if ((!cached || !m_renderables[i].m_dynamic) && m_shadows.casts_into(cascade, m_object_spheres[i])) {
+                m_shadow_casters.push_back(i);
+            }
+        }
+
+        // Sorted by mesh so they batch
+        std::sort(m_shadow_casters.begin() + first, m_shadow_casters.end(), [&](uint32_t a, uint32_t b) {
+            return m_renderables[a].m_mesh < m_renderables[b].m_mesh;
+        });
+        m_shadow_cascade_draws.push_back({cascade, first, (uint32_t) m_shadow_casters.size() - first});
+    }
+}
+
+void Engine::prepare_shadows(FrameData &frame) {
+    m_shadow_batches.clear();
+
+    uint32_t first_written_instance = frame.m_instance_count;
+    for (ShadowCascadeDraws &draws: m_shadow_cascade_draws) {
+        auto first_batch = (uint32_t) m_shadow_batches.size();
+        for (uint32_t i = draws.m_first; i < draws.m_first + draws.m_count; i++) {
+            const RenderObject &object = m_renderables[m_shadow_casters[i]];
+            if (m_shadow_batches.size() == first_batch || m_shadow_batches.back().m_mesh != object.m_mesh) {
+                m_shadow_batches.push_back({object.m_mesh, frame.m_instance_count, 0});
+            }
 
-    memcpy(data, mesh.m_vertices.data(), mesh.m_vertices.size() * sizeof(Vertex));
+            InstanceData &instance = frame.m_instances[frame.m_instance_count++];
+            instance.m_model_matrix = object.m_transform_matrix;
+            instance.m_color = object.m_color;
+            instance.m_flags = object.m_flags;
+            m_shadow_batches.back().m_count++;
+        }
 
-    vmaUnmapMemory(m_allocator, mesh.m_vertex_buffer.m_allocation);
-}
\ No newline at end of file
+        m_render_stats.m_shadow_cascades++;
+        m_render_stats.m_shadow_casters += draws.m_count;
+        draws.m_first = first_batch;
+        draws.m_count = (uint32_t) m_shadow_batches.size() - first_batch;
+    }
+
+    if (frame.m_instance_count > first_written_instance) {
+        vmaFlushAllocation(m_allocator, frame.m_instance_buffer.m_allocation,
+                           (VkDeviceSize) first_written_instance * sizeof(InstanceData),
+                           (VkDeviceSize) (frame.m_instance_count - first_written_instance) * sizeof(InstanceData));
+    }
+    m_shadow_casters.clear();
+}
+
+void Engine::cmd_render_shadows(VkCommandBuffer cmd) {
+    const FrameData &frame = m_frames[m_frame_count % FRAMES_IN_FLIGHT];
+
+    for (const ShadowCascadeDraws &draws: m_shadow_cascade_draws) {
+        m_shadows.cmd_begin_cascade(cmd, draws.m_cascade);
+
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_shadow_pipeline);
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_shadow_pipeline_layout, 0, 1,
+                                &frame.m_global_descriptor, 0, nullptr);
+        m_render_stats.m_pipeline_binds++;
+        const glm::mat4 &view_projection = m_shadows.view_projection(draws.m_cascade);
+        vkCmdPushConstants(cmd, m_shadow_pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(glm::mat4),
+                           &view_projection);
+
+        m_geometry.cmd_bind(cmd);
+        m_render_stats.m_vertex_buffer_binds++;
+        for (uint32_t i = draws.m_first; i < draws.m_first + draws.m_count; i++) {
+            const ShadowBatch &batch = m_shadow_batches[i];
+            cmd_draw_mesh(cmd, *batch.m_mesh, batch.m_count, batch.m_first_instance);
+        }
+
+        vkCmdEndRendering(cmd);
+    }
+}
+
+void Engine::cmd_draw_culled(VkCommandBuffer cmd, bool late, bool depth_only) {
+    if (m_culled_batches.empty()) {
+        return;
+    }
+
+    VkBuffer commands = m_occlusion_culler.draw_commands(m_frame_count % FRAMES_IN_FLIGHT, late);
+
+    m_geometry.cmd_bind(cmd);
+    m_render_stats.m_vertex_buffer_binds++;
+
+    BoundPipeline bound;
+    if (depth_only) {
+        // Every material goes through the same pipeline, only the render state changes
+        const FrameData &frame = m_frames[m_frame_count % FRAMES_IN_FLIGHT];
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_depth_prepass_pipeline);
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, m_debug_mesh_pipeline_layout, 0, 1,
+                                &frame.m_global_descriptor, 0, nullptr);
+        m_render_stats.m_pipeline_binds++;
+    }
+
+    for (const CulledBatch &batch: m_culled_batches) {
+        if (depth_only) {
+            if (!in_depth_prepass(*batch.m_material)) {
+                continue;
+            }
+            m_state_tracker.apply(cmd, batch.m_material->m_state);
+        } else {
+            cmd_bind_material(cmd, bound, batch.m_material->m_instanced_pipeline, *batch.m_material);
+        }
+
+        // One command per object, the culled ones draw no instance
+        vkCmdDrawIndexedIndirect(cmd, commands, (VkDeviceSize) batch.m_first * sizeof(VkDrawIndexedIndirectCommand),
+                                 batch.m_count, sizeof(VkDrawIndexedIndirectCommand));
+        m_render_stats.m_draw_calls++;
+    }
+}
+
+void Engine::cmd_draw_unculled(VkCommandBuffer cmd) {
+    cmd_draw_debug_meshes(cmd);
+    draw_objects(cmd, m_unculled_objects.data(), (int) m_unculled_objects.size());
+}
+
+void Engine::cmd_render_culled(VkCommandBuffer cmd, VkImageView color_view, VkAttachmentLoadOp color_load_op,
+                               VkAttachmentLoadOp depth_load_op, bool early, bool late, bool unculled) {
+    bool depth_only = color_view == VK_NULL_HANDLE;
+    if (!m_enable_command_cache) {
+        cmd_begin_rendering(cmd, color_view, color_load_op, depth_load_op);
+        if (early) {
+            cmd_draw_culled(cmd, false, depth_only);
+        }
+        if (late) {
+            cmd_draw_culled(cmd, true, depth_only);
+        }
+        if (unculled) {
+            cmd_draw_unculled(cmd);
+        }
+        vkCmdEndRendering(cmd);
+        return;
+    }
+
+    uint32_t frame_index = m_frame_count % FRAMES_IN_FLIGHT;
+    SecondaryRendering rendering = {depth_only ? VK_FORMAT_UNDEFINED : m_swapchain_image_format, m_depth_format};
+    // Both only grow, so the sum changes when either does
+    uint64_t key = m_command_cache_version + m_lighting.descriptor_writes();
+
+    VkCommandBuffer secondaries[3];
+    uint32_t secondary_count = 0;
+    for (bool phase_late: {false, true}) {
+        if (m_culled_batches.empty() || !(phase_late ? late : early)) {
+            continue;
+        }
+        // One per phase for the depth and for the shading passes
+        uint64_t id = (phase_late ? 2 : 0) + (depth_only ? 1 : 0);
+        secondaries[secondary_count++] = m_command_cache.get(frame_index, id, key, rendering,
+                                                             [&](VkCommandBuffer secondary) {
+            cmd_set_viewport(secondary);
+            cmd_draw_culled(secondary, phase_late, depth_only);
+        });
+    }
+    // The debug monkey spins and the objects may have been CPU culled, recorded every frame
+    if (unculled && (!m_debug_monkey_mesh.m_vertices.empty() || !m_unculled_objects.empty())) {
+        secondaries[secondary_count++] = m_command_cache.record_transient(frame_index, rendering,
+                                                                          [&](VkCommandBuffer secondary) {
+            cmd_set_viewport(secondary);
+            cmd_draw_unculled(secondary);
+        });
+    }
+
+    // Still begun with nothing to draw, for the clears
+    cmd_begin_rendering(cmd, color_view, color_load_op, depth_load_op,
+                        VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT);
+    if (secondary_count > 0) {
+        vkCmdExecuteCommands(cmd, secondary_count, secondaries);
+    }
+    vkCmdEndRendering(cmd);
+}
+
+VkPipeline Engine::build_pipeline(const PipelineBuilder &builder, const std::vector<ShaderFile> &shaders,
+                                  VkPipelineLayout *out_layout) {
+    PipelineBuilder pipeline_builder = builder;
+    VkPipeline pipeline = create_pipeline(pipeline_builder, shaders);
+    if (pipeline == VK_NULL_HANDLE) {
+        return VK_NULL_HANDLE;
+    }
+
+    // Keeps the derived layout, a hot reload must stay compatible with it
+    m_pipelines.push_back({
+            .m_builder = pipeline_builder,
+            .m_shaders = shaders,
+            .m_pipeline = pipeline
+    });
+    if (pipeline_builder.has_dynamic_render_state()) {
+        m_dynamic_state_pipelines.insert(pipeline);
+    }
+
+    if (out_layout) {
+        *out_layout = pipeline_builder.m_pipeline_layout;
+    }
+    return pipeline;
+}
+
+VkPipeline Engine::create_pipeline(PipelineBuilder &builder, const std::vector<ShaderFile> &shaders) {
+    // The vertex input is trimmed to what the shaders read, on a copy so a reload can read more
+    PipelineBuilder pipeline_builder = builder;
+    pipeline_builder.m_shader_stages.clear();
+
+    std::vector<VkShaderModule> modules;
+    PipelineReflection reflection;
+    bool loaded = true;
+    for (const ShaderFile &shader: shaders) {
+        std::vector<uint32_t> code;
+        ShaderReflection stage_reflection;
+        VkShaderModule module;
+        if (!load_spirv(shader.m_path.c_str(), &code) || !reflect_spirv(code, &stage_reflection) ||
+            !reflection.add_stage(stage_reflection) || !create_shader_module(code, &module)) {
+            std::cout << "Error when building the shader module " << shader.m_path << std::endl;
+            loaded = false;
+            break;
+        }
+        modules.push_back(module);
+        pipeline_builder.m_shader_stages.push_back(
+                Initializers::pipeline_shader_stage_create_info(shader.m_stage, module));
+    }
+
+    if (loaded) {
+        if (pipeline_builder.m_pipeline_layout == VK_NULL_HANDLE) {
+            pipeline_builder.m_pipeline_layout = derive_pipeline_layout(reflection);
+            loaded = pipeline_builder.m_pipeline_layout != VK_NULL_HANDLE;
+        } else {
+            loaded = check_pipeline_layout(pipeline_builder.m_pipeline_layout, reflection);
+        }
+    }
+    loaded = loaded && select_vertex_input(pipeline_builder, reflection);
+
+    VkPipeline pipeline = loaded ? pipeline_builder.build_pipeline(m_device) : VK_NULL_HANDLE;
+
+    // Modules are only needed to create the pipeline
+    for (VkShaderModule module: modules) {
+        vkDestroyShaderModule(m_device, module, nullptr);
+    }
+
+    if (pipeline != VK_NULL_HANDLE) {
+        builder.m_pipeline_layout = pipeline_builder.m_pipeline_layout;
+    }
+    return pipeline;
+}
+
+// Every binding in needed exists in available with the same type, at least as many descriptors
+// and visible to the same stages
+static bool bindings_provided(const std::vector<VkDescriptorSetLayoutBinding> &needed,
+                              const std::vector<VkDescriptorSetLayoutBinding> &available, uint32_t set) {
+    for (const VkDescriptorSetLayoutBinding &binding: needed) {
+        auto it = std::find_if(available.begin(), available.end(), [&](const VkDescriptorSetLayoutBinding &other) {
+            return other.binding == binding.binding;
+        });
+        if (it == available.end() || it->descriptorType != binding.descriptorType ||
+            it->descriptorCount < binding.descriptorCount ||
+            (it->stageFlags & binding.stageFlags) != binding.stageFlags) {
+            std::cout << "Set " << set << " binding " << binding.binding
+                      << " used by the shaders doesn't match the pipeline layout" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+VkPipelineLayout Engine::derive_pipeline_layout(const PipelineReflection &reflection, bool global_set) {
+    LayoutCache::PipelineLayoutDesc desc;
+    for (uint32_t set = 0; set < reflection.m_sets.size(); set++) {
+        // Set 0 is the global set, shaders can use any part of it and always get the full layout,
+        // so they stay compatible with each other
+        if (global_set && set == 0 && !reflection.m_sets[0].empty()) {
+            if (!bindings_provided(reflection.m_sets[0], *m_layout_cache.find_set_bindings(m_global_set_layout), 0)) {
+                return VK_NULL_HANDLE;
+            }
+            desc.m_set_layouts.push_back(m_global_set_layout);
+        } else {
+            // Sets the shaders skip get an empty layout
+            desc.m_set_layouts.push_back(m_layout_cache.get_set_layout(reflection.m_sets[set]));
+        }
+    }
+
+    if (reflection.m_push_constants.size > 0) {
+        desc.m_push_constants.push_back(reflection.m_push_constants);
+    }
+
+    return m_layout_cache.get_pipeline_layout(desc);
+}
+
+bool Engine::create_compute_program(const char *file_path, ComputeProgram *out_program) {
+    if (!build_compute_program(file_path, out_program)) {
+        return false;
+    }
+    m_compute_programs.push_back({file_path, *out_program});
+    return true;
+}
+
+bool Engine::build_compute_program(const char *file_path, ComputeProgram *out_program) {
+    std::vector<uint32_t> code;
+    ShaderReflection reflection;
+    PipelineReflection pipeline_reflection;
+    VkShaderModule module;
+    if (!load_spirv(file_path, &code) || !reflect_spirv(code, &reflection) ||
+        reflection.m_stage != VK_SHADER_STAGE_COMPUTE_BIT || !pipeline_reflection.add_stage(reflection) ||
+        pipeline_reflection.m_sets.size() != 1 || !create_shader_module(code, &module)) {
+        std::cout << "Error when building the compute shader " << file_path << std::endl;
+        return false;
+    }
+
+    VkPipelineLayout layout = derive_pipeline_layout(pipeline_reflection, false);
+
+    VkComputePipelineCreateInfo pipeline_info = {
+            .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .stage = Initializers::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, module),
+            .layout = layout,
+            .basePipelineHandle = VK_NULL_HANDLE,
+            .basePipelineIndex = -1
+    };
+    VkPipeline pipeline;
+    VkResult result = vkCreateComputePipelines(m_device, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &pipeline);
+    vkDestroyShaderModule(m_device, module, nullptr);
+    if (result != VK_SUCCESS) {
+        std::cout << "Error when building the compute pipeline " << file_path << std::endl;
+        return false;
+    }
+
+    *out_program = {
+            .m_pipeline = pipeline,
+            .m_layout = layout,
+            .m_set_layout = m_layout_cache.find_pipeline_desc(layout)->m_set_layouts[0]
+    };
+    return true;
+}
+
+bool Engine::check_pipeline_layout(VkPipelineLayout layout, const PipelineReflection &reflection) const {
+    const LayoutCache::PipelineLayoutDesc *desc = m_layout_cache.find_pipeline_desc(layout);
+    if (!desc) {
+        // Made by hand, nothing to compare with
+        return true;
+    }
+
+    for (uint32_t set = 0; set < reflection.m_sets.size(); set++) {
+        if (reflection.m_sets[set].empty()) {
+            continue;
+        }
+        if (set >= desc->m_set_layouts.size()) {
+            std::cout << "Set " << set << " used by the shaders isn't in the pipeline layout" << std::endl;
+            return false;
+        }
+        const std::vector<VkDescriptorSetLayoutBinding> *bindings = m_layout_cache.find_set_bindings(
+                desc->m_set_layouts[set]);
+        if (bindings && !bindings_provided(reflection.m_sets[set], *bindings, set)) {
+            return false;
+        }
+    }
+
+    const VkPushConstantRange &needed = reflection.m_push_constants;
+    if (needed.size > 0) {
+        bool covered = std::any_of(desc->m_push_constants.begin(), desc->m_push_constants.end(),
+                                   [&](const VkPushConstantRange &range) {
+                                       return range.offset <= needed.offset &&
+                                              range.offset + range.size >= needed.offset + needed.size &&
+                                              (range.stageFlags & needed.stageFlags) == needed.stageFlags;
+                                   });
+        if (!covered) {
+            std::cout << "The push constants used by the shaders (" << needed.size
+                      << " bytes) aren't in the pipeline layout" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Engine::select_vertex_input(PipelineBuilder &builder, const PipelineReflection &reflection) const {
+    // 32 bit formats are the only ones reflection gives, others (ie normalized) can't be compared
+    auto is_32_bit_format = [](VkFormat format) {
+        return format >= VK_FORMAT_R32_UINT && format <= VK_FORMAT_R32G32B32A32_SFLOAT;
+    };
+
+    // Attributes nobody reads would still be fetched
+    uint32_t location_mask = 0;
+    for (const ReflectedVertexInput &input: reflection.m_vertex_inputs) {
+        auto it = std::find_if(builder.m_vertex_attributes.begin(), builder.m_vertex_attributes.end(),
+                               [&](const VkVertexInputAttributeDescription &attribute) {
+                                   return attribute.location == input.m_location;
+                               });
+        if (it == builder.m_vertex_attributes.end()) {
+            std::cout << "The vertex shader reads location " << input.m_location
+                      << " which isn't in the vertex description" << std::endl;
+            return false;
+        }
+        if (is_32_bit_format(it->format) && it->format != input.m_format) {
+            std::cout << "The vertex shader reads location " << input.m_location << " as format " << input.m_format
+                      << " but the vertex description gives " << it->format << std::endl;
+            return false;
+        }
+        location_mask |= 1u << input.m_location;
+    }
+
+    builder.m_vertex_location_mask = location_mask;
+    return true;
+}
+
+void Engine::apply_shader_reloads() {
+    std::vector<std::string> compiled = m_shader_hot_reload.poll_compiled();
+    if (compiled.empty()) {
+        return;
+    }
+
+    for (ReloadablePipeline &entry: m_pipelines) {
+        bool affected = std::any_of(entry.m_shaders.begin(), entry.m_shaders.end(), [&](const ShaderFile &shader) {
+            return std::find(compiled.begin(), compiled.end(), shader.m_path) != compiled.end();
+        });
+        if (!affected) {
+            continue;
+        }
+
+        // A shader that compiles can still fail to link with the rest of the pipeline, or need more
+        // than the layout it was created with gives
+        VkPipeline pipeline = create_pipeline(entry.m_builder, entry.m_shaders);
+        if (pipeline == VK_NULL_HANDLE) {
+            std::cout << "Shader hot reload: couldn't rebuild a pipeline, keeping the old one" << std::endl;
+            continue;
+        }
+
+        VkPipeline old_pipeline = entry.m_pipeline;
+        entry.m_pipeline = pipeline;
+        replace_pipeline(old_pipeline, pipeline);
+
+        // The frames in flight may still be using it
+        m_timeline_deletion_queue.push_function(m_graphics_timeline.next_value(), [=, this]() {
+            vkDestroyPipeline(m_device, old_pipeline, nullptr);
+        });
+    }
+
+    for (ReloadableComputeProgram &entry: m_compute_programs) {
+        if (std::find(compiled.begin(), compiled.end(), entry.m_path) == compiled.end()) {
+            continue;
+        }
+
+        ComputeProgram program;
+        if (!build_compute_program(entry.m_path.c_str(), &program)) {
+            std::cout << "Shader hot reload: couldn't rebuild " << entry.m_path << ", keeping the old one" << std::endl;
+            continue;
+        }
+        // The subsystem's descriptor sets were allocated with the old set layout
+        if (program.m_layout != entry.m_program.m_layout) {
+            std::cout << "Shader hot reload: " << entry.m_path
+                      << " changed its bindings or push constants, restart to use it" << std::endl;
+            vkDestroyPipeline(m_device, program.m_pipeline, nullptr);
+            continue;
+        }
+
+        VkPipeline old_pipeline = entry.m_program.m_pipeline;
+        entry.m_program.m_pipeline = program.m_pipeline;
+        replace_compute_pipeline(old_pipeline, program.m_pipeline);
+
+        // Dispatches of the frames in flight, on either queue, are done before their graphics work is
+        m_timeline_deletion_queue.push_function(m_graphics_timeline.next_value(), [=, this]() {
+            vkDestroyPipeline(m_device, old_pipeline, nullptr);
+        });
+    }
+}
+
+void Engine::replace_compute_pipeline(VkPipeline old_pipeline, VkPipeline new_pipeline) {
+    // Dispatches are recorded every frame, nothing cached to invalidate
+    m_occlusion_culler.replace_pipeline(old_pipeline, new_pipeline);
+    m_lighting.replace_pipeline(old_pipeline, new_pipeline);
+    m_particles.replace_pipeline(old_pipeline, new_pipeline);
+    m_skinning.replace_pipeline(old_pipeline, new_pipeline);
+}
+
+void Engine::replace_pipeline(VkPipeline old_pipeline, VkPipeline new_pipeline) {
+    // Rebuilt from the same builder, so with the same dynamic state
+    if (m_dynamic_state_pipelines.erase(old_pipeline)) {
+        m_dynamic_state_pipelines.insert(new_pipeline);
+    }
+
+    for (auto &[name, material]: m_materials) {
+        if (material.m_pipeline == old_pipeline) {
+            material.m_pipeline = new_pipeline;
+        }
+        if (material.m_instanced_pipeline == old_pipeline) {
+            material.m_instanced_pipeline = new_pipeline;
+        }
+    }
+
+    for (VkPipeline *pipeline: {&m_triangle_pipeline, &m_debug_mesh_pipeline, &m_debug_mesh_instanced_pipeline,
+                                &m_depth_prepass_pipeline, &m_shadow_pipeline, &m_particle_pipeline,
+                                &m_upscale_pipeline}) {
+        if (*pipeline == old_pipeline) {
+            *pipeline = new_pipeline;
+        }
+    }
+    invalidate_command_cache();
+}
+
+Material *Engine::create_material(VkPipeline pipeline, VkPipelineLayout layout, const std::string &name,
+                                  VkPipeline instanced_pipeline, const RenderState &state) {
+    bool dynamic_state = m_dynamic_state_pipelines.contains(pipeline);
+    if (instanced_pipeline != VK_NULL_HANDLE &&
+        m_dynamic_state_pipelines.contains(instanced_pipeline) != dynamic_state) {
+        std::cout << "Material " << name << ": both pipelines must have the same dynamic state" << std::endl;
+        abort();
+    }
+
+    const LayoutCache::PipelineLayoutDesc *desc = m_layout_cache.find_pipeline_desc(layout);
+    bool lit = desc && desc->m_set_layouts.size() > 2 && desc->m_set_layouts[1] == m_lighting.set_layout() &&
+               desc->m_set_layouts[2] == m_shadows.set_layout();
+
+    Material material{
+            .m_pipeline = pipeline,
+            .m_pipeline_layout = layout,
+            .m_instanced_pipeline = instanced_pipeline,
+            .m_state = state,
+            .m_dynamic_state = dynamic_state,
+            .m_lit = lit
+    };
+    m_materials[name] = material;
+    return &m_materials[name];
+}
+
+PipelineVariantStats Engine::get_pipeline_variant_stats() const {
+    // Few materials, linear searches are fine
+    std::vector<VkPipeline> pipelines;
+    std::vector<std::pair<VkPipeline, RenderState>> baked;
+    auto count = [&](VkPipeline pipeline, const RenderState &state) {
+        if (pipeline == VK_NULL_HANDLE) {
+            return;
+        }
+        if (std::find(pipelines.begin(), pipelines.end(), pipeline) == pipelines.end()) {
+            pipelines.push_back(pipeline);
+        }
+        if (std::find(baked.begin(), baked.end(), std::make_pair(pipeline, state)) == baked.end()) {
+            baked.emplace_back(pipeline, state);
+        }
+    };
+
+    for (const auto &[name, material]: m_materials) {
+        count(material.m_pipeline, material.m_state);
+        count(material.m_instanced_pipeline, material.m_state);
+    }
+
+    return {
+            .m_materials = (uint32_t) m_materials.size(),
+            .m_baked_pipelines = (uint32_t) baked.size(),
+            .m_pipelines = (uint32_t) pipelines.size()
+    };
+}
+
+Material *Engine::get_material(const std::string &name) {
+    auto it = m_materials.find(name);
+    if (it == m_materials.end()) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+Mesh *Engine::get_mesh(const std::string &name) {
+    auto it = m_meshes.find(name);
+    if (it == m_meshes.end()) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool Engine::load_scene(const char *file_path, std::vector<uint32_t> *out_parents) {
+    auto start = std::chrono::steady_clock::now();
+    SceneFile file;
+    if (!file.open(file_path)) {
+        return false;
+    }
+    m_scene_load_stats = {};
+    m_scene_load_stats.m_bytes = file.size();
+    m_scene_load_stats.m_map_ms = elapsed_ms(start);
+
+    // Only the names need a lookup, the objects index these
+    start = std::chrono::steady_clock::now();
+    std::vector<Mesh *> meshes(file.mesh_count());
+    for (uint32_t i = 0; i < file.mesh_count(); i++) {
+        meshes[i] = get_mesh(std::string(file.mesh_name(i)));
+        if (meshes[i] == nullptr) {
+            std::cout << file_path << ": mesh " << file.mesh_name(i) << " isn't loaded" << std::endl;
+            return false;
+        }
+    }
+    std::vector<Material *> materials(file.material_count());
+    for (uint32_t i = 0; i < file.material_count(); i++) {
+        materials[i] = get_material(std::string(file.material_name(i)));
+        if (materials[i] == nullptr) {
+            std::cout << file_path << ": material " << file.material_name(i) << " doesn't exist" << std::endl;
+            return false;
+        }
+    }
+
+    // One pass over the mapped objects, the bounds go to the BVH
+    auto first = (uint32_t) m_renderables.size();
+    uint32_t count = file.object_count();
+    const SceneFileObject *objects = file.objects();
+    m_renderables.resize(first + count);
+    std::vector<Aabb> bounds(first == 0 ? count : 0);
+    if (out_parents) {
+        out_parents->resize(count);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        const SceneFileObject &record = objects[i];
+        if (record.m_mesh >= meshes.size() || record.m_material >= materials.size() ||
+            (record.m_parent != UINT32_MAX && record.m_parent >= i)) {
+            std::cout << file_path << ": object " << i << " is invalid" << std::endl;
+            m_renderables.resize(first);
+            return false;
+        }
+
+        RenderObject &object = m_renderables[first + i];
+        object.m_mesh = meshes[record.m_mesh];
+        object.m_material = materials[record.m_material];
+        object.m_transform_matrix = record.m_transform;
+        object.m_color = record.m_color;
+        object.m_flags = record.m_flags;
+        object.m_dynamic = record.m_dynamic != 0;
+        if (first == 0) {
+            bounds[i] = Aabb::from_sphere(record.m_bounds);
+        }
+        if (out_parents) {
+            (*out_parents)[i] = record.m_parent == UINT32_MAX ? UINT32_MAX : first + record.m_parent;
+        }
+    }
+    m_scene_load_stats.m_objects = count;
+    m_scene_load_stats.m_fixup_ms = elapsed_ms(start);
+
+    // The first frame would build it from the meshes otherwise, and then only refits. Appended
+    // to other objects it's built by the first frame as usual.
+    start = std::chrono::steady_clock::now();
+    if (first == 0) {
+        m_scene_bvh.build(bounds);
+    }
+    m_scene_load_stats.m_bvh_ms = elapsed_ms(start);
+
+    m_shadows.invalidate_static();
+    return true;
+}
+
+bool Engine::save_scene(const char *file_path, const std::vector<uint32_t> &parents) const {
+    // Index of every mesh and material in the file, in the order the objects first use them
+    std::unordered_map<const Mesh *, uint32_t> mesh_indices;
+    std::unordered_map<const Material *, uint32_t> material_indices;
+    std::unordered_map<const Mesh *, std::string> mesh_names;
+    std::unordered_map<const Material *, std::string> material_names;
+    for (const auto &[name, mesh]: m_meshes) {
+        mesh_names[&mesh] = name;
+    }
+    for (const auto &[name, material]: m_materials) {
+        material_names[&material] = name;
+    }
+
+    std::vector<std::string> meshes;
+    std::vector<std::string> materials;
+    std::vector<SceneFileObject> objects(m_renderables.size());
+    for (size_t i = 0; i < m_renderables.size(); i++) {
+        const RenderObject &object = m_renderables[i];
+        auto mesh_name = mesh_names.find(object.m_mesh);
+        auto material_name = material_names.find(object.m_material);
+        if (mesh_name == mesh_names.end() || material_name == material_names.end()) {
+            std::cout << file_path << ": renderable " << i << " uses a mesh or material that isn't named"
+                      << std::endl;
+            return false;
+        }
+        auto [mesh, new_mesh] = mesh_indices.try_emplace(object.m_mesh, (uint32_t) meshes.size());
+        if (new_mesh) {
+            meshes.push_back(mesh_name->second);
+        }
+        auto [material, new_material] = material_indices.try_emplace(object.m_material,
+                                                                     (uint32_t) materials.size());
+        if (new_material) {
+            materials.push_back(material_name->second);
+        }
+
+        // Same bounds as update_scene_bvh
+        const glm::mat4 &transform = object.m_transform_matrix;
+        float scale = std::max({glm::length(glm::vec3(transform[0])), glm::length(glm::vec3(transform[1])),
+                                glm::length(glm::vec3(transform[2]))});
+        glm::vec4 mesh_bounds = object.m_mesh->m_bounds;
+
+        objects[i] = {
+                .m_transform = transform,
+                .m_color = object.m_color,
+                .m_bounds = glm::vec4(glm::vec3(transform * glm::vec4(glm::vec3(mesh_bounds), 1.f)),
+                                      mesh_bounds.w * scale),
+                .m_flags = object.m_flags,
+                .m_mesh = mesh->second,
+                .m_material = material->second,
+                .m_parent = i < parents.size() ? parents[i] : UINT32_MAX,
+                .m_dynamic = object.m_dynamic ? 1u : 0u
+        };
+    }
+
+    return SceneFile::write(file_path, objects, meshes, materials);
+}
+
+bool Engine::begin_capture(const char *file_path) {
+    end_capture();
+    m_uncapturable_materials.clear();
+    if (!m_capture.open(file_path, m_window_extent)) {
+        return false;
+    }
+    std::cout << "Capturing frames to " << file_path << std::endl;
+    return true;
+}
+
+void Engine::end_capture() {
+    if (!m_capture.is_open()) {
+        return;
+    }
+    std::cout << "Captured " << m_capture.frame_count() << " frames" << std::endl;
+    m_capture.close();
+}
+
+void Engine::capture_frame(float delta_time) {
+    // Names of what the renderables use, written with their resources the first time
+    std::unordered_map<const Mesh *, std::string> mesh_names;
+    std::unordered_map<const Material *, std::string> material_names;
+    for (const auto &[name, mesh]: m_meshes) {
+        mesh_names[&mesh] = name;
+    }
+    for (const auto &[name, material]: m_materials) {
+        material_names[&material] = name;
+    }
+
+    std::vector<FrameCaptureObject> objects;
+    objects.reserve(m_renderables.size());
+    for (size_t i = 0; i < m_renderables.size(); i++) {
+        const RenderObject &object = m_renderables[i];
+        uint32_t material = capture_material(object.m_material, material_names);
+        if (material == UINT32_MAX) {
+            continue;
+        }
+        uint32_t mesh = m_capture.mesh_id(object.m_mesh);
+        if (mesh == UINT32_MAX) {
+            auto name = mesh_names.find(object.m_mesh);
+            mesh = m_capture.write_mesh(object.m_mesh, name != mesh_names.end() ? name->second :
+                                                       "capture_mesh_" + std::to_string(m_capture.frame_count()) +
+                                                       "_" + std::to_string(i));
+        }
+
+        objects.push_back({
+                .m_transform = object.m_transform_matrix,
+                .m_color = object.m_color,
+                .m_index = (uint32_t) objects.size(),
+                .m_flags = object.m_flags,
+                .m_mesh = mesh,
+                .m_material = material,
+                .m_dynamic = object.m_dynamic ? 1u : 0u,
+                .m_padding = {}
+        });
+    }
+
+    uint32_t flags = 0;
+    flags |= m_enable_depth_prepass ? FRAME_CAPTURE_DEPTH_PREPASS : 0;
+    flags |= m_enable_occlusion_culling ? FRAME_CAPTURE_OCCLUSION_CULLING : 0;
+    flags |= m_enable_cpu_culling ? FRAME_CAPTURE_CPU_CULLING : 0;
+    flags |= m_enable_async_compute ? FRAME_CAPTURE_ASYNC_COMPUTE : 0;
+    flags |= m_enable_command_cache ? FRAME_CAPTURE_COMMAND_CACHE : 0;
+    flags |= m_shadow_settings.m_enabled ? FRAME_CAPTURE_SHADOWS : 0;
+    flags |= m_resolution_settings.m_enabled ? FRAME_CAPTURE_DYNAMIC_RESOLUTION : 0;
+
+    FrameCaptureFrame frame = {
+            .m_camera_position = m_camera_position,
+            .m_delta_time = delta_time,
+            .m_sun_direction = m_sun.m_direction,
+            .m_sun_intensity = m_sun.m_intensity,
+            .m_sun_color = m_sun.m_color,
+            .m_flags = flags,
+            .m_instancing_threshold = m_instancing_threshold,
+            .m_particle_capacity = m_particle_capacity,
+            .m_resolution_target_ms = m_resolution_settings.m_target_ms,
+            .m_resolution_sharpness = m_resolution_settings.m_sharpness
+    };
+    m_capture.write_frame(frame, m_lights, m_particle_emitters, objects);
+}
+
+uint32_t Engine::capture_material(const Material *material,
+                                  const std::unordered_map<const Material *, std::string> &names) {
+    uint32_t id = m_capture.material_id(material);
+    if (id != UINT32_MAX || m_uncapturable_materials.contains(material)) {
+        return id;
+    }
+
+    auto name = names.find(material);
+    uint32_t pipeline = capture_pipeline(material->m_pipeline);
+    uint32_t instanced_pipeline = UINT32_MAX;
+    if (material->m_instanced_pipeline != VK_NULL_HANDLE) {
+        instanced_pipeline = capture_pipeline(material->m_instanced_pipeline);
+    }
+    if (name == names.end() || pipeline == UINT32_MAX ||
+        (material->m_instanced_pipeline != VK_NULL_HANDLE && instanced_pipeline == UINT32_MAX)) {
+        std::cout << "Capture: skipping the objects of material "
+                  << (name != names.end() ? name->second : std::string("(unnamed)"))
+                  << ", it isn't in m_materials or its pipelines weren't built with build_pipeline" << std::endl;
+        m_uncapturable_materials.insert(material);
+        return UINT32_MAX;
+    }
+
+    const RenderState &state = material->m_state;
+    FrameCaptureMaterial record = {
+            .m_id = 0,
+            .m_pipeline = pipeline,
+            .m_instanced_pipeline = instanced_pipeline,
+            .m_cull_mode = state.m_cull_mode,
+            .m_front_face = (uint32_t) state.m_front_face,
+            .m_topology = (uint32_t) state.m_topology,
+            .m_depth_test = state.m_depth_test ? 1u : 0u,
+            .m_depth_write = state.m_depth_write ? 1u : 0u,
+            .m_depth_compare_op = (uint32_t) state.m_depth_compare_op
+    };
+    return m_capture.write_material(material, name->second, record);
+}
+
+uint32_t Engine::capture_pipeline(VkPipeline pipeline) {
+    uint32_t id = m_capture.pipeline_id(pipeline);
+    if (id != UINT32_MAX) {
+        return id;
+    }
+
+    // Few pipelines, and only searched the first time
+    auto it = std::find_if(m_pipelines.begin(), m_pipelines.end(), [&](const ReloadablePipeline &reloadable) {
+        return reloadable.m_pipeline == pipeline;
+    });
+    if (it == m_pipelines.end()) {
+        return UINT32_MAX;
+    }
+
+    const PipelineBuilder &builder = it->m_builder;
+    FrameCapturePipeline record = {
+            .m_id = 0,
+            .m_dynamic_state = builder.has_dynamic_render_state() ? 1u : 0u,
+            .m_cull_mode = builder.m_rasterizer.cullMode,
+            .m_front_face = (uint32_t) builder.m_rasterizer.frontFace,
+            .m_topology = (uint32_t) builder.m_input_assembly.topology,
+            .m_depth_test = builder.m_depth_stencil.depthTestEnable,
+            .m_depth_write = builder.m_depth_stencil.depthWriteEnable,
+            .m_depth_compare_op = (uint32_t) builder.m_depth_stencil.depthCompareOp,
+            .m_blend = !builder.m_color_blend_attachment.empty() &&
+                       builder.m_color_blend_attachment[0].blendEnable ? 1u : 0u,
+            .m_shader_count = 0
+    };
+    return m_capture.write_pipeline(pipeline, record, it->m_shaders);
+}
+
+VkPipeline Engine::replay_pipeline(FrameReplay &replay, uint32_t id, VkPipelineLayout *out_layout) {
+    if (replay.m_pipelines[id] != VK_NULL_HANDLE) {
+        *out_layout = replay.m_pipeline_layouts[id];
+        return replay.m_pipelines[id];
+    }
+
+    // The usual mesh pipeline, with the state it was captured with
+    const FrameCapturePipeline &record = replay.m_pipeline_records[id];
+    PipelineBuilder builder;
+    builder.setup_default(m_window_extent);
+    builder.m_depth_stencil_format = m_depth_format;
+    builder.set_vertex_input<Vertex>();
+    builder.m_pipeline_layout = VK_NULL_HANDLE;
+    builder.m_rasterizer.cullMode = record.m_cull_mode;
+    builder.m_rasterizer.frontFace = (VkFrontFace) record.m_front_face;
+    builder.m_input_assembly.topology = (VkPrimitiveTopology) record.m_topology;
+    builder.m_depth_stencil.depthTestEnable = record.m_depth_test;
+    builder.m_depth_stencil.depthWriteEnable = record.m_depth_write;
+    builder.m_depth_stencil.depthCompareOp = (VkCompareOp) record.m_depth_compare_op;
+    if (record.m_blend) {
+        VkPipelineColorBlendAttachmentState &blend = builder.m_color_blend_attachment[0];
+        blend.blendEnable = VK_TRUE;
+        blend.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+        blend.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+        blend.colorBlendOp = VK_BLEND_OP_ADD;
+        blend.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+        blend.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+        blend.alphaBlendOp = VK_BLEND_OP_ADD;
+    }
+    if (record.m_dynamic_state) {
+        builder.enable_dynamic_render_state();
+    }
+
+    VkPipeline pipeline = build_pipeline(builder, replay.m_pipeline_shaders[id], &replay.m_pipeline_layouts[id]);
+    replay.m_pipelines[id] = pipeline;
+    *out_layout = replay.m_pipeline_layouts[id];
+    return pipeline;
+}
+
+bool Engine::replay_frame(FrameReplay &replay) {
+    FrameCaptureChunkType type;
+    FrameCaptureStream payload;
+    while (replay.m_reader.next_chunk(&type, &payload)) {
+        if (type == FrameCaptureChunkType::Mesh) {
+            FrameCaptureMesh record;
+            std::string name;
+            if (!payload.read(&record) || !payload.read_string(&name) || record.m_id > replay.m_meshes.size()) {
+                std::cout << "Replay: invalid mesh" << std::endl;
+                return false;
+            }
+            // Known from a previous pass over the capture
+            if (record.m_id < replay.m_meshes.size()) {
+                continue;
+            }
+
+            Mesh *mesh = get_mesh(name);
+            if (mesh == nullptr) {
+                Mesh &created = m_meshes[name];
+                if (!payload.read_array(&created.m_vertices, record.m_vertex_count) ||
+                    !payload.read_array(&created.m_indices, record.m_index_count)) {
+                    std::cout << "Replay: mesh " << name << " is cut short" << std::endl;
+                    m_meshes.erase(name);
+                    return false;
+                }
+                upload_mesh(created);
+                mesh = &created;
+            }
+            replay.m_meshes.push_back(mesh);
+        } else if (type == FrameCaptureChunkType::Pipeline) {
+            FrameCapturePipeline record;
+            if (!payload.read(&record) || record.m_id > replay.m_pipeline_records.size()) {
+                std::cout << "Replay: invalid pipeline" << std::endl;
+                return false;
+            }
+            if (record.m_id < replay.m_pipeline_records.size()) {
+                continue;
+            }
+
+            std::vector<ShaderFile> shaders(record.m_shader_count);
+            for (ShaderFile &shader: shaders) {
+                uint32_t stage;
+                if (!payload.read(&stage) || !payload.read_string(&shader.m_path)) {
+                    std::cout << "Replay: pipeline " << record.m_id << " is cut short" << std::endl;
+                    return false;
+                }
+                shader.m_stage = (VkShaderStageFlagBits) stage;
+            }
+            replay.m_pipeline_records.push_back(record);
+            replay.m_pipeline_shaders.push_back(std::move(shaders));
+            replay.m_pipelines.push_back(VK_NULL_HANDLE);
+            replay.m_pipeline_layouts.push_back(VK_NULL_HANDLE);
+        } else if (type == FrameCaptureChunkType::Material) {
+            FrameCaptureMaterial record;
+            std::string name;
+            if (!payload.read(&record) || !payload.read_string(&name) || record.m_id > replay.m_materials.size() ||
+                record.m_pipeline >= replay.m_pipelines.size() ||
+                (record.m_instanced_pipeline != UINT32_MAX &&
+                 record.m_instanced_pipeline >= replay.m_pipelines.size())) {
+                std::cout << "Replay: invalid material" << std::endl;
+                return false;
+            }
+            if (record.m_id < replay.m_materials.size()) {
+                continue;
+            }
+
+            Material *material = get_material(name);
+            if (material == nullptr) {
+                VkPipelineLayout layout;
+                VkPipelineLayout instanced_layout;
+                VkPipeline pipeline = replay_pipeline(replay, record.m_pipeline, &layout);
+                VkPipeline instanced_pipeline = VK_NULL_HANDLE;
+                if (record.m_instanced_pipeline != UINT32_MAX) {
+                    instanced_pipeline = replay_pipeline(replay, record.m_instanced_pipeline, &instanced_layout);
+                }
+                if (pipeline == VK_NULL_HANDLE ||
+                    (record.m_instanced_pipeline != UINT32_MAX && instanced_pipeline == VK_NULL_HANDLE)) {
+                    std::cout << "Replay: failed to build the pipelines of material " << name << std::endl;
+                    return false;
+                }
+
+                RenderState state = {
+                        .m_cull_mode = record.m_cull_mode,
+                        .m_front_face = (VkFrontFace) record.m_front_face,
+                        .m_topology = (VkPrimitiveTopology) record.m_topology,
+                        .m_depth_test = record.m_depth_test != 0,
+                        .m_depth_write = record.m_depth_write != 0,
+                        .m_depth_compare_op = (VkCompareOp) record.m_depth_compare_op
+                };
+                material = create_material(pipeline, layout, name, instanced_pipeline, state);
+            }
+            replay.m_materials.push_back(material);
+        } else if (type == FrameCaptureChunkType::Frame) {
+            FrameCaptureFrame frame;
+            if (!payload.read(&frame) || !payload.read_array(&m_lights, frame.m_light_count) ||
+                !payload.read_array(&m_particle_emitters, frame.m_emitter_count)) {
+                std::cout << "Replay: frame " << replay.m_frame << " is cut short" << std::endl;
+                return false;
+            }
+
+            m_camera_position = frame.m_camera_position;
+            m_fixed_delta_time = frame.m_delta_time;
+            m_sun.m_direction = frame.m_sun_direction;
+            m_sun.m_intensity = frame.m_sun_intensity;
+            m_sun.m_color = frame.m_sun_color;
+            m_enable_depth_prepass = (frame.m_flags & FRAME_CAPTURE_DEPTH_PREPASS) != 0;
+            m_enable_occlusion_culling = (frame.m_flags & FRAME_CAPTURE_OCCLUSION_CULLING) != 0;
+            m_enable_cpu_culling = (frame.m_flags & FRAME_CAPTURE_CPU_CULLING) != 0;
+            m_enable_async_compute = (frame.m_flags & FRAME_CAPTURE_ASYNC_COMPUTE) != 0;
+            m_enable_command_cache = (frame.m_flags & FRAME_CAPTURE_COMMAND_CACHE) != 0;
+            m_shadow_settings.m_enabled = (frame.m_flags & FRAME_CAPTURE_SHADOWS) != 0;
+            m_resolution_settings.m_enabled = (frame.m_flags & FRAME_CAPTURE_DYNAMIC_RESOLUTION) != 0;
+            m_resolution_settings.m_target_ms = frame.m_resolution_target_ms;
+            m_resolution_settings.m_sharpness = frame.m_resolution_sharpness;
+            m_instancing_threshold = frame.m_instancing_threshold;
+            m_particle_capacity = frame.m_particle_capacity;
+
+            // Only the objects that changed are in the frame, the others are already right
+            bool static_changed = m_renderables.size() != frame.m_object_count;
+            m_renderables.resize(frame.m_object_count);
+            for (uint32_t i = 0; i < frame.m_changed_objects; i++) {
+                FrameCaptureObject record;
+                if (!payload.read(&record) || record.m_index >= frame.m_object_count ||
+                    record.m_mesh >= replay.m_meshes.size() || record.m_material >= replay.m_materials.size()) {
+                    std::cout << "Replay: frame " << replay.m_frame << " has an invalid object" << std::endl;
+                    return false;
+                }
+
+                RenderObject &object = m_renderables[record.m_index];
+                static_changed |= !object.m_dynamic || record.m_dynamic == 0;
+                object.m_mesh = replay.m_meshes[record.m_mesh];
+                object.m_material = replay.m_materials[record.m_material];
+                object.m_transform_matrix = record.m_transform;
+                object.m_color = record.m_color;
+                object.m_flags = record.m_flags;
+                object.m_dynamic = record.m_dynamic != 0;
+            }
+            if (static_changed) {
+                m_shadows.invalidate_static();
+            }
+
+            replay.m_frame++;
+            return true;
+        }
+        // Unknown chunks are skipped, newer captures may add some
+    }
+    return false;
+}
+
+bool Engine::load_shader_module(const char *file_path, VkShaderModule *out_shader_module) const {
+    std::vector<uint32_t> code;
+    return load_spirv(file_path, &code) && create_shader_module(code, out_shader_module);
+}
+
+bool Engine::load_spirv(const char *file_path, std::vector<uint32_t> *out_code) const {
+    std::ifstream file(file_path, std::ios::ate | std::ios::binary);
+
+    if (!file.is_open()) {
+        return false;
+    }
+
+    size_t file_size = (size_t) file.tellg();
+
+    std::vector<uint32_t> buffer(file_size / sizeof(uint32_t));
+
+    file.seekg(0);
+    file.read((char *) buffer.data(), file_size);
+
+    file.close();
+
+    *out_code = std::move(buffer);
+    return true;
+}
+
+bool Engine::create_shader_module(const std::vector<uint32_t> &code, VkShaderModule *out_shader_module) const {
+    VkShaderModuleCreateInfo create_info = {
+            .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+            .pNext = nullptr,
+            // Size in bytes
+            .codeSize = code.size() * sizeof(uint32_t),
+            .pCode = code.data(),
+    };
+    VkShaderModule shader_module;
+    if (vkCreateShaderModule(m_device, &create_info, nullptr, &shader_module) != VK_SUCCESS) {
+        return false;
+    }
+    *out_shader_module = shader_module;
+    return true;
+}
+
+uint64_t Engine::submit_upload(std::function<void(VkCommandBuffer cmd)> &&function) {
+    UploadSlot &slot = m_upload_ring[m_upload_ring_index];
+    m_upload_ring_index = (m_upload_ring_index + 1) % UPLOAD_RING_SIZE;
+
+    // Only blocks when UPLOAD_RING_SIZE uploads are still in flight
+    m_graphics_timeline.wait(slot.m_timeline_value);
+    VK_CHECK(vkResetCommandPool(m_device, slot.m_command_pool, 0))
+
+    VkCommandBufferBeginInfo command_buffer_begin_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .pNext = nullptr,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+            .pInheritanceInfo = nullptr
+    };
+    VK_CHECK(vkBeginCommandBuffer(slot.m_command_buffer, &command_buffer_begin_info))
+
+    function(slot.m_command_buffer);
+
+    VK_CHECK(vkEndCommandBuffer(slot.m_command_buffer))
+
+    // Same queue as the frames, so the barriers recorded by function cover the frames submitted after
+    slot.m_timeline_value = m_graphics_timeline.submit({slot.m_command_buffer}, {});
+    return slot.m_timeline_value;
+}
+
+void Engine::immediate_submit(std::function<void(VkCommandBuffer cmd)> &&function) {
+    uint64_t value = submit_upload(std::move(function));
+    m_graphics_timeline.wait(value);
+}
+
+void Engine::upload_mesh(Mesh &mesh) {
+    auto vertex_count = (uint32_t) mesh.m_vertices.size();
+    auto index_count = (uint32_t) mesh.m_indices.size();
+
+    if (!m_geometry.allocate(vertex_count, index_count, &mesh.m_geometry_handle)) {
+        // Repacking removes the holes, and we double the capacity until the mesh fits
+        uint32_t vertex_capacity = m_geometry.vertex_allocator().capacity();
+        uint32_t index_capacity = m_geometry.index_allocator().capacity();
+        while (m_geometry.vertex_allocator().used() + vertex_count > vertex_capacity) {
+            vertex_capacity *= 2;
+        }
+        while (m_geometry.index_allocator().used() + index_count > index_capacity) {
+            index_capacity *= 2;
+        }
+
+        rebuild_geometry(vertex_capacity, index_capacity);
+
+        if (!m_geometry.allocate(vertex_count, index_count, &mesh.m_geometry_handle)) {
+            std::cout << "Couldn't allocate " << vertex_count << " vertices in the geometry buffer" << std::endl;
+            abort();
+        }
+    }
+
+    // Bounding sphere centered on the bounding box, not the tightest but cheap
+    if (!mesh.m_vertices.empty()) {
+        glm::vec3 min = mesh.m_vertices[0].position;
+        glm::vec3 max = min;
+        for (const Vertex &vertex: mesh.m_vertices) {
+            min = glm::min(min, vertex.position);
+            max = glm::max(max, vertex.position);
+        }
+        glm::vec3 center = (min + max) * 0.5f;
+        float radius = 0.f;
+        for (const Vertex &vertex: mesh.m_vertices) {
+            radius = std::max(radius, glm::length(vertex.position - center));
+        }
+        mesh.m_bounds = glm::vec4(center, radius);
+    }
+
+    VkDeviceSize vertex_bytes = mesh.m_vertices.size() * sizeof(Vertex);
+    VkDeviceSize index_bytes = mesh.m_indices.size() * sizeof(uint32_t);
+
+    VkBufferCreateInfo buffer_info = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .size = vertex_bytes + index_bytes,
+            .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+    };
+
+    VmaAllocationCreateInfo vma_alloc_info = {};
+    vma_alloc_info.usage = VMA_MEMORY_USAGE_CPU_ONLY;
+
+    AllocatedBuffer staging_buffer;
+    VkResult result = vmaCreateBuffer(m_allocator, &buffer_info, &vma_alloc_info,
+                                      &staging_buffer.m_buffer,
+                                      &staging_buffer.m_allocation,
+                                      nullptr);
+    if (result != VK_SUCCESS) {
+        // Keep a trace of what the memory looked like before aborting
+        m_memory_budget.dump_stats_json("vk_engine_memory_failure.json");
+        VK_CHECK(result)
+    }
+    m_memory_budget.track(staging_buffer.m_allocation, MemoryCategory::Staging);
+
+    // Copy the data, vertices first then indices
+    void *data;
+    vmaMapMemory(m_allocator, staging_buffer.m_allocation, &data);
+
+    memcpy(data, mesh.m_vertices.data(), vertex_bytes);
+    memcpy((char *) data + vertex_bytes, mesh.m_indices.data(), index_bytes);
+
+    vmaUnmapMemory(m_allocator, staging_buffer.m_allocation);
+
+    uint32_t handle = mesh.m_geometry_handle;
+    uint64_t upload_value = submit_upload([=, this](VkCommandBuffer cmd) {
+        m_geometry.cmd_upload(cmd, handle, staging_buffer.m_buffer);
+    });
+
+    // No need to wait for the copy, the staging buffer goes away once it's done
+    m_timeline_deletion_queue.push_function(upload_value, [=, this]() {
+        m_memory_budget.untrack(staging_buffer.m_allocation);
+        vmaDestroyBuffer(m_allocator, staging_buffer.m_buffer, staging_buffer.m_allocation);
+    });
+}
+
+bool Engine::upload_skinned_mesh(SkinnedMesh &mesh) {
+    auto vertex_count = (uint32_t) mesh.m_vertices.size();
+    if (vertex_count == 0 || mesh.m_joint_count == 0) {
+        std::cout << "A skinned mesh needs vertices and joints" << std::endl;
+        return false;
+    }
+    // The shader doesn't check them, it would read the palette of another instance
+    for (const SkinnedVertex &vertex: mesh.m_vertices) {
+        for (uint8_t joint: vertex.joints) {
+            if (joint >= mesh.m_joint_count) {
+                std::cout << "Skinned vertex using joint " << (uint32_t) joint << " of " << mesh.m_joint_count
+                          << std::endl;
+                return false;
+            }
+        }
+    }
+
+    uint32_t skin = m_skinning.add_skin(vertex_count, mesh.m_joint_count);
+    if (skin == UINT32_MAX) {
+        std::cout << "Couldn't add a skin, " << MAX_SKINS << " at most" << std::endl;
+        return false;
+    }
+    mesh.m_skin_handle = skin;
+
+    VkDeviceSize bytes = mesh.m_vertices.size() * sizeof(SkinnedVertex);
+    VkBufferCreateInfo buffer_info = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .size = bytes,
+            .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+    };
+
+    VmaAllocationCreateInfo vma_alloc_info = {};
+    vma_alloc_info.usage = VMA_MEMORY_USAGE_CPU_ONLY;
+
+    AllocatedBuffer staging_buffer;
+    VK_CHECK(vmaCreateBuffer(m_allocator, &buffer_info, &vma_alloc_info, &staging_buffer.m_buffer,
+                             &staging_buffer.m_allocation, nullptr))
+    m_memory_budget.track(staging_buffer.m_allocation, MemoryCategory::Staging);
+
+    void *data;
+    vmaMapMemory(m_allocator, staging_buffer.m_allocation, &data);
+    memcpy(data, mesh.m_vertices.data(), bytes);
+    vmaUnmapMemory(m_allocator, staging_buffer.m_allocation);
+
+    VkBuffer skin_buffer = m_skinning.skin_buffer(skin);
+    uint64_t upload_value = submit_upload([=](VkCommandBuffer cmd) {
+        VkBufferCopy copy = {0, 0, bytes};
+        vkCmdCopyBuffer(cmd, staging_buffer.m_buffer, skin_buffer, 1, &copy);
+
+        // Read by the skinning of the next frames
+        VkMemoryBarrier barrier = {
+                .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                .pNext = nullptr,
+                .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                .dstAccessMask = VK_ACCESS_SHADER_READ_BIT
+        };
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                             &barrier, 0, nullptr, 0, nullptr);
+    });
+
+    m_timeline_deletion_queue.push_function(upload_value, [=, this]() {
+        m_memory_budget.untrack(staging_buffer.m_allocation);
+        vmaDestroyBuffer(m_allocator, staging_buffer.m_buffer, staging_buffer.m_allocation);
+    });
+    return true;
+}
+
+uint32_t Engine::create_skinned_instance(const SkinnedMesh &mesh, const std::string &mesh_name) {
+    // Replacing the mesh would leave its range in the geometry buffer, and the objects drawing it
+    if (m_meshes.contains(mesh_name)) {
+        std::cout << "Skinned instance: there's already a mesh named " << mesh_name << std::endl;
+        return UINT32_MAX;
+    }
+
+    // The bind pose, overwritten by the skinning before any draw
+    Mesh &instance_mesh = m_meshes[mesh_name];
+    instance_mesh.m_vertices.resize(mesh.m_vertices.size());
+    for (size_t i = 0; i < mesh.m_vertices.size(); i++) {
+        const SkinnedVertex &vertex = mesh.m_vertices[i];
+        instance_mesh.m_vertices[i] = {vertex.position, vertex.normal, vertex.color};
+    }
+    instance_mesh.m_indices = mesh.m_indices;
+    upload_mesh(instance_mesh);
+    // The skinned vertices are never read back, so the bind pose bounds are culled, grown to
+    // whatever the animation reaches
+    instance_mesh.m_bounds.w += mesh.m_bounds_margin;
+
+    m_skinned_instances.push_back({
+            .m_skin = mesh.m_skin_handle,
+            .m_mesh = &instance_mesh,
+            .m_joints = std::vector<glm::mat4>(mesh.m_joint_count, glm::mat4(1.f))
+    });
+    return (uint32_t) m_skinned_instances.size() - 1;
+}
+
+void Engine::free_mesh(Mesh &mesh) {
+    if (mesh.m_geometry_handle == GeometryBuffer::INVALID_HANDLE) {
+        return;
+    }
+
+    uint32_t handle = mesh.m_geometry_handle;
+    mesh.m_geometry_handle = GeometryBuffer::INVALID_HANDLE;
+
+    // The frames in flight may still be drawing it
+    m_timeline_deletion_queue.push_function(m_graphics_timeline.next_value(), [=, this]() {
+        m_geometry.free(handle);
+    });
+}
+
+void Engine::compact_geometry() {
+    rebuild_geometry(m_geometry.vertex_allocator().capacity(), m_geometry.index_allocator().capacity());
+}
+
+void Engine::rebuild_geometry(uint32_t vertex_capacity, uint32_t index_capacity) {
+    std::vector<AllocatedBuffer> old_buffers;
+    uint64_t rebuild_value = submit_upload([&](VkCommandBuffer cmd) {
+        old_buffers = m_geometry.cmd_rebuild(cmd, vertex_capacity, index_capacity);
+    });
+    // The cached draws bind the old buffers
+    invalidate_command_cache();
+
+    // The copy reads them, and so do the frames submitted before it
+    m_timeline_deletion_queue.push_function(rebuild_value, [=, this]() {
+        for (const auto &buffer: old_buffers) {
+            m_geometry.destroy_buffer(buffer);
+        }
+    });
+}
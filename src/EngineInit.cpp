@@ -7,23 +7,51 @@
 #include <Initializers.h>
 #include <PipelineBuilder.h>
 
+#include <imgui.h>
+#include <imgui_impl_glfw.h>
+#include <imgui_impl_vulkan.h>
+
 #include <vulkan/vulkan.h>
 #define VMA_IMPLEMENTATION
 #include <vk_mem_alloc.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
 
 void Engine::init() {
 
     m_frame_count = 0;
 
-    init_glfw();
+    if (!m_headless) {
+        init_glfw();
+    }
     init_vulkan();
     init_swapchain();
     init_commands();
     init_sync_structures();
+    init_geometry();
+    init_descriptors();
+    init_lighting();
+    init_shadows();
     init_base_pipelines();
+    init_occlusion_culling();
+    init_particles();
+    init_skinning();
+    init_dynamic_resolution();
+    init_profiler();
+    init_render_graph();
+    if (imgui_enabled()) {
+        init_imgui();
+    }
+    if (!m_headless && m_enable_shader_hot_reload) {
+        init_shader_hot_reload();
+    }
 #ifndef NDEBUG
-    init_debug_meshes();
+    if (!m_headless) {
+        init_debug_meshes();
+    }
 #endif
 
     m_is_initialized = true;
@@ -44,9 +72,17 @@ void DestroyDebugUtilsMessengerEXT(VkInstance instance, VkDebugUtilsMessengerEXT
 
 void Engine::cleanup() {
     if (m_is_initialized) {
-        // Wait for render fence
-        VK_CHECK(vkWaitForFences(m_device, 1, &m_render_fence, true, 1000000000))
+        end_capture();
+        // Wait for every submission, frames and uploads, on both queues
+        m_graphics_timeline.wait_idle();
+        if (m_async_compute_supported) {
+            m_compute_timeline.wait_idle();
+        }
+        m_timeline_deletion_queue.flush();
+        m_swapchain_deletion_queue.flush();
         m_main_deletion_queue.flush();
+        // Joins its rebuild worker
+        m_scene_bvh.clear();
 
         vmaDestroyAllocator(m_allocator);
 
@@ -55,7 +91,9 @@ void Engine::cleanup() {
         DestroyDebugUtilsMessengerEXT(m_instance, m_debug_messenger, nullptr);
         vkDestroyInstance(m_instance, nullptr);
 
-        glfwDestroyWindow(m_window);
+        if (m_window) {
+            glfwDestroyWindow(m_window);
+        }
     }
 }
 
@@ -63,9 +101,62 @@ void Engine::init_glfw() {
     glfwInit();
 
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+    glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
 
     m_window = glfwCreateWindow(m_window_extent.width, m_window_extent.height, "VulkanEngine", nullptr, nullptr);
+
+    // ImGui chains to this callback, so it has to be installed before init_imgui
+    glfwSetWindowUserPointer(m_window, this);
+    glfwSetFramebufferSizeCallback(m_window, [](GLFWwindow *window, int width, int height) {
+        auto *engine = static_cast<Engine *>(glfwGetWindowUserPointer(window));
+        engine->m_swapchain_dirty = true;
+    });
+    glfwSetKeyCallback(m_window, [](GLFWwindow *window, int key, int scancode, int action, int mods) {
+        auto *engine = static_cast<Engine *>(glfwGetWindowUserPointer(window));
+        if (action != GLFW_PRESS) {
+            return;
+        }
+
+        // The keys touch what the render thread owns, it handles them before its next frame
+        if (engine->m_render_thread_active) {
+            std::lock_guard<std::mutex> lock(engine->m_key_mutex);
+            engine->m_pending_keys.push_back(key);
+        } else {
+            engine->on_key(key);
+        }
+    });
+}
+
+void Engine::on_key(int key) {
+    if (key == GLFW_KEY_F1) {
+        m_show_profiler_overlay = !m_show_profiler_overlay;
+    } else if (key == GLFW_KEY_F2) {
+        m_profiler.export_chrome_trace("vk_engine_trace.json");
+    } else if (key == GLFW_KEY_F3) {
+        m_memory_budget.dump_stats_json("vk_engine_memory.json");
+    } else if (key == GLFW_KEY_F4) {
+        cycle_present_mode();
+    } else if (key == GLFW_KEY_F5) {
+        m_enable_depth_prepass = !m_enable_depth_prepass;
+    } else if (key == GLFW_KEY_F6) {
+        m_enable_occlusion_culling = !m_enable_occlusion_culling;
+    } else if (key == GLFW_KEY_F7) {
+        m_shadow_settings.m_enabled = !m_shadow_settings.m_enabled;
+    } else if (key == GLFW_KEY_F8) {
+        m_enable_cpu_culling = !m_enable_cpu_culling;
+    } else if (key == GLFW_KEY_F9) {
+        m_enable_async_compute = !m_enable_async_compute;
+    } else if (key == GLFW_KEY_F10) {
+        m_enable_command_cache = !m_enable_command_cache;
+    } else if (key == GLFW_KEY_F11) {
+        m_resolution_settings.m_enabled = !m_resolution_settings.m_enabled;
+    } else if (key == GLFW_KEY_F12) {
+        if (is_capturing()) {
+            end_capture();
+        } else {
+            begin_capture("vk_engine_capture.vkfc");
+        }
+    }
 }
 
 void Engine::init_vulkan() {
@@ -79,37 +170,106 @@ void Engine::init_vulkan() {
             .set_engine_name("VulkanEngine")
             .require_api_version(1, 3, 0);
 
-    uint32_t glfw_extensions_count;
-    const char **extensions = glfwGetRequiredInstanceExtensions(&glfw_extensions_count);
+    if (m_headless) {
+        builder.set_headless(true);
+    } else {
+        uint32_t glfw_extensions_count;
+        const char **extensions = glfwGetRequiredInstanceExtensions(&glfw_extensions_count);
 
-    for (int i = 0; i < glfw_extensions_count; i++) {
-        builder.enable_extension(extensions[i]);
+        for (int i = 0; i < glfw_extensions_count; i++) {
+            builder.enable_extension(extensions[i]);
+        }
     }
 
     auto vkb_instance = builder.build().value();
     m_instance = vkb_instance.instance;
     m_debug_messenger = vkb_instance.debug_messenger;
 
-    glfwCreateWindowSurface(m_instance, m_window, nullptr, &m_surface);
-
     vkb::PhysicalDeviceSelector selector{vkb_instance};
-    selector.set_minimum_version(1, 3)
-            .set_surface(m_surface);
+    selector.set_minimum_version(1, 3);
+
+    if (m_headless) {
+        // No surface, so we don't need a queue able to present either (ie lavapipe on CI)
+        selector.require_present(false);
+    } else {
+        glfwCreateWindowSurface(m_instance, m_window, nullptr, &m_surface);
+        selector.set_surface(m_surface);
+    }
 
     // VK_KHR_dynamic_rendering isn't an instance extensions, we need to enable
     // it on the device.
     selector.add_required_extension("VK_KHR_dynamic_rendering");
+    // Culled objects are drawn with one indirect command each, see OcclusionCuller
+    selector.set_required_features({
+            .multiDrawIndirect = VK_TRUE,
+            .drawIndirectFirstInstance = VK_TRUE
+    });
+    // Lets VMA report the real usage and budget of each heap, enabled only if present
+    selector.add_desired_extension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    // Used together to measure when frames actually reach the screen, enabled only if present
+    if (!m_headless) {
+        selector.add_desired_extension(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+        selector.add_desired_extension(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+    }
 
     auto vkb_physical_device = selector.select().value();
 
+    uint32_t extension_count = 0;
+    vkEnumerateDeviceExtensionProperties(vkb_physical_device.physical_device, nullptr, &extension_count, nullptr);
+    std::vector<VkExtensionProperties> available_extensions(extension_count);
+    vkEnumerateDeviceExtensionProperties(vkb_physical_device.physical_device, nullptr, &extension_count,
+                                         available_extensions.data());
+
+    auto extension_supported = [&](const char *name) {
+        return std::any_of(available_extensions.begin(), available_extensions.end(),
+                           [=](const VkExtensionProperties &extension) {
+                               return strcmp(extension.extensionName, name) == 0;
+                           });
+    };
+
+    bool memory_budget_supported = extension_supported(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    bool present_wait_supported = !m_headless && extension_supported(VK_KHR_PRESENT_ID_EXTENSION_NAME) &&
+                                  extension_supported(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+
     VkPhysicalDeviceDynamicRenderingFeatures dynamic_rendering_feature{
             .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR,
             .pNext = nullptr,
             .dynamicRendering = VK_TRUE,
     };
 
+    // Core in 1.2, every submission is tracked with timeline semaphores instead of fences
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_semaphore_feature{
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+            .pNext = nullptr,
+            .timelineSemaphore = VK_TRUE,
+    };
+
+    // Core in 1.3, the render graph records its barriers with vkCmdPipelineBarrier2
+    VkPhysicalDeviceSynchronization2Features synchronization2_feature{
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES,
+            .pNext = nullptr,
+            .synchronization2 = VK_TRUE,
+    };
+
     vkb::DeviceBuilder device_builder{vkb_physical_device};
     device_builder.add_pNext<VkPhysicalDeviceDynamicRenderingFeatures>(&dynamic_rendering_feature);
+    device_builder.add_pNext<VkPhysicalDeviceTimelineSemaphoreFeatures>(&timeline_semaphore_feature);
+    device_builder.add_pNext<VkPhysicalDeviceSynchronization2Features>(&synchronization2_feature);
+
+    VkPhysicalDevicePresentIdFeaturesKHR present_id_feature{
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR,
+            .pNext = nullptr,
+            .presentId = VK_TRUE,
+    };
+    VkPhysicalDevicePresentWaitFeaturesKHR present_wait_feature{
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR,
+            .pNext = nullptr,
+            .presentWait = VK_TRUE,
+    };
+    if (present_wait_supported) {
+        device_builder.add_pNext<VkPhysicalDevicePresentIdFeaturesKHR>(&present_id_feature);
+        device_builder.add_pNext<VkPhysicalDevicePresentWaitFeaturesKHR>(&present_wait_feature);
+    }
 
     m_vkb_device = device_builder.build().value();
 
@@ -119,73 +279,219 @@ void Engine::init_vulkan() {
     m_graphics_queue = m_vkb_device.get_queue(vkb::QueueType::graphics).value();
     m_graphics_queue_family = m_vkb_device.get_queue_index(vkb::QueueType::graphics).value();
 
+    // vk-bootstrap only returns a family without graphics here, so it really runs alongside
+    auto compute_queue_family = m_vkb_device.get_queue_index(vkb::QueueType::compute);
+    if (compute_queue_family.has_value()) {
+        m_compute_queue = m_vkb_device.get_queue(vkb::QueueType::compute).value();
+        m_compute_queue_family = compute_queue_family.value();
+        m_async_compute_supported = true;
+    } else {
+        std::cout << "No separate compute queue family, async compute is disabled" << std::endl;
+    }
+
 
     VmaAllocatorCreateInfo allocatorInfo = {
+            .flags = memory_budget_supported ? (VmaAllocatorCreateFlags) VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT : 0u,
             .physicalDevice = m_physical_device,
             .device = m_device,
-            .instance = m_instance
+            .instance = m_instance,
+            // The vendored VMA only knows about 1.0 and 1.1, 1.1 is enough for the budget queries
+            .vulkanApiVersion = VK_API_VERSION_1_1
     };
 
-    vmaCreateAllocator(&allocatorInfo, &m_allocator);
+    VK_CHECK(vmaCreateAllocator(&allocatorInfo, &m_allocator))
+
+    m_memory_budget.init(m_allocator, memory_budget_supported);
+
+    m_present_wait_supported = present_wait_supported;
 }
 
 void Engine::init_swapchain() {
+    if (m_headless) {
+        init_offscreen_target();
+    } else {
+        uint32_t present_mode_count = 0;
+        vkGetPhysicalDeviceSurfacePresentModesKHR(m_physical_device, m_surface, &present_mode_count, nullptr);
+        m_supported_present_modes.resize(present_mode_count);
+        vkGetPhysicalDeviceSurfacePresentModesKHR(m_physical_device, m_surface, &present_mode_count,
+                                                  m_supported_present_modes.data());
+
+        init_surface_swapchain();
+
+        // Reads m_swapchain when run, so it destroys whichever swapchain is current
+        m_main_deletion_queue.push_function([=, this]() {
+            vkDestroySwapchainKHR(m_device, m_swapchain, nullptr);
+        });
+
+        // Stopped before the swapchain it waits on is destroyed
+        m_present_latency.init(m_device, m_present_wait_supported);
+        m_main_deletion_queue.push_function([=, this]() {
+            m_present_latency.cleanup();
+        });
+    }
+
+    init_render_target_extent();
+}
+
+void Engine::init_offscreen_target() {
+    // No surface to present to, the frame is rendered into an image we own and left in
+    // TRANSFER_SRC layout so it can be read back.
+    m_swapchain_image_format = VK_FORMAT_B8G8R8A8_UNORM;
+
+    VkExtent3D image_extent = {
+            m_window_extent.width,
+            m_window_extent.height,
+            1
+    };
+
+    VkImageCreateInfo image_info = Initializers::image_create_info(m_swapchain_image_format,
+                                                                   VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                                                                   VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                                                                   image_extent);
+
+    VmaAllocationCreateInfo image_allocinfo = {};
+    image_allocinfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+    image_allocinfo.requiredFlags = VkMemoryPropertyFlags(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    VK_CHECK(vmaCreateImage(m_allocator, &image_info, &image_allocinfo, &m_offscreen_image.m_image,
+                            &m_offscreen_image.m_allocation, nullptr))
+    m_memory_budget.track(m_offscreen_image.m_allocation, MemoryCategory::RenderTarget);
+
+    VkImageViewCreateInfo view_info = Initializers::imageview_create_info(m_swapchain_image_format,
+                                                                          m_offscreen_image.m_image,
+                                                                          VK_IMAGE_ASPECT_COLOR_BIT);
+    VkImageView image_view;
+    VK_CHECK(vkCreateImageView(m_device, &view_info, nullptr, &image_view))
+
+    // The rest of the engine sees it as a single image swapchain
+    m_swapchain_images = {m_offscreen_image.m_image};
+    m_swapchain_images_view = {image_view};
+
+    m_main_deletion_queue.push_function([=, this]() {
+        vkDestroyImageView(m_device, image_view, nullptr);
+        m_memory_budget.untrack(m_offscreen_image.m_allocation);
+        vmaDestroyImage(m_allocator, m_offscreen_image.m_image, m_offscreen_image.m_allocation);
+    });
+}
+
+void Engine::init_surface_swapchain() {
+    // FIFO is the only mode every driver has to support
+    if (std::find(m_supported_present_modes.begin(), m_supported_present_modes.end(), m_present_mode) ==
+        m_supported_present_modes.end()) {
+        std::cout << "Present mode " << present_mode_name(m_present_mode) << " isn't supported, using FIFO"
+                  << std::endl;
+        m_present_mode = VK_PRESENT_MODE_FIFO_KHR;
+    }
+
+    // Handing the old swapchain over lets the driver reuse its resources, and the images it still
+    // has queued get presented
+    VkSwapchainKHR old_swapchain = m_swapchain;
+
     vkb::SwapchainBuilder swapchain_builder{m_vkb_device, m_surface};
 
     auto vkb_swapchain = swapchain_builder
             .use_default_format_selection()
-                    //use vsync present mode
-            .set_desired_present_mode(VK_PRESENT_MODE_FIFO_KHR)
+            .set_desired_present_mode(m_present_mode)
             .set_desired_extent(m_window_extent.width, m_window_extent.height)
+            .set_old_swapchain(old_swapchain)
             .build()
             .value();
 
+    if (old_swapchain != VK_NULL_HANDLE) {
+        m_present_latency.forget_swapchain(old_swapchain);
+        vkDestroySwapchainKHR(m_device, old_swapchain, nullptr);
+    }
+
     m_swapchain = vkb_swapchain.swapchain;
     m_swapchain_images = vkb_swapchain.get_images().value();
     m_swapchain_images_view = vkb_swapchain.get_image_views().value();
 
     m_swapchain_image_format = vkb_swapchain.image_format;
+    // The surface decides, it may not be exactly the size we asked for
+    m_window_extent = vkb_swapchain.extent;
 
 
     for (auto &i: m_swapchain_images_view) {
-        m_main_deletion_queue.push_function([=, this]() {
+        m_swapchain_deletion_queue.push_function([=, this]() {
             vkDestroyImageView(m_device, i, nullptr);
         });
     }
+}
 
-    m_main_deletion_queue.push_function([=, this]() {
-        vkDestroySwapchainKHR(m_device, m_swapchain, nullptr);
-    });
+void Engine::recreate_swapchain() {
+    // Minimized, there is nothing to render to until the window comes back
+    int width = 0;
+    int height = 0;
+    if (m_render_thread_active) {
+        // The main thread keeps polling, the size shows up there
+        uint64_t size = m_framebuffer_size;
+        while ((size >> 32 == 0 || (uint32_t) size == 0) && !m_render_thread_quit) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            size = m_framebuffer_size;
+        }
+        width = (int) (size >> 32);
+        height = (int) (uint32_t) size;
+    } else {
+        glfwGetFramebufferSize(m_window, &width, &height);
+        while ((width == 0 || height == 0) && !glfwWindowShouldClose(m_window)) {
+            glfwWaitEvents();
+            glfwGetFramebufferSize(m_window, &width, &height);
+        }
+    }
 
-    // Depth texture
-    VkExtent3D depth_image_extent = {
-            m_window_extent.width,
-            m_window_extent.height,
-            1
-    };
+    // The views may still be used by the last frame
+    m_graphics_timeline.wait_idle();
+    VK_CHECK(vkQueueWaitIdle(m_graphics_queue))
 
-    m_depth_format = VK_FORMAT_D32_SFLOAT;
+    m_swapchain_deletion_queue.flush();
 
-    VkImageCreateInfo dimg_info = Initializers::image_create_info(m_depth_format,
-                                                                  VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-                                                                  depth_image_extent);
+    m_window_extent = {(uint32_t) width, (uint32_t) height};
+    init_surface_swapchain();
+    init_render_target_extent();
+    init_depth_pyramid();
+    init_scene_color();
+    init_imgui_framebuffers();
+    // The cached draws set the viewport, and the swapchain format may have changed
+    invalidate_command_cache();
 
-    VmaAllocationCreateInfo dimg_allocinfo = {};
-    dimg_allocinfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-    dimg_allocinfo.requiredFlags = VkMemoryPropertyFlags(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    m_swapchain_dirty = false;
+}
 
-    vmaCreateImage(m_allocator, &dimg_info, &dimg_allocinfo, &m_depth_image.m_image, &m_depth_image.m_allocation,
-                   nullptr);
+void Engine::set_present_mode(VkPresentModeKHR present_mode) {
+    if (present_mode == m_present_mode) {
+        return;
+    }
 
-    VkImageViewCreateInfo dview_info = Initializers::imageview_create_info(m_depth_format, m_depth_image.m_image,
-                                                                           VK_IMAGE_ASPECT_DEPTH_BIT);
+    m_present_mode = present_mode;
+    m_swapchain_dirty = true;
+}
 
-    VK_CHECK(vkCreateImageView(m_device, &dview_info, nullptr, &m_depth_image_view));
+void Engine::cycle_present_mode() {
+    // Lowest latency last
+    const VkPresentModeKHR modes[] = {
+            VK_PRESENT_MODE_FIFO_KHR,
+            VK_PRESENT_MODE_FIFO_RELAXED_KHR,
+            VK_PRESENT_MODE_MAILBOX_KHR,
+            VK_PRESENT_MODE_IMMEDIATE_KHR
+    };
+    const size_t mode_count = sizeof(modes) / sizeof(modes[0]);
+
+    size_t current = std::find(modes, modes + mode_count, m_present_mode) - modes;
+    for (size_t i = 1; i <= mode_count; i++) {
+        VkPresentModeKHR candidate = modes[(current + i) % mode_count];
+        if (std::find(m_supported_present_modes.begin(), m_supported_present_modes.end(), candidate) !=
+            m_supported_present_modes.end()) {
+            set_present_mode(candidate);
+            return;
+        }
+    }
+}
 
-    m_main_deletion_queue.push_function([=, this]() {
-        vkDestroyImageView(m_device, m_depth_image_view, nullptr);
-        vmaDestroyImage(m_allocator, m_depth_image.m_image, m_depth_image.m_allocation);
-    });
+void Engine::init_render_target_extent() {
+    // Large enough for the largest dynamic resolution scale. The depth image is the render
+    // graph's, declared every frame at this size and sampled to build the depth pyramid.
+    m_render_target_extent = DynamicResolution::max_extent(m_window_extent, m_resolution_settings);
+    m_depth_format = VK_FORMAT_D32_SFLOAT;
 }
 
 void Engine::init_commands() {
@@ -209,21 +515,170 @@ void Engine::init_commands() {
     m_main_deletion_queue.push_function([=, this]() {
         vkDestroyCommandPool(m_device, m_main_command_pool, nullptr);
     });
+
+    m_command_cache.init(m_device, m_graphics_queue_family, FRAMES_IN_FLIGHT);
+    m_main_deletion_queue.push_function([=, this]() {
+        m_command_cache.cleanup();
+    });
+
+    // One pool per upload slot, so uploads don't touch the frame command buffer and a slot can be
+    // reset as soon as its timeline value is reached
+    command_pool_create_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    for (UploadSlot &slot: m_upload_ring) {
+        VK_CHECK(vkCreateCommandPool(m_device, &command_pool_create_info, nullptr, &slot.m_command_pool))
+
+        command_buffer_allocate_info.commandPool = slot.m_command_pool;
+        VK_CHECK(vkAllocateCommandBuffers(m_device, &command_buffer_allocate_info, &slot.m_command_buffer))
+
+        m_main_deletion_queue.push_function([=, this]() {
+            vkDestroyCommandPool(m_device, slot.m_command_pool, nullptr);
+        });
+    }
+}
+
+void Engine::init_geometry() {
+    // Grows on demand, this is enough for a few hundred small meshes
+    m_geometry.init(m_allocator, &m_memory_budget, sizeof(Vertex), 1 << 18, 1 << 20);
+
+    m_main_deletion_queue.push_function([=, this]() {
+        m_geometry.cleanup();
+    });
 }
 
-void Engine::init_sync_structures() {
-    VkFenceCreateInfo fence_create_info = {
-            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+void Engine::init_descriptors() {
+    // Room for more than the frame sets, for the passes to come
+    std::vector<VkDescriptorPoolSize> pool_sizes = {
+            {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 16},
+            {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 16}
+    };
+
+    VkDescriptorPoolCreateInfo pool_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
             .pNext = nullptr,
-            //we want to create the fence with the Create Signaled flag, so we can wait on it before using it on a GPU command (for the first frame)
-            .flags = VK_FENCE_CREATE_SIGNALED_BIT
+            .flags = 0,
+            .maxSets = 16,
+            .poolSizeCount = (uint32_t) pool_sizes.size(),
+            .pPoolSizes = pool_sizes.data()
     };
-    VK_CHECK(vkCreateFence(m_device, &fence_create_info, nullptr, &m_render_fence))
+    VK_CHECK(vkCreateDescriptorPool(m_device, &pool_info, nullptr, &m_descriptor_pool))
 
+    // Owns the set and pipeline layouts, destroyed after every pipeline using them
+    m_layout_cache.init(m_device);
     m_main_deletion_queue.push_function([=, this]() {
-        vkDestroyFence(m_device, m_render_fence, nullptr);
+        m_layout_cache.cleanup();
     });
 
+    m_global_set_layout = m_layout_cache.get_set_layout({
+            Initializers::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+                                                       VK_SHADER_STAGE_VERTEX_BIT, 0),
+            Initializers::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                                       VK_SHADER_STAGE_VERTEX_BIT, 1)
+    });
+
+    m_main_deletion_queue.push_function([=, this]() {
+        vkDestroyDescriptorPool(m_device, m_descriptor_pool, nullptr);
+    });
+
+    for (FrameData &frame: m_frames) {
+        VkBufferCreateInfo buffer_info = {
+                .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                .size = sizeof(CameraData),
+                .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT
+        };
+
+        VmaAllocationCreateInfo vma_alloc_info = {};
+        vma_alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+        vma_alloc_info.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+
+        VmaAllocationInfo allocation_info;
+        VK_CHECK(vmaCreateBuffer(m_allocator, &buffer_info, &vma_alloc_info, &frame.m_camera_buffer.m_buffer,
+                                 &frame.m_camera_buffer.m_allocation, &allocation_info))
+        m_memory_budget.track(frame.m_camera_buffer.m_allocation, MemoryCategory::PerFrame);
+        frame.m_camera = (CameraData *) allocation_info.pMappedData;
+
+        VkDescriptorSetAllocateInfo set_allocate_info = {
+                .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+                .pNext = nullptr,
+                .descriptorPool = m_descriptor_pool,
+                .descriptorSetCount = 1,
+                .pSetLayouts = &m_global_set_layout
+        };
+        VK_CHECK(vkAllocateDescriptorSets(m_device, &set_allocate_info, &frame.m_global_descriptor))
+
+        VkDescriptorBufferInfo camera_info = {
+                .buffer = frame.m_camera_buffer.m_buffer,
+                .offset = 0,
+                .range = sizeof(CameraData)
+        };
+        VkWriteDescriptorSet camera_write = Initializers::write_descriptor_buffer(
+                VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, frame.m_global_descriptor, &camera_info, 0);
+        vkUpdateDescriptorSets(m_device, 1, &camera_write, 0, nullptr);
+
+        // Also writes binding 1
+        create_instance_buffer(frame, INITIAL_INSTANCE_CAPACITY);
+
+        m_main_deletion_queue.push_function([=, this, &frame]() {
+            destroy_instance_buffer(frame);
+            m_memory_budget.untrack(frame.m_camera_buffer.m_allocation);
+            vmaDestroyBuffer(m_allocator, frame.m_camera_buffer.m_buffer, frame.m_camera_buffer.m_allocation);
+        });
+    }
+}
+
+void Engine::create_instance_buffer(FrameData &frame, uint32_t capacity) {
+    VkBufferCreateInfo buffer_info = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .size = (VkDeviceSize) capacity * sizeof(InstanceData),
+            .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+    };
+
+    VmaAllocationCreateInfo vma_alloc_info = {};
+    vma_alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+    vma_alloc_info.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+
+    VmaAllocationInfo allocation_info;
+    VK_CHECK(vmaCreateBuffer(m_allocator, &buffer_info, &vma_alloc_info, &frame.m_instance_buffer.m_buffer,
+                             &frame.m_instance_buffer.m_allocation, &allocation_info))
+    m_memory_budget.track(frame.m_instance_buffer.m_allocation, MemoryCategory::PerFrame);
+
+    frame.m_instances = (InstanceData *) allocation_info.pMappedData;
+    frame.m_instance_capacity = capacity;
+
+    VkDescriptorBufferInfo instance_info = {
+            .buffer = frame.m_instance_buffer.m_buffer,
+            .offset = 0,
+            .range = VK_WHOLE_SIZE
+    };
+    VkWriteDescriptorSet instance_write = Initializers::write_descriptor_buffer(
+            VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame.m_global_descriptor, &instance_info, 1);
+    vkUpdateDescriptorSets(m_device, 1, &instance_write, 0, nullptr);
+    // The cached draws bind the set
+    invalidate_command_cache();
+}
+
+void Engine::destroy_instance_buffer(FrameData &frame) {
+    m_memory_budget.untrack(frame.m_instance_buffer.m_allocation);
+    vmaDestroyBuffer(m_allocator, frame.m_instance_buffer.m_buffer, frame.m_instance_buffer.m_allocation);
+    frame.m_instances = nullptr;
+    frame.m_instance_capacity = 0;
+}
+
+void Engine::init_sync_structures() {
+    // Starts at 0, which counts as reached, so the first frame doesn't wait
+    m_graphics_timeline.init(m_device, m_graphics_queue, m_graphics_queue_family);
+
+    m_main_deletion_queue.push_function([=, this]() {
+        m_graphics_timeline.cleanup();
+    });
+
+    if (m_async_compute_supported) {
+        m_compute_timeline.init(m_device, m_compute_queue, m_compute_queue_family);
+        m_main_deletion_queue.push_function([=, this]() {
+            m_compute_timeline.cleanup();
+        });
+    }
+
+    // Binary semaphores are still needed for the swapchain, acquire and present can't use timelines
     VkSemaphoreCreateInfo semaphore_create_info = {
             .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
             .pNext = nullptr,
@@ -241,95 +696,439 @@ void Engine::init_sync_structures() {
 }
 
 void Engine::init_base_pipelines() {
-    VkShaderModule triangle_frag_shader;
-    if (!load_shader_module("triangle.frag.spv", &triangle_frag_shader)) {
-        std::cout << "Error when building the triangle fragment shader module" << std::endl;
+    // Every pipeline made with build_pipeline, including the ones made after init
+    m_main_deletion_queue.push_function([=, this]() {
+        for (const ReloadablePipeline &pipeline: m_pipelines) {
+            vkDestroyPipeline(m_device, pipeline.m_pipeline, nullptr);
+        }
+        m_pipelines.clear();
+    });
+
+    PipelineBuilder pipeline_builder;
+
+    pipeline_builder.setup_default(m_window_extent);
+
+    pipeline_builder.m_depth_stencil_format = m_depth_format;
+    pipeline_builder.m_depth_stencil = Initializers::depth_stencil_create_info(true, true, VK_COMPARE_OP_LESS_OR_EQUAL);
+    // Cull and depth state come from the materials
+    pipeline_builder.enable_dynamic_render_state();
+
+    // The layouts are derived from the shaders
+    pipeline_builder.m_pipeline_layout = VK_NULL_HANDLE;
+
+    m_triangle_pipeline = build_pipeline(pipeline_builder, {
+            {VK_SHADER_STAGE_VERTEX_BIT, "triangle.vert.spv"},
+            {VK_SHADER_STAGE_FRAGMENT_BIT, "triangle.frag.spv"}
+    }, &m_triangle_pipeline_layout);
+    if (m_triangle_pipeline == VK_NULL_HANDLE) {
+        std::cout << "Error when building the triangle pipeline" << std::endl;
+        abort();
+    }
+
+    //
+    //
+    //base trimesh pipeline
+    pipeline_builder.set_vertex_input<Vertex>();
+
+    pipeline_builder.m_pipeline_layout = VK_NULL_HANDLE;
+
+    m_debug_mesh_pipeline = build_pipeline(pipeline_builder, {
+            {VK_SHADER_STAGE_VERTEX_BIT, "base_trimesh.vert.spv"},
+            {VK_SHADER_STAGE_FRAGMENT_BIT, "base_vertex_color.frag.spv"}
+    }, &m_debug_mesh_pipeline_layout);
+    if (m_debug_mesh_pipeline == VK_NULL_HANDLE) {
+        std::cout << "Error when building the base trimesh pipeline" << std::endl;
+        abort();
+    }
+
+    // draw_objects pushes MeshPushConstants to the vertex stage, the shader has to agree
+    const LayoutCache::PipelineLayoutDesc *mesh_layout = m_layout_cache.find_pipeline_desc(
+            m_debug_mesh_pipeline_layout);
+    if (mesh_layout->m_push_constants.size() != 1 ||
+        mesh_layout->m_push_constants[0].size != sizeof(MeshPushConstants) ||
+        !(mesh_layout->m_push_constants[0].stageFlags & VK_SHADER_STAGE_VERTEX_BIT)) {
+        std::cout << "base_trimesh.vert push constants don't match MeshPushConstants" << std::endl;
+        abort();
+    }
+
+    // Same layout and state, the per object data comes from the instance buffer. It doesn't use
+    // the push constants but must stay compatible with the non instanced pipeline.
+    pipeline_builder.m_pipeline_layout = m_debug_mesh_pipeline_layout;
+    m_debug_mesh_instanced_pipeline = build_pipeline(pipeline_builder, {
+            {VK_SHADER_STAGE_VERTEX_BIT, "base_trimesh_instanced.vert.spv"},
+            {VK_SHADER_STAGE_FRAGMENT_BIT, "base_vertex_color.frag.spv"}
+    });
+
+    if (m_debug_mesh_instanced_pipeline == VK_NULL_HANDLE) {
+        std::cout << "Error when building the instanced base trimesh pipeline" << std::endl;
+        abort();
+    }
+
+    create_material(m_debug_mesh_pipeline, m_debug_mesh_pipeline_layout, "default_mesh",
+                    m_debug_mesh_instanced_pipeline);
+
+    // Shaded with the clustered lights, set 1 is ClusteredLighting::set_layout
+    pipeline_builder.m_pipeline_layout = VK_NULL_HANDLE;
+    VkPipeline lit_mesh_pipeline = build_pipeline(pipeline_builder, {
+            {VK_SHADER_STAGE_VERTEX_BIT, "lit_trimesh.vert.spv"},
+            {VK_SHADER_STAGE_FRAGMENT_BIT, "clustered_lit.frag.spv"}
+    }, &m_lit_mesh_pipeline_layout);
+    VkPipeline lit_mesh_instanced_pipeline = VK_NULL_HANDLE;
+    if (lit_mesh_pipeline != VK_NULL_HANDLE) {
+        pipeline_builder.m_pipeline_layout = m_lit_mesh_pipeline_layout;
+        lit_mesh_instanced_pipeline = build_pipeline(pipeline_builder, {
+                {VK_SHADER_STAGE_VERTEX_BIT, "lit_trimesh_instanced.vert.spv"},
+                {VK_SHADER_STAGE_FRAGMENT_BIT, "clustered_lit.frag.spv"}
+        });
+    }
+    if (lit_mesh_pipeline == VK_NULL_HANDLE || lit_mesh_instanced_pipeline == VK_NULL_HANDLE) {
+        std::cout << "Error when building the lit mesh pipelines" << std::endl;
         abort();
     }
 
-    VkShaderModule triangle_vertex_shader;
-    if (!load_shader_module("triangle.vert.spv", &triangle_vertex_shader)) {
-        std::cout << "Error when building the triangle vertex shader module" << std::endl;
+    // Derived from the shaders, they must have ended up with the lighting and shadow sets
+    const LayoutCache::PipelineLayoutDesc *lit_layout = m_layout_cache.find_pipeline_desc(m_lit_mesh_pipeline_layout);
+    if (lit_layout->m_set_layouts.size() < 3 || lit_layout->m_set_layouts[1] != m_lighting.set_layout() ||
+        lit_layout->m_set_layouts[2] != m_shadows.set_layout()) {
+        std::cout << "clustered_lit.frag sets 1 and 2 don't match ClusteredLighting and CascadedShadows" << std::endl;
         abort();
     }
 
-    VkShaderModule base_trimesh_vertex_shader;
-    if (!load_shader_module("base_trimesh.vert.spv", &base_trimesh_vertex_shader)) {
-        std::cout << "Error when building the base trimesh vertex shader module" << std::endl;
+    create_material(lit_mesh_pipeline, m_lit_mesh_pipeline_layout, "lit_mesh", lit_mesh_instanced_pipeline);
+
+    // Depth only, so no fragment shader and no color attachment. Every culled object goes through
+    // it, whatever its material, so their instanced vertex shaders must place vertices the same way.
+    pipeline_builder.m_color_blend_attachment.clear();
+    m_depth_prepass_pipeline = build_pipeline(pipeline_builder, {
+            {VK_SHADER_STAGE_VERTEX_BIT, "base_trimesh_instanced.vert.spv"}
+    });
+    if (m_depth_prepass_pipeline == VK_NULL_HANDLE) {
+        std::cout << "Error when building the depth prepass pipeline" << std::endl;
         abort();
     }
+}
+
+void Engine::init_occlusion_culling() {
+    ComputeProgram reduce;
+    ComputeProgram cull;
+    if (!create_compute_program("hiz_reduce.comp.spv", &reduce) ||
+        !create_compute_program("occlusion_cull.comp.spv", &cull)) {
+        std::cout << "Error when building the occlusion culling pipelines" << std::endl;
+        abort();
+    }
+
+    m_occlusion_culler.init(m_device, m_allocator, &m_memory_budget, FRAMES_IN_FLIGHT, reduce, cull,
+                            async_compute_queue_families());
+    m_occlusion_culler.reserve(INITIAL_INSTANCE_CAPACITY);
+    m_main_deletion_queue.push_function([=, this]() {
+        m_occlusion_culler.cleanup();
+    });
+
+    init_depth_pyramid();
+}
+
+void Engine::init_depth_pyramid() {
+    // The image is declared in the render graph with the size the culler picks
+    m_occlusion_culler.resize_pyramid(m_render_target_extent);
+}
+
+std::vector<uint32_t> Engine::async_compute_queue_families() const {
+    if (!m_async_compute_supported) {
+        return {};
+    }
+    return {m_graphics_queue_family, m_compute_queue_family};
+}
 
-    VkShaderModule base_vertex_color_frag_shader;
-    if (!load_shader_module("base_vertex_color.frag.spv", &base_vertex_color_frag_shader)) {
-        std::cout << "Error when building the base vertex color shader module" << std::endl;
+void Engine::init_lighting() {
+    ComputeProgram cluster;
+    if (!create_compute_program("light_cluster.comp.spv", &cluster)) {
+        std::cout << "Error when building the light clustering pipeline" << std::endl;
         abort();
     }
 
-    VkPipelineLayoutCreateInfo pipeline_layout_info = Initializers::pipeline_layout_create_info();
-    VK_CHECK(vkCreatePipelineLayout(m_device, &pipeline_layout_info, nullptr, &m_triangle_pipeline_layout));
+    m_lighting.init(m_device, m_allocator, &m_memory_budget, &m_layout_cache, FRAMES_IN_FLIGHT, cluster,
+                    async_compute_queue_families());
+    m_main_deletion_queue.push_function([=, this]() {
+        m_lighting.cleanup();
+    });
+}
+
+void Engine::init_shader_hot_reload() {
+#ifdef VK_ENGINE_SHADER_SOURCE_DIR
+    // The shaders are loaded from the working directory, so that's where they are recompiled to
+    std::string compiler = VK_ENGINE_GLSL_VALIDATOR;
+    if (compiler.find("NOTFOUND") != std::string::npos) {
+        compiler.clear();
+    }
+
+    if (m_shader_hot_reload.init(VK_ENGINE_SHADER_SOURCE_DIR, ".", compiler)) {
+        m_main_deletion_queue.push_function([=, this]() {
+            m_shader_hot_reload.cleanup();
+        });
+    }
+#endif
+}
+
+void Engine::init_profiler() {
+    m_profiler.init(m_device, m_physical_device, m_graphics_queue_family, FRAMES_IN_FLIGHT, m_compute_queue_family);
+
+    m_main_deletion_queue.push_function([=, this]() {
+        m_profiler.cleanup();
+    });
+}
 
-    VkPipelineLayoutCreateInfo mesh_pipeline_layout_info = Initializers::pipeline_layout_create_info();
-    VkPushConstantRange push_constant;
-    push_constant.offset = 0;
-    push_constant.size = sizeof(MeshPushConstants);
-    push_constant.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-    mesh_pipeline_layout_info.pPushConstantRanges = &push_constant;
-    mesh_pipeline_layout_info.pushConstantRangeCount = 1;
-    VK_CHECK(vkCreatePipelineLayout(m_device, &mesh_pipeline_layout_info, nullptr, &m_debug_mesh_pipeline_layout));
+void Engine::init_shadows() {
+    m_shadows.init(m_device, m_allocator, &m_memory_budget, &m_layout_cache, FRAMES_IN_FLIGHT, m_shadow_settings);
+    m_main_deletion_queue.push_function([=, this]() {
+        m_shadows.cleanup();
+    });
 
+    // Depth only, biased against acne. Both faces cast, so thin and open meshes do too.
     PipelineBuilder pipeline_builder;
+    pipeline_builder.setup_default({m_shadow_settings.m_resolution, m_shadow_settings.m_resolution});
+    pipeline_builder.m_depth_stencil_format = SHADOW_MAP_FORMAT;
+    pipeline_builder.m_depth_stencil = Initializers::depth_stencil_create_info(true, true, VK_COMPARE_OP_LESS_OR_EQUAL);
+    pipeline_builder.m_color_blend_attachment.clear();
+    pipeline_builder.m_rasterizer.cullMode = VK_CULL_MODE_NONE;
+    pipeline_builder.m_rasterizer.depthBiasEnable = VK_TRUE;
+    pipeline_builder.m_rasterizer.depthBiasConstantFactor = 1.25f;
+    pipeline_builder.m_rasterizer.depthBiasSlopeFactor = 1.75f;
+    pipeline_builder.m_pipeline_layout = VK_NULL_HANDLE;
+    m_shadow_pipeline = build_pipeline(pipeline_builder, {
+            {VK_SHADER_STAGE_VERTEX_BIT, "shadow_instanced.vert.spv"}
+    }, &m_shadow_pipeline_layout);
+    if (m_shadow_pipeline == VK_NULL_HANDLE) {
+        std::cout << "Error when building the shadow pipeline" << std::endl;
+        abort();
+    }
+}
 
-    pipeline_builder.setup_default(m_window_extent);
+void Engine::init_particles() {
+    ParticlePrograms programs;
+    if (!create_compute_program("particle_args.comp.spv", &programs.m_args) ||
+        !create_compute_program("particle_emit.comp.spv", &programs.m_emit) ||
+        !create_compute_program("particle_simulate.comp.spv", &programs.m_simulate) ||
+        !create_compute_program("particle_compact.comp.spv", &programs.m_compact) ||
+        !create_compute_program("particle_sort.comp.spv", &programs.m_sort)) {
+        std::cout << "Error when building the particle pipelines" << std::endl;
+        abort();
+    }
 
+    // The buffers are only allocated once there are emitters, see draw
+    m_particles.init(m_device, m_allocator, &m_memory_budget, &m_layout_cache, FRAMES_IN_FLIGHT, programs,
+                     async_compute_queue_families());
+    m_main_deletion_queue.push_function([=, this]() {
+        m_particles.cleanup();
+    });
+
+    // Camera facing quads built by the vertex shader, so no vertex input. Tested against the
+    // scene's depth without writing it, blended back to front.
+    PipelineBuilder pipeline_builder;
+    pipeline_builder.setup_default(m_window_extent);
     pipeline_builder.m_depth_stencil_format = m_depth_format;
-    pipeline_builder.m_depth_stencil = Initializers::depth_stencil_create_info(true, true, VK_COMPARE_OP_LESS_OR_EQUAL);
+    pipeline_builder.m_depth_stencil = Initializers::depth_stencil_create_info(true, false, VK_COMPARE_OP_LESS_OR_EQUAL);
+    pipeline_builder.m_rasterizer.cullMode = VK_CULL_MODE_NONE;
+    VkPipelineColorBlendAttachmentState &blend = pipeline_builder.m_color_blend_attachment[0];
+    blend.blendEnable = VK_TRUE;
+    blend.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+    blend.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    blend.colorBlendOp = VK_BLEND_OP_ADD;
+    blend.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    blend.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    blend.alphaBlendOp = VK_BLEND_OP_ADD;
+    pipeline_builder.m_pipeline_layout = VK_NULL_HANDLE;
+    m_particle_pipeline = build_pipeline(pipeline_builder, {
+            {VK_SHADER_STAGE_VERTEX_BIT, "particle.vert.spv"},
+            {VK_SHADER_STAGE_FRAGMENT_BIT, "particle.frag.spv"}
+    }, &m_particle_pipeline_layout);
+    if (m_particle_pipeline == VK_NULL_HANDLE) {
+        std::cout << "Error when building the particle pipeline" << std::endl;
+        abort();
+    }
 
+    const LayoutCache::PipelineLayoutDesc *layout = m_layout_cache.find_pipeline_desc(m_particle_pipeline_layout);
+    if (layout->m_set_layouts.size() < 2 || layout->m_set_layouts[1] != m_particles.set_layout()) {
+        std::cout << "particle.vert set 1 doesn't match ParticleSystem" << std::endl;
+        abort();
+    }
+}
 
-    pipeline_builder.m_shader_stages.push_back(
-            Initializers::pipeline_shader_stage_create_info(VK_SHADER_STAGE_VERTEX_BIT, triangle_vertex_shader));
+void Engine::init_skinning() {
+    ComputeProgram program;
+    if (!create_compute_program("skinning.comp.spv", &program)) {
+        std::cout << "Error when building the skinning pipeline" << std::endl;
+        abort();
+    }
 
-    pipeline_builder.m_shader_stages.push_back(
-            Initializers::pipeline_shader_stage_create_info(VK_SHADER_STAGE_FRAGMENT_BIT, triangle_frag_shader));
+    m_skinning.init(m_device, m_allocator, &m_memory_budget, &m_layout_cache, FRAMES_IN_FLIGHT, program);
+    m_main_deletion_queue.push_function([=, this]() {
+        m_skinning.cleanup();
+    });
+}
 
-    pipeline_builder.m_pipeline_layout = m_triangle_pipeline_layout;
+void Engine::init_dynamic_resolution() {
+    m_dynamic_resolution.init(m_device, m_allocator, &m_memory_budget, &m_layout_cache);
+    m_main_deletion_queue.push_function([=, this]() {
+        m_dynamic_resolution.cleanup();
+    });
+    init_scene_color();
 
-    m_triangle_pipeline = pipeline_builder.build_pipeline(m_device);
+    // Fullscreen triangle, no vertex input or depth
+    PipelineBuilder pipeline_builder;
+    pipeline_builder.setup_default(m_window_extent);
+    pipeline_builder.m_depth_stencil_format = VK_FORMAT_UNDEFINED;
+    pipeline_builder.m_depth_stencil = Initializers::depth_stencil_create_info(false, false, VK_COMPARE_OP_ALWAYS);
+    pipeline_builder.m_rasterizer.cullMode = VK_CULL_MODE_NONE;
+    pipeline_builder.m_pipeline_layout = VK_NULL_HANDLE;
+    m_upscale_pipeline = build_pipeline(pipeline_builder, {
+            {VK_SHADER_STAGE_VERTEX_BIT, "fullscreen.vert.spv"},
+            {VK_SHADER_STAGE_FRAGMENT_BIT, "upscale.frag.spv"}
+    }, &m_upscale_pipeline_layout);
+    if (m_upscale_pipeline == VK_NULL_HANDLE) {
+        std::cout << "Error when building the upscale pipeline" << std::endl;
+        abort();
+    }
 
-    //
-    //
-    //base trimesh pipeline
-    pipeline_builder.m_shader_stages.clear();
+    const LayoutCache::PipelineLayoutDesc *layout = m_layout_cache.find_pipeline_desc(m_upscale_pipeline_layout);
+    if (layout->m_set_layouts.size() < 2 || layout->m_set_layouts[1] != m_dynamic_resolution.set_layout()) {
+        std::cout << "upscale.frag set 1 doesn't match DynamicResolution" << std::endl;
+        abort();
+    }
+}
 
-    VertexInputDescription vertex_description = Vertex::get_vertex_description();
+void Engine::init_scene_color() {
+    // Same format as the swapchain, the upscale is a plain copy when the scale is 1
+    m_dynamic_resolution.create_target(m_window_extent, m_swapchain_image_format, m_resolution_settings);
+    m_swapchain_deletion_queue.push_function([=, this]() {
+        m_dynamic_resolution.destroy_target();
+    });
+}
 
-    //connect the pipeline builder vertex input info to the one we get from Vertex
-    pipeline_builder.m_vertex_input_info.pVertexAttributeDescriptions = vertex_description.attributes.data();
-    pipeline_builder.m_vertex_input_info.vertexAttributeDescriptionCount = vertex_description.attributes.size();
+void Engine::init_render_graph() {
+    m_render_graph.init(m_device, m_allocator, &m_memory_budget, &m_graphics_timeline, &m_timeline_deletion_queue,
+                        &m_profiler);
+    if (m_async_compute_supported) {
+        m_render_graph.set_async_compute(&m_compute_timeline);
+    }
 
-    pipeline_builder.m_vertex_input_info.pVertexBindingDescriptions = vertex_description.bindings.data();
-    pipeline_builder.m_vertex_input_info.vertexBindingDescriptionCount = vertex_description.bindings.size();
+    m_main_deletion_queue.push_function([=, this]() {
+        m_render_graph.cleanup();
+    });
+}
 
-    pipeline_builder.m_pipeline_layout = m_debug_mesh_pipeline_layout;
+void Engine::init_imgui() {
+    // Oversized, but imgui only needs a few descriptors for the font and user textures
+    VkDescriptorPoolSize pool_sizes[] = {
+            {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 64}
+    };
 
-    pipeline_builder.m_shader_stages.push_back(
-            Initializers::pipeline_shader_stage_create_info(VK_SHADER_STAGE_VERTEX_BIT, base_trimesh_vertex_shader));
+    VkDescriptorPoolCreateInfo pool_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
+            .maxSets = 64,
+            .poolSizeCount = 1,
+            .pPoolSizes = pool_sizes
+    };
+    VK_CHECK(vkCreateDescriptorPool(m_device, &pool_info, nullptr, &m_imgui_pool))
+
+    // The vendored imgui backend predates dynamic rendering, so the UI is drawn in a small
+    // render pass that loads what the main pass wrote to the swapchain image.
+    VkAttachmentDescription color_attachment = {
+            .format = m_swapchain_image_format,
+            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+            .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+            .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+            .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .initialLayout = VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL,
+            .finalLayout = VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL
+    };
 
-    pipeline_builder.m_shader_stages.push_back(
-            Initializers::pipeline_shader_stage_create_info(VK_SHADER_STAGE_FRAGMENT_BIT,
-                                                            base_vertex_color_frag_shader));
+    // Same layout as the render graph attachments, so the pass has no transition of its own
+    VkAttachmentReference color_attachment_ref = {
+            .attachment = 0,
+            .layout = VK_IMAGE_LAYOUT_ATTACHMENT_OPTIMAL
+    };
 
-    m_debug_mesh_pipeline = pipeline_builder.build_pipeline(m_device);
+    VkSubpassDescription subpass = {
+            .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+            .colorAttachmentCount = 1,
+            .pColorAttachments = &color_attachment_ref
+    };
 
-    vkDestroyShaderModule(m_device, triangle_frag_shader, nullptr);
-    vkDestroyShaderModule(m_device, triangle_vertex_shader, nullptr);
-    vkDestroyShaderModule(m_device, base_trimesh_vertex_shader, nullptr);
-    vkDestroyShaderModule(m_device, base_vertex_color_frag_shader, nullptr);
+    // No dependency, the render graph waits for the main pass before it
+    VkRenderPassCreateInfo render_pass_info = {
+            .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+            .pNext = nullptr,
+            .attachmentCount = 1,
+            .pAttachments = &color_attachment,
+            .subpassCount = 1,
+            .pSubpasses = &subpass,
+            .dependencyCount = 0,
+            .pDependencies = nullptr
+    };
+    VK_CHECK(vkCreateRenderPass(m_device, &render_pass_info, nullptr, &m_imgui_render_pass))
+
+    init_imgui_framebuffers();
+
+    ImGui::CreateContext();
+    ImGui_ImplGlfw_InitForVulkan(m_window, true);
+
+    ImGui_ImplVulkan_InitInfo init_info = {};
+    init_info.Instance = m_instance;
+    init_info.PhysicalDevice = m_physical_device;
+    init_info.Device = m_device;
+    init_info.QueueFamily = m_graphics_queue_family;
+    init_info.Queue = m_graphics_queue;
+    init_info.DescriptorPool = m_imgui_pool;
+    init_info.MinImageCount = m_swapchain_images.size();
+    init_info.ImageCount = m_swapchain_images.size();
+    init_info.MSAASamples = VK_SAMPLE_COUNT_1_BIT;
+
+    ImGui_ImplVulkan_Init(&init_info, m_imgui_render_pass);
+
+    immediate_submit([&](VkCommandBuffer cmd) {
+        ImGui_ImplVulkan_CreateFontsTexture(cmd);
+    });
+    ImGui_ImplVulkan_DestroyFontUploadObjects();
 
     m_main_deletion_queue.push_function([=, this]() {
-        vkDestroyPipeline(m_device, m_triangle_pipeline, nullptr);
-        vkDestroyPipeline(m_device, m_debug_mesh_pipeline, nullptr);
-        vkDestroyPipelineLayout(m_device, m_debug_mesh_pipeline_layout, nullptr);
-        vkDestroyPipelineLayout(m_device, m_triangle_pipeline_layout, nullptr);
+        ImGui_ImplVulkan_Shutdown();
+        ImGui_ImplGlfw_Shutdown();
+        ImGui::DestroyContext();
+
+        vkDestroyRenderPass(m_device, m_imgui_render_pass, nullptr);
+        vkDestroyDescriptorPool(m_device, m_imgui_pool, nullptr);
+    });
+}
+
+void Engine::init_imgui_framebuffers() {
+    // Called again on swapchain recreation, before imgui is initialized it has no render pass
+    if (m_imgui_render_pass == VK_NULL_HANDLE) {
+        return;
+    }
+
+    m_imgui_framebuffers.resize(m_swapchain_images_view.size());
+    for (size_t i = 0; i < m_swapchain_images_view.size(); i++) {
+        VkFramebufferCreateInfo framebuffer_info = {
+                .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+                .pNext = nullptr,
+                .renderPass = m_imgui_render_pass,
+                .attachmentCount = 1,
+                .pAttachments = &m_swapchain_images_view[i],
+                .width = m_window_extent.width,
+                .height = m_window_extent.height,
+                .layers = 1
+        };
+        VK_CHECK(vkCreateFramebuffer(m_device, &framebuffer_info, nullptr, &m_imgui_framebuffers[i]))
+    }
+
+    m_swapchain_deletion_queue.push_function([=, this]() {
+        for (auto framebuffer: m_imgui_framebuffers) {
+            vkDestroyFramebuffer(m_device, framebuffer, nullptr);
+        }
+        m_imgui_framebuffers.clear();
     });
 }
 
@@ -344,7 +1143,7 @@ void Engine::init_debug_meshes() {
     m_debug_triangle_mesh.m_vertices[1].color = {1.f, 0.f, 0.f};
     m_debug_triangle_mesh.m_vertices[2].color = {0.f, 0.f, 1.f};
 
-    m_debug_monkey_mesh.load_from_obj("./assets/monkey.obj");
+    m_debug_monkey_mesh.load_from_obj_parallel("./assets/monkey.obj");
 
     upload_mesh(m_debug_triangle_mesh);
     upload_mesh(m_debug_monkey_mesh);
@@ -0,0 +1,226 @@
+#include "FrameCapture.h"
+
+#include <bit>
+#include <cstring>
+#include <iostream>
+
+// Written as they are in memory, so only little endian platforms read and write them
+static bool little_endian(const char *filename) {
+    if constexpr (std::endian::native != std::endian::little) {
+        std::cout << filename << ": frame captures are little endian, this platform isn't" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool same_object(const FrameCaptureObject &a, const FrameCaptureObject &b) {
+    return memcmp(&a, &b, sizeof(FrameCaptureObject)) == 0;
+}
+
+bool FrameCaptureWriter::open(const char *filename, VkExtent2D extent) {
+    close();
+    if (!little_endian(filename)) {
+        return false;
+    }
+
+    m_file.open(filename, std::ios::binary | std::ios::trunc);
+    if (!m_file.is_open()) {
+        std::cout << "Failed to open " << filename << " for writing" << std::endl;
+        return false;
+    }
+    m_filename = filename;
+
+    FrameCaptureHeader header = {
+            .m_magic = FRAME_CAPTURE_MAGIC,
+            .m_version = FRAME_CAPTURE_VERSION,
+            .m_width = extent.width,
+            .m_height = extent.height
+    };
+    m_file.write((const char *) &header, sizeof(header));
+    return true;
+}
+
+void FrameCaptureWriter::close() {
+    if (m_file.is_open()) {
+        m_file.close();
+        if (!m_file.good()) {
+            std::cout << "Failed to write " << m_filename << std::endl;
+        }
+    }
+    m_file.clear();
+    m_chunk.clear();
+    m_mesh_ids.clear();
+    m_pipeline_ids.clear();
+    m_material_ids.clear();
+    m_last_objects.clear();
+    m_frame_count = 0;
+}
+
+uint32_t FrameCaptureWriter::mesh_id(const Mesh *mesh) const {
+    auto it = m_mesh_ids.find(mesh);
+    return it == m_mesh_ids.end() ? UINT32_MAX : it->second;
+}
+
+uint32_t FrameCaptureWriter::pipeline_id(VkPipeline pipeline) const {
+    auto it = m_pipeline_ids.find(pipeline);
+    return it == m_pipeline_ids.end() ? UINT32_MAX : it->second;
+}
+
+uint32_t FrameCaptureWriter::material_id(const Material *material) const {
+    auto it = m_material_ids.find(material);
+    return it == m_material_ids.end() ? UINT32_MAX : it->second;
+}
+
+uint32_t FrameCaptureWriter::write_mesh(const Mesh *mesh, const std::string &name) {
+    auto id = (uint32_t) m_mesh_ids.size();
+    m_mesh_ids[mesh] = id;
+
+    FrameCaptureMesh record = {
+            .m_id = id,
+            .m_vertex_count = (uint32_t) mesh->m_vertices.size(),
+            .m_index_count = (uint32_t) mesh->m_indices.size()
+    };
+    put(record);
+    put_string(name);
+    put_bytes(mesh->m_vertices.data(), mesh->m_vertices.size() * sizeof(Vertex));
+    put_bytes(mesh->m_indices.data(), mesh->m_indices.size() * sizeof(uint32_t));
+    flush_chunk(FrameCaptureChunkType::Mesh);
+    return id;
+}
+
+uint32_t FrameCaptureWriter::write_pipeline(VkPipeline pipeline, FrameCapturePipeline record,
+                                            const std::vector<ShaderFile> &shaders) {
+    record.m_id = (uint32_t) m_pipeline_ids.size();
+    record.m_shader_count = (uint32_t) shaders.size();
+    m_pipeline_ids[pipeline] = record.m_id;
+
+    put(record);
+    for (const ShaderFile &shader: shaders) {
+        put((uint32_t) shader.m_stage);
+        put_string(shader.m_path);
+    }
+    flush_chunk(FrameCaptureChunkType::Pipeline);
+    return record.m_id;
+}
+
+uint32_t FrameCaptureWriter::write_material(const Material *material, const std::string &name,
+                                            FrameCaptureMaterial record) {
+    record.m_id = (uint32_t) m_material_ids.size();
+    m_material_ids[material] = record.m_id;
+
+    put(record);
+    put_string(name);
+    flush_chunk(FrameCaptureChunkType::Material);
+    return record.m_id;
+}
+
+void FrameCaptureWriter::write_frame(FrameCaptureFrame record, const std::vector<PointLight> &lights,
+                                     const std::vector<ParticleEmitter> &emitters,
+                                     const std::vector<FrameCaptureObject> &objects) {
+    // Objects are compared at the same index, appending or removing at the end stays cheap
+    std::vector<uint32_t> changed;
+    for (uint32_t i = 0; i < (uint32_t) objects.size(); i++) {
+        if (i >= m_last_objects.size() || !same_object(objects[i], m_last_objects[i])) {
+            changed.push_back(i);
+        }
+    }
+
+    record.m_light_count = (uint32_t) lights.size();
+    record.m_emitter_count = (uint32_t) emitters.size();
+    record.m_object_count = (uint32_t) objects.size();
+    record.m_changed_objects = (uint32_t) changed.size();
+    put(record);
+    put_bytes(lights.data(), lights.size() * sizeof(PointLight));
+    put_bytes(emitters.data(), emitters.size() * sizeof(ParticleEmitter));
+    for (uint32_t i: changed) {
+        put(objects[i]);
+    }
+    flush_chunk(FrameCaptureChunkType::Frame);
+
+    m_last_objects = objects;
+    m_frame_count++;
+}
+
+void FrameCaptureWriter::put_bytes(const void *data, size_t size) {
+    m_chunk.insert(m_chunk.end(), (const char *) data, (const char *) data + size);
+}
+
+void FrameCaptureWriter::put_string(const std::string &value) {
+    put((uint32_t) value.size());
+    put_bytes(value.data(), value.size());
+}
+
+void FrameCaptureWriter::flush_chunk(FrameCaptureChunkType type) {
+    FrameCaptureChunk chunk = {(uint32_t) type, (uint32_t) m_chunk.size()};
+    m_file.write((const char *) &chunk, sizeof(chunk));
+    m_file.write(m_chunk.data(), (std::streamsize) m_chunk.size());
+    m_chunk.clear();
+}
+
+bool FrameCaptureStream::read_bytes(void *out_data, size_t size) {
+    if (size > m_size - m_offset) {
+        return false;
+    }
+    memcpy(out_data, m_data + m_offset, size);
+    m_offset += size;
+    return true;
+}
+
+bool FrameCaptureStream::read_string(std::string *out_value) {
+    uint32_t size;
+    if (!read(&size) || size > m_size - m_offset) {
+        return false;
+    }
+    out_value->assign(m_data + m_offset, size);
+    m_offset += size;
+    return true;
+}
+
+bool FrameCaptureReader::open(const char *filename) {
+    close();
+    if (!little_endian(filename) || !m_file.open(filename)) {
+        return false;
+    }
+
+    FrameCaptureHeader header;
+    if (m_file.size() < sizeof(header)) {
+        std::cout << filename << " is too small to be a frame capture" << std::endl;
+        close();
+        return false;
+    }
+    memcpy(&header, m_file.data(), sizeof(header));
+
+    if (header.m_magic != FRAME_CAPTURE_MAGIC) {
+        std::cout << filename << " isn't a frame capture" << std::endl;
+        close();
+        return false;
+    }
+    if (header.m_version != FRAME_CAPTURE_VERSION) {
+        std::cout << filename << ": frame capture version " << header.m_version << ", only version "
+                  << FRAME_CAPTURE_VERSION << " is supported" << std::endl;
+        close();
+        return false;
+    }
+
+    // Read front to back, maybe several times when replaying in a loop
+    m_file.advise_sequential();
+    m_extent = {header.m_width, header.m_height};
+    rewind();
+    return true;
+}
+
+bool FrameCaptureReader::next_chunk(FrameCaptureChunkType *out_type, FrameCaptureStream *out_payload) {
+    FrameCaptureChunk chunk;
+    if (m_file.size() - m_offset < sizeof(chunk)) {
+        return false;
+    }
+    memcpy(&chunk, m_file.data() + m_offset, sizeof(chunk));
+    if (chunk.m_size > m_file.size() - m_offset - sizeof(chunk)) {
+        return false;
+    }
+
+    *out_type = (FrameCaptureChunkType) chunk.m_type;
+    *out_payload = FrameCaptureStream(m_file.data() + m_offset + sizeof(chunk), chunk.m_size);
+    m_offset += sizeof(chunk) + chunk.m_size;
+    return true;
+}
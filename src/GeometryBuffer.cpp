@@ -0,0 +1,217 @@
+#include "GeometryBuffer.h"
+
+#include <algorithm>
+
+void GeometryBuffer::init(VmaAllocator allocator, MemoryBudget *memory_budget, uint32_t vertex_stride,
+                          uint32_t vertex_capacity, uint32_t index_capacity) {
+    m_allocator = allocator;
+    m_memory_budget = memory_budget;
+    m_vertex_stride = vertex_stride;
+
+    // Zero sized buffers aren't allowed
+    vertex_capacity = std::max(vertex_capacity, 1u);
+    index_capacity = std::max(index_capacity, 1u);
+
+    m_vertex_buffer = create_buffer((VkDeviceSize) vertex_capacity * m_vertex_stride,
+                                    VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+    m_index_buffer = create_buffer((VkDeviceSize) index_capacity * sizeof(uint32_t),
+                                   VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+
+    m_vertex_allocator.init(vertex_capacity);
+    m_index_allocator.init(index_capacity);
+}
+
+void GeometryBuffer::cleanup() {
+    destroy_buffer(m_vertex_buffer);
+    destroy_buffer(m_index_buffer);
+    m_ranges.clear();
+    m_free_handles.clear();
+}
+
+bool GeometryBuffer::allocate(uint32_t vertex_count, uint32_t index_count, uint32_t *out_handle) {
+    GeometryRange range{
+            .m_vertex_count = vertex_count,
+            .m_index_count = index_count,
+            .m_live = true
+    };
+
+    if (!m_vertex_allocator.allocate(vertex_count, &range.m_first_vertex)) {
+        return false;
+    }
+    if (!m_index_allocator.allocate(index_count, &range.m_first_index)) {
+        m_vertex_allocator.free(range.m_first_vertex, vertex_count);
+        return false;
+    }
+
+    if (m_free_handles.empty()) {
+        *out_handle = (uint32_t) m_ranges.size();
+        m_ranges.push_back(range);
+    } else {
+        *out_handle = m_free_handles.back();
+        m_free_handles.pop_back();
+        m_ranges[*out_handle] = range;
+    }
+    return true;
+}
+
+void GeometryBuffer::free(uint32_t handle) {
+    GeometryRange &range = m_ranges[handle];
+    if (!range.m_live) {
+        return;
+    }
+
+    m_vertex_allocator.free(range.m_first_vertex, range.m_vertex_count);
+    m_index_allocator.free(range.m_first_index, range.m_index_count);
+    range.m_live = false;
+    m_free_handles.push_back(handle);
+}
+
+void GeometryBuffer::cmd_upload(VkCommandBuffer cmd, uint32_t handle, VkBuffer staging_buffer) const {
+    const GeometryRange &range = m_ranges[handle];
+
+    VkDeviceSize vertex_bytes = (VkDeviceSize) range.m_vertex_count * m_vertex_stride;
+    if (range.m_vertex_count > 0) {
+        VkBufferCopy vertex_copy = {
+                .srcOffset = 0,
+                .dstOffset = (VkDeviceSize) range.m_first_vertex * m_vertex_stride,
+                .size = vertex_bytes
+        };
+        vkCmdCopyBuffer(cmd, staging_buffer, m_vertex_buffer.m_buffer, 1, &vertex_copy);
+    }
+
+    if (range.m_index_count > 0) {
+        VkBufferCopy index_copy = {
+                .srcOffset = vertex_bytes,
+                .dstOffset = (VkDeviceSize) range.m_first_index * sizeof(uint32_t),
+                .size = (VkDeviceSize) range.m_index_count * sizeof(uint32_t)
+        };
+        vkCmdCopyBuffer(cmd, staging_buffer, m_index_buffer.m_buffer, 1, &index_copy);
+    }
+
+    cmd_barrier(cmd);
+}
+
+std::vector<AllocatedBuffer>
+GeometryBuffer::cmd_rebuild(VkCommandBuffer cmd, uint32_t vertex_capacity, uint32_t index_capacity) {
+    vertex_capacity = std::max({vertex_capacity, m_vertex_allocator.used(), 1u});
+    index_capacity = std::max({index_capacity, m_index_allocator.used(), 1u});
+
+    AllocatedBuffer new_vertex_buffer = create_buffer((VkDeviceSize) vertex_capacity * m_vertex_stride,
+                                                      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+    AllocatedBuffer new_index_buffer = create_buffer((VkDeviceSize) index_capacity * sizeof(uint32_t),
+                                                     VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+
+    m_vertex_allocator.init(vertex_capacity);
+    m_index_allocator.init(index_capacity);
+
+    // The copies read what earlier uploads and the skinning wrote, cmd_barrier only orders those
+    // before the draws and compute passes
+    VkMemoryBarrier barrier = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .pNext = nullptr,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    std::vector<VkBufferCopy> vertex_copies;
+    std::vector<VkBufferCopy> index_copies;
+
+    // Live ranges are packed one after the other, in handle order
+    for (GeometryRange &range: m_ranges) {
+        if (!range.m_live) {
+            continue;
+        }
+
+        uint32_t first_vertex;
+        uint32_t first_index;
+        m_vertex_allocator.allocate(range.m_vertex_count, &first_vertex);
+        m_index_allocator.allocate(range.m_index_count, &first_index);
+
+        if (range.m_vertex_count > 0) {
+            vertex_copies.push_back({
+                    .srcOffset = (VkDeviceSize) range.m_first_vertex * m_vertex_stride,
+                    .dstOffset = (VkDeviceSize) first_vertex * m_vertex_stride,
+                    .size = (VkDeviceSize) range.m_vertex_count * m_vertex_stride
+            });
+        }
+        if (range.m_index_count > 0) {
+            index_copies.push_back({
+                    .srcOffset = (VkDeviceSize) range.m_first_index * sizeof(uint32_t),
+                    .dstOffset = (VkDeviceSize) first_index * sizeof(uint32_t),
+                    .size = (VkDeviceSize) range.m_index_count * sizeof(uint32_t)
+            });
+        }
+
+        range.m_first_vertex = first_vertex;
+        range.m_first_index = first_index;
+    }
+
+    if (!vertex_copies.empty()) {
+        vkCmdCopyBuffer(cmd, m_vertex_buffer.m_buffer, new_vertex_buffer.m_buffer,
+                        (uint32_t) vertex_copies.size(), vertex_copies.data());
+    }
+    if (!index_copies.empty()) {
+        vkCmdCopyBuffer(cmd, m_index_buffer.m_buffer, new_index_buffer.m_buffer,
+                        (uint32_t) index_copies.size(), index_copies.data());
+    }
+    cmd_barrier(cmd);
+
+    std::vector<AllocatedBuffer> old_buffers = {m_vertex_buffer, m_index_buffer};
+    m_vertex_buffer = new_vertex_buffer;
+    m_index_buffer = new_index_buffer;
+    return old_buffers;
+}
+
+void GeometryBuffer::destroy_buffer(const AllocatedBuffer &buffer) {
+    if (m_memory_budget) {
+        m_memory_budget->untrack(buffer.m_allocation);
+    }
+    vmaDestroyBuffer(m_allocator, buffer.m_buffer, buffer.m_allocation);
+}
+
+void GeometryBuffer::cmd_bind(VkCommandBuffer cmd) const {
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(cmd, 0, 1, &m_vertex_buffer.m_buffer, &offset);
+    vkCmdBindIndexBuffer(cmd, m_index_buffer.m_buffer, 0, VK_INDEX_TYPE_UINT32);
+}
+
+AllocatedBuffer GeometryBuffer::create_buffer(VkDeviceSize size, VkBufferUsageFlags usage) {
+    // Transfer src so the buffer can be repacked, storage so compute passes can read geometry
+    VkBufferCreateInfo buffer_info = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .size = size,
+            .usage = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+    };
+
+    VmaAllocationCreateInfo vma_alloc_info = {};
+    vma_alloc_info.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+
+    AllocatedBuffer buffer{};
+    VK_CHECK(vmaCreateBuffer(m_allocator, &buffer_info, &vma_alloc_info, &buffer.m_buffer, &buffer.m_allocation,
+                             nullptr))
+
+    if (m_memory_budget) {
+        m_memory_budget->track(buffer.m_allocation, MemoryCategory::Mesh);
+    }
+    return buffer;
+}
+
+void GeometryBuffer::cmd_barrier(VkCommandBuffer cmd) const {
+    // Make the copies visible to the vertex input and to compute shaders reading geometry, or
+    // writing it like the skinning
+    VkMemoryBarrier barrier = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .pNext = nullptr,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT |
+                             VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+    };
+
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
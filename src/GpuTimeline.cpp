@@ -0,0 +1,124 @@
+#include "GpuTimeline.h"
+
+#include <VulkanHelpers.h>
+
+#include <algorithm>
+
+void GpuTimeline::init(VkDevice device, VkQueue queue, uint32_t queue_family) {
+    m_device = device;
+    m_queue = queue;
+    m_queue_family = queue_family;
+    m_last_submitted = 0;
+    m_last_completed = 0;
+
+    VkSemaphoreTypeCreateInfo type_info = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+            .pNext = nullptr,
+            .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+            .initialValue = 0
+    };
+
+    VkSemaphoreCreateInfo semaphore_create_info = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+            .pNext = &type_info,
+            .flags = 0
+    };
+    VK_CHECK(vkCreateSemaphore(m_device, &semaphore_create_info, nullptr, &m_semaphore))
+}
+
+void GpuTimeline::cleanup() {
+    vkDestroySemaphore(m_device, m_semaphore, nullptr);
+    m_semaphore = VK_NULL_HANDLE;
+}
+
+uint64_t GpuTimeline::submit(const std::vector<VkCommandBuffer> &cmds, const std::vector<SemaphoreWait> &waits,
+                             uint64_t signal_value, const std::vector<VkSemaphore> &binary_signals) {
+    if (signal_value == 0) {
+        signal_value = m_last_submitted + 1;
+    } else if (signal_value <= m_last_submitted) {
+        std::cout << "Timeline values must increase, got " << signal_value << " after " << m_last_submitted
+                  << std::endl;
+        abort();
+    }
+
+    std::vector<VkSemaphore> wait_semaphores;
+    std::vector<uint64_t> wait_values;
+    std::vector<VkPipelineStageFlags> wait_stages;
+    for (const SemaphoreWait &wait: waits) {
+        wait_semaphores.push_back(wait.m_semaphore);
+        wait_values.push_back(wait.m_value);
+        wait_stages.push_back(wait.m_stage);
+    }
+
+    // Our timeline first, binary values are ignored but the arrays must match the semaphore counts
+    std::vector<VkSemaphore> signal_semaphores = {m_semaphore};
+    std::vector<uint64_t> signal_values = {signal_value};
+    for (VkSemaphore semaphore: binary_signals) {
+        signal_semaphores.push_back(semaphore);
+        signal_values.push_back(0);
+    }
+
+    VkTimelineSemaphoreSubmitInfo timeline_info = {
+            .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+            .pNext = nullptr,
+            .waitSemaphoreValueCount = (uint32_t) wait_values.size(),
+            .pWaitSemaphoreValues = wait_values.data(),
+            .signalSemaphoreValueCount = (uint32_t) signal_values.size(),
+            .pSignalSemaphoreValues = signal_values.data()
+    };
+
+    VkSubmitInfo submit = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .pNext = &timeline_info,
+            .waitSemaphoreCount = (uint32_t) wait_semaphores.size(),
+            .pWaitSemaphores = wait_semaphores.data(),
+            .pWaitDstStageMask = wait_stages.data(),
+            .commandBufferCount = (uint32_t) cmds.size(),
+            .pCommandBuffers = cmds.data(),
+            .signalSemaphoreCount = (uint32_t) signal_semaphores.size(),
+            .pSignalSemaphores = signal_semaphores.data()
+    };
+
+    VK_CHECK(vkQueueSubmit(m_queue, 1, &submit, VK_NULL_HANDLE))
+
+    m_last_submitted = signal_value;
+    return signal_value;
+}
+
+uint64_t GpuTimeline::completed_value() {
+    uint64_t value;
+    VK_CHECK(vkGetSemaphoreCounterValue(m_device, m_semaphore, &value))
+    m_last_completed = std::max(m_last_completed, value);
+    return m_last_completed;
+}
+
+bool GpuTimeline::is_complete(uint64_t value) {
+    if (value <= m_last_completed) {
+        return true;
+    }
+    return completed_value() >= value;
+}
+
+bool GpuTimeline::wait(uint64_t value, uint64_t timeout) {
+    if (is_complete(value)) {
+        return true;
+    }
+
+    VkSemaphoreWaitInfo wait_info = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .semaphoreCount = 1,
+            .pSemaphores = &m_semaphore,
+            .pValues = &value
+    };
+
+    VkResult result = vkWaitSemaphores(m_device, &wait_info, timeout);
+    if (result == VK_TIMEOUT) {
+        return false;
+    }
+    VK_CHECK(result)
+
+    m_last_completed = std::max(m_last_completed, value);
+    return true;
+}
@@ -156,3 +156,48 @@ Initializers::depth_stencil_create_info(bool depth_test, bool depth_write, VkCom
 
 
 
+
+VkDescriptorSetLayoutBinding
+Initializers::descriptorset_layout_binding(VkDescriptorType type, VkShaderStageFlags stage_flags, uint32_t binding) {
+    VkDescriptorSetLayoutBinding set_binding = {
+            .binding = binding,
+            .descriptorType = type,
+            .descriptorCount = 1,
+            .stageFlags = stage_flags,
+            .pImmutableSamplers = nullptr
+    };
+
+    return set_binding;
+}
+
+VkWriteDescriptorSet Initializers::write_descriptor_buffer(VkDescriptorType type, VkDescriptorSet dst_set,
+                                                           const VkDescriptorBufferInfo *buffer_info,
+                                                           uint32_t binding) {
+    VkWriteDescriptorSet write = {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = dst_set,
+            .dstBinding = binding,
+            .descriptorCount = 1,
+            .descriptorType = type,
+            .pBufferInfo = buffer_info
+    };
+
+    return write;
+}
+
+VkWriteDescriptorSet Initializers::write_descriptor_image(VkDescriptorType type, VkDescriptorSet dst_set,
+                                                          const VkDescriptorImageInfo *image_info,
+                                                          uint32_t binding) {
+    VkWriteDescriptorSet write = {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = dst_set,
+            .dstBinding = binding,
+            .descriptorCount = 1,
+            .descriptorType = type,
+            .pImageInfo = image_info
+    };
+
+    return write;
+}
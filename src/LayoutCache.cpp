@@ -0,0 +1,135 @@
+#include "LayoutCache.h"
+
+#include <VulkanHelpers.h>
+
+#include <algorithm>
+#include <functional>
+
+static void hash_combine(size_t &seed, size_t value) {
+    seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
+bool LayoutCache::SetLayoutKey::operator==(const SetLayoutKey &other) const {
+    return std::equal(m_bindings.begin(), m_bindings.end(), other.m_bindings.begin(), other.m_bindings.end(),
+                      [](const VkDescriptorSetLayoutBinding &a, const VkDescriptorSetLayoutBinding &b) {
+                          return a.binding == b.binding && a.descriptorType == b.descriptorType &&
+                                 a.descriptorCount == b.descriptorCount && a.stageFlags == b.stageFlags;
+                      });
+}
+
+size_t LayoutCache::SetLayoutKeyHash::operator()(const SetLayoutKey &key) const {
+    size_t seed = key.m_bindings.size();
+    for (const VkDescriptorSetLayoutBinding &binding: key.m_bindings) {
+        hash_combine(seed, binding.binding);
+        hash_combine(seed, binding.descriptorType);
+        hash_combine(seed, binding.descriptorCount);
+        hash_combine(seed, binding.stageFlags);
+    }
+    return seed;
+}
+
+bool LayoutCache::PipelineLayoutDesc::operator==(const PipelineLayoutDesc &other) const {
+    return m_set_layouts == other.m_set_layouts &&
+           std::equal(m_push_constants.begin(), m_push_constants.end(), other.m_push_constants.begin(),
+                      other.m_push_constants.end(), [](const VkPushConstantRange &a, const VkPushConstantRange &b) {
+                return a.stageFlags == b.stageFlags && a.offset == b.offset && a.size == b.size;
+            });
+}
+
+size_t LayoutCache::PipelineLayoutDescHash::operator()(const PipelineLayoutDesc &desc) const {
+    size_t seed = desc.m_set_layouts.size();
+    for (VkDescriptorSetLayout layout: desc.m_set_layouts) {
+        hash_combine(seed, std::hash<VkDescriptorSetLayout>()(layout));
+    }
+    for (const VkPushConstantRange &range: desc.m_push_constants) {
+        hash_combine(seed, range.stageFlags);
+        hash_combine(seed, range.offset);
+        hash_combine(seed, range.size);
+    }
+    return seed;
+}
+
+void LayoutCache::init(VkDevice device) {
+    m_device = device;
+}
+
+void LayoutCache::cleanup() {
+    // Pipeline layouts reference the set layouts, destroy them first
+    for (auto &[desc, layout]: m_pipeline_layouts) {
+        vkDestroyPipelineLayout(m_device, layout, nullptr);
+    }
+    for (auto &[key, layout]: m_set_layouts) {
+        vkDestroyDescriptorSetLayout(m_device, layout, nullptr);
+    }
+    m_pipeline_layout_descs.clear();
+    m_set_layout_keys.clear();
+    m_pipeline_layouts.clear();
+    m_set_layouts.clear();
+}
+
+VkDescriptorSetLayout LayoutCache::get_set_layout(const std::vector<VkDescriptorSetLayoutBinding> &bindings) {
+    m_set_layout_requests++;
+
+    SetLayoutKey key = {bindings};
+    std::sort(key.m_bindings.begin(), key.m_bindings.end(),
+              [](const VkDescriptorSetLayoutBinding &a, const VkDescriptorSetLayoutBinding &b) {
+                  return a.binding < b.binding;
+              });
+    for (VkDescriptorSetLayoutBinding &binding: key.m_bindings) {
+        binding.pImmutableSamplers = nullptr;
+    }
+
+    auto it = m_set_layouts.find(key);
+    if (it != m_set_layouts.end()) {
+        return it->second;
+    }
+
+    VkDescriptorSetLayoutCreateInfo set_layout_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .bindingCount = (uint32_t) key.m_bindings.size(),
+            .pBindings = key.m_bindings.data()
+    };
+    VkDescriptorSetLayout layout;
+    VK_CHECK(vkCreateDescriptorSetLayout(m_device, &set_layout_info, nullptr, &layout))
+
+    auto inserted = m_set_layouts.emplace(std::move(key), layout).first;
+    m_set_layout_keys[layout] = &inserted->first;
+    return layout;
+}
+
+VkPipelineLayout LayoutCache::get_pipeline_layout(const PipelineLayoutDesc &desc) {
+    m_pipeline_layout_requests++;
+
+    auto it = m_pipeline_layouts.find(desc);
+    if (it != m_pipeline_layouts.end()) {
+        return it->second;
+    }
+
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .setLayoutCount = (uint32_t) desc.m_set_layouts.size(),
+            .pSetLayouts = desc.m_set_layouts.data(),
+            .pushConstantRangeCount = (uint32_t) desc.m_push_constants.size(),
+            .pPushConstantRanges = desc.m_push_constants.data()
+    };
+    VkPipelineLayout layout;
+    VK_CHECK(vkCreatePipelineLayout(m_device, &pipeline_layout_info, nullptr, &layout))
+
+    auto inserted = m_pipeline_layouts.emplace(desc, layout).first;
+    m_pipeline_layout_descs[layout] = &inserted->first;
+    return layout;
+}
+
+const std::vector<VkDescriptorSetLayoutBinding> *LayoutCache::find_set_bindings(VkDescriptorSetLayout layout) const {
+    auto it = m_set_layout_keys.find(layout);
+    return it != m_set_layout_keys.end() ? &it->second->m_bindings : nullptr;
+}
+
+const LayoutCache::PipelineLayoutDesc *LayoutCache::find_pipeline_desc(VkPipelineLayout layout) const {
+    auto it = m_pipeline_layout_descs.find(layout);
+    return it != m_pipeline_layout_descs.end() ? it->second : nullptr;
+}
@@ -0,0 +1,80 @@
+#include "MappedFile.h"
+
+#include <fstream>
+#include <iostream>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool MappedFile::open(const char *filename) {
+    close();
+
+#ifdef __linux__
+    int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cout << "Failed to open " << filename << std::endl;
+        return false;
+    }
+
+    struct stat info{};
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        return false;
+    }
+
+    m_size = (size_t) info.st_size;
+    // mmap refuses empty mappings, an empty file is still a valid one
+    if (m_size > 0) {
+        void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            std::cout << "Failed to map " << filename << std::endl;
+            ::close(fd);
+            m_size = 0;
+            return false;
+        }
+        m_data = (const char *) data;
+        m_mapped = true;
+    }
+    // The mapping keeps the file alive
+    ::close(fd);
+    return true;
+#else
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        std::cout << "Failed to open " << filename << std::endl;
+        return false;
+    }
+
+    m_buffer.resize((size_t) file.tellg());
+    file.seekg(0);
+    file.read(m_buffer.data(), (std::streamsize) m_buffer.size());
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+    return true;
+#endif
+}
+
+void MappedFile::close() {
+#ifdef __linux__
+    if (m_mapped) {
+        munmap((void *) m_data, m_size);
+    }
+#endif
+    m_buffer.clear();
+    m_buffer.shrink_to_fit();
+    m_data = nullptr;
+    m_size = 0;
+    m_mapped = false;
+}
+
+void MappedFile::advise_sequential() const {
+#ifdef __linux__
+    if (m_mapped) {
+        madvise((void *) m_data, m_size, MADV_SEQUENTIAL);
+    }
+#endif
+}
@@ -0,0 +1,207 @@
+#include "MemoryBudget.h"
+
+#include <imgui.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+const char *memory_category_name(MemoryCategory category) {
+    switch (category) {
+        case MemoryCategory::Mesh:
+            return "mesh";
+        case MemoryCategory::Texture:
+            return "texture";
+        case MemoryCategory::RenderTarget:
+            return "render_target";
+        case MemoryCategory::Staging:
+            return "staging";
+        case MemoryCategory::PerFrame:
+            return "per_frame";
+        default:
+            return "other";
+    }
+}
+
+void MemoryBudget::init(VmaAllocator allocator, bool budget_extension_enabled) {
+    m_allocator = allocator;
+    m_budget_extension_enabled = budget_extension_enabled;
+
+    const VkPhysicalDeviceMemoryProperties *memory_properties;
+    vmaGetMemoryProperties(m_allocator, &memory_properties);
+
+    m_heaps.resize(memory_properties->memoryHeapCount);
+    for (uint32_t i = 0; i < memory_properties->memoryHeapCount; i++) {
+        m_heaps[i].m_flags = memory_properties->memoryHeaps[i].flags;
+        m_heaps[i].m_size = memory_properties->memoryHeaps[i].size;
+    }
+
+    m_type_to_heap.resize(memory_properties->memoryTypeCount);
+    for (uint32_t i = 0; i < memory_properties->memoryTypeCount; i++) {
+        m_type_to_heap[i] = memory_properties->memoryTypes[i].heapIndex;
+    }
+
+    if (!m_budget_extension_enabled) {
+        std::cout << "MemoryBudget: VK_EXT_memory_budget unavailable, budgets are estimated from the heap sizes"
+                  << std::endl;
+    }
+}
+
+void MemoryBudget::update(uint32_t frame_index) {
+    // Also refreshes the budget fetched from VK_EXT_memory_budget
+    vmaSetCurrentFrameIndex(m_allocator, frame_index);
+
+    VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+    vmaGetBudget(m_allocator, budgets);
+
+    std::vector<std::pair<uint32_t, VkDeviceSize>> over_budget;
+    // Copied so a callback can be added or removed while they run
+    std::vector<std::pair<uint32_t, EvictionCallback>> callbacks;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (uint32_t i = 0; i < m_heaps.size(); i++) {
+            HeapBudget &heap = m_heaps[i];
+            heap.m_usage = budgets[i].usage;
+            heap.m_budget = budgets[i].budget;
+            heap.m_block_bytes = budgets[i].blockBytes;
+            heap.m_allocation_bytes = budgets[i].allocationBytes;
+            heap.m_usage_history.push((double) heap.m_usage / (1024.0 * 1024.0));
+
+            auto threshold = (VkDeviceSize) ((double) heap.m_budget * m_eviction_threshold);
+            if (heap.m_usage > threshold) {
+                over_budget.emplace_back(i, heap.m_usage - threshold);
+            }
+        }
+        if (!over_budget.empty()) {
+            callbacks = m_eviction_callbacks;
+        }
+    }
+
+    // What the callbacks couldn't release, per heap
+    std::vector<VkDeviceSize> still_over(m_heaps.size(), 0);
+    for (auto [heap_index, bytes_over]: over_budget) {
+        VkDeviceSize released = 0;
+        for (auto &[handle, callback]: callbacks) {
+            released += callback(heap_index, bytes_over - released);
+            if (released >= bytes_over) {
+                break;
+            }
+        }
+
+        if (released < bytes_over) {
+            still_over[heap_index] = bytes_over - released;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (uint32_t i = 0; i < m_heaps.size(); i++) {
+        // Only when it starts, not every frame it stays there
+        if (still_over[i] > 0 && !m_heaps[i].m_over_budget) {
+            std::cout << "MemoryBudget: heap " << i << " is still " << still_over[i] / (1024 * 1024)
+                      << " MB over budget after eviction" << std::endl;
+        }
+        m_heaps[i].m_over_budget = still_over[i] > 0;
+    }
+}
+
+void MemoryBudget::track(VmaAllocation allocation, MemoryCategory category) {
+    VmaAllocationInfo info;
+    vmaGetAllocationInfo(m_allocator, allocation, &info);
+
+    uint32_t heap_index = m_type_to_heap[info.memoryType];
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tracked[allocation] = {category, heap_index, info.size};
+    m_heaps[heap_index].m_category_bytes[(size_t) category] += info.size;
+}
+
+void MemoryBudget::untrack(VmaAllocation allocation) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_tracked.find(allocation);
+    if (it == m_tracked.end()) {
+        return;
+    }
+
+    m_heaps[it->second.m_heap_index].m_category_bytes[(size_t) it->second.m_category] -= it->second.m_size;
+    m_tracked.erase(it);
+}
+
+uint32_t MemoryBudget::add_eviction_callback(EvictionCallback &&callback) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint32_t handle = m_next_callback_handle++;
+    m_eviction_callbacks.emplace_back(handle, std::move(callback));
+    return handle;
+}
+
+void MemoryBudget::remove_eviction_callback(uint32_t handle) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::erase_if(m_eviction_callbacks, [handle](const auto &entry) { return entry.first == handle; });
+}
+
+VkDeviceSize MemoryBudget::get_category_bytes(MemoryCategory category) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    VkDeviceSize total = 0;
+    for (const auto &heap: m_heaps) {
+        total += heap.m_category_bytes[(size_t) category];
+    }
+    return total;
+}
+
+std::string MemoryBudget::build_stats_json(bool detailed) const {
+    char *stats_string = nullptr;
+    vmaBuildStatsString(m_allocator, &stats_string, detailed ? VK_TRUE : VK_FALSE);
+    std::string result = stats_string;
+    vmaFreeStatsString(m_allocator, stats_string);
+    return result;
+}
+
+bool MemoryBudget::dump_stats_json(const char *file_path, bool detailed) const {
+    std::ofstream out(file_path);
+    if (!out.is_open()) {
+        std::cout << "MemoryBudget: couldn't open " << file_path << " for writing" << std::endl;
+        return false;
+    }
+
+    out << build_stats_json(detailed);
+    std::cout << "MemoryBudget: wrote allocator stats to " << file_path << std::endl;
+    return true;
+}
+
+void MemoryBudget::draw_overlay() {
+    ImGui::SetNextWindowPos(ImVec2(440, 10), ImGuiCond_FirstUseEver);
+    ImGui::SetNextWindowSize(ImVec2(380, 300), ImGuiCond_FirstUseEver);
+    if (!ImGui::Begin("Memory")) {
+        ImGui::End();
+        return;
+    }
+
+    ImGui::Text("VK_EXT_memory_budget: %s", m_budget_extension_enabled ? "enabled" : "unavailable");
+    if (ImGui::Button("Dump VMA stats")) {
+        dump_stats_json("vk_engine_memory.json");
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (uint32_t i = 0; i < m_heaps.size(); i++) {
+        const HeapBudget &heap = m_heaps[i];
+        const double mb = 1024.0 * 1024.0;
+
+        ImGui::Separator();
+        ImGui::Text("Heap %u%s: %.1f / %.1f MB", i,
+                    heap.m_flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT ? " (device local)" : "",
+                    (double) heap.m_usage / mb, (double) heap.m_budget / mb);
+
+        float fraction = heap.m_budget > 0 ? (float) ((double) heap.m_usage / (double) heap.m_budget) : 0.0f;
+        ImGui::ProgressBar(std::min(fraction, 1.0f));
+
+        ImGui::Text("VMA blocks %.1f MB, allocations %.1f MB", (double) heap.m_block_bytes / mb,
+                    (double) heap.m_allocation_bytes / mb);
+        for (size_t c = 0; c < (size_t) MemoryCategory::Count; c++) {
+            if (heap.m_category_bytes[c] > 0) {
+                ImGui::BulletText("%s: %.2f MB", memory_category_name((MemoryCategory) c),
+                                  (double) heap.m_category_bytes[c] / mb);
+            }
+        }
+    }
+
+    ImGui::End();
+}
@@ -4,42 +4,27 @@
 
 #include "Mesh.h"
 
+#include <ObjParser.h>
+
 #include <tiny_obj_loader.h>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
-VertexInputDescription Vertex::get_vertex_description() {
-    VertexInputDescription description;
-
-    VkVertexInputBindingDescription main_binding = {};
-    main_binding.binding = 0;
-    main_binding.stride = sizeof(Vertex);
-    main_binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-
-    description.bindings.push_back(main_binding);
-
-    VkVertexInputAttributeDescription position_attribute = {};
-    position_attribute.binding = 0;
-    position_attribute.location = 0;
-    position_attribute.format = VK_FORMAT_R32G32B32_SFLOAT;
-    position_attribute.offset = offsetof(Vertex, position);
-
-    VkVertexInputAttributeDescription normal_attribute = {};
-    normal_attribute.binding = 0;
-    normal_attribute.location = 1;
-    normal_attribute.format = VK_FORMAT_R32G32B32_SFLOAT;
-    normal_attribute.offset = offsetof(Vertex, normal);
-
-    VkVertexInputAttributeDescription color_attribute = {};
-    color_attribute.binding = 0;
-    color_attribute.location = 2;
-    color_attribute.format = VK_FORMAT_R32G32B32_SFLOAT;
-    color_attribute.offset = offsetof(Vertex, color);
-
-    description.attributes.push_back(position_attribute);
-    description.attributes.push_back(normal_attribute);
-    description.attributes.push_back(color_attribute);
-
-    return description;
+PackedVertex PackedVertex::pack(const Vertex &vertex) {
+    auto snorm10 = [](float value) {
+        return (uint32_t) (int32_t) std::round(std::clamp(value, -1.f, 1.f) * 511.f) & 0x3ffu;
+    };
+    auto unorm8 = [](float value) {
+        return (uint32_t) std::round(std::clamp(value, 0.f, 1.f) * 255.f);
+    };
+
+    // A2B10G10R10: x in the low bits, alpha 0. R8G8B8A8: r in the low byte, alpha 1.
+    return {
+            .position = vertex.position,
+            .normal = snorm10(vertex.normal.x) | snorm10(vertex.normal.y) << 10 | snorm10(vertex.normal.z) << 20,
+            .color = unorm8(vertex.color.r) | unorm8(vertex.color.g) << 8 | unorm8(vertex.color.b) << 16 | 0xffu << 24
+    };
 }
 
 bool Mesh::load_from_obj(const char *filename) {
@@ -64,12 +49,23 @@ bool Mesh::load_from_obj(const char *filename) {
         return false;
     }
 
+    size_t vertex_count = 0;
+    for (auto & shape : shapes) {
+        vertex_count += shape.mesh.indices.size();
+    }
+    m_vertices.reserve(m_vertices.size() + vertex_count);
+
     for (auto & shape : shapes) {
         // Loop over faces(polygon)
         size_t index_offset = 0;
         for (size_t f = 0; f < shape.mesh.num_face_vertices.size(); f++) {
 
-            int fv = 3;
+            // Triangulated by LoadObj, but the faces it can't triangulate are left as they are
+            size_t fv = shape.mesh.num_face_vertices[f];
+            if (fv != 3) {
+                index_offset += fv;
+                continue;
+            }
 
             for (size_t v = 0; v < fv; v++) {
                 tinyobj::index_t idx = shape.mesh.indices[index_offset + v];
@@ -78,18 +74,17 @@ bool Mesh::load_from_obj(const char *filename) {
                 tinyobj::real_t vy = attrib.vertices[3 * idx.vertex_index + 1];
                 tinyobj::real_t vz = attrib.vertices[3 * idx.vertex_index + 2];
 
-                tinyobj::real_t nx = attrib.normals[3 * idx.normal_index + 0];
-                tinyobj::real_t ny = attrib.normals[3 * idx.normal_index + 1];
-                tinyobj::real_t nz = attrib.normals[3 * idx.normal_index + 2];
-
                 Vertex new_vert{};
                 new_vert.position.x = vx;
                 new_vert.position.y = vy;
                 new_vert.position.z = vz;
 
-                new_vert.normal.x = nx;
-                new_vert.normal.y = ny;
-                new_vert.normal.z = nz;
+                // -1 when the file has no normal for it
+                if (idx.normal_index >= 0) {
+                    new_vert.normal.x = attrib.normals[3 * idx.normal_index + 0];
+                    new_vert.normal.y = attrib.normals[3 * idx.normal_index + 1];
+                    new_vert.normal.z = attrib.normals[3 * idx.normal_index + 2];
+                }
 
                 //we are setting the vertex color as the vertex normal. This is just for display purposes
                 new_vert.color = new_vert.normal;
@@ -100,5 +95,17 @@ bool Mesh::load_from_obj(const char *filename) {
         }
     }
 
+    return true;
+}
+
+bool Mesh::load_from_obj_parallel(const char *filename, uint32_t thread_count) {
+    ObjParser parser;
+    parser.m_thread_count = thread_count;
+    // The parser replaces what it's given, load_from_obj appends
+    std::vector<Vertex> vertices;
+    if (!parser.parse(filename, vertices)) {
+        return false;
+    }
+    m_vertices.insert(m_vertices.end(), vertices.begin(), vertices.end());
     return true;
 }
\ No newline at end of file
@@ -0,0 +1,460 @@
+#include "ObjParser.h"
+
+#include <MappedFile.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+#include <thread>
+
+// Several chunks per thread so they finish together even when the lines aren't evenly spread,
+// but not so small that a small file gets cut in pieces
+static constexpr size_t MIN_CHUNK_SIZE = 1 << 20;
+static constexpr uint32_t CHUNKS_PER_THREAD = 4;
+
+// In ObjParser::m_face_sizes
+static constexpr uint32_t INVALID_FACE = 1u << 31;
+// In Corner::m_normal
+static constexpr uint32_t NO_NORMAL = UINT32_MAX;
+
+// Runs job(i) for every i below count, the calling thread is one of the workers
+template<typename Job>
+static void run_parallel(uint32_t thread_count, uint32_t count, const Job &job) {
+    std::atomic<uint32_t> next = 0;
+    auto worker = [&]() {
+        for (uint32_t i = next++; i < count; i = next++) {
+            job(i);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < std::min(thread_count, count); i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &thread: threads) {
+        thread.join();
+    }
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point &start) {
+    auto now = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(now - start).count();
+    start = now;
+    return ms;
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char *skip_spaces(const char *ptr, const char *end) {
+    while (ptr < end && is_space(*ptr)) {
+        ptr++;
+    }
+    return ptr;
+}
+
+static const char *skip_token(const char *ptr, const char *end) {
+    while (ptr < end && !is_space(*ptr)) {
+        ptr++;
+    }
+    return ptr;
+}
+
+// End of the line starting at ptr, without the '\n'
+static const char *line_end(const char *ptr, const char *end) {
+    const char *newline = (const char *) std::memchr(ptr, '\n', end - ptr);
+    return newline ? newline : end;
+}
+
+enum class LineKind {
+    Position,
+    Normal,
+    Face,
+    Other
+};
+
+// Moves ptr past the keyword
+static LineKind line_kind(const char *&ptr, const char *end) {
+    ptr = skip_spaces(ptr, end);
+    if (end - ptr >= 2 && ptr[0] == 'v' && is_space(ptr[1])) {
+        ptr += 2;
+        return LineKind::Position;
+    }
+    if (end - ptr >= 3 && ptr[0] == 'v' && ptr[1] == 'n' && is_space(ptr[2])) {
+        ptr += 3;
+        return LineKind::Normal;
+    }
+    if (end - ptr >= 2 && ptr[0] == 'f' && is_space(ptr[1])) {
+        ptr += 2;
+        return LineKind::Face;
+    }
+    return LineKind::Other;
+}
+
+// Missing or broken components are 0, like tinyobjloader does
+static glm::vec3 parse_vec3(const char *ptr, const char *end) {
+    glm::vec3 value = {0.f, 0.f, 0.f};
+    for (int i = 0; i < 3; i++) {
+        ptr = skip_spaces(ptr, end);
+        // from_chars doesn't take the plus sign
+        if (ptr < end && *ptr == '+') {
+            ptr++;
+        }
+
+        auto result = std::from_chars(ptr, end, value[i]);
+        if (result.ec == std::errc::result_out_of_range) {
+            // Denormals and overflows, let strtof round them. Rare enough to copy the token.
+            char token[64] = {};
+            std::memcpy(token, ptr, std::min<size_t>(result.ptr - ptr, sizeof(token) - 1));
+            value[i] = std::strtof(token, nullptr);
+        } else if (result.ec != std::errc()) {
+            break;
+        }
+        ptr = result.ptr;
+    }
+    return value;
+}
+
+// 1 based, negative ones count back from the last element seen. False when out of range.
+static bool resolve_index(int64_t index, uint64_t seen, uint64_t total, uint32_t &resolved) {
+    int64_t value = index > 0 ? index - 1 : (int64_t) seen + index;
+    if (index == 0 || value < 0 || (uint64_t) value >= total) {
+        return false;
+    }
+    resolved = (uint32_t) value;
+    return true;
+}
+
+// Ear clipping in the plane the polygon faces the most, so concave faces come out right.
+// Writes size - 2 triangles, indices into points, in the winding of the face.
+static void triangulate_polygon(const glm::vec3 *points, uint32_t size, std::vector<uint32_t> &remaining,
+                                std::vector<uint32_t> &triangles) {
+    triangles.clear();
+    remaining.resize(size);
+    std::iota(remaining.begin(), remaining.end(), 0u);
+
+    if (size > 3) {
+        // Newell's normal, fine with concave and slightly non planar polygons. Each component is
+        // twice the area of the polygon projected along that axis.
+        glm::vec3 normal = {0.f, 0.f, 0.f};
+        for (uint32_t i = 0; i < size; i++) {
+            const glm::vec3 &a = points[i];
+            const glm::vec3 &b = points[(i + 1) % size];
+            normal.x += (a.y - b.y) * (a.z + b.z);
+            normal.y += (a.z - b.z) * (a.x + b.x);
+            normal.z += (a.x - b.x) * (a.y + b.y);
+        }
+
+        // Cyclic axes so that a positive normal component means counter clockwise
+        glm::vec3 abs_normal = glm::abs(normal);
+        uint32_t u_axis = 0;
+        uint32_t v_axis = 1;
+        float facing = normal.z;
+        if (abs_normal.x >= abs_normal.y && abs_normal.x >= abs_normal.z) {
+            u_axis = 1;
+            v_axis = 2;
+            facing = normal.x;
+        } else if (abs_normal.y >= abs_normal.z) {
+            u_axis = 2;
+            v_axis = 0;
+            facing = normal.y;
+        }
+        float orientation = facing >= 0.f ? 1.f : -1.f;
+
+        auto point = [&](uint32_t i) {
+            return glm::vec2(points[i][u_axis], points[i][v_axis]);
+        };
+        // Positive when a, b, c turn the same way as the polygon
+        auto turn = [&](glm::vec2 a, glm::vec2 b, glm::vec2 c) {
+            return ((b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x)) * orientation;
+        };
+
+        // A degenerate polygon never has an ear, the fan below takes it
+        uint32_t i = 0;
+        uint32_t misses = 0;
+        while (remaining.size() > 3 && facing != 0.f) {
+            auto n = (uint32_t) remaining.size();
+            i %= n;
+            uint32_t prev = remaining[(i + n - 1) % n];
+            uint32_t current = remaining[i];
+            uint32_t next = remaining[(i + 1) % n];
+            glm::vec2 a = point(prev);
+            glm::vec2 b = point(current);
+            glm::vec2 c = point(next);
+
+            bool ear = turn(a, b, c) > 0.f;
+            for (uint32_t j = 0; ear && j < n; j++) {
+                uint32_t other = remaining[j];
+                if (other == prev || other == current || other == next) {
+                    continue;
+                }
+                // Touching the ear counts as inside
+                glm::vec2 p = point(other);
+                ear = !(turn(a, b, p) >= 0.f && turn(b, c, p) >= 0.f && turn(c, a, p) >= 0.f);
+            }
+
+            if (ear) {
+                triangles.insert(triangles.end(), {prev, current, next});
+                // i is now the next corner
+                remaining.erase(remaining.begin() + i);
+                misses = 0;
+            } else {
+                i++;
+                // Self intersecting, the fan will do
+                if (++misses >= n) {
+                    break;
+                }
+            }
+        }
+    }
+
+    // The last triangle, or a fan over what's left when no ear was found
+    for (uint32_t k = 1; k + 1 < remaining.size(); k++) {
+        triangles.insert(triangles.end(), {remaining[0], remaining[k], remaining[k + 1]});
+    }
+}
+
+bool ObjParser::parse(const char *filename, std::vector<Vertex> &vertices) {
+    m_stats = {};
+    auto start = std::chrono::steady_clock::now();
+
+    MappedFile file;
+    if (!file.open(filename)) {
+        return false;
+    }
+    file.advise_sequential();
+    m_stats.m_map_ms = elapsed_ms(start);
+
+    uint32_t thread_count = m_thread_count > 0 ? m_thread_count : std::max(std::thread::hardware_concurrency(), 1u);
+    size_t chunk_size = std::max(file.size() / (thread_count * CHUNKS_PER_THREAD), MIN_CHUNK_SIZE);
+
+    // Lines belong to the chunk they start in
+    m_chunks.clear();
+    const char *end = file.data() + file.size();
+    for (const char *ptr = file.data(); ptr < end;) {
+        Chunk chunk;
+        chunk.m_begin = ptr;
+        const char *split = ptr + std::min(chunk_size, (size_t) (end - ptr));
+        const char *newline = line_end(split - 1, end);
+        chunk.m_end = newline < end ? newline + 1 : end;
+        m_chunks.push_back(chunk);
+        ptr = chunk.m_end;
+    }
+    auto chunk_count = (uint32_t) m_chunks.size();
+
+    run_parallel(thread_count, chunk_count, [&](uint32_t i) {
+        count_chunk(m_chunks[i]);
+    });
+
+    uint64_t position_count = 0;
+    uint64_t normal_count = 0;
+    uint64_t face_count = 0;
+    uint64_t corner_count = 0;
+    uint64_t triangle_count = 0;
+    for (Chunk &chunk: m_chunks) {
+        chunk.m_position_base = position_count;
+        chunk.m_normal_base = normal_count;
+        chunk.m_face_base = face_count;
+        chunk.m_corner_base = corner_count;
+        chunk.m_triangle_base = triangle_count;
+        position_count += chunk.m_positions;
+        normal_count += chunk.m_normals;
+        face_count += chunk.m_faces;
+        corner_count += chunk.m_corners;
+        triangle_count += chunk.m_triangles;
+    }
+
+    // Corners hold 32 bit indices
+    if (position_count >= UINT32_MAX || normal_count >= UINT32_MAX) {
+        std::cout << filename << " has more than 2^32 positions or normals" << std::endl;
+        return false;
+    }
+
+    m_positions.resize(position_count);
+    m_normals.resize(normal_count);
+    m_corners.resize(corner_count);
+    m_face_sizes.resize(face_count);
+    m_stats.m_count_ms = elapsed_ms(start);
+
+    run_parallel(thread_count, chunk_count, [&](uint32_t i) {
+        parse_chunk(m_chunks[i]);
+    });
+    m_stats.m_parse_ms = elapsed_ms(start);
+
+    vertices.resize(triangle_count * 3);
+    run_parallel(thread_count, chunk_count, [&](uint32_t i) {
+        triangulate_chunk(m_chunks[i], vertices);
+    });
+
+    // Invalid faces left holes at the end of their chunk
+    uint64_t written = 0;
+    for (const Chunk &chunk: m_chunks) {
+        if (chunk.m_triangle_base != written) {
+            auto first = vertices.begin() + (ptrdiff_t) (chunk.m_triangle_base * 3);
+            std::copy(first, first + (ptrdiff_t) (chunk.m_written_triangles * 3),
+                      vertices.begin() + (ptrdiff_t) (written * 3));
+        }
+        written += chunk.m_written_triangles;
+        m_stats.m_invalid_faces += chunk.m_invalid_faces;
+    }
+    vertices.resize(written * 3);
+    m_stats.m_triangulate_ms = elapsed_ms(start);
+
+    m_stats.m_threads = thread_count;
+    m_stats.m_chunks = chunk_count;
+    m_stats.m_bytes = file.size();
+    m_stats.m_positions = position_count;
+    m_stats.m_normals = normal_count;
+    m_stats.m_faces = face_count;
+    m_stats.m_triangles = written;
+
+    if (m_stats.m_invalid_faces > 0) {
+        std::cout << "WARN: " << filename << " has " << m_stats.m_invalid_faces << " invalid faces" << std::endl;
+    }
+
+    // Can be gigabytes
+    m_positions = {};
+    m_normals = {};
+    m_corners = {};
+    m_face_sizes = {};
+    return true;
+}
+
+void ObjParser::count_chunk(Chunk &chunk) const {
+    for (const char *ptr = chunk.m_begin; ptr < chunk.m_end;) {
+        const char *end = line_end(ptr, chunk.m_end);
+
+        switch (line_kind(ptr, end)) {
+            case LineKind::Position:
+                chunk.m_positions++;
+                break;
+            case LineKind::Normal:
+                chunk.m_normals++;
+                break;
+            case LineKind::Face: {
+                // Same tokens as parse_chunk
+                uint64_t corners = 0;
+                for (ptr = skip_spaces(ptr, end); ptr < end && *ptr != '#'; ptr = skip_spaces(ptr, end)) {
+                    ptr = skip_token(ptr, end);
+                    corners++;
+                }
+                chunk.m_faces++;
+                chunk.m_corners += corners;
+                chunk.m_triangles += corners >= 3 ? corners - 2 : 0;
+                break;
+            }
+            case LineKind::Other:
+                break;
+        }
+
+        ptr = end < chunk.m_end ? end + 1 : end;
+    }
+}
+
+void ObjParser::parse_chunk(Chunk &chunk) {
+    uint64_t position = chunk.m_position_base;
+    uint64_t normal = chunk.m_normal_base;
+    uint64_t face = chunk.m_face_base;
+    uint64_t corner = chunk.m_corner_base;
+
+    for (const char *ptr = chunk.m_begin; ptr < chunk.m_end;) {
+        const char *end = line_end(ptr, chunk.m_end);
+
+        switch (line_kind(ptr, end)) {
+            case LineKind::Position:
+                m_positions[position++] = parse_vec3(ptr, end);
+                break;
+            case LineKind::Normal:
+                m_normals[normal++] = parse_vec3(ptr, end);
+                break;
+            case LineKind::Face: {
+                // v, v/vt, v//vn or v/vt/vn
+                uint32_t size = 0;
+                bool valid = true;
+                for (ptr = skip_spaces(ptr, end); ptr < end && *ptr != '#'; ptr = skip_spaces(ptr, end)) {
+                    const char *token_end = skip_token(ptr, end);
+
+                    int64_t position_index = 0;
+                    int64_t normal_index = 0;
+                    auto result = std::from_chars(ptr, token_end, position_index);
+                    if (result.ptr < token_end && *result.ptr == '/') {
+                        const char *texcoord_end = std::find(result.ptr + 1, token_end, '/');
+                        if (texcoord_end < token_end) {
+                            std::from_chars(texcoord_end + 1, token_end, normal_index);
+                        }
+                    }
+
+                    Corner &out = m_corners[corner + size];
+                    valid &= result.ec == std::errc() &&
+                             resolve_index(position_index, position, m_positions.size(), out.m_position);
+                    out.m_normal = NO_NORMAL;
+                    if (normal_index != 0) {
+                        valid &= resolve_index(normal_index, normal, m_normals.size(), out.m_normal);
+                    }
+
+                    size++;
+                    ptr = token_end;
+                }
+
+                valid &= size >= 3;
+                m_face_sizes[face++] = valid ? size : size | INVALID_FACE;
+                corner += size;
+                break;
+            }
+            case LineKind::Other:
+                break;
+        }
+
+        ptr = end < chunk.m_end ? end + 1 : end;
+    }
+}
+
+void ObjParser::triangulate_chunk(Chunk &chunk, std::vector<Vertex> &vertices) {
+    Vertex *out = vertices.data() + chunk.m_triangle_base * 3;
+    const Corner *corners = m_corners.data() + chunk.m_corner_base;
+
+    std::vector<glm::vec3> points;
+    std::vector<uint32_t> remaining;
+    std::vector<uint32_t> triangles;
+
+    for (uint64_t face = chunk.m_face_base; face < chunk.m_face_base + chunk.m_faces; face++) {
+        uint32_t size = m_face_sizes[face] & ~INVALID_FACE;
+        if (m_face_sizes[face] & INVALID_FACE) {
+            chunk.m_invalid_faces++;
+            corners += size;
+            continue;
+        }
+
+        points.resize(size);
+        for (uint32_t i = 0; i < size; i++) {
+            points[i] = m_positions[corners[i].m_position];
+        }
+        triangulate_polygon(points.data(), size, remaining, triangles);
+
+        for (size_t t = 0; t < triangles.size(); t += 3) {
+            const glm::vec3 &p0 = points[triangles[t]];
+            glm::vec3 face_normal = glm::cross(points[triangles[t + 1]] - p0, points[triangles[t + 2]] - p0);
+            float length = glm::length(face_normal);
+            face_normal = length > 0.f ? face_normal / length : face_normal;
+
+            for (size_t k = 0; k < 3; k++) {
+                const Corner &corner = corners[triangles[t + k]];
+                Vertex &vertex = *out++;
+                vertex.position = points[triangles[t + k]];
+                vertex.normal = corner.m_normal != NO_NORMAL ? m_normals[corner.m_normal] : face_normal;
+                // Same as Mesh::load_from_obj, for display
+                vertex.color = vertex.normal;
+            }
+        }
+
+        chunk.m_written_triangles += size - 2;
+        corners += size;
+    }
+}
@@ -0,0 +1,416 @@
+#include "OcclusionCuller.h"
+
+#include <Initializers.h>
+
+#include <algorithm>
+
+// Matches the local sizes of the shaders
+constexpr uint32_t CULL_GROUP_SIZE = 64;
+constexpr uint32_t REDUCE_GROUP_SIZE = 8;
+
+struct ReducePushConstants {
+    glm::uvec2 m_src_size;
+    glm::uvec2 m_dst_size;
+};
+
+static uint32_t previous_power_of_two(uint32_t value) {
+    uint32_t result = 1;
+    while (result * 2 <= value) {
+        result *= 2;
+    }
+    return result;
+}
+
+void OcclusionCuller::init(VkDevice device, VmaAllocator allocator, MemoryBudget *memory_budget,
+                           uint32_t frame_count, const ComputeProgram &reduce, const ComputeProgram &cull,
+                           const std::vector<uint32_t> &queue_families) {
+    m_device = device;
+    m_allocator = allocator;
+    m_memory_budget = memory_budget;
+    m_queue_families = queue_families;
+    m_reduce = reduce;
+    m_cull = cull;
+    m_frames.resize(frame_count);
+
+    // Sets are allocated once and rewritten when what they point to is recreated
+    std::vector<VkDescriptorPoolSize> pool_sizes = {
+            {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, frame_count},
+            {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 5 * frame_count},
+            {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, frame_count * (1 + MAX_DEPTH_PYRAMID_LEVELS)},
+            {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, frame_count * MAX_DEPTH_PYRAMID_LEVELS}
+    };
+    VkDescriptorPoolCreateInfo pool_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .maxSets = frame_count * (1 + MAX_DEPTH_PYRAMID_LEVELS),
+            .poolSizeCount = (uint32_t) pool_sizes.size(),
+            .pPoolSizes = pool_sizes.data()
+    };
+    VK_CHECK(vkCreateDescriptorPool(m_device, &pool_info, nullptr, &m_descriptor_pool))
+
+    std::vector<VkDescriptorSetLayout> cull_layouts(frame_count, m_cull.m_set_layout);
+    std::vector<VkDescriptorSet> cull_sets(frame_count);
+    VkDescriptorSetAllocateInfo allocate_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .pNext = nullptr,
+            .descriptorPool = m_descriptor_pool,
+            .descriptorSetCount = frame_count,
+            .pSetLayouts = cull_layouts.data()
+    };
+    VK_CHECK(vkAllocateDescriptorSets(m_device, &allocate_info, cull_sets.data()))
+    for (uint32_t i = 0; i < frame_count; i++) {
+        m_frames[i].m_descriptor = cull_sets[i];
+    }
+
+    // Per frame too, the pyramid is recreated while the other frames may still be using theirs
+    std::vector<VkDescriptorSetLayout> reduce_layouts(MAX_DEPTH_PYRAMID_LEVELS, m_reduce.m_set_layout);
+    allocate_info.descriptorSetCount = MAX_DEPTH_PYRAMID_LEVELS;
+    allocate_info.pSetLayouts = reduce_layouts.data();
+    for (FrameResources &frame: m_frames) {
+        VK_CHECK(vkAllocateDescriptorSets(m_device, &allocate_info, frame.m_reduce_descriptors))
+    }
+
+    // Only texelFetch is used, the sampler is there because the images are combined image samplers
+    VkSamplerCreateInfo sampler_info = {
+            .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .magFilter = VK_FILTER_NEAREST,
+            .minFilter = VK_FILTER_NEAREST,
+            .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+            .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+            .minLod = 0.f,
+            .maxLod = VK_LOD_CLAMP_NONE
+    };
+    VK_CHECK(vkCreateSampler(m_device, &sampler_info, nullptr, &m_sampler))
+}
+
+void OcclusionCuller::cleanup() {
+    destroy_buffers();
+
+    vkDestroySampler(m_device, m_sampler, nullptr);
+    vkDestroyDescriptorPool(m_device, m_descriptor_pool, nullptr);
+    vkDestroyPipeline(m_device, m_reduce.m_pipeline, nullptr);
+    vkDestroyPipeline(m_device, m_cull.m_pipeline, nullptr);
+    m_frames.clear();
+}
+
+void OcclusionCuller::replace_pipeline(VkPipeline old_pipeline, VkPipeline new_pipeline) {
+    for (ComputeProgram *program: {&m_reduce, &m_cull}) {
+        if (program->m_pipeline == old_pipeline) {
+            program->m_pipeline = new_pipeline;
+        }
+    }
+}
+
+AllocatedBuffer OcclusionCuller::create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                                               VmaMemoryUsage memory_usage, MemoryCategory category,
+                                               void **out_mapped) {
+    VkBufferCreateInfo buffer_info = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .size = size,
+            .usage = usage
+    };
+    if (m_queue_families.size() > 1) {
+        buffer_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        buffer_info.queueFamilyIndexCount = (uint32_t) m_queue_families.size();
+        buffer_info.pQueueFamilyIndices = m_queue_families.data();
+    }
+
+    VmaAllocationCreateInfo vma_alloc_info = {};
+    vma_alloc_info.usage = memory_usage;
+    if (out_mapped) {
+        vma_alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+    }
+
+    AllocatedBuffer buffer;
+    VmaAllocationInfo allocation_info;
+    VK_CHECK(vmaCreateBuffer(m_allocator, &buffer_info, &vma_alloc_info, &buffer.m_buffer, &buffer.m_allocation,
+                             &allocation_info))
+    m_memory_budget->track(buffer.m_allocation, category);
+
+    if (out_mapped) {
+        *out_mapped = allocation_info.pMappedData;
+    }
+    return buffer;
+}
+
+void OcclusionCuller::destroy_buffer(const AllocatedBuffer &buffer) {
+    m_memory_budget->untrack(buffer.m_allocation);
+    vmaDestroyBuffer(m_allocator, buffer.m_buffer, buffer.m_allocation);
+}
+
+void OcclusionCuller::destroy_buffers() {
+    if (m_capacity == 0) {
+        return;
+    }
+
+    for (FrameResources &frame: m_frames) {
+        destroy_buffer(frame.m_objects);
+        destroy_buffer(frame.m_cull_data);
+        destroy_buffer(frame.m_early_commands);
+        destroy_buffer(frame.m_late_commands);
+        destroy_buffer(frame.m_stats);
+        frame.m_mapped_objects = nullptr;
+        frame.m_mapped_cull_data = nullptr;
+        frame.m_mapped_stats = nullptr;
+        frame.m_object_count = 0;
+    }
+    destroy_buffer(m_visibility);
+    m_capacity = 0;
+}
+
+void OcclusionCuller::reserve(uint32_t object_capacity) {
+    destroy_buffers();
+
+    VkDeviceSize command_bytes = (VkDeviceSize) object_capacity * sizeof(VkDrawIndexedIndirectCommand);
+    for (FrameResources &frame: m_frames) {
+        frame.m_objects = create_buffer((VkDeviceSize) object_capacity * sizeof(CullObject),
+                                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU,
+                                        MemoryCategory::PerFrame, (void **) &frame.m_mapped_objects);
+        frame.m_cull_data = create_buffer(sizeof(CullData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                                          VMA_MEMORY_USAGE_CPU_TO_GPU, MemoryCategory::PerFrame,
+                                          (void **) &frame.m_mapped_cull_data);
+        frame.m_early_commands = create_buffer(command_bytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                                              VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                                               VMA_MEMORY_USAGE_GPU_ONLY, MemoryCategory::PerFrame, nullptr);
+        frame.m_late_commands = create_buffer(command_bytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                                             VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                                              VMA_MEMORY_USAGE_GPU_ONLY, MemoryCategory::PerFrame, nullptr);
+        // Cleared at the start of the frame and read back once it's done
+        frame.m_stats = create_buffer(sizeof(CullStats), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                      VMA_MEMORY_USAGE_GPU_TO_CPU, MemoryCategory::PerFrame,
+                                      (void **) &frame.m_mapped_stats);
+        *frame.m_mapped_stats = {};
+    }
+
+    // Starts zeroed by the first early phase, see cmd_cull
+    m_visibility = create_buffer((VkDeviceSize) object_capacity * sizeof(uint32_t),
+                                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                 VMA_MEMORY_USAGE_GPU_ONLY, MemoryCategory::Other, nullptr);
+    m_visibility_cleared = false;
+
+    m_capacity = object_capacity;
+    write_descriptors();
+}
+
+void OcclusionCuller::resize_pyramid(VkExtent2D depth_extent) {
+    m_depth_extent = depth_extent;
+
+    // Rounded down so every level is exactly half the previous one, the first reduction covers
+    // the extra texels
+    m_pyramid_extent = {previous_power_of_two(depth_extent.width), previous_power_of_two(depth_extent.height)};
+    m_pyramid_levels = 1;
+    while (m_pyramid_levels < MAX_DEPTH_PYRAMID_LEVELS &&
+           std::max(m_pyramid_extent.width, m_pyramid_extent.height) >> m_pyramid_levels > 0) {
+        m_pyramid_levels++;
+    }
+}
+
+void OcclusionCuller::set_images(uint32_t frame, uint64_t version, VkImageView depth_view,
+                                 VkImageView pyramid_view, const VkImageView *level_views) {
+    FrameResources &resources = m_frames[frame];
+    if (resources.m_images_version == version) {
+        return;
+    }
+    resources.m_images_version = version;
+
+    for (uint32_t level = 0; level < m_pyramid_levels; level++) {
+        VkDescriptorImageInfo src_info = {
+                .sampler = m_sampler,
+                .imageView = level == 0 ? depth_view : level_views[level - 1],
+                .imageLayout = level == 0 ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL
+        };
+        VkDescriptorImageInfo dst_info = {
+                .sampler = VK_NULL_HANDLE,
+                .imageView = level_views[level],
+                .imageLayout = VK_IMAGE_LAYOUT_GENERAL
+        };
+        VkWriteDescriptorSet writes[] = {
+                Initializers::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                                                     resources.m_reduce_descriptors[level], &src_info, 0),
+                Initializers::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                                                     resources.m_reduce_descriptors[level], &dst_info, 1)
+        };
+        vkUpdateDescriptorSets(m_device, 2, writes, 0, nullptr);
+    }
+
+    VkDescriptorImageInfo pyramid_info = {
+            .sampler = m_sampler,
+            .imageView = pyramid_view,
+            .imageLayout = VK_IMAGE_LAYOUT_GENERAL
+    };
+    VkWriteDescriptorSet pyramid_write = Initializers::write_descriptor_image(
+            VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, resources.m_descriptor, &pyramid_info, 6);
+    vkUpdateDescriptorSets(m_device, 1, &pyramid_write, 0, nullptr);
+}
+
+void OcclusionCuller::write_descriptors() {
+    // The pyramid is written by set_images
+    if (m_capacity == 0) {
+        return;
+    }
+
+    for (FrameResources &frame: m_frames) {
+        VkDescriptorBufferInfo cull_data_info = {frame.m_cull_data.m_buffer, 0, sizeof(CullData)};
+        VkDescriptorBufferInfo objects_info = {frame.m_objects.m_buffer, 0, VK_WHOLE_SIZE};
+        VkDescriptorBufferInfo early_info = {frame.m_early_commands.m_buffer, 0, VK_WHOLE_SIZE};
+        VkDescriptorBufferInfo late_info = {frame.m_late_commands.m_buffer, 0, VK_WHOLE_SIZE};
+        VkDescriptorBufferInfo visibility_info = {m_visibility.m_buffer, 0, VK_WHOLE_SIZE};
+        VkDescriptorBufferInfo stats_info = {frame.m_stats.m_buffer, 0, sizeof(CullStats)};
+
+        VkWriteDescriptorSet writes[] = {
+                Initializers::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, frame.m_descriptor,
+                                                      &cull_data_info, 0),
+                Initializers::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame.m_descriptor,
+                                                      &objects_info, 1),
+                Initializers::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame.m_descriptor,
+                                                      &early_info, 2),
+                Initializers::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame.m_descriptor,
+                                                      &late_info, 3),
+                Initializers::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame.m_descriptor,
+                                                      &visibility_info, 4),
+                Initializers::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame.m_descriptor,
+                                                      &stats_info, 5)
+        };
+        vkUpdateDescriptorSets(m_device, sizeof(writes) / sizeof(writes[0]), writes, 0, nullptr);
+    }
+}
+
+CullObject *OcclusionCuller::map_objects(uint32_t frame, uint32_t object_count) {
+    FrameResources &resources = m_frames[frame];
+    resources.m_object_count = std::min(object_count, m_capacity);
+    return resources.m_mapped_objects;
+}
+
+void OcclusionCuller::update(uint32_t frame, const glm::mat4 &view, const glm::mat4 &projection, float z_near,
+                             bool occlusion) {
+    FrameResources &resources = m_frames[frame];
+
+    CullData &data = *resources.m_mapped_cull_data;
+    data.m_view = view;
+    data.m_projection = projection;
+
+    // Planes of the clip volume, -w <= x, y, z <= w, brought back to world space. Flipping y in
+    // the projection only swaps the top and bottom ones.
+    glm::mat4 view_projection = glm::transpose(projection * view);
+    data.m_frustum[0] = view_projection[3] + view_projection[0];
+    data.m_frustum[1] = view_projection[3] - view_projection[0];
+    data.m_frustum[2] = view_projection[3] + view_projection[1];
+    data.m_frustum[3] = view_projection[3] - view_projection[1];
+    data.m_frustum[4] = view_projection[3] + view_projection[2];
+    data.m_frustum[5] = view_projection[3] - view_projection[2];
+    for (glm::vec4 &plane: data.m_frustum) {
+        plane /= glm::length(glm::vec3(plane));
+    }
+
+    data.m_pyramid_size = {(float) m_pyramid_extent.width, (float) m_pyramid_extent.height};
+    data.m_pyramid_levels = (float) m_pyramid_levels;
+    data.m_z_near = z_near;
+    data.m_object_count = resources.m_object_count;
+    data.m_occlusion_enabled = occlusion ? 1 : 0;
+
+    vmaFlushAllocation(m_allocator, resources.m_cull_data.m_allocation, 0, VK_WHOLE_SIZE);
+    vmaFlushAllocation(m_allocator, resources.m_objects.m_allocation, 0,
+                       (VkDeviceSize) resources.m_object_count * sizeof(CullObject));
+}
+
+void OcclusionCuller::cmd_cull(VkCommandBuffer cmd, uint32_t frame, bool late) {
+    FrameResources &resources = m_frames[frame];
+
+    if (!late) {
+        vkCmdFillBuffer(cmd, resources.m_stats.m_buffer, 0, sizeof(CullStats), 0);
+        // A new visibility buffer says nothing was visible, everything in the frustum is drawn late
+        if (!m_visibility_cleared) {
+            vkCmdFillBuffer(cmd, m_visibility.m_buffer, 0, VK_WHOLE_SIZE, 0);
+            m_visibility_cleared = true;
+        }
+
+        VkMemoryBarrier fill_barrier = {
+                .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                .pNext = nullptr,
+                .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+        };
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                             &fill_barrier, 0, nullptr, 0, nullptr);
+    }
+
+    if (resources.m_object_count == 0) {
+        return;
+    }
+
+    uint32_t push_late = late ? 1 : 0;
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_cull.m_pipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_cull.m_layout, 0, 1, &resources.m_descriptor, 0,
+                            nullptr);
+    vkCmdPushConstants(cmd, m_cull.m_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_late), &push_late);
+    vkCmdDispatch(cmd, (resources.m_object_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+    // Stats for the readback, the passes using the commands and the visibility are synchronized by
+    // the render graph
+    VkMemoryBarrier cull_barrier = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .pNext = nullptr,
+            .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_HOST_READ_BIT
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &cull_barrier,
+                         0, nullptr, 0, nullptr);
+}
+
+void OcclusionCuller::cmd_build_pyramid(VkCommandBuffer cmd, uint32_t frame, VkExtent2D render_extent) {
+    const FrameResources &resources = m_frames[frame];
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_reduce.m_pipeline);
+
+    // The pyramid keeps its size, its uv still covers the screen
+    VkExtent2D src_extent = {std::min(render_extent.width, m_depth_extent.width),
+                             std::min(render_extent.height, m_depth_extent.height)};
+    for (uint32_t level = 0; level < m_pyramid_levels; level++) {
+        VkExtent2D dst_extent = {std::max(m_pyramid_extent.width >> level, 1u),
+                                 std::max(m_pyramid_extent.height >> level, 1u)};
+
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_reduce.m_layout, 0, 1,
+                                &resources.m_reduce_descriptors[level], 0, nullptr);
+
+        ReducePushConstants constants = {
+                .m_src_size = {src_extent.width, src_extent.height},
+                .m_dst_size = {dst_extent.width, dst_extent.height}
+        };
+        vkCmdPushConstants(cmd, m_reduce.m_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+        vkCmdDispatch(cmd, (dst_extent.width + REDUCE_GROUP_SIZE - 1) / REDUCE_GROUP_SIZE,
+                      (dst_extent.height + REDUCE_GROUP_SIZE - 1) / REDUCE_GROUP_SIZE, 1);
+
+        // Read by the next level, the render graph takes care of the last one
+        if (level + 1 == m_pyramid_levels) {
+            break;
+        }
+        VkMemoryBarrier level_barrier = {
+                .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                .pNext = nullptr,
+                .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+                .dstAccessMask = VK_ACCESS_SHADER_READ_BIT
+        };
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                             &level_barrier, 0, nullptr, 0, nullptr);
+
+        src_extent = dst_extent;
+    }
+}
+
+VkBuffer OcclusionCuller::draw_commands(uint32_t frame, bool late) const {
+    return late ? m_frames[frame].m_late_commands.m_buffer : m_frames[frame].m_early_commands.m_buffer;
+}
+
+CullStats OcclusionCuller::read_stats(uint32_t frame) const {
+    const FrameResources &resources = m_frames[frame];
+    if (!resources.m_mapped_stats) {
+        return {};
+    }
+    vmaInvalidateAllocation(m_allocator, resources.m_stats.m_allocation, 0, VK_WHOLE_SIZE);
+    return *resources.m_mapped_stats;
+}
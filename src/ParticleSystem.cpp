@@ -0,0 +1,465 @@
+#include "ParticleSystem.h"
+
+#include <Initializers.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+// Match the local sizes of the shaders
+constexpr uint32_t PARTICLE_GROUP_SIZE = 64;
+constexpr uint32_t SORT_GROUP_SIZE = 256;
+// Keys sorted by one workgroup of particle_sort.comp
+constexpr uint32_t SORT_BLOCK_SIZE = SORT_GROUP_SIZE * 4;
+// 24 bit keys, 8 bits per pass. An odd count, so the sort ends where the compaction started.
+constexpr uint32_t SORT_PASSES = 3;
+constexpr uint32_t SORT_RADIX = 256;
+
+// 64 bytes, see the shaders. Only the GPU reads and writes them.
+constexpr VkDeviceSize PARTICLE_SIZE = 64;
+
+// Matches the Counters of the shaders, only the GPU writes it
+struct ParticleCounters {
+    // Of the sorted particles, 6 vertices per particle
+    VkDrawIndirectCommand m_draw;
+    VkDispatchIndirectCommand m_emit_groups;
+    // Simulation and compaction, over the alive particles once the new ones are in
+    VkDispatchIndirectCommand m_update_groups;
+    VkDispatchIndirectCommand m_sort_groups;
+    uint32_t m_alive_count;
+    uint32_t m_dead_count;
+    uint32_t m_emit_count;
+    uint32_t m_compacted_count;
+};
+static_assert(sizeof(ParticleCounters) == 68, "ParticleCounters must match the std430 layout of the shaders");
+
+// particle_args.comp, what it prepares
+enum ParticleArgsStage : uint32_t {
+    // Every particle dead, one invocation per particle
+    PARTICLE_ARGS_RESET = 0,
+    // Emission clamped to the dead particles, the emit and update dispatches
+    PARTICLE_ARGS_BEGIN = 1,
+    // The compacted list becomes the alive one, the sort dispatches and the draw
+    PARTICLE_ARGS_END = 2
+};
+
+struct SortPushConstants {
+    // 0 histogram, 1 scan, 2 scatter
+    uint32_t m_step;
+    uint32_t m_shift;
+};
+
+// Bindings of the emit, simulate, compact and args sets, each program has the ones it uses
+enum ParticleBinding : uint32_t {
+    BINDING_FRAME_DATA = 0,
+    BINDING_COUNTERS,
+    BINDING_PARTICLES,
+    BINDING_EMITTERS,
+    BINDING_DEAD,
+    BINDING_ALIVE,
+    BINDING_COMPACTED_KEYS,
+    BINDING_COMPACTED_VALUES,
+    BINDING_STATS,
+    PARTICLE_BINDING_COUNT
+};
+
+// Everything written by a dispatch is read by the next ones, some of it as indirect arguments
+static void cmd_compute_barrier(VkCommandBuffer cmd) {
+    VkMemoryBarrier barrier = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .pNext = nullptr,
+            .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT |
+                             VK_ACCESS_INDIRECT_COMMAND_READ_BIT
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 1, &barrier,
+                         0, nullptr, 0, nullptr);
+}
+
+void ParticleSystem::init(VkDevice device, VmaAllocator allocator, MemoryBudget *memory_budget,
+                          LayoutCache *layout_cache, uint32_t frame_count, const ParticlePrograms &programs,
+                          const std::vector<uint32_t> &queue_families) {
+    m_device = device;
+    m_allocator = allocator;
+    m_memory_budget = memory_budget;
+    m_layout_cache = layout_cache;
+    m_queue_families = queue_families;
+    m_programs = programs;
+    m_frames.resize(frame_count);
+
+    // Same bindings as the ones reflected from particle.vert, so the cache hands out the layout
+    // its pipeline was derived with
+    m_set_layout = layout_cache->get_set_layout({
+            Initializers::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                                       VK_SHADER_STAGE_VERTEX_BIT, 0),
+            Initializers::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                                       VK_SHADER_STAGE_VERTEX_BIT, 1)
+    });
+
+    // The descriptor sets come with the buffers, see reserve
+    for (FrameResources &frame: m_frames) {
+        frame.m_frame_data = create_buffer(sizeof(FrameData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                                           VMA_MEMORY_USAGE_CPU_TO_GPU, MemoryCategory::PerFrame,
+                                           (void **) &frame.m_mapped_frame_data);
+        *frame.m_mapped_frame_data = {};
+        frame.m_emitters = create_buffer(MAX_PARTICLE_EMITTERS * sizeof(EmitterData),
+                                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU,
+                                         MemoryCategory::PerFrame, (void **) &frame.m_mapped_emitters);
+        // Written at the end of the simulation and read back once the frame is done
+        frame.m_stats = create_buffer(sizeof(ParticleStats), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                      VMA_MEMORY_USAGE_GPU_TO_CPU, MemoryCategory::PerFrame,
+                                      (void **) &frame.m_mapped_stats);
+        *frame.m_mapped_stats = {};
+    }
+}
+
+void ParticleSystem::cleanup() {
+    destroy_retired(retire_buffers());
+    for (FrameResources &frame: m_frames) {
+        destroy_buffer(frame.m_frame_data);
+        destroy_buffer(frame.m_emitters);
+        destroy_buffer(frame.m_stats);
+    }
+    m_frames.clear();
+
+    for (const ComputeProgram *program: {&m_programs.m_args, &m_programs.m_emit, &m_programs.m_simulate,
+                                         &m_programs.m_compact, &m_programs.m_sort}) {
+        vkDestroyPipeline(m_device, program->m_pipeline, nullptr);
+    }
+}
+
+void ParticleSystem::replace_pipeline(VkPipeline old_pipeline, VkPipeline new_pipeline) {
+    for (ComputeProgram *program: {&m_programs.m_args, &m_programs.m_emit, &m_programs.m_simulate,
+                                   &m_programs.m_compact, &m_programs.m_sort}) {
+        if (program->m_pipeline == old_pipeline) {
+            program->m_pipeline = new_pipeline;
+        }
+    }
+}
+
+AllocatedBuffer ParticleSystem::create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                                              VmaMemoryUsage memory_usage, MemoryCategory category,
+                                              void **out_mapped) {
+    VkBufferCreateInfo buffer_info = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .size = size,
+            .usage = usage
+    };
+    if (m_queue_families.size() > 1) {
+        buffer_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        buffer_info.queueFamilyIndexCount = (uint32_t) m_queue_families.size();
+        buffer_info.pQueueFamilyIndices = m_queue_families.data();
+    }
+
+    VmaAllocationCreateInfo vma_alloc_info = {};
+    vma_alloc_info.usage = memory_usage;
+    if (out_mapped) {
+        vma_alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+    }
+
+    AllocatedBuffer buffer;
+    VmaAllocationInfo allocation_info;
+    VK_CHECK(vmaCreateBuffer(m_allocator, &buffer_info, &vma_alloc_info, &buffer.m_buffer, &buffer.m_allocation,
+                             &allocation_info))
+    m_memory_budget->track(buffer.m_allocation, category);
+
+    if (out_mapped) {
+        *out_mapped = allocation_info.pMappedData;
+    }
+    return buffer;
+}
+
+void ParticleSystem::destroy_buffer(const AllocatedBuffer &buffer) {
+    m_memory_budget->untrack(buffer.m_allocation);
+    vmaDestroyBuffer(m_allocator, buffer.m_buffer, buffer.m_allocation);
+}
+
+ParticleSystem::RetiredBuffers ParticleSystem::retire_buffers() {
+    RetiredBuffers retired;
+    if (m_capacity == 0) {
+        return retired;
+    }
+
+    retired.m_buffers = {m_counters, m_particles, m_dead, m_keys[0], m_keys[1], m_values[0], m_values[1],
+                         m_histograms};
+    retired.m_descriptor_pool = m_descriptor_pool;
+    m_descriptor_pool = VK_NULL_HANDLE;
+    m_capacity = 0;
+    return retired;
+}
+
+void ParticleSystem::destroy_retired(const RetiredBuffers &retired) {
+    for (const AllocatedBuffer &buffer: retired.m_buffers) {
+        destroy_buffer(buffer);
+    }
+    // Frees the sets with it
+    if (retired.m_descriptor_pool != VK_NULL_HANDLE) {
+        vkDestroyDescriptorPool(m_device, retired.m_descriptor_pool, nullptr);
+    }
+}
+
+void ParticleSystem::allocate_descriptors() {
+    // Four simulation sets per frame, the sort and draw sets are shared. Sized for every binding
+    // in every set, the programs only use some of them.
+    auto frame_count = (uint32_t) m_frames.size();
+    uint32_t max_sets = 4 * frame_count + 3;
+    std::vector<VkDescriptorPoolSize> pool_sizes = {
+            {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 4 * frame_count},
+            {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, max_sets * PARTICLE_BINDING_COUNT}
+    };
+    VkDescriptorPoolCreateInfo pool_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .maxSets = max_sets,
+            .poolSizeCount = (uint32_t) pool_sizes.size(),
+            .pPoolSizes = pool_sizes.data()
+    };
+    VK_CHECK(vkCreateDescriptorPool(m_device, &pool_info, nullptr, &m_descriptor_pool))
+
+    for (FrameResources &frame: m_frames) {
+        VkDescriptorSetLayout layouts[] = {m_programs.m_args.m_set_layout, m_programs.m_emit.m_set_layout,
+                                           m_programs.m_simulate.m_set_layout, m_programs.m_compact.m_set_layout};
+        VkDescriptorSetAllocateInfo allocate_info = {
+                .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+                .pNext = nullptr,
+                .descriptorPool = m_descriptor_pool,
+                .descriptorSetCount = 4,
+                .pSetLayouts = layouts
+        };
+        VK_CHECK(vkAllocateDescriptorSets(m_device, &allocate_info, frame.m_descriptors))
+    }
+
+    VkDescriptorSetLayout shared_layouts[] = {m_programs.m_sort.m_set_layout, m_programs.m_sort.m_set_layout,
+                                              m_set_layout};
+    VkDescriptorSet shared_sets[3];
+    VkDescriptorSetAllocateInfo allocate_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .pNext = nullptr,
+            .descriptorPool = m_descriptor_pool,
+            .descriptorSetCount = 3,
+            .pSetLayouts = shared_layouts
+    };
+    VK_CHECK(vkAllocateDescriptorSets(m_device, &allocate_info, shared_sets))
+    m_sort_descriptors[0] = shared_sets[0];
+    m_sort_descriptors[1] = shared_sets[1];
+    m_draw_descriptor = shared_sets[2];
+}
+
+ParticleSystem::RetiredBuffers ParticleSystem::reserve(uint32_t capacity) {
+    // The frames in flight still use the old sets, so they aren't written again either
+    RetiredBuffers retired = retire_buffers();
+    if (capacity == 0) {
+        return retired;
+    }
+
+    // Device local, the CPU never sees a particle
+    VkDeviceSize index_bytes = (VkDeviceSize) capacity * sizeof(uint32_t);
+    m_counters = create_buffer(sizeof(ParticleCounters), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                                         VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                               VMA_MEMORY_USAGE_GPU_ONLY, MemoryCategory::Other, nullptr);
+    m_particles = create_buffer((VkDeviceSize) capacity * PARTICLE_SIZE, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                VMA_MEMORY_USAGE_GPU_ONLY, MemoryCategory::Other, nullptr);
+    m_dead = create_buffer(index_bytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY,
+                           MemoryCategory::Other, nullptr);
+    for (uint32_t i = 0; i < 2; i++) {
+        m_keys[i] = create_buffer(index_bytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY,
+                                  MemoryCategory::Other, nullptr);
+        m_values[i] = create_buffer(index_bytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY,
+                                    MemoryCategory::Other, nullptr);
+    }
+    // A count per digit and per sort workgroup
+    uint32_t max_sort_groups = (capacity + SORT_BLOCK_SIZE - 1) / SORT_BLOCK_SIZE;
+    m_histograms = create_buffer((VkDeviceSize) SORT_RADIX * max_sort_groups * sizeof(uint32_t),
+                                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY,
+                                 MemoryCategory::Other, nullptr);
+    m_capacity = capacity;
+    m_initialized = false;
+
+    allocate_descriptors();
+    for (FrameResources &frame: m_frames) {
+        VkBuffer buffers[PARTICLE_BINDING_COUNT] = {};
+        buffers[BINDING_FRAME_DATA] = frame.m_frame_data.m_buffer;
+        buffers[BINDING_COUNTERS] = m_counters.m_buffer;
+        buffers[BINDING_PARTICLES] = m_particles.m_buffer;
+        buffers[BINDING_EMITTERS] = frame.m_emitters.m_buffer;
+        buffers[BINDING_DEAD] = m_dead.m_buffer;
+        buffers[BINDING_ALIVE] = m_values[0].m_buffer;
+        buffers[BINDING_COMPACTED_KEYS] = m_keys[1].m_buffer;
+        buffers[BINDING_COMPACTED_VALUES] = m_values[1].m_buffer;
+        buffers[BINDING_STATS] = frame.m_stats.m_buffer;
+
+        const ComputeProgram *programs[] = {&m_programs.m_args, &m_programs.m_emit, &m_programs.m_simulate,
+                                            &m_programs.m_compact};
+        for (uint32_t i = 0; i < 4; i++) {
+            write_descriptors(frame.m_descriptors[i], *programs[i], buffers, PARTICLE_BINDING_COUNT);
+        }
+    }
+
+    // Counters, keys and values in, keys and values out, histograms
+    for (uint32_t direction = 0; direction < 2; direction++) {
+        uint32_t src = direction == 0 ? 1 : 0;
+        VkBuffer buffers[] = {m_counters.m_buffer, m_keys[src].m_buffer, m_values[src].m_buffer,
+                              m_keys[1 - src].m_buffer, m_values[1 - src].m_buffer, m_histograms.m_buffer};
+        write_descriptors(m_sort_descriptors[direction], m_programs.m_sort, buffers, 6);
+    }
+
+    VkDescriptorBufferInfo particles_info = {m_particles.m_buffer, 0, VK_WHOLE_SIZE};
+    VkDescriptorBufferInfo sorted_info = {m_values[0].m_buffer, 0, VK_WHOLE_SIZE};
+    VkWriteDescriptorSet draw_writes[] = {
+            Initializers::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_draw_descriptor,
+                                                  &particles_info, 0),
+            Initializers::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_draw_descriptor,
+                                                  &sorted_info, 1)
+    };
+    vkUpdateDescriptorSets(m_device, 2, draw_writes, 0, nullptr);
+    return retired;
+}
+
+void ParticleSystem::write_descriptors(VkDescriptorSet set, const ComputeProgram &program, const VkBuffer *buffers,
+                                       uint32_t buffer_count) {
+    // The layouts are reflected, a shader only has the bindings it uses
+    const std::vector<VkDescriptorSetLayoutBinding> *bindings = m_layout_cache->find_set_bindings(
+            program.m_set_layout);
+    std::vector<VkDescriptorBufferInfo> infos(bindings->size());
+    std::vector<VkWriteDescriptorSet> writes;
+    for (size_t i = 0; i < bindings->size(); i++) {
+        const VkDescriptorSetLayoutBinding &binding = (*bindings)[i];
+        if (binding.binding >= buffer_count || buffers[binding.binding] == VK_NULL_HANDLE) {
+            std::cout << "Particle shader binding " << binding.binding << " doesn't match any buffer" << std::endl;
+            abort();
+        }
+        infos[i] = {buffers[binding.binding], 0, VK_WHOLE_SIZE};
+        writes.push_back(Initializers::write_descriptor_buffer(binding.descriptorType, set, &infos[i],
+                                                               binding.binding));
+    }
+    vkUpdateDescriptorSets(m_device, (uint32_t) writes.size(), writes.data(), 0, nullptr);
+}
+
+void ParticleSystem::update(uint32_t frame, const std::vector<ParticleEmitter> &emitters, float delta_time,
+                            const glm::mat4 &view, float z_far) {
+    FrameResources &resources = m_frames[frame];
+
+    auto emitter_count = (uint32_t) std::min<size_t>(emitters.size(), MAX_PARTICLE_EMITTERS);
+    if (m_spawn_remainders.size() != emitter_count) {
+        m_spawn_remainders.assign(emitter_count, 0.f);
+    }
+
+    // Each emitter gets a range of the frame's spawns, the GPU stops once the dead list is empty
+    uint32_t spawn_count = 0;
+    for (uint32_t i = 0; i < emitter_count; i++) {
+        float spawns = m_spawn_remainders[i] + std::max(emitters[i].m_rate, 0.f) * delta_time;
+        auto count = (uint32_t) std::min(std::floor(spawns), (float) (m_capacity - spawn_count));
+        m_spawn_remainders[i] = spawns - (float) count;
+
+        resources.m_mapped_emitters[i] = {
+                .m_emitter = emitters[i],
+                .m_first_spawn = spawn_count,
+                .m_spawn_count = count
+        };
+        spawn_count += count;
+    }
+    if (emitter_count > 0) {
+        vmaFlushAllocation(m_allocator, resources.m_emitters.m_allocation, 0,
+                           (VkDeviceSize) emitter_count * sizeof(EmitterData));
+    }
+
+    *resources.m_mapped_frame_data = {
+            .m_view = view,
+            .m_delta_time = delta_time,
+            .m_spawn_count = spawn_count,
+            .m_emitter_count = emitter_count,
+            .m_seed = m_seed++,
+            .m_z_far = z_far,
+            .m_capacity = m_capacity
+    };
+    vmaFlushAllocation(m_allocator, resources.m_frame_data.m_allocation, 0, VK_WHOLE_SIZE);
+}
+
+void ParticleSystem::cmd_dispatch_args(VkCommandBuffer cmd, VkDescriptorSet set, uint32_t stage,
+                                       uint32_t group_count) {
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_programs.m_args.m_pipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_programs.m_args.m_layout, 0, 1, &set, 0,
+                            nullptr);
+    vkCmdPushConstants(cmd, m_programs.m_args.m_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(stage), &stage);
+    vkCmdDispatch(cmd, group_count, 1, 1);
+}
+
+void ParticleSystem::cmd_simulate(VkCommandBuffer cmd, uint32_t frame) {
+    FrameResources &resources = m_frames[frame];
+
+    if (!m_initialized) {
+        cmd_dispatch_args(cmd, resources.m_descriptors[0], PARTICLE_ARGS_RESET,
+                          (m_capacity + PARTICLE_GROUP_SIZE - 1) / PARTICLE_GROUP_SIZE);
+        cmd_compute_barrier(cmd);
+        m_initialized = true;
+    }
+
+    cmd_dispatch_args(cmd, resources.m_descriptors[0], PARTICLE_ARGS_BEGIN, 1);
+    cmd_compute_barrier(cmd);
+
+    // Sized on the GPU by the args
+    auto dispatch = [&](const ComputeProgram &program, VkDescriptorSet set, VkDeviceSize args_offset) {
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, program.m_pipeline);
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, program.m_layout, 0, 1, &set, 0, nullptr);
+        vkCmdDispatchIndirect(cmd, m_counters.m_buffer, args_offset);
+        cmd_compute_barrier(cmd);
+    };
+    dispatch(m_programs.m_emit, resources.m_descriptors[1], offsetof(ParticleCounters, m_emit_groups));
+    dispatch(m_programs.m_simulate, resources.m_descriptors[2], offsetof(ParticleCounters, m_update_groups));
+    dispatch(m_programs.m_compact, resources.m_descriptors[3], offsetof(ParticleCounters, m_update_groups));
+
+    cmd_dispatch_args(cmd, resources.m_descriptors[0], PARTICLE_ARGS_END, 1);
+    cmd_compute_barrier(cmd);
+
+    // Least significant digit first, B to A, A to B and back to A
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_programs.m_sort.m_pipeline);
+    for (uint32_t pass = 0; pass < SORT_PASSES; pass++) {
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_programs.m_sort.m_layout, 0, 1,
+                                &m_sort_descriptors[pass % 2], 0, nullptr);
+        for (uint32_t step = 0; step < 3; step++) {
+            SortPushConstants constants = {step, pass * 8};
+            vkCmdPushConstants(cmd, m_programs.m_sort.m_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants),
+                               &constants);
+            // The scan is a single workgroup, one invocation per digit
+            if (step == 1) {
+                vkCmdDispatch(cmd, 1, 1, 1);
+            } else {
+                vkCmdDispatchIndirect(cmd, m_counters.m_buffer, offsetof(ParticleCounters, m_sort_groups));
+            }
+            // The draw after the last one is synchronized by the render graph
+            if (pass + 1 < SORT_PASSES || step < 2) {
+                cmd_compute_barrier(cmd);
+            }
+        }
+    }
+
+    // Stats for the readback
+    VkMemoryBarrier stats_barrier = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .pNext = nullptr,
+            .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_HOST_READ_BIT
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &stats_barrier,
+                         0, nullptr, 0, nullptr);
+}
+
+void ParticleSystem::cmd_bind(VkCommandBuffer cmd, VkPipelineLayout layout) const {
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 1, 1, &m_draw_descriptor, 0, nullptr);
+}
+
+void ParticleSystem::cmd_draw(VkCommandBuffer cmd) const {
+    vkCmdDrawIndirect(cmd, m_counters.m_buffer, offsetof(ParticleCounters, m_draw), 1,
+                      sizeof(VkDrawIndirectCommand));
+}
+
+ParticleStats ParticleSystem::read_stats(uint32_t frame) const {
+    const FrameResources &resources = m_frames[frame];
+    if (!resources.m_mapped_stats) {
+        return {};
+    }
+    vmaInvalidateAllocation(m_allocator, resources.m_stats.m_allocation, 0, VK_WHOLE_SIZE);
+    return *resources.m_mapped_stats;
+}
@@ -3,6 +3,8 @@
 //
 
 #include "PipelineBuilder.h"
+#include <algorithm>
+#include <array>
 #include <iostream>
 
 
@@ -29,9 +31,50 @@ void PipelineBuilder::setup_default(VkExtent2D window_extent) {
 
     //a single blend attachment with no blending and writing to RGBA
     m_color_blend_attachment.push_back(Initializers::color_blend_attachment_state());
+
+    // m_viewport and m_scissor are only used for their count, they are set when drawing
+    m_dynamic_states = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+}
+
+static constexpr VkDynamicState RENDER_STATE_DYNAMIC_STATES[] = {
+        VK_DYNAMIC_STATE_CULL_MODE,
+        VK_DYNAMIC_STATE_FRONT_FACE,
+        VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY,
+        VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE,
+        VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE,
+        VK_DYNAMIC_STATE_DEPTH_COMPARE_OP
+};
+
+void PipelineBuilder::enable_dynamic_render_state() {
+    if (!has_dynamic_render_state()) {
+        m_dynamic_states.insert(m_dynamic_states.end(), std::begin(RENDER_STATE_DYNAMIC_STATES),
+                                std::end(RENDER_STATE_DYNAMIC_STATES));
+    }
+}
+
+bool PipelineBuilder::has_dynamic_render_state() const {
+    return std::find(m_dynamic_states.begin(), m_dynamic_states.end(), VK_DYNAMIC_STATE_CULL_MODE) !=
+           m_dynamic_states.end();
 }
 
 VkPipeline PipelineBuilder::build_pipeline(VkDevice device) {
+    // On the stack, VertexLayout caps the attribute count
+    std::array<VkVertexInputAttributeDescription, MAX_VERTEX_ATTRIBUTES> attributes;
+    uint32_t attribute_count = 0;
+    for (const VkVertexInputAttributeDescription &attribute: m_vertex_attributes) {
+        if (m_vertex_location_mask & (1u << attribute.location)) {
+            attributes[attribute_count++] = attribute;
+        }
+    }
+
+    VkPipelineVertexInputStateCreateInfo vertex_input_info = m_vertex_input_info;
+    if (!m_vertex_bindings.empty()) {
+        vertex_input_info.vertexBindingDescriptionCount = static_cast<uint32_t>(m_vertex_bindings.size());
+        vertex_input_info.pVertexBindingDescriptions = m_vertex_bindings.data();
+        vertex_input_info.vertexAttributeDescriptionCount = attribute_count;
+        vertex_input_info.pVertexAttributeDescriptions = attributes.data();
+    }
+
     VkPipelineViewportStateCreateInfo viewport_state = {
             .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
             .pNext = nullptr,
@@ -52,6 +95,14 @@ VkPipeline PipelineBuilder::build_pipeline(VkDevice device) {
             .pAttachments = m_color_blend_attachment.data()
     };
 
+    VkPipelineDynamicStateCreateInfo dynamic_state = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .dynamicStateCount = static_cast<uint32_t>(m_dynamic_states.size()),
+            .pDynamicStates = m_dynamic_states.data()
+    };
+
     // We ignore color attachment because it works without it.
     // We might change stencil tho
     const VkPipelineRenderingCreateInfoKHR pipeline_rendering_create_info {
@@ -67,13 +118,14 @@ VkPipeline PipelineBuilder::build_pipeline(VkDevice device) {
             .pNext = &pipeline_rendering_create_info,
             .stageCount = static_cast<uint32_t>(m_shader_stages.size()),
             .pStages = m_shader_stages.data(),
-            .pVertexInputState = &m_vertex_input_info,
+            .pVertexInputState = &vertex_input_info,
             .pInputAssemblyState = &m_input_assembly,
             .pViewportState = &viewport_state,
             .pRasterizationState = &m_rasterizer,
             .pMultisampleState = &m_multisampling,
             .pDepthStencilState = &m_depth_stencil,
             .pColorBlendState = &color_blending,
+            .pDynamicState = &dynamic_state,
             .layout = m_pipeline_layout,
             .subpass = 0,
             .basePipelineHandle = VK_NULL_HANDLE
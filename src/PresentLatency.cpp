@@ -0,0 +1,149 @@
+#include "PresentLatency.h"
+
+#include <imgui.h>
+
+#include <algorithm>
+#include <chrono>
+
+const char *present_mode_name(VkPresentModeKHR present_mode) {
+    switch (present_mode) {
+        case VK_PRESENT_MODE_IMMEDIATE_KHR:
+            return "IMMEDIATE";
+        case VK_PRESENT_MODE_MAILBOX_KHR:
+            return "MAILBOX";
+        case VK_PRESENT_MODE_FIFO_KHR:
+            return "FIFO";
+        case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+            return "FIFO_RELAXED";
+        default:
+            return "unknown";
+    }
+}
+
+void PresentLatencyTracker::init(VkDevice device, bool present_wait_enabled) {
+    m_device = device;
+    m_present_wait_enabled = present_wait_enabled;
+
+    if (m_present_wait_enabled) {
+        // Extension function, not exported by the loader
+        m_wait_for_present = (PFN_vkWaitForPresentKHR) vkGetDeviceProcAddr(m_device, "vkWaitForPresentKHR");
+        m_present_wait_enabled = m_wait_for_present != nullptr;
+    }
+
+    if (m_present_wait_enabled) {
+        m_running = true;
+        m_thread = std::thread(&PresentLatencyTracker::worker, this);
+    }
+}
+
+void PresentLatencyTracker::cleanup() {
+    if (m_running) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_running = false;
+        }
+        m_condition.notify_all();
+        m_thread.join();
+    }
+    m_pending.clear();
+}
+
+uint64_t PresentLatencyTracker::now_us() {
+    return (uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void PresentLatencyTracker::on_present(VkSwapchainKHR swapchain, uint64_t present_id, uint64_t input_us) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_input_to_submit_ms.push((double) (now_us() - input_us) / 1000.0);
+
+    if (m_present_wait_enabled && present_id != 0) {
+        m_pending.push_back({swapchain, present_id, input_us});
+        m_condition.notify_one();
+    }
+}
+
+void PresentLatencyTracker::forget_swapchain(VkSwapchainKHR swapchain) {
+    // Waits for the worker to give the swapchain back
+    std::lock_guard<std::mutex> swapchain_lock(m_swapchain_mutex);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::erase_if(m_pending, [=](const PendingPresent &present) {
+        return present.m_swapchain == swapchain;
+    });
+}
+
+RollingStats PresentLatencyTracker::input_to_submit_ms() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_input_to_submit_ms;
+}
+
+RollingStats PresentLatencyTracker::input_to_present_ms() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_input_to_present_ms;
+}
+
+void PresentLatencyTracker::worker() {
+    // Short timeout so forget_swapchain never waits long on us
+    constexpr uint64_t WAIT_TIMEOUT_NS = 10000000;
+
+    while (true) {
+        PendingPresent present{};
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]() { return !m_running || !m_pending.empty(); });
+            if (!m_running) {
+                return;
+            }
+            present = m_pending.front();
+        }
+
+        VkResult result;
+        {
+            std::lock_guard<std::mutex> swapchain_lock(m_swapchain_mutex);
+            {
+                // The swapchain may have been forgotten while we weren't holding it
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_pending.empty() || m_pending.front().m_present_id != present.m_present_id) {
+                    continue;
+                }
+            }
+            result = m_wait_for_present(m_device, present.m_swapchain, present.m_present_id, WAIT_TIMEOUT_NS);
+        }
+
+        if (result == VK_TIMEOUT) {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (result == VK_SUCCESS) {
+            m_input_to_present_ms.push((double) (now_us() - present.m_input_us) / 1000.0);
+        }
+        // Out of date or surface lost, either way this present won't be measured
+        if (!m_pending.empty() && m_pending.front().m_present_id == present.m_present_id) {
+            m_pending.pop_front();
+        }
+    }
+}
+
+void PresentLatencyTracker::draw_overlay(VkPresentModeKHR present_mode) {
+    ImGui::SetNextWindowPos(ImVec2(830, 10), ImGuiCond_FirstUseEver);
+    ImGui::SetNextWindowSize(ImVec2(300, 140), ImGuiCond_FirstUseEver);
+    if (!ImGui::Begin("Latency")) {
+        ImGui::End();
+        return;
+    }
+
+    ImGui::Text("Present mode: %s (F4 to cycle)", present_mode_name(present_mode));
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ImGui::Text("Input to submit: %.2f ms (p99 %.2f)", m_input_to_submit_ms.avg(),
+                m_input_to_submit_ms.percentile(0.99));
+    if (m_present_wait_enabled) {
+        ImGui::Text("Input to present: %.2f ms (p99 %.2f)", m_input_to_present_ms.avg(),
+                    m_input_to_present_ms.percentile(0.99));
+    } else {
+        ImGui::TextDisabled("Input to present: needs VK_KHR_present_wait");
+    }
+
+    ImGui::End();
+}
@@ -0,0 +1,484 @@
+#include "Profiler.h"
+#include "VulkanHelpers.h"
+
+#include <imgui.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+namespace {
+    // Small, stable ids are nicer to read in the trace viewer than hashed std::thread::id
+    std::atomic<uint32_t> g_next_thread_id{0};
+    thread_local uint32_t t_thread_id = g_next_thread_id++;
+    thread_local uint32_t t_depth = 0;
+
+    uint64_t steady_now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void write_json_string(std::ofstream &out, const char *str) {
+        out << '"';
+        for (const char *c = str; *c; c++) {
+            if (*c == '"' || *c == '\\') {
+                out << '\\';
+            }
+            out << *c;
+        }
+        out << '"';
+    }
+}
+
+RollingStats::RollingStats() : RollingStats(256) {
+}
+
+RollingStats::RollingStats(size_t capacity) : m_samples(capacity, 0.0) {
+}
+
+void RollingStats::push(double value) {
+    m_samples[m_head] = value;
+    m_head = (m_head + 1) % m_samples.size();
+    m_count = std::min(m_count + 1, m_samples.size());
+}
+
+double RollingStats::last() const {
+    if (m_count == 0) return 0.0;
+    return m_samples[(m_head + m_samples.size() - 1) % m_samples.size()];
+}
+
+double RollingStats::min() const {
+    if (m_count == 0) return 0.0;
+    return *std::min_element(m_samples.begin(), m_samples.begin() + (long) m_count);
+}
+
+double RollingStats::max() const {
+    if (m_count == 0) return 0.0;
+    return *std::max_element(m_samples.begin(), m_samples.begin() + (long) m_count);
+}
+
+double RollingStats::avg() const {
+    if (m_count == 0) return 0.0;
+    double sum = 0.0;
+    for (size_t i = 0; i < m_count; i++) {
+        sum += m_samples[i];
+    }
+    return sum / (double) m_count;
+}
+
+double RollingStats::percentile(double p) const {
+    if (m_count == 0) return 0.0;
+    // Samples aren't ordered once the ring wrapped, but only the first m_count are valid
+    std::vector<double> sorted(m_samples.begin(), m_samples.begin() + (long) m_count);
+    size_t rank = std::min((size_t) (p * (double) (m_count - 1) + 0.5), m_count - 1);
+    std::nth_element(sorted.begin(), sorted.begin() + (long) rank, sorted.end());
+    return sorted[rank];
+}
+
+void Profiler::init(VkDevice device, VkPhysicalDevice physical_device, uint32_t queue_family,
+                    uint32_t frames_in_flight, uint32_t compute_queue_family) {
+    m_device = device;
+    m_origin_ns = steady_now_ns();
+    m_frame_slots.resize(frames_in_flight);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    m_timestamp_period = properties.limits.timestampPeriod;
+
+    uint32_t family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &family_count, nullptr);
+    std::vector<VkQueueFamilyProperties> families(family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &family_count, families.data());
+
+    uint32_t queue_families[GPU_QUEUE_COUNT] = {queue_family, compute_queue_family};
+    uint32_t valid_bits = 64;
+    for (uint32_t queue = 0; queue < GPU_QUEUE_COUNT; queue++) {
+        uint32_t family = queue_families[queue];
+        uint32_t bits = family < family_count ? families[family].timestampValidBits : 0;
+        m_queue_supported[queue] = bits > 0 && m_timestamp_period > 0.0;
+        if (m_queue_supported[queue]) {
+            // Compared across queues, so only the bits both have
+            valid_bits = std::min(valid_bits, bits);
+        }
+    }
+    m_gpu_supported = m_queue_supported[(uint32_t) GpuQueue::Graphics];
+    // Without graphics timings there is no frame to place the compute ones in
+    m_queue_supported[(uint32_t) GpuQueue::Compute] &= m_gpu_supported;
+    m_timestamp_mask = valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+
+    if (!m_gpu_supported) {
+        std::cout << "Profiler: timestamps not supported on this queue, GPU timings are disabled" << std::endl;
+        return;
+    }
+    if (compute_queue_family != UINT32_MAX && !m_queue_supported[(uint32_t) GpuQueue::Compute]) {
+        std::cout << "Profiler: timestamps not supported on the compute queue, its work isn't timed" << std::endl;
+    }
+
+    VkQueryPoolCreateInfo query_pool_info = {
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .queryType = VK_QUERY_TYPE_TIMESTAMP,
+            .queryCount = MAX_GPU_SCOPES * 2
+    };
+
+    for (auto &slot: m_frame_slots) {
+        for (uint32_t queue = 0; queue < GPU_QUEUE_COUNT; queue++) {
+            if (m_queue_supported[queue]) {
+                VK_CHECK(vkCreateQueryPool(m_device, &query_pool_info, nullptr, &slot.m_query_pools[queue]))
+            }
+        }
+    }
+}
+
+void Profiler::cleanup() {
+    for (auto &slot: m_frame_slots) {
+        for (VkQueryPool &pool: slot.m_query_pools) {
+            if (pool != VK_NULL_HANDLE) {
+                vkDestroyQueryPool(m_device, pool, nullptr);
+                pool = VK_NULL_HANDLE;
+            }
+        }
+    }
+}
+
+void Profiler::begin_frame(uint32_t frame_index) {
+    m_current_slot = frame_index % m_frame_slots.size();
+    m_frame_start_us = now_us();
+
+    FrameSlot &slot = m_frame_slots[m_current_slot];
+    if (slot.m_pending) {
+        resolve_gpu_slot(slot);
+        slot.m_pending = false;
+    }
+
+    FrameTrace trace;
+    {
+        std::lock_guard<std::mutex> lock(m_events_mutex);
+        trace.m_events.swap(m_pending_events);
+    }
+
+    // A scope can run several times per frame (ie once per object), we want the sum.
+    std::unordered_map<std::string, double> frame_totals;
+    for (const auto &event: trace.m_events) {
+        bool gpu = event.thread_id == GPU_THREAD_ID || event.thread_id == GPU_COMPUTE_THREAD_ID;
+        const char *prefix = gpu ? "gpu:" : "";
+        frame_totals[std::string(prefix) + event.name] += (double) event.duration_us / 1000.0;
+    }
+    for (const auto &[name, total]: frame_totals) {
+        m_scope_stats[name].push(total);
+    }
+
+    if (!trace.m_events.empty()) {
+        m_trace_frames.push_back(std::move(trace));
+        if (m_trace_frames.size() > TRACE_FRAME_COUNT) {
+            m_trace_frames.pop_front();
+        }
+    }
+}
+
+void Profiler::end_frame() {
+    uint64_t end_us = now_us();
+    m_cpu_frame_stats.push((double) (end_us - m_frame_start_us) / 1000.0);
+
+    record_cpu_event({
+            .name = "frame",
+            .thread_id = t_thread_id,
+            .depth = 0,
+            .start_us = m_frame_start_us,
+            .duration_us = end_us - m_frame_start_us
+    });
+}
+
+void Profiler::cmd_reset_queries(VkCommandBuffer cmd, GpuQueue queue) {
+    FrameSlot &slot = m_frame_slots[m_current_slot];
+    auto index = (uint32_t) queue;
+    if (queue == GpuQueue::Graphics) {
+        slot.m_scopes.clear();
+        slot.m_cpu_start_us = now_us();
+        for (uint32_t i = 0; i < GPU_QUEUE_COUNT; i++) {
+            slot.m_query_counts[i] = 0;
+            slot.m_reset[i] = false;
+            m_gpu_depth[i] = 0;
+        }
+    }
+
+    if (!m_queue_supported[index]) {
+        return;
+    }
+
+    vkCmdResetQueryPool(cmd, slot.m_query_pools[index], 0, MAX_GPU_SCOPES * 2);
+    slot.m_reset[index] = true;
+    slot.m_pending = true;
+}
+
+uint32_t Profiler::cmd_begin_gpu_scope(VkCommandBuffer cmd, const char *name, GpuQueue queue) {
+    FrameSlot &slot = m_frame_slots[m_current_slot];
+    auto index = (uint32_t) queue;
+    if (!m_enabled || !slot.m_reset[index] || slot.m_query_counts[index] >= MAX_GPU_SCOPES) {
+        return UINT32_MAX;
+    }
+
+    auto scope = (uint32_t) slot.m_scopes.size();
+    uint32_t query = slot.m_query_counts[index]++;
+    slot.m_scopes.push_back({name, m_gpu_depth[index]++, queue, query});
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, slot.m_query_pools[index], query * 2);
+    return scope;
+}
+
+void Profiler::cmd_end_gpu_scope(VkCommandBuffer cmd, uint32_t scope) {
+    if (scope == UINT32_MAX) {
+        return;
+    }
+
+    FrameSlot &slot = m_frame_slots[m_current_slot];
+    const GpuScope &gpu_scope = slot.m_scopes[scope];
+    auto index = (uint32_t) gpu_scope.queue;
+    m_gpu_depth[index]--;
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, slot.m_query_pools[index], gpu_scope.query * 2 + 1);
+}
+
+// Total length covered by the intervals, sorts them
+static double union_length(std::vector<std::pair<double, double>> &intervals) {
+    std::sort(intervals.begin(), intervals.end());
+    double total = 0.0;
+    double covered_until = -DBL_MAX;
+    for (const auto &[begin, end]: intervals) {
+        double from = std::max(begin, covered_until);
+        if (end > from) {
+            total += end - from;
+        }
+        covered_until = std::max(covered_until, end);
+    }
+    return total;
+}
+
+void Profiler::resolve_gpu_slot(FrameSlot &slot) {
+    if (slot.m_scopes.empty()) {
+        return;
+    }
+
+    // The frame's timeline value was reached, so the results are available and we don't need WAIT_BIT
+    std::vector<uint64_t> timestamps[GPU_QUEUE_COUNT];
+    for (uint32_t queue = 0; queue < GPU_QUEUE_COUNT; queue++) {
+        if (!slot.m_reset[queue] || slot.m_query_counts[queue] == 0) {
+            continue;
+        }
+        timestamps[queue].resize(slot.m_query_counts[queue] * 2);
+        VkResult result = vkGetQueryPoolResults(m_device, slot.m_query_pools[queue], 0,
+                                                (uint32_t) timestamps[queue].size(),
+                                                timestamps[queue].size() * sizeof(uint64_t), timestamps[queue].data(),
+                                                sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+        if (result != VK_SUCCESS) {
+            return;
+        }
+    }
+    if (timestamps[(uint32_t) GpuQueue::Graphics].empty()) {
+        return;
+    }
+
+    // In ns from the first graphics timestamp, the compute queue can start before it. The
+    // difference is sign extended from the valid bits so wrapping around doesn't matter.
+    uint64_t reference = timestamps[(uint32_t) GpuQueue::Graphics][0] & m_timestamp_mask;
+    uint64_t sign_bit = (m_timestamp_mask >> 1) + 1;
+    auto to_ns = [&](uint64_t timestamp) {
+        uint64_t ticks = ((timestamp & m_timestamp_mask) - reference) & m_timestamp_mask;
+        auto signed_ticks = (int64_t) ticks;
+        if (m_timestamp_mask != ~0ull && (ticks & sign_bit) != 0) {
+            signed_ticks -= (int64_t) (m_timestamp_mask + 1);
+        }
+        return (double) signed_ticks * m_timestamp_period;
+    };
+
+    std::vector<std::pair<double, double>> intervals(slot.m_scopes.size());
+    double first = DBL_MAX;
+    double last = -DBL_MAX;
+    for (size_t i = 0; i < slot.m_scopes.size(); i++) {
+        const GpuScope &scope = slot.m_scopes[i];
+        const std::vector<uint64_t> &queue_timestamps = timestamps[(uint32_t) scope.queue];
+        intervals[i] = {to_ns(queue_timestamps[scope.query * 2]), to_ns(queue_timestamps[scope.query * 2 + 1])};
+        first = std::min(first, intervals[i].first);
+        last = std::max(last, intervals[i].second);
+    }
+
+    // Innermost scopes: the next scope of the same queue isn't nested in it
+    std::vector<std::pair<double, double>> busy[GPU_QUEUE_COUNT];
+    std::vector<std::pair<double, double>> any_busy;
+    for (size_t i = 0; i < slot.m_scopes.size(); i++) {
+        const GpuScope &scope = slot.m_scopes[i];
+        auto next = std::find_if(slot.m_scopes.begin() + (long) i + 1, slot.m_scopes.end(),
+                                 [&](const GpuScope &other) { return other.queue == scope.queue; });
+        if (next == slot.m_scopes.end() || next->depth <= scope.depth) {
+            busy[(uint32_t) scope.queue].push_back(intervals[i]);
+            any_busy.push_back(intervals[i]);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_events_mutex);
+    for (size_t i = 0; i < slot.m_scopes.size(); i++) {
+        // GPU and CPU clocks aren't calibrated, the GPU events are placed relative to
+        // the moment the frame started recording, which is good enough to read a trace.
+        const GpuScope &scope = slot.m_scopes[i];
+        m_pending_events.push_back({
+                .name = scope.name,
+                .thread_id = scope.queue == GpuQueue::Compute ? GPU_COMPUTE_THREAD_ID : GPU_THREAD_ID,
+                .depth = scope.depth,
+                .start_us = slot.m_cpu_start_us + (uint64_t) ((intervals[i].first - first) / 1000.0),
+                .duration_us = (uint64_t) (std::max(intervals[i].second - intervals[i].first, 0.0) / 1000.0)
+        });
+    }
+
+    m_gpu_frame_stats.push((last - first) / 1000000.0);
+    double busy_total = 0.0;
+    for (uint32_t queue = 0; queue < GPU_QUEUE_COUNT; queue++) {
+        double queue_busy = union_length(busy[queue]);
+        m_gpu_queue_busy_stats[queue].push(queue_busy / 1000000.0);
+        busy_total += queue_busy;
+    }
+    m_gpu_overlap_stats.push((busy_total - union_length(any_busy)) / 1000000.0);
+}
+
+void Profiler::record_cpu_event(const ProfileEvent &event) {
+    std::lock_guard<std::mutex> lock(m_events_mutex);
+    m_pending_events.push_back(event);
+}
+
+uint64_t Profiler::now_us() const {
+    return (steady_now_ns() - m_origin_ns) / 1000;
+}
+
+bool Profiler::export_chrome_trace(const char *file_path) {
+    std::ofstream out(file_path);
+    if (!out.is_open()) {
+        std::cout << "Profiler: couldn't open " << file_path << " for writing" << std::endl;
+        return false;
+    }
+
+    out << "{\"traceEvents\":[\n";
+    out << R"({"name":"thread_name","ph":"M","pid":0,"tid":)" << GPU_THREAD_ID
+        << R"(,"args":{"name":"GPU"}})";
+    out << R"(,
+{"name":"thread_name","ph":"M","pid":0,"tid":)" << GPU_COMPUTE_THREAD_ID
+        << R"(,"args":{"name":"GPU async compute"}})";
+
+    for (const auto &frame: m_trace_frames) {
+        for (const auto &event: frame.m_events) {
+            out << ",\n{\"name\":";
+            write_json_string(out, event.name);
+            bool gpu = event.thread_id == GPU_THREAD_ID || event.thread_id == GPU_COMPUTE_THREAD_ID;
+            out << ",\"cat\":\"" << (gpu ? "gpu" : "cpu") << "\""
+                << ",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.thread_id
+                << ",\"ts\":" << event.start_us
+                << ",\"dur\":" << event.duration_us << "}";
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    std::cout << "Profiler: wrote trace to " << file_path << std::endl;
+    return true;
+}
+
+void Profiler::draw_overlay() {
+    ImGui::SetNextWindowPos(ImVec2(10, 10), ImGuiCond_FirstUseEver);
+    ImGui::SetNextWindowSize(ImVec2(420, 360), ImGuiCond_FirstUseEver);
+    if (!ImGui::Begin("Profiler")) {
+        ImGui::End();
+        return;
+    }
+
+    ImGui::Checkbox("Enabled", &m_enabled);
+    ImGui::SameLine();
+    if (ImGui::Button("Export chrome trace")) {
+        export_chrome_trace("vk_engine_trace.json");
+    }
+
+    ImGui::Text("CPU frame: %.3f ms (min %.3f, avg %.3f, p99 %.3f)", m_cpu_frame_stats.last(),
+                m_cpu_frame_stats.min(), m_cpu_frame_stats.avg(), m_cpu_frame_stats.percentile(0.99));
+    if (m_gpu_supported) {
+        ImGui::Text("GPU frame: %.3f ms (min %.3f, avg %.3f, p99 %.3f)", m_gpu_frame_stats.last(),
+                    m_gpu_frame_stats.min(), m_gpu_frame_stats.avg(), m_gpu_frame_stats.percentile(0.99));
+    } else {
+        ImGui::TextUnformatted("GPU timestamps unsupported");
+    }
+    // Only once something ran on the compute queue
+    const RollingStats &compute_busy = m_gpu_queue_busy_stats[(uint32_t) GpuQueue::Compute];
+    if (m_queue_supported[(uint32_t) GpuQueue::Compute] && compute_busy.max() > 0.0) {
+        ImGui::Text("GPU busy: graphics %.3f ms, compute %.3f ms, overlapping %.3f ms (avg)",
+                    m_gpu_queue_busy_stats[(uint32_t) GpuQueue::Graphics].avg(), compute_busy.avg(),
+                    m_gpu_overlap_stats.avg());
+    }
+
+    // PlotLines wants floats in chronological order
+    std::vector<float> history;
+    history.reserve(m_cpu_frame_stats.m_count);
+    size_t oldest = m_cpu_frame_stats.m_count < m_cpu_frame_stats.m_samples.size() ? 0 : m_cpu_frame_stats.m_head;
+    for (size_t i = 0; i < m_cpu_frame_stats.m_count; i++) {
+        history.push_back((float) m_cpu_frame_stats.m_samples[(oldest + i) % m_cpu_frame_stats.m_samples.size()]);
+    }
+    ImGui::PlotLines("CPU ms", history.data(), (int) history.size(), 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 60));
+
+    std::vector<const std::string *> names;
+    names.reserve(m_scope_stats.size());
+    for (const auto &[name, stats]: m_scope_stats) {
+        names.push_back(&name);
+    }
+    std::sort(names.begin(), names.end(), [](const std::string *a, const std::string *b) { return *a < *b; });
+
+    // Columns by hand, the vendored imgui is built without the table API
+    const float column_width = ImGui::GetFontSize() * 5.f;
+    const float first_column_width = ImGui::GetFontSize() * 14.f;
+    auto row = [&](const char *name, const char *last, const char *min, const char *avg, const char *p99) {
+        ImGui::TextUnformatted(name);
+        const char *values[] = {last, min, avg, p99};
+        for (uint32_t i = 0; i < 4; i++) {
+            ImGui::SameLine(first_column_width + column_width * (float) i);
+            ImGui::TextUnformatted(values[i]);
+        }
+    };
+
+    row("Scope", "Last", "Min", "Avg", "p99");
+    ImGui::Separator();
+    ImGui::BeginChild("scopes");
+    char last[32], min[32], avg[32], p99[32];
+    for (const std::string *name: names) {
+        const RollingStats &stats = m_scope_stats[*name];
+        snprintf(last, sizeof(last), "%.3f", stats.last());
+        snprintf(min, sizeof(min), "%.3f", stats.min());
+        snprintf(avg, sizeof(avg), "%.3f", stats.avg());
+        snprintf(p99, sizeof(p99), "%.3f", stats.percentile(0.99));
+        row(name->c_str(), last, min, avg, p99);
+    }
+    ImGui::EndChild();
+
+    ImGui::End();
+}
+
+ProfileScope::ProfileScope(Profiler &profiler, const char *name)
+        : m_profiler(profiler), m_name(name), m_start_us(profiler.now_us()), m_depth(t_depth++) {
+}
+
+ProfileScope::~ProfileScope() {
+    t_depth--;
+    if (!m_profiler.m_enabled) {
+        return;
+    }
+
+    m_profiler.record_cpu_event({
+            .name = m_name,
+            .thread_id = t_thread_id,
+            .depth = m_depth,
+            .start_us = m_start_us,
+            .duration_us = m_profiler.now_us() - m_start_us
+    });
+}
+
+GpuProfileScope::GpuProfileScope(Profiler &profiler, VkCommandBuffer cmd, const char *name)
+        : m_profiler(profiler), m_cmd(cmd), m_scope(profiler.cmd_begin_gpu_scope(cmd, name)) {
+}
+
+GpuProfileScope::~GpuProfileScope() {
+    m_profiler.cmd_end_gpu_scope(m_cmd, m_scope);
+}
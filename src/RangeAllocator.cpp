@@ -0,0 +1,97 @@
+#include "RangeAllocator.h"
+
+void RangeAllocator::init(uint32_t capacity) {
+    m_capacity = capacity;
+    m_used = 0;
+    m_free_by_offset.clear();
+    m_free_by_size.clear();
+
+    if (capacity > 0) {
+        insert_free(0, capacity);
+    }
+}
+
+bool RangeAllocator::allocate(uint32_t size, uint32_t *out_offset) {
+    if (size == 0) {
+        *out_offset = 0;
+        return true;
+    }
+
+    // Smallest free range that fits
+    auto it = m_free_by_size.lower_bound(size);
+    if (it == m_free_by_size.end()) {
+        return false;
+    }
+
+    uint32_t free_size = it->first;
+    uint32_t free_offset = it->second;
+    erase_free(free_offset, free_size);
+
+    if (free_size > size) {
+        insert_free(free_offset + size, free_size - size);
+    }
+
+    m_used += size;
+    *out_offset = free_offset;
+    return true;
+}
+
+void RangeAllocator::free(uint32_t offset, uint32_t size) {
+    if (size == 0) {
+        return;
+    }
+
+    m_used -= size;
+
+    // Merge with the free range right after
+    auto next = m_free_by_offset.find(offset + size);
+    if (next != m_free_by_offset.end()) {
+        uint32_t next_size = next->second;
+        erase_free(offset + size, next_size);
+        size += next_size;
+    }
+
+    // And with the one right before
+    auto prev = m_free_by_offset.lower_bound(offset);
+    if (prev != m_free_by_offset.begin()) {
+        prev--;
+        if (prev->first + prev->second == offset) {
+            uint32_t prev_offset = prev->first;
+            uint32_t prev_size = prev->second;
+            erase_free(prev_offset, prev_size);
+            offset = prev_offset;
+            size += prev_size;
+        }
+    }
+
+    insert_free(offset, size);
+}
+
+uint32_t RangeAllocator::largest_free_range() const {
+    return m_free_by_size.empty() ? 0 : m_free_by_size.rbegin()->first;
+}
+
+float RangeAllocator::fragmentation() const {
+    uint32_t free_space = m_capacity - m_used;
+    if (free_space == 0) {
+        return 0.0f;
+    }
+    return 1.0f - (float) largest_free_range() / (float) free_space;
+}
+
+void RangeAllocator::insert_free(uint32_t offset, uint32_t size) {
+    m_free_by_offset[offset] = size;
+    m_free_by_size.emplace(size, offset);
+}
+
+void RangeAllocator::erase_free(uint32_t offset, uint32_t size) {
+    m_free_by_offset.erase(offset);
+
+    auto [begin, end] = m_free_by_size.equal_range(size);
+    for (auto it = begin; it != end; it++) {
+        if (it->second == offset) {
+            m_free_by_size.erase(it);
+            return;
+        }
+    }
+}
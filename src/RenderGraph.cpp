@@ -0,0 +1,837 @@
+#include "RenderGraph.h"
+
+#include <Initializers.h>
+
+#include <algorithm>
+
+constexpr uint32_t NO_PASS = UINT32_MAX;
+constexpr uint32_t NO_BATCH = UINT32_MAX;
+
+constexpr VkAccessFlags2 WRITE_ACCESS = VK_ACCESS_2_SHADER_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT |
+                                        VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT |
+                                        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+                                        VK_ACCESS_2_TRANSFER_WRITE_BIT | VK_ACCESS_2_HOST_WRITE_BIT |
+                                        VK_ACCESS_2_MEMORY_WRITE_BIT;
+
+static bool is_write(const RenderGraphAccess &access) {
+    return (access.m_access & WRITE_ACCESS) != 0;
+}
+
+static bool is_read(const RenderGraphAccess &access) {
+    return (access.m_access & ~WRITE_ACCESS) != 0;
+}
+
+// Its command buffers are recycled one by one
+static VkCommandPool create_command_pool(VkDevice device, uint32_t queue_family) {
+    VkCommandPoolCreateInfo pool_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+            .queueFamilyIndex = queue_family
+    };
+    VkCommandPool pool;
+    VK_CHECK(vkCreateCommandPool(device, &pool_info, nullptr, &pool))
+    return pool;
+}
+
+static VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+void RenderGraph::init(VkDevice device, VmaAllocator allocator, MemoryBudget *memory_budget, GpuTimeline *timeline,
+                       TimelineDeletionQueue *deletion_queue, Profiler *profiler) {
+    m_device = device;
+    m_allocator = allocator;
+    m_memory_budget = memory_budget;
+    m_timeline = timeline;
+    m_deletion_queue = deletion_queue;
+    m_profiler = profiler;
+
+    m_command_pools[(uint32_t) GpuQueue::Graphics] = create_command_pool(m_device, timeline->m_queue_family);
+}
+
+void RenderGraph::set_async_compute(GpuTimeline *compute_timeline) {
+    m_compute_timeline = compute_timeline;
+
+    m_command_pools[(uint32_t) GpuQueue::Compute] = create_command_pool(m_device, compute_timeline->m_queue_family);
+}
+
+void RenderGraph::cleanup() {
+    for (const TransientImage &transient: m_transients) {
+        destroy_transient(transient);
+    }
+    for (VmaAllocation allocation: m_transient_memory) {
+        m_memory_budget->untrack(allocation);
+        vmaFreeMemory(m_allocator, allocation);
+    }
+    m_transients.clear();
+    m_transient_memory.clear();
+    m_has_compiled = false;
+    m_prepared = false;
+
+    // Frees their command buffers too
+    for (uint32_t queue = 0; queue < GPU_QUEUE_COUNT; queue++) {
+        if (m_command_pools[queue] != VK_NULL_HANDLE) {
+            vkDestroyCommandPool(m_device, m_command_pools[queue], nullptr);
+            m_command_pools[queue] = VK_NULL_HANDLE;
+        }
+        m_command_buffers[queue].clear();
+    }
+}
+
+void RenderGraph::begin() {
+    m_declaration.m_resources.clear();
+    m_declaration.m_passes.clear();
+    m_pass_names.clear();
+    m_records.clear();
+    m_imported_images.clear();
+    m_imported_views.clear();
+    m_waits.clear();
+    m_prepared = false;
+}
+
+RenderGraph::Resource RenderGraph::import_image(const char *name, VkImage image, VkImageView view,
+                                                VkImageAspectFlags aspect, const RenderGraphAccess &initial,
+                                                const RenderGraphAccess &final) {
+    m_declaration.m_resources.push_back({
+            .m_name = name,
+            .m_kind = ResourceKind::ImportedImage,
+            .m_aspect = aspect,
+            .m_initial = initial,
+            .m_final = final
+    });
+    m_imported_images.push_back(image);
+    m_imported_views.push_back(view);
+    return (Resource) m_declaration.m_resources.size() - 1;
+}
+
+RenderGraph::Resource RenderGraph::import_buffer(const char *name, const RenderGraphAccess &initial) {
+    m_declaration.m_resources.push_back({
+            .m_name = name,
+            .m_kind = ResourceKind::ImportedBuffer,
+            .m_initial = initial
+    });
+    m_imported_images.push_back(VK_NULL_HANDLE);
+    m_imported_views.push_back(VK_NULL_HANDLE);
+    return (Resource) m_declaration.m_resources.size() - 1;
+}
+
+RenderGraph::Resource RenderGraph::create_image(const char *name, const RenderGraphImageDesc &desc) {
+    m_declaration.m_resources.push_back({
+            .m_name = name,
+            .m_kind = ResourceKind::TransientImage,
+            .m_aspect = desc.m_aspect,
+            .m_image = desc
+    });
+    m_imported_images.push_back(VK_NULL_HANDLE);
+    m_imported_views.push_back(VK_NULL_HANDLE);
+    return (Resource) m_declaration.m_resources.size() - 1;
+}
+
+RenderGraph::Resource RenderGraph::create_buffer(const char *name) {
+    m_declaration.m_resources.push_back({
+            .m_name = name,
+            .m_kind = ResourceKind::TransientBuffer
+    });
+    m_imported_images.push_back(VK_NULL_HANDLE);
+    m_imported_views.push_back(VK_NULL_HANDLE);
+    return (Resource) m_declaration.m_resources.size() - 1;
+}
+
+RenderGraph::Pass RenderGraph::add_pass(const char *name, RecordFunction &&record, GpuQueue queue) {
+    m_declaration.m_passes.push_back({
+            .m_name = name,
+            .m_queue = m_compute_timeline ? queue : GpuQueue::Graphics
+    });
+    m_pass_names.push_back(name);
+    m_records.push_back(std::move(record));
+    return (Pass) m_declaration.m_passes.size() - 1;
+}
+
+void RenderGraph::use(Pass pass, Resource resource, const RenderGraphAccess &access) {
+    std::vector<ResourceUse> &uses = m_declaration.m_passes[pass].m_uses;
+
+    // Used twice by the same pass, it must be in a single layout
+    auto it = std::find_if(uses.begin(), uses.end(), [=](const ResourceUse &use) {
+        return use.m_resource == resource;
+    });
+    if (it != uses.end()) {
+        if (it->m_access.m_layout != access.m_layout) {
+            std::cout << "Pass " << m_declaration.m_passes[pass].m_name << " uses "
+                      << m_declaration.m_resources[resource].m_name << " in two layouts" << std::endl;
+            abort();
+        }
+        it->m_access.m_stages |= access.m_stages;
+        it->m_access.m_access |= access.m_access;
+        return;
+    }
+
+    uses.push_back({resource, access});
+}
+
+void RenderGraph::wait_before(Resource resource, const SemaphoreWait &wait) {
+    m_waits.emplace_back(resource, wait);
+}
+
+void RenderGraph::prepare() {
+    if (!m_has_compiled || !(m_declaration == m_compiled)) {
+        compile();
+        m_compiled = m_declaration;
+        m_has_compiled = true;
+        m_stats.m_compiles++;
+    }
+    m_prepared = true;
+}
+
+void RenderGraph::execute(VkCommandBuffer cmd) {
+    if (!m_prepared) {
+        prepare();
+    }
+
+    m_stats.m_passes = (uint32_t) m_declaration.m_passes.size();
+    m_stats.m_culled_passes = (uint32_t) std::count(m_pass_alive.begin(), m_pass_alive.end(), false);
+    m_stats.m_compute_passes = 0;
+    m_stats.m_submissions = (uint32_t) m_batches.size();
+    m_stats.m_barrier_batches = 0;
+    m_stats.m_barriers = 0;
+
+    m_batch_commands.assign(m_batches.size(), VK_NULL_HANDLE);
+    m_batch_command_indices.assign(m_batches.size(), UINT32_MAX);
+    bool compute_queries_reset = false;
+    for (uint32_t batch = 0; batch < m_batches.size(); batch++) {
+        const Batch &desc = m_batches[batch];
+        VkCommandBuffer batch_cmd = batch == 0 ? cmd : begin_command_buffer(desc.m_queue,
+                                                                            m_batch_command_indices[batch]);
+        m_batch_commands[batch] = batch_cmd;
+
+        // The graphics queries were reset by the caller, with the start of the frame
+        if (desc.m_queue == GpuQueue::Compute && !compute_queries_reset && m_profiler) {
+            m_profiler->cmd_reset_queries(batch_cmd, GpuQueue::Compute);
+            compute_queries_reset = true;
+        }
+
+        for (Pass pass: desc.m_passes) {
+            record_barriers(batch_cmd, m_pass_barriers[pass]);
+
+            uint32_t scope = m_profiler ? m_profiler->cmd_begin_gpu_scope(batch_cmd, m_pass_names[pass], desc.m_queue) : 0;
+            m_records[pass](batch_cmd);
+            if (m_profiler) {
+                m_profiler->cmd_end_gpu_scope(batch_cmd, scope);
+            }
+        }
+        if (desc.m_queue == GpuQueue::Compute) {
+            m_stats.m_compute_passes += (uint32_t) desc.m_passes.size();
+        }
+
+        record_barriers(batch_cmd, desc.m_releases);
+        if (batch == m_last_graphics_batch) {
+            record_barriers(batch_cmd, m_final_barriers);
+        }
+    }
+}
+
+uint64_t RenderGraph::submit(const std::vector<VkSemaphore> &binary_signals) {
+    // Work from earlier frames and uploads, the compute queue doesn't see it otherwise
+    uint64_t graphics_before = m_timeline->last_submitted_value();
+
+    std::vector<uint64_t> values(m_batches.size(), 0);
+    for (uint32_t batch = 0; batch < m_batches.size(); batch++) {
+        const Batch &desc = m_batches[batch];
+        VkCommandBuffer cmd = m_batch_commands[batch];
+        VK_CHECK(vkEndCommandBuffer(cmd))
+
+        std::vector<SemaphoreWait> waits;
+        for (const auto &[resource, wait]: m_waits) {
+            uint32_t first_batch = m_first_batch[resource] == NO_BATCH ? 0 : m_first_batch[resource];
+            if (first_batch == batch) {
+                waits.push_back(wait);
+            }
+        }
+        // All commands wait, the acquire barriers rely on it
+        GpuQueue other = desc.m_queue == GpuQueue::Graphics ? GpuQueue::Compute : GpuQueue::Graphics;
+        if (desc.m_wait != NO_BATCH) {
+            waits.push_back(timeline(other)->wait_info(values[desc.m_wait], VK_PIPELINE_STAGE_ALL_COMMANDS_BIT));
+        } else if (desc.m_queue == GpuQueue::Compute) {
+            waits.push_back(m_timeline->wait_info(graphics_before, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT));
+        }
+
+        values[batch] = timeline(desc.m_queue)->submit({cmd}, waits, 0, batch == m_last_graphics_batch ?
+                                                                        binary_signals : std::vector<VkSemaphore>{});
+        if (m_batch_command_indices[batch] != UINT32_MAX) {
+            m_command_buffers[(uint32_t) desc.m_queue][m_batch_command_indices[batch]].m_retire_value = values[batch];
+        }
+    }
+
+    return values[m_last_graphics_batch];
+}
+
+VkImage RenderGraph::image(Resource resource) const {
+    if (m_declaration.m_resources[resource].m_kind == ResourceKind::TransientImage) {
+        return m_transients[resource].m_image;
+    }
+    return m_imported_images[resource];
+}
+
+VkImageView RenderGraph::view(Resource resource) const {
+    if (m_declaration.m_resources[resource].m_kind == ResourceKind::TransientImage) {
+        return m_transients[resource].m_view;
+    }
+    return m_imported_views[resource];
+}
+
+VkImageView RenderGraph::level_view(Resource resource, uint32_t level) const {
+    const TransientImage &transient = m_transients[resource];
+    return transient.m_level_views.empty() ? transient.m_view : transient.m_level_views[level];
+}
+
+void RenderGraph::compile() {
+    const std::vector<ResourceDesc> &resources = m_declaration.m_resources;
+    const std::vector<PassDesc> &passes = m_declaration.m_passes;
+
+    // Culling, walking back from the outputs. A pass is kept if it writes an imported resource,
+    // or something a kept pass after it reads.
+    m_pass_alive.assign(passes.size(), false);
+    std::vector<bool> needed(resources.size(), false);
+    for (size_t pass = passes.size(); pass-- > 0;) {
+        bool alive = false;
+        for (const ResourceUse &use: passes[pass].m_uses) {
+            ResourceKind kind = resources[use.m_resource].m_kind;
+            bool imported = kind == ResourceKind::ImportedImage || kind == ResourceKind::ImportedBuffer;
+            if (is_write(use.m_access) && (imported || needed[use.m_resource])) {
+                alive = true;
+            }
+        }
+        if (!alive) {
+            continue;
+        }
+
+        m_pass_alive[pass] = true;
+        for (const ResourceUse &use: passes[pass].m_uses) {
+            if (is_read(use.m_access)) {
+                needed[use.m_resource] = true;
+            }
+        }
+    }
+
+    // Lifetimes in pass indices, only counting the kept passes
+    std::vector<uint32_t> first_use(resources.size(), NO_PASS);
+    std::vector<uint32_t> last_use(resources.size(), NO_PASS);
+    for (uint32_t pass = 0; pass < passes.size(); pass++) {
+        if (!m_pass_alive[pass]) {
+            continue;
+        }
+        for (const ResourceUse &use: passes[pass].m_uses) {
+            if (first_use[use.m_resource] == NO_PASS) {
+                first_use[use.m_resource] = pass;
+            }
+            last_use[use.m_resource] = pass;
+        }
+    }
+
+    // Memory shared by images of both queues would need both queues to wait on each other, the
+    // images used on compute get their own by living the whole frame
+    std::vector<uint32_t> alias_first_use = first_use;
+    std::vector<uint32_t> alias_last_use = last_use;
+    for (uint32_t pass = 0; pass < passes.size(); pass++) {
+        if (!m_pass_alive[pass] || passes[pass].m_queue != GpuQueue::Compute) {
+            continue;
+        }
+        for (const ResourceUse &use: passes[pass].m_uses) {
+            alias_first_use[use.m_resource] = 0;
+            alias_last_use[use.m_resource] = (uint32_t) passes.size();
+        }
+    }
+    allocate_transients(alias_first_use, alias_last_use);
+
+    // How each resource was last used, the next use waits on it
+    struct State {
+        VkImageLayout m_layout;
+        // Last write (or layout transition), and the reads since then
+        VkPipelineStageFlags2 m_write_stages;
+        VkAccessFlags2 m_write_access;
+        VkPipelineStageFlags2 m_read_stages;
+        // What the last write was already made visible to
+        VkPipelineStageFlags2 m_visible_stages;
+        VkAccessFlags2 m_visible_access;
+        // Queue and batch of the last use, the frame starts on graphics
+        GpuQueue m_queue;
+        uint32_t m_batch;
+    };
+
+    auto last_access = [&](Resource resource) {
+        RenderGraphAccess access;
+        for (const ResourceUse &use: passes[last_use[resource]].m_uses) {
+            if (use.m_resource == resource) {
+                access = use.m_access;
+            }
+        }
+        return access;
+    };
+
+    std::vector<State> states(resources.size());
+    for (Resource resource = 0; resource < resources.size(); resource++) {
+        const ResourceDesc &desc = resources[resource];
+        State &state = states[resource];
+        state = {
+                .m_layout = desc.m_initial.m_layout,
+                .m_write_stages = desc.m_initial.m_stages,
+                .m_write_access = desc.m_initial.m_access & WRITE_ACCESS,
+                .m_read_stages = VK_PIPELINE_STAGE_2_NONE,
+                .m_visible_stages = VK_PIPELINE_STAGE_2_NONE,
+                .m_visible_access = VK_ACCESS_2_NONE,
+                .m_queue = GpuQueue::Graphics,
+                .m_batch = 0
+        };
+
+        if (desc.m_kind != ResourceKind::TransientImage || first_use[resource] == NO_PASS) {
+            continue;
+        }
+
+        // Its memory was last used by the images sharing it, here or in the previous frame. The
+        // layout is undefined so there is nothing to make visible, but they must be done.
+        const TransientImage &transient = m_transients[resource];
+        state.m_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        for (Resource other = 0; other < resources.size(); other++) {
+            const TransientImage &other_transient = m_transients[other];
+            if (other_transient.m_image == VK_NULL_HANDLE || other_transient.m_memory != transient.m_memory ||
+                other_transient.m_offset >= transient.m_offset + transient.m_size ||
+                transient.m_offset >= other_transient.m_offset + other_transient.m_size) {
+                continue;
+            }
+            RenderGraphAccess access = last_access(other);
+            state.m_write_stages |= access.m_stages;
+            state.m_write_access |= access.m_access & WRITE_ACCESS;
+        }
+    }
+
+    auto make_barrier = [](Resource resource, VkPipelineStageFlags2 src_stages, VkAccessFlags2 src_access,
+                           const RenderGraphAccess &dst, VkImageLayout old_layout, VkImageLayout new_layout) {
+        return Barrier{
+                .m_resource = resource,
+                .m_src_stages = src_stages,
+                .m_src_access = src_access,
+                .m_dst_stages = dst.m_stages,
+                .m_dst_access = dst.m_access,
+                .m_old_layout = old_layout,
+                .m_new_layout = new_layout
+        };
+    };
+
+    auto is_image = [&](Resource resource) {
+        ResourceKind kind = resources[resource].m_kind;
+        return kind == ResourceKind::ImportedImage || kind == ResourceKind::TransientImage;
+    };
+
+    // Ownership of an image with content goes from the batch that last used it to the other
+    // queue. Both barriers must do the same layout transition.
+    auto transfer = [&](Resource resource, State &state, GpuQueue queue, VkImageLayout new_layout,
+                        const RenderGraphAccess &dst, std::vector<Barrier> &acquires) {
+        Barrier release = make_barrier(resource, state.m_write_stages | state.m_read_stages, state.m_write_access,
+                                       {}, state.m_layout, new_layout);
+        release.m_transfer = true;
+        release.m_src_queue = state.m_queue;
+        release.m_dst_queue = queue;
+        m_batches[state.m_batch].m_releases.push_back(release);
+
+        // The submission waits on the release with every command, the acquire chains on its own stages
+        Barrier acquire = make_barrier(resource, dst.m_stages, VK_ACCESS_2_NONE, dst, state.m_layout, new_layout);
+        acquire.m_transfer = true;
+        acquire.m_src_queue = state.m_queue;
+        acquire.m_dst_queue = queue;
+        acquires.push_back(acquire);
+        m_stats.m_queue_transfers++;
+    };
+
+    m_stats.m_queue_transfers = 0;
+    m_pass_barriers.assign(passes.size(), {});
+    m_batches.clear();
+    m_batches.push_back({.m_queue = GpuQueue::Graphics, .m_wait = NO_BATCH});
+    m_first_batch.assign(resources.size(), NO_BATCH);
+    // Batch each queue adds its passes to, a batch closes once the other queue waits on it
+    uint32_t open_batches[GPU_QUEUE_COUNT] = {0, NO_BATCH};
+    for (uint32_t pass = 0; pass < passes.size(); pass++) {
+        if (!m_pass_alive[pass]) {
+            continue;
+        }
+
+        // The latest batch of the other queue that touched what the pass uses
+        GpuQueue queue = passes[pass].m_queue;
+        auto other = (uint32_t) (queue == GpuQueue::Graphics ? GpuQueue::Compute : GpuQueue::Graphics);
+        uint32_t wait = NO_BATCH;
+        for (const ResourceUse &use: passes[pass].m_uses) {
+            const State &state = states[use.m_resource];
+            bool pending = state.m_write_stages != VK_PIPELINE_STAGE_2_NONE ||
+                           state.m_read_stages != VK_PIPELINE_STAGE_2_NONE ||
+                           (is_image(use.m_resource) && state.m_layout != VK_IMAGE_LAYOUT_UNDEFINED);
+            if (state.m_queue != queue && pending) {
+                wait = wait == NO_BATCH ? state.m_batch : std::max(wait, state.m_batch);
+            }
+        }
+
+        // A new batch when the open one doesn't already wait on it, waiting later would hold
+        // back the passes in it
+        uint32_t &batch = open_batches[(uint32_t) queue];
+        if (batch == NO_BATCH || (wait != NO_BATCH && (m_batches[batch].m_wait == NO_BATCH ||
+                                                       m_batches[batch].m_wait < wait))) {
+            m_batches.push_back({.m_queue = queue, .m_wait = wait});
+            batch = (uint32_t) m_batches.size() - 1;
+        }
+        if (wait != NO_BATCH && open_batches[other] == wait) {
+            open_batches[other] = NO_BATCH;
+        }
+        m_batches[batch].m_passes.push_back(pass);
+
+        for (const ResourceUse &use: passes[pass].m_uses) {
+            State &state = states[use.m_resource];
+            bool image = is_image(use.m_resource);
+            const RenderGraphAccess &access = use.m_access;
+            if (m_first_batch[use.m_resource] == NO_BATCH) {
+                m_first_batch[use.m_resource] = batch;
+            }
+
+            if (state.m_queue != queue) {
+                // The semaphore makes the other queue's writes visible, only images need barriers:
+                // an ownership transfer when they have content, a layout transition otherwise
+                if (image && state.m_layout != VK_IMAGE_LAYOUT_UNDEFINED) {
+                    transfer(use.m_resource, state, queue, access.m_layout, access, m_pass_barriers[pass]);
+                } else if (image) {
+                    m_pass_barriers[pass].push_back(make_barrier(use.m_resource, access.m_stages, VK_ACCESS_2_NONE,
+                                                                 access, VK_IMAGE_LAYOUT_UNDEFINED, access.m_layout));
+                }
+
+                state = {
+                        .m_layout = image ? access.m_layout : state.m_layout,
+                        .m_write_stages = access.m_stages,
+                        .m_write_access = access.m_access & WRITE_ACCESS,
+                        .m_read_stages = VK_PIPELINE_STAGE_2_NONE,
+                        .m_visible_stages = access.m_stages,
+                        .m_visible_access = access.m_access,
+                        .m_queue = queue,
+                        .m_batch = batch
+                };
+                continue;
+            }
+            state.m_batch = batch;
+
+            bool layout_change = image && access.m_layout != state.m_layout;
+            if (is_write(access) || layout_change) {
+                // Waits for the last write and every read since, nothing to wait on the first time
+                VkPipelineStageFlags2 src_stages = state.m_write_stages | state.m_read_stages;
+                if (src_stages != VK_PIPELINE_STAGE_2_NONE || layout_change) {
+                    m_pass_barriers[pass].push_back(make_barrier(use.m_resource, src_stages, state.m_write_access,
+                                                                 access, state.m_layout,
+                                                                 image ? access.m_layout : state.m_layout));
+                }
+
+                // A layout transition counts as a write the next uses must wait on
+                state = {
+                        .m_layout = image ? access.m_layout : state.m_layout,
+                        .m_write_stages = access.m_stages,
+                        .m_write_access = access.m_access & WRITE_ACCESS,
+                        .m_read_stages = VK_PIPELINE_STAGE_2_NONE,
+                        .m_visible_stages = access.m_stages,
+                        .m_visible_access = access.m_access,
+                        .m_queue = queue,
+                        .m_batch = batch
+                };
+            } else {
+                // Reading in the same layout, only needs the last write to be visible here
+                bool visible = (access.m_stages & ~state.m_visible_stages) == 0 &&
+                               (access.m_access & ~state.m_visible_access) == 0;
+                if (!visible && state.m_write_stages != VK_PIPELINE_STAGE_2_NONE) {
+                    m_pass_barriers[pass].push_back(make_barrier(use.m_resource, state.m_write_stages,
+                                                                 state.m_write_access, access, state.m_layout,
+                                                                 state.m_layout));
+                    state.m_visible_stages |= access.m_stages;
+                    state.m_visible_access |= access.m_access;
+                }
+                state.m_read_stages |= access.m_stages;
+            }
+        }
+    }
+
+    // The frame ends on graphics once all the compute work is done, in a last batch of its own
+    // if the last graphics one doesn't wait on it already
+    m_last_graphics_batch = 0;
+    uint32_t last_compute_batch = NO_BATCH;
+    for (uint32_t batch = 0; batch < m_batches.size(); batch++) {
+        (m_batches[batch].m_queue == GpuQueue::Graphics ? m_last_graphics_batch : last_compute_batch) = batch;
+    }
+    if (last_compute_batch != NO_BATCH && m_batches[m_last_graphics_batch].m_wait != last_compute_batch) {
+        m_batches.push_back({.m_queue = GpuQueue::Graphics, .m_wait = last_compute_batch});
+        m_last_graphics_batch = (uint32_t) m_batches.size() - 1;
+    }
+
+    // Imported images handed back to graphics, in the layout they are expected in
+    m_final_barriers.clear();
+    for (Resource resource = 0; resource < resources.size(); resource++) {
+        const ResourceDesc &desc = resources[resource];
+        State &state = states[resource];
+        if (desc.m_kind != ResourceKind::ImportedImage) {
+            continue;
+        }
+
+        VkImageLayout final_layout = desc.m_final.m_layout == VK_IMAGE_LAYOUT_UNDEFINED ? state.m_layout :
+                                     desc.m_final.m_layout;
+        if (state.m_queue != GpuQueue::Graphics && state.m_layout != VK_IMAGE_LAYOUT_UNDEFINED) {
+            transfer(resource, state, GpuQueue::Graphics, final_layout, desc.m_final, m_final_barriers);
+        } else if (desc.m_final.m_layout != VK_IMAGE_LAYOUT_UNDEFINED) {
+            m_final_barriers.push_back(make_barrier(resource, state.m_write_stages | state.m_read_stages,
+                                                    state.m_write_access, desc.m_final, state.m_layout,
+                                                    desc.m_final.m_layout));
+        }
+    }
+}
+
+void RenderGraph::allocate_transients(const std::vector<uint32_t> &first_use, const std::vector<uint32_t> &last_use) {
+    retire_transients();
+
+    const std::vector<ResourceDesc> &resources = m_declaration.m_resources;
+    m_transients.assign(resources.size(), {});
+    m_stats.m_transient_bytes = 0;
+    m_stats.m_transient_unaliased_bytes = 0;
+
+    // Only the images a kept pass uses
+    std::vector<Resource> images;
+    std::vector<VkMemoryRequirements> requirements(resources.size());
+    for (Resource resource = 0; resource < resources.size(); resource++) {
+        const ResourceDesc &desc = resources[resource];
+        if (desc.m_kind != ResourceKind::TransientImage || first_use[resource] == NO_PASS) {
+            continue;
+        }
+
+        VkImageCreateInfo image_info = Initializers::image_create_info(desc.m_image.m_format, desc.m_image.m_usage,
+                                                                       {desc.m_image.m_extent.width,
+                                                                        desc.m_image.m_extent.height, 1});
+        image_info.arrayLayers = desc.m_image.m_layers;
+        image_info.mipLevels = desc.m_image.m_levels;
+        VK_CHECK(vkCreateImage(m_device, &image_info, nullptr, &m_transients[resource].m_image))
+        vkGetImageMemoryRequirements(m_device, m_transients[resource].m_image, &requirements[resource]);
+
+        images.push_back(resource);
+        m_stats.m_transient_unaliased_bytes += requirements[resource].size;
+    }
+
+    // Biggest first, each at the lowest offset where it doesn't overlap an image living at the same time
+    std::sort(images.begin(), images.end(), [&](Resource a, Resource b) {
+        return requirements[a].size > requirements[b].size;
+    });
+
+    struct Memory {
+        uint32_t m_type_bits;
+        VkDeviceSize m_size;
+        VkDeviceSize m_alignment;
+        std::vector<Resource> m_images;
+    };
+    std::vector<Memory> memories;
+
+    for (Resource resource: images) {
+        const VkMemoryRequirements &requirement = requirements[resource];
+        TransientImage &transient = m_transients[resource];
+        transient.m_size = requirement.size;
+
+        auto lifetimes_overlap = [&](Resource other) {
+            return first_use[resource] <= last_use[other] && first_use[other] <= last_use[resource];
+        };
+
+        auto memory = std::find_if(memories.begin(), memories.end(), [&](const Memory &candidate) {
+            return (candidate.m_type_bits & requirement.memoryTypeBits) != 0;
+        });
+        if (memory == memories.end()) {
+            memories.push_back({requirement.memoryTypeBits, 0, 1, {}});
+            memory = memories.end() - 1;
+        }
+
+        // Pushed past every image in the way until nothing overlaps
+        VkDeviceSize offset = 0;
+        bool moved = true;
+        while (moved) {
+            moved = false;
+            for (Resource other: memory->m_images) {
+                const TransientImage &placed = m_transients[other];
+                if (lifetimes_overlap(other) && offset < placed.m_offset + placed.m_size &&
+                    placed.m_offset < offset + transient.m_size) {
+                    offset = align_up(placed.m_offset + placed.m_size, requirement.alignment);
+                    moved = true;
+                }
+            }
+        }
+
+        transient.m_memory = (uint32_t) (memory - memories.begin());
+        transient.m_offset = offset;
+        memory->m_type_bits &= requirement.memoryTypeBits;
+        memory->m_size = std::max(memory->m_size, offset + transient.m_size);
+        memory->m_alignment = std::max(memory->m_alignment, requirement.alignment);
+        memory->m_images.push_back(resource);
+    }
+
+    for (const Memory &memory: memories) {
+        VkMemoryRequirements memory_requirements = {
+                .size = memory.m_size,
+                .alignment = memory.m_alignment,
+                .memoryTypeBits = memory.m_type_bits
+        };
+        VmaAllocationCreateInfo allocation_info = {};
+        allocation_info.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+
+        VmaAllocation allocation;
+        VK_CHECK(vmaAllocateMemory(m_allocator, &memory_requirements, &allocation_info, &allocation, nullptr))
+        m_memory_budget->track(allocation, MemoryCategory::RenderTarget);
+        m_transient_memory.push_back(allocation);
+        m_stats.m_transient_bytes += memory.m_size;
+
+        for (Resource resource: memory.m_images) {
+            TransientImage &transient = m_transients[resource];
+            VK_CHECK(vmaBindImageMemory2(m_allocator, allocation, transient.m_offset, transient.m_image, nullptr))
+
+            const RenderGraphImageDesc &desc = resources[resource].m_image;
+            VkImageViewCreateInfo view_info = Initializers::imageview_create_info(desc.m_format, transient.m_image,
+                                                                                  desc.m_aspect);
+            if (desc.m_layers > 1) {
+                view_info.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+                view_info.subresourceRange.layerCount = desc.m_layers;
+            }
+            view_info.subresourceRange.levelCount = desc.m_levels;
+            VK_CHECK(vkCreateImageView(m_device, &view_info, nullptr, &transient.m_view))
+
+            if (desc.m_levels > 1) {
+                transient.m_level_views.resize(desc.m_levels);
+                view_info.subresourceRange.levelCount = 1;
+                for (uint32_t level = 0; level < desc.m_levels; level++) {
+                    view_info.subresourceRange.baseMipLevel = level;
+                    VK_CHECK(vkCreateImageView(m_device, &view_info, nullptr, &transient.m_level_views[level]))
+                }
+            }
+        }
+    }
+}
+
+void RenderGraph::retire_transients() {
+    std::vector<TransientImage> transients = std::move(m_transients);
+    std::vector<VmaAllocation> memory = std::move(m_transient_memory);
+    m_transients.clear();
+    m_transient_memory.clear();
+    if (memory.empty()) {
+        return;
+    }
+
+    // The frames already recorded may still use them
+    m_deletion_queue->push_function(m_timeline->next_value(), [=, this]() {
+        for (const TransientImage &transient: transients) {
+            destroy_transient(transient);
+        }
+        for (VmaAllocation allocation: memory) {
+            m_memory_budget->untrack(allocation);
+            vmaFreeMemory(m_allocator, allocation);
+        }
+    });
+}
+
+void RenderGraph::destroy_transient(const TransientImage &transient) {
+    if (transient.m_image == VK_NULL_HANDLE) {
+        return;
+    }
+    for (VkImageView level_view: transient.m_level_views) {
+        vkDestroyImageView(m_device, level_view, nullptr);
+    }
+    vkDestroyImageView(m_device, transient.m_view, nullptr);
+    vkDestroyImage(m_device, transient.m_image, nullptr);
+}
+
+GpuTimeline *RenderGraph::timeline(GpuQueue queue) const {
+    return queue == GpuQueue::Compute ? m_compute_timeline : m_timeline;
+}
+
+VkCommandBuffer RenderGraph::begin_command_buffer(GpuQueue queue, uint32_t &index) {
+    std::vector<CommandBuffer> &command_buffers = m_command_buffers[(uint32_t) queue];
+    uint64_t completed = timeline(queue)->completed_value();
+    auto free = std::find_if(command_buffers.begin(), command_buffers.end(), [=](const CommandBuffer &command_buffer) {
+        return command_buffer.m_retire_value <= completed;
+    });
+    if (free == command_buffers.end()) {
+        VkCommandBufferAllocateInfo allocate_info = {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                .pNext = nullptr,
+                .commandPool = m_command_pools[(uint32_t) queue],
+                .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                .commandBufferCount = 1
+        };
+        VkCommandBuffer cmd;
+        VK_CHECK(vkAllocateCommandBuffers(m_device, &allocate_info, &cmd))
+        command_buffers.push_back({cmd, 0});
+        free = command_buffers.end() - 1;
+    }
+
+    // Until submit knows its value
+    free->m_retire_value = UINT64_MAX;
+    index = (uint32_t) (free - command_buffers.begin());
+
+    // Beginning resets it, the pool allows it
+    VkCommandBufferBeginInfo begin_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .pNext = nullptr,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+            .pInheritanceInfo = nullptr
+    };
+    VK_CHECK(vkBeginCommandBuffer(free->m_cmd, &begin_info))
+    return free->m_cmd;
+}
+
+void RenderGraph::record_barriers(VkCommandBuffer cmd, const std::vector<Barrier> &barriers) {
+    if (barriers.empty()) {
+        return;
+    }
+
+    // Buffers are only tokens, they all go in one global barrier
+    VkMemoryBarrier2 memory_barrier = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+            .pNext = nullptr
+    };
+    bool has_memory_barrier = false;
+
+    m_image_barriers.clear();
+    for (const Barrier &barrier: barriers) {
+        const ResourceDesc &desc = m_declaration.m_resources[barrier.m_resource];
+        if (desc.m_kind == ResourceKind::ImportedBuffer || desc.m_kind == ResourceKind::TransientBuffer) {
+            memory_barrier.srcStageMask |= barrier.m_src_stages;
+            memory_barrier.srcAccessMask |= barrier.m_src_access;
+            memory_barrier.dstStageMask |= barrier.m_dst_stages;
+            memory_barrier.dstAccessMask |= barrier.m_dst_access;
+            has_memory_barrier = true;
+            continue;
+        }
+
+        m_image_barriers.push_back({
+                .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                .pNext = nullptr,
+                .srcStageMask = barrier.m_src_stages,
+                .srcAccessMask = barrier.m_src_access,
+                .dstStageMask = barrier.m_dst_stages,
+                .dstAccessMask = barrier.m_dst_access,
+                .oldLayout = barrier.m_old_layout,
+                .newLayout = barrier.m_new_layout,
+                .srcQueueFamilyIndex = barrier.m_transfer ? timeline(barrier.m_src_queue)->m_queue_family :
+                                       VK_QUEUE_FAMILY_IGNORED,
+                .dstQueueFamilyIndex = barrier.m_transfer ? timeline(barrier.m_dst_queue)->m_queue_family :
+                                       VK_QUEUE_FAMILY_IGNORED,
+                .image = image(barrier.m_resource),
+                .subresourceRange = {desc.m_aspect, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS}
+        });
+    }
+
+    VkDependencyInfo dependency_info = {
+            .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+            .pNext = nullptr,
+            .dependencyFlags = 0,
+            .memoryBarrierCount = has_memory_barrier ? 1u : 0u,
+            .pMemoryBarriers = &memory_barrier,
+            .bufferMemoryBarrierCount = 0,
+            .pBufferMemoryBarriers = nullptr,
+            .imageMemoryBarrierCount = (uint32_t) m_image_barriers.size(),
+            .pImageMemoryBarriers = m_image_barriers.data()
+    };
+    vkCmdPipelineBarrier2(cmd, &dependency_info);
+
+    m_stats.m_barrier_batches++;
+    m_stats.m_barriers += dependency_info.memoryBarrierCount + dependency_info.imageMemoryBarrierCount;
+}
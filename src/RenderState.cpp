@@ -0,0 +1,68 @@
+#include "RenderState.h"
+
+#include <cstring>
+
+void RenderStateTracker::reset() {
+    m_viewport.reset();
+    m_scissor.reset();
+    invalidate_render_state();
+}
+
+void RenderStateTracker::invalidate_render_state() {
+    m_cull_mode.reset();
+    m_front_face.reset();
+    m_topology.reset();
+    m_depth_test.reset();
+    m_depth_write.reset();
+    m_depth_compare_op.reset();
+}
+
+void RenderStateTracker::reset_counters() {
+    m_calls = 0;
+    m_skipped = 0;
+}
+
+template<typename T>
+bool RenderStateTracker::update(std::optional<T> &current, const T &value) {
+    // Vulkan structs have no operator==, they are plain data so comparing bytes is fine
+    if (current && std::memcmp(&*current, &value, sizeof(T)) == 0) {
+        m_skipped++;
+        return false;
+    }
+    current = value;
+    m_calls++;
+    return true;
+}
+
+void RenderStateTracker::set_viewport(VkCommandBuffer cmd, const VkViewport &viewport) {
+    if (update(m_viewport, viewport)) {
+        vkCmdSetViewport(cmd, 0, 1, &viewport);
+    }
+}
+
+void RenderStateTracker::set_scissor(VkCommandBuffer cmd, const VkRect2D &scissor) {
+    if (update(m_scissor, scissor)) {
+        vkCmdSetScissor(cmd, 0, 1, &scissor);
+    }
+}
+
+void RenderStateTracker::apply(VkCommandBuffer cmd, const RenderState &state) {
+    if (update(m_cull_mode, state.m_cull_mode)) {
+        vkCmdSetCullMode(cmd, state.m_cull_mode);
+    }
+    if (update(m_front_face, state.m_front_face)) {
+        vkCmdSetFrontFace(cmd, state.m_front_face);
+    }
+    if (update(m_topology, state.m_topology)) {
+        vkCmdSetPrimitiveTopology(cmd, state.m_topology);
+    }
+    if (update(m_depth_test, state.m_depth_test)) {
+        vkCmdSetDepthTestEnable(cmd, state.m_depth_test);
+    }
+    if (update(m_depth_write, state.m_depth_write)) {
+        vkCmdSetDepthWriteEnable(cmd, state.m_depth_write);
+    }
+    if (update(m_depth_compare_op, state.m_depth_compare_op)) {
+        vkCmdSetDepthCompareOp(cmd, state.m_depth_compare_op);
+    }
+}
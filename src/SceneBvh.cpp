@@ -0,0 +1,567 @@
+#include "SceneBvh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <numeric>
+
+// Small leaves are cheaper to refit and cull precisely, the SAH may still stop earlier
+constexpr uint32_t MAX_LEAF_OBJECTS = 4;
+constexpr uint32_t SAH_BINS = 16;
+// Relative cost of visiting a node against testing an object
+constexpr float TRAVERSAL_COST = 1.f;
+constexpr float INTERSECTION_COST = 1.f;
+// Past this depth nodes are split at the median, which bounds the depth of a degenerate scene
+constexpr uint32_t MAX_SAH_DEPTH = 48;
+// Deep enough for MAX_SAH_DEPTH plus 32 median splits
+constexpr uint32_t TRAVERSAL_STACK_SIZE = 128;
+// Past this many dirty leaves, a full bottom up refit is cheaper than walking up from each
+constexpr uint32_t FULL_REFIT_DIVISOR = 8;
+
+Frustum Frustum::from_matrix(const glm::mat4 &view_projection) {
+    // Rows of the matrix, same planes as OcclusionCuller except near which is z >= 0 here
+    glm::mat4 rows = glm::transpose(view_projection);
+    Frustum frustum = {};
+    frustum.m_planes[0] = rows[3] + rows[0];
+    frustum.m_planes[1] = rows[3] - rows[0];
+    frustum.m_planes[2] = rows[3] + rows[1];
+    frustum.m_planes[3] = rows[3] - rows[1];
+    frustum.m_planes[4] = rows[2];
+    frustum.m_planes[5] = rows[3] - rows[2];
+    for (glm::vec4 &plane: frustum.m_planes) {
+        plane /= glm::length(glm::vec3(plane));
+    }
+    return frustum;
+}
+
+// Half of it really, only ever compared or divided
+static float surface_area(const glm::vec3 &min, const glm::vec3 &max) {
+    glm::vec3 size = glm::max(max - min, glm::vec3(0.f));
+    return size.x * size.y + size.y * size.z + size.z * size.x;
+}
+
+enum class Containment {
+    Outside,
+    Intersecting,
+    Inside
+};
+
+static Containment classify(const Frustum &frustum, const glm::vec3 &min, const glm::vec3 &max) {
+    Containment result = Containment::Inside;
+    for (const glm::vec4 &plane: frustum.m_planes) {
+        glm::vec3 normal = glm::vec3(plane);
+        // Corners furthest along the plane normal and against it
+        glm::vec3 positive = glm::mix(min, max, glm::greaterThan(normal, glm::vec3(0.f)));
+        glm::vec3 negative = glm::mix(max, min, glm::greaterThan(normal, glm::vec3(0.f)));
+        if (glm::dot(normal, positive) + plane.w < 0.f) {
+            return Containment::Outside;
+        }
+        if (glm::dot(normal, negative) + plane.w < 0.f) {
+            result = Containment::Intersecting;
+        }
+    }
+    return result;
+}
+
+// Distance along the ray where it enters the box, infinity if it doesn't before max_distance
+static float ray_entry(const glm::vec3 &origin, const glm::vec3 &inverse_direction, float max_distance,
+                       const glm::vec3 &min, const glm::vec3 &max) {
+    glm::vec3 t0 = (min - origin) * inverse_direction;
+    glm::vec3 t1 = (max - origin) * inverse_direction;
+    glm::vec3 entries = glm::min(t0, t1);
+    glm::vec3 exits = glm::max(t0, t1);
+    float entry = std::max({entries.x, entries.y, entries.z, 0.f});
+    float exit = std::min({exits.x, exits.y, exits.z, max_distance});
+    return entry <= exit ? entry : std::numeric_limits<float>::infinity();
+}
+
+SceneBvh::~SceneBvh() {
+    clear();
+}
+
+void SceneBvh::build(const std::vector<Aabb> &bounds) {
+    // Built from bounds that are about to be replaced
+    if (m_rebuild_thread.joinable()) {
+        m_rebuild_thread.join();
+        m_rebuild_tree = {};
+        m_rebuild_bounds = {};
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    m_object_bounds = bounds;
+    build_tree(m_object_bounds, m_tree);
+    m_last_build_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    m_builds++;
+
+    m_dirty_leaves.clear();
+    m_leaf_dirty.assign(m_tree.m_nodes.size(), 0);
+}
+
+void SceneBvh::clear() {
+    if (m_rebuild_thread.joinable()) {
+        m_rebuild_thread.join();
+    }
+    m_rebuild_tree = {};
+    m_rebuild_bounds = {};
+    m_object_bounds.clear();
+    m_tree = {};
+    m_dirty_leaves.clear();
+    m_leaf_dirty.clear();
+}
+
+void SceneBvh::update(uint32_t object, const Aabb &bounds) {
+    if (m_object_bounds[object] == bounds) {
+        return;
+    }
+    m_object_bounds[object] = bounds;
+
+    uint32_t leaf = m_tree.m_object_leaves[object];
+    if (!m_leaf_dirty[leaf]) {
+        m_leaf_dirty[leaf] = 1;
+        m_dirty_leaves.push_back(leaf);
+    }
+    if (m_rebuild_thread.joinable()) {
+        m_moved_while_rebuilding.push_back(object);
+    }
+}
+
+void SceneBvh::refit() {
+    if (m_dirty_leaves.empty()) {
+        return;
+    }
+
+    if (m_dirty_leaves.size() > m_tree.m_nodes.size() / FULL_REFIT_DIVISOR) {
+        // Children come after their parent
+        for (auto node = (uint32_t) m_tree.m_nodes.size(); node-- > 0;) {
+            refit_node(node);
+        }
+    } else {
+        // Parents stop changing as soon as one of them contains the new bounds already
+        for (uint32_t leaf: m_dirty_leaves) {
+            for (uint32_t node = leaf; refit_node(node) && node != 0;) {
+                node = m_tree.m_nodes[node].m_parent;
+            }
+        }
+    }
+
+    for (uint32_t leaf: m_dirty_leaves) {
+        m_leaf_dirty[leaf] = 0;
+    }
+    m_dirty_leaves.clear();
+}
+
+bool SceneBvh::needs_rebuild() const {
+    return !m_tree.m_nodes.empty() && !m_rebuild_thread.joinable() &&
+           tree_cost(m_tree, m_tree.m_area_cost) > m_tree.m_built_cost * m_rebuild_threshold;
+}
+
+void SceneBvh::start_rebuild() {
+    if (m_rebuild_thread.joinable() || m_object_bounds.empty()) {
+        return;
+    }
+
+    // The worker only touches the copy and its own tree
+    m_rebuild_bounds = m_object_bounds;
+    m_moved_while_rebuilding.clear();
+    m_rebuild_done = false;
+    m_rebuild_thread = std::thread([this]() {
+        auto start = std::chrono::steady_clock::now();
+        build_tree(m_rebuild_bounds, m_rebuild_tree);
+        m_rebuild_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        m_rebuild_done = true;
+    });
+}
+
+bool SceneBvh::poll_rebuild() {
+    if (!m_rebuild_thread.joinable() || !m_rebuild_done) {
+        return false;
+    }
+    m_rebuild_thread.join();
+
+    std::swap(m_tree, m_rebuild_tree);
+    m_rebuild_tree = {};
+    m_rebuild_bounds = {};
+    m_last_build_ms = m_rebuild_ms;
+    m_builds++;
+    m_async_builds++;
+
+    // Pending updates point at leaves of the old tree
+    m_dirty_leaves.clear();
+    m_leaf_dirty.assign(m_tree.m_nodes.size(), 0);
+    for (uint32_t object: m_moved_while_rebuilding) {
+        uint32_t leaf = m_tree.m_object_leaves[object];
+        if (!m_leaf_dirty[leaf]) {
+            m_leaf_dirty[leaf] = 1;
+            m_dirty_leaves.push_back(leaf);
+        }
+    }
+    m_moved_while_rebuilding.clear();
+    refit();
+    return true;
+}
+
+void SceneBvh::query_frustum(const Frustum &frustum, std::vector<uint32_t> &out) const {
+    if (m_tree.m_nodes.empty()) {
+        return;
+    }
+
+    uint32_t stack[TRAVERSAL_STACK_SIZE];
+    uint32_t stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        uint32_t index = stack[--stack_size];
+        const Node &node = m_tree.m_nodes[index];
+        Containment containment = classify(frustum, node.m_min, node.m_max);
+        if (containment == Containment::Outside) {
+            continue;
+        }
+        if (containment == Containment::Inside) {
+            append_subtree(index, out);
+            continue;
+        }
+
+        if (node.m_right != 0) {
+            stack[stack_size++] = node.m_right;
+            stack[stack_size++] = index + 1;
+            continue;
+        }
+        for (uint32_t i = node.m_first; i < node.m_first + node.m_count; i++) {
+            const Aabb &bounds = m_object_bounds[m_tree.m_objects[i]];
+            if (classify(frustum, bounds.m_min, bounds.m_max) != Containment::Outside) {
+                out.push_back(m_tree.m_objects[i]);
+            }
+        }
+    }
+}
+
+void SceneBvh::query_sphere(const glm::vec3 &center, float radius, std::vector<uint32_t> &out) const {
+    if (m_tree.m_nodes.empty()) {
+        return;
+    }
+
+    float radius_squared = radius * radius;
+    auto distance_squared = [&](const glm::vec3 &min, const glm::vec3 &max) {
+        glm::vec3 offset = glm::clamp(center, min, max) - center;
+        return glm::dot(offset, offset);
+    };
+
+    uint32_t stack[TRAVERSAL_STACK_SIZE];
+    uint32_t stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        uint32_t index = stack[--stack_size];
+        const Node &node = m_tree.m_nodes[index];
+        if (distance_squared(node.m_min, node.m_max) > radius_squared) {
+            continue;
+        }
+        // Its furthest corner is in the sphere
+        glm::vec3 furthest = glm::max(glm::abs(node.m_min - center), glm::abs(node.m_max - center));
+        if (glm::dot(furthest, furthest) <= radius_squared) {
+            append_subtree(index, out);
+            continue;
+        }
+
+        if (node.m_right != 0) {
+            stack[stack_size++] = node.m_right;
+            stack[stack_size++] = index + 1;
+            continue;
+        }
+        for (uint32_t i = node.m_first; i < node.m_first + node.m_count; i++) {
+            const Aabb &bounds = m_object_bounds[m_tree.m_objects[i]];
+            if (distance_squared(bounds.m_min, bounds.m_max) <= radius_squared) {
+                out.push_back(m_tree.m_objects[i]);
+            }
+        }
+    }
+}
+
+void SceneBvh::query_aabb(const Aabb &box, std::vector<uint32_t> &out) const {
+    if (m_tree.m_nodes.empty()) {
+        return;
+    }
+
+    auto overlaps = [&](const glm::vec3 &min, const glm::vec3 &max) {
+        return glm::all(glm::lessThanEqual(min, box.m_max)) && glm::all(glm::greaterThanEqual(max, box.m_min));
+    };
+
+    uint32_t stack[TRAVERSAL_STACK_SIZE];
+    uint32_t stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        uint32_t index = stack[--stack_size];
+        const Node &node = m_tree.m_nodes[index];
+        if (!overlaps(node.m_min, node.m_max)) {
+            continue;
+        }
+        if (glm::all(glm::greaterThanEqual(node.m_min, box.m_min)) &&
+            glm::all(glm::lessThanEqual(node.m_max, box.m_max))) {
+            append_subtree(index, out);
+            continue;
+        }
+
+        if (node.m_right != 0) {
+            stack[stack_size++] = node.m_right;
+            stack[stack_size++] = index + 1;
+            continue;
+        }
+        for (uint32_t i = node.m_first; i < node.m_first + node.m_count; i++) {
+            const Aabb &bounds = m_object_bounds[m_tree.m_objects[i]];
+            if (overlaps(bounds.m_min, bounds.m_max)) {
+                out.push_back(m_tree.m_objects[i]);
+            }
+        }
+    }
+}
+
+bool SceneBvh::raycast(const glm::vec3 &origin, const glm::vec3 &direction, float max_distance,
+                       BvhRayHit &hit) const {
+    if (m_tree.m_nodes.empty()) {
+        return false;
+    }
+
+    // Infinite on the axes the ray is parallel to, the slabs then reject or accept everything
+    glm::vec3 inverse_direction = 1.f / direction;
+    float best = max_distance;
+    hit = {};
+
+    uint32_t stack[TRAVERSAL_STACK_SIZE];
+    uint32_t stack_size = 0;
+    if (ray_entry(origin, inverse_direction, best, m_tree.m_nodes[0].m_min, m_tree.m_nodes[0].m_max) <= best) {
+        stack[stack_size++] = 0;
+    }
+    while (stack_size > 0) {
+        uint32_t index = stack[--stack_size];
+        const Node &node = m_tree.m_nodes[index];
+
+        if (node.m_right != 0) {
+            // Nearest child last so it is visited first, and shortens the ray for the other one
+            uint32_t left = index + 1;
+            float left_entry = ray_entry(origin, inverse_direction, best, m_tree.m_nodes[left].m_min,
+                                         m_tree.m_nodes[left].m_max);
+            float right_entry = ray_entry(origin, inverse_direction, best, m_tree.m_nodes[node.m_right].m_min,
+                                          m_tree.m_nodes[node.m_right].m_max);
+            uint32_t nearest = left_entry <= right_entry ? left : node.m_right;
+            uint32_t furthest = left_entry <= right_entry ? node.m_right : left;
+            if (std::max(left_entry, right_entry) <= best) {
+                stack[stack_size++] = furthest;
+            }
+            if (std::min(left_entry, right_entry) <= best) {
+                stack[stack_size++] = nearest;
+            }
+            continue;
+        }
+
+        for (uint32_t i = node.m_first; i < node.m_first + node.m_count; i++) {
+            const Aabb &bounds = m_object_bounds[m_tree.m_objects[i]];
+            float entry = ray_entry(origin, inverse_direction, best, bounds.m_min, bounds.m_max);
+            if (entry <= best) {
+                best = entry;
+                hit = {m_tree.m_objects[i], entry};
+            }
+        }
+    }
+
+    return hit.m_object != UINT32_MAX;
+}
+
+void SceneBvh::append_subtree(uint32_t node, std::vector<uint32_t> &out) const {
+    auto first = m_tree.m_objects.begin() + m_tree.m_nodes[node].m_first;
+    out.insert(out.end(), first, first + m_tree.m_nodes[node].m_count);
+}
+
+BvhStats SceneBvh::stats() const {
+    BvhStats stats = {};
+    stats.m_objects = (uint32_t) m_object_bounds.size();
+    stats.m_nodes = (uint32_t) m_tree.m_nodes.size();
+    stats.m_depth = m_tree.m_depth;
+    if (!m_tree.m_nodes.empty() && m_tree.m_built_cost > 0.0) {
+        stats.m_cost_ratio = (float) (tree_cost(m_tree, m_tree.m_area_cost) / m_tree.m_built_cost);
+    }
+    stats.m_builds = m_builds;
+    stats.m_async_builds = m_async_builds;
+    stats.m_last_build_ms = m_last_build_ms;
+    return stats;
+}
+
+void SceneBvh::build_tree(const std::vector<Aabb> &bounds, Tree &tree) {
+    auto count = (uint32_t) bounds.size();
+    tree.m_nodes.clear();
+    tree.m_objects.resize(count);
+    std::iota(tree.m_objects.begin(), tree.m_objects.end(), 0u);
+    tree.m_object_leaves.resize(count);
+    tree.m_depth = 0;
+    tree.m_area_cost = 0.0;
+    tree.m_built_cost = 0.0;
+    if (count == 0) {
+        return;
+    }
+
+    std::vector<glm::vec3> centroids(count);
+    for (uint32_t i = 0; i < count; i++) {
+        centroids[i] = (bounds[i].m_min + bounds[i].m_max) * 0.5f;
+    }
+
+    tree.m_nodes.reserve(2 * (count / MAX_LEAF_OBJECTS + 1));
+    build_node(bounds, centroids, tree, 0, count, UINT32_MAX, 1);
+    tree.m_built_cost = tree_cost(tree, tree.m_area_cost);
+}
+
+uint32_t SceneBvh::build_node(const std::vector<Aabb> &bounds, const std::vector<glm::vec3> &centroids, Tree &tree,
+                              uint32_t first, uint32_t count, uint32_t parent, uint32_t depth) {
+    auto index = (uint32_t) tree.m_nodes.size();
+    tree.m_nodes.push_back({});
+    tree.m_depth = std::max(tree.m_depth, depth);
+
+    glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 max = glm::vec3(-std::numeric_limits<float>::max());
+    glm::vec3 centroid_min = min;
+    glm::vec3 centroid_max = max;
+    for (uint32_t i = first; i < first + count; i++) {
+        uint32_t object = tree.m_objects[i];
+        min = glm::min(min, bounds[object].m_min);
+        max = glm::max(max, bounds[object].m_max);
+        centroid_min = glm::min(centroid_min, centroids[object]);
+        centroid_max = glm::max(centroid_max, centroids[object]);
+    }
+
+    // Split by the SAH over binned centroids, on the best axis
+    uint32_t split_axis = 3;
+    uint32_t split_bin = 0;
+    float split_cost = (float) count * INTERSECTION_COST;
+    glm::vec3 extent = centroid_max - centroid_min;
+    bool must_split = count > MAX_LEAF_OBJECTS;
+    if (must_split && depth < MAX_SAH_DEPTH) {
+        // Any split beats a leaf too big
+        split_cost = std::numeric_limits<float>::max();
+        float parent_area = std::max(surface_area(min, max), std::numeric_limits<float>::min());
+
+        for (uint32_t axis = 0; axis < 3; axis++) {
+            if (extent[axis] <= 0.f) {
+                continue;
+            }
+
+            struct Bin {
+                glm::vec3 m_min = glm::vec3(std::numeric_limits<float>::max());
+                glm::vec3 m_max = glm::vec3(-std::numeric_limits<float>::max());
+                uint32_t m_count = 0;
+            };
+            Bin bins[SAH_BINS];
+            float scale = (float) SAH_BINS / extent[axis];
+            for (uint32_t i = first; i < first + count; i++) {
+                uint32_t object = tree.m_objects[i];
+                auto bin = std::min((uint32_t) ((centroids[object][axis] - centroid_min[axis]) * scale), SAH_BINS - 1);
+                bins[bin].m_min = glm::min(bins[bin].m_min, bounds[object].m_min);
+                bins[bin].m_max = glm::max(bins[bin].m_max, bounds[object].m_max);
+                bins[bin].m_count++;
+            }
+
+            // Area times count of everything left of each plane, then right of it
+            float left_cost[SAH_BINS - 1];
+            Bin accumulated;
+            for (uint32_t b = 0; b < SAH_BINS - 1; b++) {
+                accumulated.m_min = glm::min(accumulated.m_min, bins[b].m_min);
+                accumulated.m_max = glm::max(accumulated.m_max, bins[b].m_max);
+                accumulated.m_count += bins[b].m_count;
+                left_cost[b] = accumulated.m_count > 0 ?
+                               surface_area(accumulated.m_min, accumulated.m_max) * (float) accumulated.m_count : -1.f;
+            }
+            accumulated = {};
+            for (uint32_t b = SAH_BINS - 1; b > 0; b--) {
+                accumulated.m_min = glm::min(accumulated.m_min, bins[b].m_min);
+                accumulated.m_max = glm::max(accumulated.m_max, bins[b].m_max);
+                accumulated.m_count += bins[b].m_count;
+                if (accumulated.m_count == 0 || left_cost[b - 1] < 0.f) {
+                    continue;
+                }
+
+                float right_cost = surface_area(accumulated.m_min, accumulated.m_max) * (float) accumulated.m_count;
+                float cost = TRAVERSAL_COST + INTERSECTION_COST * (left_cost[b - 1] + right_cost) / parent_area;
+                if (cost < split_cost) {
+                    split_cost = cost;
+                    split_axis = axis;
+                    split_bin = b;
+                }
+            }
+        }
+    }
+
+    uint32_t middle = first;
+    if (split_axis < 3) {
+        float scale = (float) SAH_BINS / extent[split_axis];
+        auto *objects = tree.m_objects.data();
+        middle = (uint32_t) (std::partition(objects + first, objects + first + count, [&](uint32_t object) {
+            auto bin = std::min((uint32_t) ((centroids[object][split_axis] - centroid_min[split_axis]) * scale),
+                                SAH_BINS - 1);
+            return bin < split_bin;
+        }) - objects);
+    } else if (must_split) {
+        // Too deep, or every centroid in the same place: halves along the longest axis
+        uint32_t axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+        middle = first + count / 2;
+        auto *objects = tree.m_objects.data();
+        std::nth_element(objects + first, objects + middle, objects + first + count, [&](uint32_t a, uint32_t b) {
+            return centroids[a][axis] < centroids[b][axis];
+        });
+    }
+
+    Node node = {
+            .m_min = min,
+            .m_first = first,
+            .m_max = max,
+            .m_count = count,
+            .m_right = 0,
+            .m_parent = parent
+    };
+
+    if (middle == first || middle == first + count) {
+        for (uint32_t i = first; i < first + count; i++) {
+            tree.m_object_leaves[tree.m_objects[i]] = index;
+        }
+        tree.m_nodes[index] = node;
+        tree.m_area_cost += surface_area(min, max) * (float) count * INTERSECTION_COST;
+        return index;
+    }
+
+    // The left child is always the next node
+    build_node(bounds, centroids, tree, first, middle - first, index, depth + 1);
+    node.m_right = build_node(bounds, centroids, tree, middle, first + count - middle, index, depth + 1);
+    tree.m_nodes[index] = node;
+    tree.m_area_cost += surface_area(min, max) * TRAVERSAL_COST;
+    return index;
+}
+
+double SceneBvh::tree_cost(const Tree &tree, double area_cost) {
+    double root_area = surface_area(tree.m_nodes[0].m_min, tree.m_nodes[0].m_max);
+    return root_area > 0.0 ? area_cost / root_area : 1.0;
+}
+
+bool SceneBvh::refit_node(uint32_t index) {
+    Node &node = m_tree.m_nodes[index];
+
+    glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 max = glm::vec3(-std::numeric_limits<float>::max());
+    float weight;
+    if (node.m_right != 0) {
+        const Node &left = m_tree.m_nodes[index + 1];
+        const Node &right = m_tree.m_nodes[node.m_right];
+        min = glm::min(left.m_min, right.m_min);
+        max = glm::max(left.m_max, right.m_max);
+        weight = TRAVERSAL_COST;
+    } else {
+        for (uint32_t i = node.m_first; i < node.m_first + node.m_count; i++) {
+            const Aabb &bounds = m_object_bounds[m_tree.m_objects[i]];
+            min = glm::min(min, bounds.m_min);
+            max = glm::max(max, bounds.m_max);
+        }
+        weight = (float) node.m_count * INTERSECTION_COST;
+    }
+
+    if (min == node.m_min && max == node.m_max) {
+        return false;
+    }
+
+    m_tree.m_area_cost += (double) ((surface_area(min, max) - surface_area(node.m_min, node.m_max)) * weight);
+    node.m_min = min;
+    node.m_max = max;
+    return true;
+}
@@ -0,0 +1,142 @@
+#include "SceneFile.h"
+
+#include <bit>
+#include <fstream>
+#include <iostream>
+
+static uint64_t align_up(uint64_t value) {
+    return (value + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+}
+
+// Written as they are in memory, so only little endian platforms read and write them
+static bool little_endian(const char *filename) {
+    if constexpr (std::endian::native != std::endian::little) {
+        std::cout << filename << ": scene files are little endian, this platform isn't" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool section_valid(const SceneFileSection &section, uint64_t record_size, uint64_t file_size) {
+    return section.m_offset % SCENE_FILE_ALIGNMENT == 0 && section.m_offset <= file_size &&
+           section.m_count <= (file_size - section.m_offset) / record_size;
+}
+
+bool SceneFile::open(const char *filename) {
+    close();
+    if (!little_endian(filename) || !m_file.open(filename)) {
+        return false;
+    }
+
+    if (m_file.size() < sizeof(SceneFileHeader)) {
+        std::cout << filename << " is too small to be a scene file" << std::endl;
+        close();
+        return false;
+    }
+    m_header = (const SceneFileHeader *) m_file.data();
+
+    if (m_header->m_magic != SCENE_FILE_MAGIC) {
+        std::cout << filename << " isn't a scene file" << std::endl;
+        close();
+        return false;
+    }
+    if (m_header->m_version != SCENE_FILE_VERSION) {
+        std::cout << filename << ": scene file version " << m_header->m_version << ", only version "
+                  << SCENE_FILE_VERSION << " is supported" << std::endl;
+        close();
+        return false;
+    }
+
+    uint64_t file_size = m_file.size();
+    bool valid = section_valid(m_header->m_objects, sizeof(SceneFileObject), file_size) &&
+                 section_valid(m_header->m_meshes, sizeof(SceneFileString), file_size) &&
+                 section_valid(m_header->m_materials, sizeof(SceneFileString), file_size) &&
+                 section_valid(m_header->m_strings, 1, file_size) &&
+                 m_header->m_objects.m_count < UINT32_MAX && m_header->m_meshes.m_count < UINT32_MAX &&
+                 m_header->m_materials.m_count < UINT32_MAX;
+
+    // Few of them, the objects are the ones not checked here
+    for (const SceneFileSection *names: {&m_header->m_meshes, &m_header->m_materials}) {
+        const SceneFileString *strings = section<SceneFileString>(*names);
+        for (uint64_t i = 0; valid && i < names->m_count; i++) {
+            valid = strings[i].m_offset <= m_header->m_strings.m_count &&
+                    strings[i].m_size <= m_header->m_strings.m_count - strings[i].m_offset;
+        }
+    }
+
+    if (!valid) {
+        std::cout << filename << ": scene file sections are out of bounds" << std::endl;
+        close();
+        return false;
+    }
+    return true;
+}
+
+std::string_view SceneFile::mesh_name(uint32_t mesh) const {
+    return name(m_header->m_meshes, mesh);
+}
+
+std::string_view SceneFile::material_name(uint32_t material) const {
+    return name(m_header->m_materials, material);
+}
+
+std::string_view SceneFile::name(const SceneFileSection &names, uint32_t index) const {
+    const SceneFileString &string = section<SceneFileString>(names)[index];
+    return {section<char>(m_header->m_strings) + string.m_offset, string.m_size};
+}
+
+bool SceneFile::write(const char *filename, const std::vector<SceneFileObject> &objects,
+                      const std::vector<std::string> &meshes, const std::vector<std::string> &materials) {
+    if (!little_endian(filename)) {
+        return false;
+    }
+
+    std::string strings;
+    auto add_names = [&](const std::vector<std::string> &names) {
+        std::vector<SceneFileString> records;
+        records.reserve(names.size());
+        for (const std::string &name: names) {
+            records.push_back({(uint32_t) strings.size(), (uint32_t) name.size()});
+            strings += name;
+        }
+        return records;
+    };
+    std::vector<SceneFileString> mesh_records = add_names(meshes);
+    std::vector<SceneFileString> material_records = add_names(materials);
+
+    // Sections one after the other, in the order of the header
+    SceneFileHeader header = {
+            .m_magic = SCENE_FILE_MAGIC,
+            .m_version = SCENE_FILE_VERSION
+    };
+    header.m_objects = {align_up(sizeof(SceneFileHeader)), objects.size()};
+    header.m_meshes = {align_up(header.m_objects.m_offset + objects.size() * sizeof(SceneFileObject)),
+                       mesh_records.size()};
+    header.m_materials = {align_up(header.m_meshes.m_offset + mesh_records.size() * sizeof(SceneFileString)),
+                          material_records.size()};
+    header.m_strings = {align_up(header.m_materials.m_offset + material_records.size() * sizeof(SceneFileString)),
+                        strings.size()};
+
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        std::cout << "Failed to open " << filename << " for writing" << std::endl;
+        return false;
+    }
+
+    auto write_section = [&](const SceneFileSection &section, const void *data, uint64_t size) {
+        static const char padding[SCENE_FILE_ALIGNMENT] = {};
+        file.write(padding, (std::streamsize) (section.m_offset - (uint64_t) file.tellp()));
+        file.write((const char *) data, (std::streamsize) size);
+    };
+    file.write((const char *) &header, sizeof(header));
+    write_section(header.m_objects, objects.data(), objects.size() * sizeof(SceneFileObject));
+    write_section(header.m_meshes, mesh_records.data(), mesh_records.size() * sizeof(SceneFileString));
+    write_section(header.m_materials, material_records.data(), material_records.size() * sizeof(SceneFileString));
+    write_section(header.m_strings, strings.data(), strings.size());
+
+    if (!file.good()) {
+        std::cout << "Failed to write " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
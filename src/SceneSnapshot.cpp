@@ -0,0 +1,37 @@
+#include "SceneSnapshot.h"
+
+// Per component, close enough to the real motion for the small changes of one step. Unchanged
+// matrices are kept as they are so static objects don't look like they moved.
+static glm::mat4 interpolate_matrix(const glm::mat4 &previous, const glm::mat4 &current, float alpha) {
+    if (previous == current) {
+        return current;
+    }
+    return previous + (current - previous) * alpha;
+}
+
+void SceneSnapshot::interpolate(float alpha, SceneState *out_state) const {
+    // Copied into the existing vectors, they keep their capacity from one frame to the next
+    *out_state = m_current;
+    out_state->m_camera_position = glm::mix(m_previous.m_camera_position, m_current.m_camera_position, alpha);
+
+    if (m_previous.m_renderables.size() == m_current.m_renderables.size()) {
+        for (size_t i = 0; i < m_current.m_renderables.size(); i++) {
+            RenderObject &object = out_state->m_renderables[i];
+            object.m_transform_matrix = interpolate_matrix(m_previous.m_renderables[i].m_transform_matrix,
+                                                           object.m_transform_matrix, alpha);
+        }
+    }
+
+    if (m_previous.m_skinned_instances.size() == m_current.m_skinned_instances.size()) {
+        for (size_t i = 0; i < m_current.m_skinned_instances.size(); i++) {
+            const std::vector<glm::mat4> &previous_joints = m_previous.m_skinned_instances[i].m_joints;
+            std::vector<glm::mat4> &joints = out_state->m_skinned_instances[i].m_joints;
+            if (previous_joints.size() != joints.size()) {
+                continue;
+            }
+            for (size_t j = 0; j < joints.size(); j++) {
+                joints[j] = interpolate_matrix(previous_joints[j], joints[j], alpha);
+            }
+        }
+    }
+}
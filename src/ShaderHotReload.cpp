@@ -0,0 +1,153 @@
+#include "ShaderHotReload.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+static bool is_shader_source(const std::string &file_name) {
+    auto ends_with = [&](const char *suffix) {
+        std::string s(suffix);
+        return file_name.size() > s.size() && file_name.compare(file_name.size() - s.size(), s.size(), s) == 0;
+    };
+    return ends_with(".vert") || ends_with(".frag") || ends_with(".comp");
+}
+
+bool ShaderHotReload::init(const std::string &source_dir, const std::string &output_dir,
+                           const std::string &compiler) {
+#ifdef __linux__
+    m_source_dir = source_dir;
+    m_output_dir = output_dir;
+    m_compiler = compiler;
+
+    if (m_compiler.empty() || !std::filesystem::is_directory(m_source_dir)) {
+        std::cout << "Shader hot reload disabled, no glslangValidator or no " << m_source_dir << std::endl;
+        return false;
+    }
+
+    m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_inotify_fd < 0) {
+        return false;
+    }
+
+    // Editors either write in place or write a temporary file and rename it over the original
+    if (inotify_add_watch(m_inotify_fd, m_source_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(m_inotify_fd);
+        m_inotify_fd = -1;
+        return false;
+    }
+
+    m_running = true;
+    m_thread = std::thread(&ShaderHotReload::worker, this);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void ShaderHotReload::cleanup() {
+#ifdef __linux__
+    if (m_running) {
+        m_running = false;
+        m_thread.join();
+    }
+    if (m_inotify_fd >= 0) {
+        close(m_inotify_fd);
+        m_inotify_fd = -1;
+    }
+#endif
+}
+
+std::vector<std::string> ShaderHotReload::poll_compiled() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<std::string> compiled;
+    compiled.swap(m_compiled);
+    return compiled;
+}
+
+void ShaderHotReload::worker() {
+#ifdef __linux__
+    // Big enough for a burst of events, names are short
+    alignas(inotify_event) char buffer[4096];
+
+    while (m_running) {
+        // Wake up regularly to notice cleanup
+        pollfd poll_fd = {m_inotify_fd, POLLIN, 0};
+        if (poll(&poll_fd, 1, 100) <= 0) {
+            continue;
+        }
+
+        // Saving several times quickly sends several events for the same file, compile it once
+        std::vector<std::string> changed;
+        ssize_t length;
+        while ((length = read(m_inotify_fd, buffer, sizeof(buffer))) > 0) {
+            for (char *ptr = buffer; ptr < buffer + length;) {
+                auto *event = (inotify_event *) ptr;
+                if (event->len > 0 && is_shader_source(event->name) &&
+                    std::find(changed.begin(), changed.end(), event->name) == changed.end()) {
+                    changed.emplace_back(event->name);
+                }
+                ptr += sizeof(inotify_event) + event->len;
+            }
+        }
+
+        for (const std::string &file_name: changed) {
+            if (compile(file_name)) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_compiled.push_back(file_name + ".spv");
+            }
+        }
+    }
+#endif
+}
+
+bool ShaderHotReload::compile(const std::string &file_name) {
+#ifdef __linux__
+    std::filesystem::path source = std::filesystem::path(m_source_dir) / file_name;
+    std::filesystem::path output = std::filesystem::path(m_output_dir) / (file_name + ".spv");
+    // Written next to the output then renamed, so a failed compile never leaves a broken .spv
+    std::filesystem::path temporary = output;
+    temporary += ".tmp";
+
+    std::string command = "\"" + m_compiler + "\" -V \"" + source.string() + "\" -o \"" + temporary.string() +
+                          "\" 2>&1";
+
+    FILE *pipe = popen(command.c_str(), "r");
+    if (!pipe) {
+        return false;
+    }
+
+    std::string log;
+    char line[512];
+    while (fgets(line, sizeof(line), pipe)) {
+        log += line;
+    }
+    int status = pclose(pipe);
+
+    if (status != 0) {
+        std::cout << "Shader hot reload: " << file_name << " failed to compile, keeping the old version\n" << log
+                  << std::endl;
+        std::error_code error;
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temporary, output, error);
+    if (error) {
+        std::cout << "Shader hot reload: couldn't write " << output << ": " << error.message() << std::endl;
+        return false;
+    }
+
+    std::cout << "Shader hot reload: recompiled " << file_name << std::endl;
+    return true;
+#else
+    return false;
+#endif
+}
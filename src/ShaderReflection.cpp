@@ -0,0 +1,503 @@
+#include "ShaderReflection.h"
+
+#include <algorithm>
+#include <iostream>
+
+// Values from the SPIR-V specification, only the ones we read
+namespace spirv {
+    constexpr uint32_t MAGIC = 0x07230203;
+    constexpr uint32_t HEADER_WORDS = 5;
+
+    constexpr uint32_t OP_ENTRY_POINT = 15;
+    constexpr uint32_t OP_TYPE_BOOL = 20;
+    constexpr uint32_t OP_TYPE_INT = 21;
+    constexpr uint32_t OP_TYPE_FLOAT = 22;
+    constexpr uint32_t OP_TYPE_VECTOR = 23;
+    constexpr uint32_t OP_TYPE_MATRIX = 24;
+    constexpr uint32_t OP_TYPE_IMAGE = 25;
+    constexpr uint32_t OP_TYPE_SAMPLER = 26;
+    constexpr uint32_t OP_TYPE_SAMPLED_IMAGE = 27;
+    constexpr uint32_t OP_TYPE_ARRAY = 28;
+    constexpr uint32_t OP_TYPE_RUNTIME_ARRAY = 29;
+    constexpr uint32_t OP_TYPE_STRUCT = 30;
+    constexpr uint32_t OP_TYPE_POINTER = 32;
+    constexpr uint32_t OP_CONSTANT = 43;
+    constexpr uint32_t OP_VARIABLE = 59;
+    constexpr uint32_t OP_DECORATE = 71;
+    constexpr uint32_t OP_MEMBER_DECORATE = 72;
+    constexpr uint32_t OP_TYPE_ACCELERATION_STRUCTURE = 5341;
+
+    constexpr uint32_t DECORATION_BUFFER_BLOCK = 3;
+    constexpr uint32_t DECORATION_ARRAY_STRIDE = 6;
+    constexpr uint32_t DECORATION_MATRIX_STRIDE = 7;
+    constexpr uint32_t DECORATION_BUILT_IN = 11;
+    constexpr uint32_t DECORATION_LOCATION = 30;
+    constexpr uint32_t DECORATION_BINDING = 33;
+    constexpr uint32_t DECORATION_DESCRIPTOR_SET = 34;
+    constexpr uint32_t DECORATION_OFFSET = 35;
+
+    constexpr uint32_t STORAGE_UNIFORM_CONSTANT = 0;
+    constexpr uint32_t STORAGE_INPUT = 1;
+    constexpr uint32_t STORAGE_UNIFORM = 2;
+    constexpr uint32_t STORAGE_PUSH_CONSTANT = 9;
+    constexpr uint32_t STORAGE_STORAGE_BUFFER = 12;
+
+    constexpr uint32_t DIM_BUFFER = 5;
+    constexpr uint32_t DIM_SUBPASS_DATA = 6;
+}
+
+namespace {
+    // Everything we keep about one result id
+    struct SpirvId {
+        uint32_t m_opcode = 0;
+        // Int/float width, vector/matrix count, pointer storage class or variable storage class
+        uint32_t m_value = 0;
+        bool m_signed = false;
+        // Component, element, pointee or variable type
+        uint32_t m_type = 0;
+        // Array length constant
+        uint32_t m_length = 0;
+        uint32_t m_image_dim = 0;
+        uint32_t m_image_sampled = 0;
+        std::vector<uint32_t> m_members;
+        uint32_t m_constant = 0;
+
+        // Decorations
+        bool m_has_set = false;
+        bool m_has_binding = false;
+        bool m_has_location = false;
+        uint32_t m_set = 0;
+        uint32_t m_binding = 0;
+        uint32_t m_location = 0;
+        bool m_buffer_block = false;
+        bool m_builtin = false;
+        uint32_t m_array_stride = 0;
+        std::vector<uint32_t> m_member_offsets;
+        std::vector<uint32_t> m_member_matrix_strides;
+    };
+
+    struct SpirvModule {
+        std::vector<SpirvId> m_ids;
+        std::vector<uint32_t> m_variables;
+        uint32_t m_execution_model = ~0u;
+
+        uint32_t array_length(const SpirvId &array) const {
+            return m_ids[array.m_length].m_constant;
+        }
+
+        // Bytes used by a type laid out with the offsets and strides glslang decorated it with
+        uint32_t type_size(uint32_t id, uint32_t matrix_stride) const {
+            const SpirvId &type = m_ids[id];
+            switch (type.m_opcode) {
+                case spirv::OP_TYPE_BOOL:
+                    return 4;
+                case spirv::OP_TYPE_INT:
+                case spirv::OP_TYPE_FLOAT:
+                    return type.m_value / 8;
+                case spirv::OP_TYPE_VECTOR:
+                    return type.m_value * type_size(type.m_type, 0);
+                case spirv::OP_TYPE_MATRIX:
+                    return type.m_value * (matrix_stride ? matrix_stride : type_size(type.m_type, 0));
+                case spirv::OP_TYPE_ARRAY: {
+                    uint32_t stride = type.m_array_stride ? type.m_array_stride : type_size(type.m_type, matrix_stride);
+                    return array_length(type) * stride;
+                }
+                case spirv::OP_TYPE_STRUCT: {
+                    uint32_t size = 0;
+                    for (size_t i = 0; i < type.m_members.size(); i++) {
+                        uint32_t offset = i < type.m_member_offsets.size() ? type.m_member_offsets[i] : 0;
+                        uint32_t stride = i < type.m_member_matrix_strides.size() ? type.m_member_matrix_strides[i] : 0;
+                        size = std::max(size, offset + type_size(type.m_members[i], stride));
+                    }
+                    return size;
+                }
+                default:
+                    // Runtime arrays have no size of their own
+                    return 0;
+            }
+        }
+    };
+
+    bool execution_model_stage(uint32_t execution_model, VkShaderStageFlagBits *out_stage) {
+        switch (execution_model) {
+            case 0:
+                *out_stage = VK_SHADER_STAGE_VERTEX_BIT;
+                return true;
+            case 1:
+                *out_stage = VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT;
+                return true;
+            case 2:
+                *out_stage = VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT;
+                return true;
+            case 3:
+                *out_stage = VK_SHADER_STAGE_GEOMETRY_BIT;
+                return true;
+            case 4:
+                *out_stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+                return true;
+            case 5:
+                *out_stage = VK_SHADER_STAGE_COMPUTE_BIT;
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    bool descriptor_type(const SpirvId &type, uint32_t storage_class, VkDescriptorType *out_type) {
+        if (storage_class == spirv::STORAGE_STORAGE_BUFFER) {
+            *out_type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            return true;
+        }
+        if (storage_class == spirv::STORAGE_UNIFORM) {
+            // Before SPIR-V 1.3 storage buffers are uniforms decorated with BufferBlock
+            *out_type = type.m_buffer_block ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            return true;
+        }
+
+        switch (type.m_opcode) {
+            case spirv::OP_TYPE_SAMPLED_IMAGE:
+                *out_type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+                return true;
+            case spirv::OP_TYPE_SAMPLER:
+                *out_type = VK_DESCRIPTOR_TYPE_SAMPLER;
+                return true;
+            case spirv::OP_TYPE_ACCELERATION_STRUCTURE:
+                *out_type = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+                return true;
+            case spirv::OP_TYPE_IMAGE:
+                // Sampled 2 means used without a sampler, ie storage
+                if (type.m_image_dim == spirv::DIM_BUFFER) {
+                    *out_type = type.m_image_sampled == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER
+                                                          : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+                } else if (type.m_image_dim == spirv::DIM_SUBPASS_DATA) {
+                    *out_type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+                } else {
+                    *out_type = type.m_image_sampled == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE
+                                                          : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+                }
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    bool vertex_format(const SpirvModule &module, const SpirvId &type, VkFormat *out_format) {
+        uint32_t components = 1;
+        const SpirvId *scalar = &type;
+        if (type.m_opcode == spirv::OP_TYPE_VECTOR) {
+            components = type.m_value;
+            scalar = &module.m_ids[type.m_type];
+        }
+
+        // 64 bit and 16 bit inputs aren't used by the engine
+        if (scalar->m_value != 32 || components < 1 || components > 4) {
+            return false;
+        }
+
+        static const VkFormat float_formats[] = {VK_FORMAT_R32_SFLOAT, VK_FORMAT_R32G32_SFLOAT,
+                                                 VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32A32_SFLOAT};
+        static const VkFormat sint_formats[] = {VK_FORMAT_R32_SINT, VK_FORMAT_R32G32_SINT,
+                                                VK_FORMAT_R32G32B32_SINT, VK_FORMAT_R32G32B32A32_SINT};
+        static const VkFormat uint_formats[] = {VK_FORMAT_R32_UINT, VK_FORMAT_R32G32_UINT,
+                                                VK_FORMAT_R32G32B32_UINT, VK_FORMAT_R32G32B32A32_UINT};
+
+        if (scalar->m_opcode == spirv::OP_TYPE_FLOAT) {
+            *out_format = float_formats[components - 1];
+        } else if (scalar->m_opcode == spirv::OP_TYPE_INT) {
+            *out_format = scalar->m_signed ? sint_formats[components - 1] : uint_formats[components - 1];
+        } else {
+            return false;
+        }
+        return true;
+    }
+}
+
+bool reflect_spirv(const std::vector<uint32_t> &code, ShaderReflection *out_reflection) {
+    if (code.size() < spirv::HEADER_WORDS || code[0] != spirv::MAGIC) {
+        std::cout << "Reflection: not a SPIR-V module" << std::endl;
+        return false;
+    }
+
+    SpirvModule module;
+    // Every id is below the bound
+    module.m_ids.resize(code[3]);
+    auto id_at = [&](uint32_t id) -> SpirvId * {
+        return id < module.m_ids.size() ? &module.m_ids[id] : nullptr;
+    };
+
+    size_t word = spirv::HEADER_WORDS;
+    while (word < code.size()) {
+        uint32_t word_count = code[word] >> 16;
+        uint32_t opcode = code[word] & 0xffff;
+        if (word_count == 0 || word + word_count > code.size()) {
+            std::cout << "Reflection: truncated SPIR-V module" << std::endl;
+            return false;
+        }
+        const uint32_t *operands = &code[word + 1];
+        uint32_t operand_count = word_count - 1;
+
+        switch (opcode) {
+            case spirv::OP_ENTRY_POINT:
+                if (module.m_execution_model == ~0u) {
+                    module.m_execution_model = operands[0];
+                }
+                break;
+            case spirv::OP_TYPE_BOOL:
+            case spirv::OP_TYPE_SAMPLER:
+            case spirv::OP_TYPE_ACCELERATION_STRUCTURE:
+                if (SpirvId *id = id_at(operands[0])) {
+                    id->m_opcode = opcode;
+                }
+                break;
+            case spirv::OP_TYPE_INT:
+            case spirv::OP_TYPE_FLOAT:
+                if (SpirvId *id = id_at(operands[0])) {
+                    id->m_opcode = opcode;
+                    id->m_value = operands[1];
+                    id->m_signed = opcode == spirv::OP_TYPE_INT ? operands[2] != 0 : true;
+                }
+                break;
+            case spirv::OP_TYPE_VECTOR:
+            case spirv::OP_TYPE_MATRIX:
+                if (SpirvId *id = id_at(operands[0])) {
+                    id->m_opcode = opcode;
+                    id->m_type = operands[1];
+                    id->m_value = operands[2];
+                }
+                break;
+            case spirv::OP_TYPE_IMAGE:
+                if (SpirvId *id = id_at(operands[0])) {
+                    id->m_opcode = opcode;
+                    id->m_type = operands[1];
+                    id->m_image_dim = operands[2];
+                    id->m_image_sampled = operands[6];
+                }
+                break;
+            case spirv::OP_TYPE_SAMPLED_IMAGE:
+            case spirv::OP_TYPE_RUNTIME_ARRAY:
+                if (SpirvId *id = id_at(operands[0])) {
+                    id->m_opcode = opcode;
+                    id->m_type = operands[1];
+                }
+                break;
+            case spirv::OP_TYPE_ARRAY:
+                if (SpirvId *id = id_at(operands[0])) {
+                    id->m_opcode = opcode;
+                    id->m_type = operands[1];
+                    id->m_length = operands[2];
+                }
+                break;
+            case spirv::OP_TYPE_STRUCT:
+                if (SpirvId *id = id_at(operands[0])) {
+                    id->m_opcode = opcode;
+                    id->m_members.assign(operands + 1, operands + operand_count);
+                }
+                break;
+            case spirv::OP_TYPE_POINTER:
+                if (SpirvId *id = id_at(operands[0])) {
+                    id->m_opcode = opcode;
+                    id->m_value = operands[1];
+                    id->m_type = operands[2];
+                }
+                break;
+            case spirv::OP_CONSTANT:
+                // Only 32 bit constants matter, they size the arrays
+                if (SpirvId *id = id_at(operands[1])) {
+                    id->m_opcode = opcode;
+                    id->m_constant = operands[2];
+                }
+                break;
+            case spirv::OP_VARIABLE:
+                if (SpirvId *id = id_at(operands[1])) {
+                    id->m_opcode = opcode;
+                    id->m_type = operands[0];
+                    id->m_value = operands[2];
+                    module.m_variables.push_back(operands[1]);
+                }
+                break;
+            case spirv::OP_DECORATE:
+                if (SpirvId *id = id_at(operands[0])) {
+                    uint32_t literal = operand_count > 2 ? operands[2] : 0;
+                    switch (operands[1]) {
+                        case spirv::DECORATION_DESCRIPTOR_SET:
+                            id->m_has_set = true;
+                            id->m_set = literal;
+                            break;
+                        case spirv::DECORATION_BINDING:
+                            id->m_has_binding = true;
+                            id->m_binding = literal;
+                            break;
+                        case spirv::DECORATION_LOCATION:
+                            id->m_has_location = true;
+                            id->m_location = literal;
+                            break;
+                        case spirv::DECORATION_BUFFER_BLOCK:
+                            id->m_buffer_block = true;
+                            break;
+                        case spirv::DECORATION_BUILT_IN:
+                            id->m_builtin = true;
+                            break;
+                        case spirv::DECORATION_ARRAY_STRIDE:
+                            id->m_array_stride = literal;
+                            break;
+                        default:
+                            break;
+                    }
+                }
+                break;
+            case spirv::OP_MEMBER_DECORATE:
+                if (SpirvId *id = id_at(operands[0])) {
+                    uint32_t member = operands[1];
+                    uint32_t literal = operand_count > 3 ? operands[3] : 0;
+                    if (operands[2] == spirv::DECORATION_OFFSET) {
+                        id->m_member_offsets.resize(std::max<size_t>(id->m_member_offsets.size(), member + 1));
+                        id->m_member_offsets[member] = literal;
+                    } else if (operands[2] == spirv::DECORATION_MATRIX_STRIDE) {
+                        id->m_member_matrix_strides.resize(
+                                std::max<size_t>(id->m_member_matrix_strides.size(), member + 1));
+                        id->m_member_matrix_strides[member] = literal;
+                    } else if (operands[2] == spirv::DECORATION_BUILT_IN) {
+                        // gl_PerVertex, never a vertex buffer input
+                        id->m_builtin = true;
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+
+        word += word_count;
+    }
+
+    ShaderReflection reflection;
+    if (!execution_model_stage(module.m_execution_model, &reflection.m_stage)) {
+        std::cout << "Reflection: unsupported execution model " << module.m_execution_model << std::endl;
+        return false;
+    }
+
+    for (uint32_t variable_id: module.m_variables) {
+        const SpirvId &variable = module.m_ids[variable_id];
+        uint32_t storage_class = variable.m_value;
+        const SpirvId &pointer = module.m_ids[variable.m_type];
+        uint32_t type_id = pointer.m_type;
+
+        if (storage_class == spirv::STORAGE_PUSH_CONSTANT) {
+            const SpirvId &block = module.m_ids[type_id];
+            uint32_t first_offset = block.m_member_offsets.empty()
+                                    ? 0 : *std::min_element(block.m_member_offsets.begin(),
+                                                            block.m_member_offsets.end());
+            reflection.m_push_constants = {
+                    .stageFlags = (VkShaderStageFlags) reflection.m_stage,
+                    .offset = first_offset,
+                    .size = module.type_size(type_id, 0) - first_offset
+            };
+            continue;
+        }
+
+        if (storage_class == spirv::STORAGE_INPUT) {
+            if (reflection.m_stage != VK_SHADER_STAGE_VERTEX_BIT || variable.m_builtin ||
+                module.m_ids[type_id].m_builtin || !variable.m_has_location) {
+                continue;
+            }
+
+            // Matrices take one location per column
+            const SpirvId &type = module.m_ids[type_id];
+            uint32_t location_count = 1;
+            const SpirvId *location_type = &type;
+            if (type.m_opcode == spirv::OP_TYPE_MATRIX) {
+                location_count = type.m_value;
+                location_type = &module.m_ids[type.m_type];
+            }
+
+            VkFormat format;
+            if (!vertex_format(module, *location_type, &format)) {
+                std::cout << "Reflection: unsupported vertex input type at location " << variable.m_location
+                          << std::endl;
+                return false;
+            }
+            for (uint32_t i = 0; i < location_count; i++) {
+                reflection.m_vertex_inputs.push_back({variable.m_location + i, format});
+            }
+            continue;
+        }
+
+        if (storage_class != spirv::STORAGE_UNIFORM_CONSTANT && storage_class != spirv::STORAGE_UNIFORM &&
+            storage_class != spirv::STORAGE_STORAGE_BUFFER) {
+            continue;
+        }
+        if (!variable.m_has_binding) {
+            continue;
+        }
+
+        // Arrays of descriptors, runtime sized ones would need descriptor indexing so they count as one
+        uint32_t count = 1;
+        while (module.m_ids[type_id].m_opcode == spirv::OP_TYPE_ARRAY ||
+               module.m_ids[type_id].m_opcode == spirv::OP_TYPE_RUNTIME_ARRAY) {
+            const SpirvId &array = module.m_ids[type_id];
+            if (array.m_opcode == spirv::OP_TYPE_ARRAY) {
+                count *= module.array_length(array);
+            }
+            type_id = array.m_type;
+        }
+
+        VkDescriptorType type;
+        if (!descriptor_type(module.m_ids[type_id], storage_class, &type)) {
+            std::cout << "Reflection: unsupported descriptor at binding " << variable.m_binding << std::endl;
+            return false;
+        }
+
+        reflection.m_bindings.push_back({
+                .m_set = variable.m_has_set ? variable.m_set : 0,
+                .m_binding = {
+                        .binding = variable.m_binding,
+                        .descriptorType = type,
+                        .descriptorCount = count,
+                        .stageFlags = (VkShaderStageFlags) reflection.m_stage,
+                        .pImmutableSamplers = nullptr
+                }
+        });
+    }
+
+    *out_reflection = std::move(reflection);
+    return true;
+}
+
+bool PipelineReflection::add_stage(const ShaderReflection &stage) {
+    for (const ReflectedBinding &reflected: stage.m_bindings) {
+        if (m_sets.size() <= reflected.m_set) {
+            m_sets.resize(reflected.m_set + 1);
+        }
+        std::vector<VkDescriptorSetLayoutBinding> &set = m_sets[reflected.m_set];
+
+        auto it = std::find_if(set.begin(), set.end(), [&](const VkDescriptorSetLayoutBinding &binding) {
+            return binding.binding == reflected.m_binding.binding;
+        });
+        if (it == set.end()) {
+            set.push_back(reflected.m_binding);
+            std::sort(set.begin(), set.end(), [](const auto &a, const auto &b) { return a.binding < b.binding; });
+        } else if (it->descriptorType != reflected.m_binding.descriptorType ||
+                   it->descriptorCount != reflected.m_binding.descriptorCount) {
+            std::cout << "Reflection: set " << reflected.m_set << " binding " << reflected.m_binding.binding
+                      << " doesn't match between stages" << std::endl;
+            return false;
+        } else {
+            it->stageFlags |= reflected.m_binding.stageFlags;
+        }
+    }
+
+    if (stage.m_push_constants.size > 0) {
+        if (m_push_constants.size == 0) {
+            m_push_constants = stage.m_push_constants;
+        } else {
+            uint32_t begin = std::min(m_push_constants.offset, stage.m_push_constants.offset);
+            uint32_t end = std::max(m_push_constants.offset + m_push_constants.size,
+                                    stage.m_push_constants.offset + stage.m_push_constants.size);
+            m_push_constants.stageFlags |= stage.m_push_constants.stageFlags;
+            m_push_constants.offset = begin;
+            m_push_constants.size = end - begin;
+        }
+    }
+
+    m_vertex_inputs.insert(m_vertex_inputs.end(), stage.m_vertex_inputs.begin(), stage.m_vertex_inputs.end());
+    return true;
+}
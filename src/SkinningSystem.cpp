@@ -0,0 +1,246 @@
+#include "SkinningSystem.h"
+
+#include <Initializers.h>
+
+#include <algorithm>
+
+// Matches the local size of skinning.comp
+constexpr uint32_t SKINNING_GROUP_SIZE = 64;
+// Palette entries the per frame buffers start with, they double when a frame needs more
+constexpr uint32_t INITIAL_JOINT_CAPACITY = 1024;
+
+// Bindings of skinning.comp
+enum SkinningBinding : uint32_t {
+    BINDING_JOINTS = 0,
+    BINDING_SKIN,
+    BINDING_OUTPUT,
+    SKINNING_BINDING_COUNT
+};
+
+void SkinningSystem::init(VkDevice device, VmaAllocator allocator, MemoryBudget *memory_budget,
+                          LayoutCache *layout_cache, uint32_t frame_count, const ComputeProgram &program) {
+    m_device = device;
+    m_allocator = allocator;
+    m_memory_budget = memory_budget;
+    m_program = program;
+    m_frames.resize(frame_count);
+
+    // The set is reflected from the shader, check it has what update writes
+    const std::vector<VkDescriptorSetLayoutBinding> *bindings = layout_cache->find_set_bindings(
+            m_program.m_set_layout);
+    if (!bindings || bindings->size() != SKINNING_BINDING_COUNT) {
+        std::cout << "skinning.comp must have the joints, skin and output bindings" << std::endl;
+        abort();
+    }
+
+    VkDescriptorPoolSize pool_size = {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                      MAX_SKINS * frame_count * SKINNING_BINDING_COUNT};
+    VkDescriptorPoolCreateInfo pool_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .maxSets = MAX_SKINS * frame_count,
+            .poolSizeCount = 1,
+            .pPoolSizes = &pool_size
+    };
+    VK_CHECK(vkCreateDescriptorPool(m_device, &pool_info, nullptr, &m_descriptor_pool))
+
+    for (FrameResources &frame: m_frames) {
+        reserve_joints(frame, INITIAL_JOINT_CAPACITY);
+    }
+}
+
+void SkinningSystem::cleanup() {
+    for (FrameResources &frame: m_frames) {
+        destroy_buffer(frame.m_joints);
+    }
+    m_frames.clear();
+    for (const Skin &skin: m_skins) {
+        destroy_buffer(skin.m_buffer);
+    }
+    m_skins.clear();
+
+    vkDestroyDescriptorPool(m_device, m_descriptor_pool, nullptr);
+    vkDestroyPipeline(m_device, m_program.m_pipeline, nullptr);
+}
+
+void SkinningSystem::replace_pipeline(VkPipeline old_pipeline, VkPipeline new_pipeline) {
+    if (m_program.m_pipeline == old_pipeline) {
+        m_program.m_pipeline = new_pipeline;
+    }
+}
+
+AllocatedBuffer SkinningSystem::create_buffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                                              VmaMemoryUsage memory_usage, MemoryCategory category,
+                                              void **out_mapped) {
+    VkBufferCreateInfo buffer_info = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+            .size = size,
+            .usage = usage
+    };
+
+    VmaAllocationCreateInfo vma_alloc_info = {};
+    vma_alloc_info.usage = memory_usage;
+    if (out_mapped) {
+        vma_alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+    }
+
+    AllocatedBuffer buffer;
+    VmaAllocationInfo allocation_info;
+    VK_CHECK(vmaCreateBuffer(m_allocator, &buffer_info, &vma_alloc_info, &buffer.m_buffer, &buffer.m_allocation,
+                             &allocation_info))
+    m_memory_budget->track(buffer.m_allocation, category);
+
+    if (out_mapped) {
+        *out_mapped = allocation_info.pMappedData;
+    }
+    return buffer;
+}
+
+void SkinningSystem::destroy_buffer(const AllocatedBuffer &buffer) {
+    m_memory_budget->untrack(buffer.m_allocation);
+    vmaDestroyBuffer(m_allocator, buffer.m_buffer, buffer.m_allocation);
+}
+
+void SkinningSystem::reserve_joints(FrameResources &frame, uint32_t joint_count) {
+    if (joint_count <= frame.m_joint_capacity) {
+        return;
+    }
+
+    uint32_t capacity = std::max(frame.m_joint_capacity, INITIAL_JOINT_CAPACITY);
+    while (capacity < joint_count) {
+        capacity *= 2;
+    }
+    if (frame.m_joint_capacity > 0) {
+        destroy_buffer(frame.m_joints);
+    }
+    frame.m_joints = create_buffer((VkDeviceSize) capacity * sizeof(glm::mat4), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                   VMA_MEMORY_USAGE_CPU_TO_GPU, MemoryCategory::PerFrame,
+                                   (void **) &frame.m_mapped_joints);
+    frame.m_joint_capacity = capacity;
+}
+
+uint32_t SkinningSystem::add_skin(uint32_t vertex_count, uint32_t joint_count) {
+    if (m_skins.size() >= MAX_SKINS || vertex_count == 0) {
+        return UINT32_MAX;
+    }
+
+    // Only the skinning reads it
+    Skin skin = {
+            .m_buffer = create_buffer((VkDeviceSize) vertex_count * sizeof(SkinnedVertex),
+                                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                      VMA_MEMORY_USAGE_GPU_ONLY, MemoryCategory::Mesh, nullptr),
+            .m_vertex_count = vertex_count,
+            .m_joint_count = joint_count
+    };
+    m_skins.push_back(skin);
+
+    // Written by the next update of each frame
+    for (FrameResources &frame: m_frames) {
+        VkDescriptorSetAllocateInfo allocate_info = {
+                .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+                .pNext = nullptr,
+                .descriptorPool = m_descriptor_pool,
+                .descriptorSetCount = 1,
+                .pSetLayouts = &m_program.m_set_layout
+        };
+        VkDescriptorSet set;
+        VK_CHECK(vkAllocateDescriptorSets(m_device, &allocate_info, &set))
+        frame.m_descriptors.push_back(set);
+    }
+    return (uint32_t) m_skins.size() - 1;
+}
+
+void SkinningSystem::write_descriptor(VkDescriptorSet set, const FrameResources &frame, const Skin &skin,
+                                      VkBuffer vertex_buffer) {
+    VkDescriptorBufferInfo infos[SKINNING_BINDING_COUNT] = {
+            {frame.m_joints.m_buffer, 0, VK_WHOLE_SIZE},
+            {skin.m_buffer.m_buffer, 0, VK_WHOLE_SIZE},
+            {vertex_buffer, 0, VK_WHOLE_SIZE}
+    };
+    VkWriteDescriptorSet writes[SKINNING_BINDING_COUNT];
+    for (uint32_t i = 0; i < SKINNING_BINDING_COUNT; i++) {
+        writes[i] = Initializers::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, set, &infos[i], i);
+    }
+    vkUpdateDescriptorSets(m_device, SKINNING_BINDING_COUNT, writes, 0, nullptr);
+}
+
+uint32_t SkinningSystem::update(uint32_t frame, const std::vector<SkinnedInstance> &instances,
+                                const GeometryBuffer &geometry) {
+    FrameResources &resources = m_frames[frame];
+    resources.m_dispatches.clear();
+
+    uint32_t joint_count = 0;
+    for (const SkinnedInstance &instance: instances) {
+        if (instance.m_skin < m_skins.size()) {
+            joint_count += m_skins[instance.m_skin].m_joint_count;
+        }
+    }
+    reserve_joints(resources, joint_count);
+
+    // The geometry buffer is replaced when it's repacked or grows
+    VkBuffer vertex_buffer = geometry.m_vertex_buffer.m_buffer;
+    bool rewrite = vertex_buffer != resources.m_written_vertex_buffer ||
+                   resources.m_joints.m_buffer != resources.m_written_joints;
+    for (auto i = rewrite ? 0 : resources.m_written_skins; i < (uint32_t) m_skins.size(); i++) {
+        write_descriptor(resources.m_descriptors[i], resources, m_skins[i], vertex_buffer);
+    }
+    resources.m_written_vertex_buffer = vertex_buffer;
+    resources.m_written_joints = resources.m_joints.m_buffer;
+    resources.m_written_skins = (uint32_t) m_skins.size();
+
+    uint32_t first_joint = 0;
+    uint32_t vertex_count = 0;
+    for (const SkinnedInstance &instance: instances) {
+        if (instance.m_skin >= m_skins.size() || instance.m_mesh == nullptr ||
+            instance.m_mesh->m_geometry_handle == GeometryBuffer::INVALID_HANDLE) {
+            continue;
+        }
+        const Skin &skin = m_skins[instance.m_skin];
+        const GeometryRange &range = geometry.get_range(instance.m_mesh->m_geometry_handle);
+        if (range.m_vertex_count != skin.m_vertex_count) {
+            continue;
+        }
+
+        // Joints the application didn't write stay in the bind pose
+        auto written = (uint32_t) std::min<size_t>(instance.m_joints.size(), skin.m_joint_count);
+        std::copy_n(instance.m_joints.begin(), written, resources.m_mapped_joints + first_joint);
+        std::fill_n(resources.m_mapped_joints + first_joint + written, skin.m_joint_count - written,
+                    glm::mat4(1.f));
+
+        resources.m_dispatches.push_back({
+                .m_skin = instance.m_skin,
+                .m_constants = {
+                        .m_vertex_count = skin.m_vertex_count,
+                        .m_first_output_vertex = range.m_first_vertex,
+                        .m_first_joint = first_joint
+                }
+        });
+        first_joint += skin.m_joint_count;
+        vertex_count += skin.m_vertex_count;
+    }
+    if (first_joint > 0) {
+        vmaFlushAllocation(m_allocator, resources.m_joints.m_allocation, 0,
+                           (VkDeviceSize) first_joint * sizeof(glm::mat4));
+    }
+    return vertex_count;
+}
+
+void SkinningSystem::cmd_skin(VkCommandBuffer cmd, uint32_t frame) const {
+    const FrameResources &resources = m_frames[frame];
+
+    // Instances write disjoint ranges, no barrier between them
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_program.m_pipeline);
+    uint32_t bound_skin = UINT32_MAX;
+    for (const Dispatch &dispatch: resources.m_dispatches) {
+        if (dispatch.m_skin != bound_skin) {
+            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_program.m_layout, 0, 1,
+                                    &resources.m_descriptors[dispatch.m_skin], 0, nullptr);
+            bound_skin = dispatch.m_skin;
+        }
+        vkCmdPushConstants(cmd, m_program.m_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(SkinConstants),
+                           &dispatch.m_constants);
+        vkCmdDispatch(cmd, (dispatch.m_constants.m_vertex_count + SKINNING_GROUP_SIZE - 1) / SKINNING_GROUP_SIZE,
+                      1, 1);
+    }
+}